@@ -0,0 +1,175 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A bounded journal of the invalidations acknowledged by the application, kept
+// in persistent storage so that it survives a restart.
+
+#include "google/cacheinvalidation/impl/ack-journal.h"
+
+#include "google/cacheinvalidation/impl/memory-usage.h"
+
+namespace invalidation {
+
+void AckJournal::RecordAck(const InvalidationP& invalidation) {
+  ObjectKey key(invalidation.object_id().source(),
+                invalidation.object_id().name());
+  InvalidationP ack(invalidation);
+  bool has_known_version = invalidation.is_known_version();
+  int64 known_version = has_known_version ? invalidation.version() : 0;
+  map<ObjectKey, Entry>::iterator iter = entries_.find(key);
+  if (iter != entries_.end()) {
+    const Entry& entry = iter->second;
+    // System versions and known versions are not comparable.
+    if ((entry.invalidation.is_known_version() ==
+         invalidation.is_known_version()) &&
+        (entry.invalidation.version() > invalidation.version())) {
+      // A higher version was acknowledged already: only its ack is pending
+      // again, since the server may not have received it.
+      ack.CopyFrom(entry.invalidation);
+    }
+    if (entry.has_known_version &&
+        (!has_known_version || (entry.known_version > known_version))) {
+      has_known_version = true;
+      known_version = entry.known_version;
+    }
+  }
+  AddEntry(ack, true, has_known_version, known_version);
+}
+
+bool AckJournal::IsAcknowledged(const InvalidationP& invalidation) const {
+  if (!invalidation.is_known_version()) {
+    return false;
+  }
+  ObjectKey key(invalidation.object_id().source(),
+                invalidation.object_id().name());
+  map<ObjectKey, Entry>::const_iterator iter = entries_.find(key);
+  return (iter != entries_.end()) && iter->second.has_known_version &&
+      (invalidation.version() <= iter->second.known_version);
+}
+
+void AckJournal::GetPendingAcks(vector<InvalidationP>* invalidations) const {
+  invalidations->clear();
+  map<int64, ObjectKey>::const_iterator iter;
+  for (iter = ack_order_.begin(); iter != ack_order_.end(); ++iter) {
+    const Entry& entry = entries_.find(iter->second)->second;
+    if (entry.ack_pending) {
+      invalidations->push_back(entry.invalidation);
+    }
+  }
+}
+
+void AckJournal::MarkAcksSent() {
+  map<ObjectKey, Entry>::iterator iter;
+  for (iter = entries_.begin(); iter != entries_.end(); ++iter) {
+    iter->second.ack_pending = false;
+  }
+  num_pending_acks_ = 0;
+}
+
+void AckJournal::Serialize(string* serialized) const {
+  AckJournalP journal;
+  map<int64, ObjectKey>::const_iterator iter;
+  for (iter = ack_order_.begin(); iter != ack_order_.end(); ++iter) {
+    const Entry& entry = entries_.find(iter->second)->second;
+    AckJournalEntryP* entry_proto = journal.add_entry();
+    entry_proto->mutable_invalidation()->CopyFrom(entry.invalidation);
+    entry_proto->set_ack_pending(entry.ack_pending);
+    if (entry.has_known_version) {
+      entry_proto->set_known_version(entry.known_version);
+    }
+  }
+  journal.SerializeToString(serialized);
+}
+
+bool AckJournal::Parse(const string& serialized) {
+  entries_.clear();
+  ack_order_.clear();
+  num_pending_acks_ = 0;
+  memory_usage_ = 0;
+  AckJournalP journal;
+  if (!journal.ParseFromString(serialized)) {
+    return false;
+  }
+  for (int i = 0; i < journal.entry_size(); ++i) {
+    const AckJournalEntryP& entry = journal.entry(i);
+    if (!entry.has_invalidation()) {
+      continue;
+    }
+    // Journals written before the known version was stored separately
+    // recorded only the highest acknowledged invalidation.
+    const InvalidationP& invalidation = entry.invalidation();
+    if (entry.has_known_version()) {
+      AddEntry(invalidation, entry.ack_pending(), true,
+               entry.known_version());
+    } else {
+      AddEntry(invalidation, entry.ack_pending(),
+               invalidation.is_known_version(), invalidation.version());
+    }
+  }
+  return true;
+}
+
+void AckJournal::AddEntry(const InvalidationP& invalidation,
+                          bool ack_pending, bool has_known_version,
+                          int64 known_version) {
+  ObjectKey key(invalidation.object_id().source(),
+                invalidation.object_id().name());
+  map<ObjectKey, Entry>::iterator iter = entries_.find(key);
+  if (iter != entries_.end()) {
+    memory_usage_ -= GetEntryMemoryUsage(key, iter->second);
+    ack_order_.erase(iter->second.sequence);
+    if (iter->second.ack_pending) {
+      --num_pending_acks_;
+    }
+  } else {
+    if (static_cast<int>(entries_.size()) >= capacity_) {
+      EvictOldest();
+    }
+    iter = entries_.insert(make_pair(key, Entry())).first;
+  }
+  Entry* entry = &iter->second;
+  entry->invalidation.CopyFrom(invalidation);
+  entry->invalidation.clear_payload();
+  entry->ack_pending = ack_pending;
+  entry->has_known_version = has_known_version;
+  entry->known_version = has_known_version ? known_version : 0;
+  if (ack_pending) {
+    ++num_pending_acks_;
+  }
+  entry->sequence = next_sequence_++;
+  ack_order_[entry->sequence] = key;
+  memory_usage_ += GetEntryMemoryUsage(key, *entry);
+}
+
+void AckJournal::EvictOldest() {
+  CHECK(!ack_order_.empty());
+  map<int64, ObjectKey>::iterator oldest = ack_order_.begin();
+  map<ObjectKey, Entry>::iterator iter = entries_.find(oldest->second);
+  if (iter->second.ack_pending) {
+    --num_pending_acks_;
+  }
+  memory_usage_ -= GetEntryMemoryUsage(iter->first, iter->second);
+  entries_.erase(iter);
+  ack_order_.erase(oldest);
+}
+
+int64 AckJournal::GetEntryMemoryUsage(const ObjectKey& key,
+                                      const Entry& entry) {
+  // The key is stored in both maps.
+  return 2 * (MemoryUsage::kTreeNodeOverhead + sizeof(key) +
+              key.second.size()) +
+      sizeof(entry) + entry.invalidation.ByteSize() + sizeof(entry.sequence);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,159 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A bounded journal of the invalidations acknowledged by the application, kept
+// in persistent storage so that it survives a restart.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_ACK_JOURNAL_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_ACK_JOURNAL_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/impl/client-protocol-namespace-fix.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// Records, for each of the most recently acknowledged objects, the highest
+// acknowledged known version, the last acknowledged invalidation and whether
+// its ack may not have been sent to the server yet. After a restart, the
+// pending acks can be sent again and redeliveries of acknowledged versions
+// recognized.
+//
+// This class is not thread-safe.
+class AckJournal {
+ public:
+  /* Creates an empty journal of at most |capacity| objects. */
+  explicit AckJournal(int capacity)
+      : capacity_(capacity), next_sequence_(0), num_pending_acks_(0),
+        memory_usage_(0) {}
+
+  /* Records that the application acknowledged |invalidation| and that its ack
+   * is pending, evicting the least recently acknowledged object if the
+   * journal is full.
+   */
+  void RecordAck(const InvalidationP& invalidation);
+
+  /* Returns whether |invalidation| has a known version that is no higher than
+   * the highest acknowledged known version of its object.
+   */
+  bool IsAcknowledged(const InvalidationP& invalidation) const;
+
+  /* Stores the invalidations whose acks are pending in |invalidations|. */
+  void GetPendingAcks(vector<InvalidationP>* invalidations) const;
+
+  /* Returns whether any ack is pending. */
+  bool HasPendingAcks() const {
+    return num_pending_acks_ > 0;
+  }
+
+  /* Records that all the pending acks have been sent. */
+  void MarkAcksSent();
+
+  /* Stores the serialized journal in |serialized|. */
+  void Serialize(string* serialized) const;
+
+  /* Replaces the journal with the one in |serialized|, dropping its least
+   * recently acknowledged entries beyond the capacity. Returns false (and
+   * leaves the journal empty) if it cannot be parsed.
+   */
+  bool Parse(const string& serialized);
+
+  /* Returns the number of objects in the journal. */
+  int size() const {
+    return entries_.size();
+  }
+
+  /* Returns the estimated memory used by the entries, in bytes. */
+  int64 GetMemoryUsage() const {
+    return memory_usage_;
+  }
+
+ private:
+  /* Key of an object: its source and name. */
+  typedef pair<int, string> ObjectKey;
+
+  /* The journal entry of an object. */
+  struct Entry {
+    /* The invalidation whose ack is resent, without its payload: the highest
+     * acknowledged one in the version space of the last acknowledgement.
+     */
+    InvalidationP invalidation;
+
+    /* Whether the ack may not have been sent. */
+    bool ack_pending;
+
+    /* Whether a known version was acknowledged. */
+    bool has_known_version;
+
+    /* The highest acknowledged known version, if |has_known_version|. */
+    int64 known_version;
+
+    /* Position of the entry in |ack_order_|. */
+    int64 sequence;
+  };
+
+  /* Adds or updates the entry of |invalidation|'s object as the most recently
+   * acknowledged one, with the highest acknowledged known version
+   * |known_version| if |has_known_version|.
+   */
+  void AddEntry(const InvalidationP& invalidation, bool ack_pending,
+                bool has_known_version, int64 known_version);
+
+  /* Removes the least recently acknowledged entry. */
+  void EvictOldest();
+
+  /* Returns the estimated memory used by the entry of |key|, in both
+   * |entries_| and |ack_order_|.
+   */
+  static int64 GetEntryMemoryUsage(const ObjectKey& key, const Entry& entry);
+
+  /* Maximum number of objects in the journal. */
+  int capacity_;
+
+  /* Sequence number of the next acknowledgement. */
+  int64 next_sequence_;
+
+  /* Number of entries whose ack is pending. */
+  int num_pending_acks_;
+
+  /* The entry of each object in the journal. */
+  map<ObjectKey, Entry> entries_;
+
+  /* The objects in the journal by the sequence number of their last
+   * acknowledgement.
+   */
+  map<int64, ObjectKey> ack_order_;
+
+  /* Estimated memory used by the entries, maintained as they are added and
+   * removed.
+   */
+  int64 memory_usage_;
+
+  DISALLOW_COPY_AND_ASSIGN(AckJournal);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_ACK_JOURNAL_H_
@@ -0,0 +1,134 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the AckJournal class.
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/impl/ack-journal.h"
+
+namespace invalidation {
+
+class AckJournalTest : public testing::Test {
+ public:
+  /* Returns a known-version invalidation of object |name| at |version|. */
+  static InvalidationP MakeInvalidation(const string& name, int64 version) {
+    InvalidationP invalidation;
+    invalidation.mutable_object_id()->set_source(1);
+    invalidation.mutable_object_id()->set_name(name);
+    invalidation.set_is_known_version(true);
+    invalidation.set_version(version);
+    invalidation.set_payload("payload");
+    return invalidation;
+  }
+};
+
+/* Tests that acknowledged versions are recognized after the journal is read
+ * back, along with the acks still pending.
+ */
+TEST_F(AckJournalTest, RoundTrip) {
+  AckJournal journal(10);
+  journal.RecordAck(MakeInvalidation("a", 5));
+  journal.MarkAcksSent();
+  journal.RecordAck(MakeInvalidation("b", 7));
+  journal.RecordAck(MakeInvalidation("b", 6));  // Older version.
+  string serialized;
+  journal.Serialize(&serialized);
+
+  AckJournal restored(10);
+  ASSERT_TRUE(restored.Parse(serialized));
+  EXPECT_TRUE(restored.IsAcknowledged(MakeInvalidation("a", 4)));
+  EXPECT_TRUE(restored.IsAcknowledged(MakeInvalidation("a", 5)));
+  EXPECT_FALSE(restored.IsAcknowledged(MakeInvalidation("a", 6)));
+  EXPECT_TRUE(restored.IsAcknowledged(MakeInvalidation("b", 7)));
+  InvalidationP unknown_version = MakeInvalidation("a", 1);
+  unknown_version.set_is_known_version(false);
+  EXPECT_FALSE(restored.IsAcknowledged(unknown_version));
+
+  vector<InvalidationP> pending_acks;
+  restored.GetPendingAcks(&pending_acks);
+  ASSERT_EQ(1, static_cast<int>(pending_acks.size()));
+  EXPECT_EQ("b", pending_acks[0].object_id().name());
+  EXPECT_EQ(7, pending_acks[0].version());
+  EXPECT_FALSE(pending_acks[0].has_payload());
+
+  restored.MarkAcksSent();
+  EXPECT_FALSE(restored.HasPendingAcks());
+  EXPECT_FALSE(restored.Parse("garbage"));
+  EXPECT_EQ(0, restored.size());
+}
+
+/* Tests that the least recently acknowledged object is evicted when the
+ * journal is full.
+ */
+TEST_F(AckJournalTest, EvictsOldest) {
+  AckJournal journal(2);
+  journal.RecordAck(MakeInvalidation("a", 1));
+  journal.RecordAck(MakeInvalidation("b", 1));
+  journal.RecordAck(MakeInvalidation("a", 2));
+  journal.RecordAck(MakeInvalidation("c", 1));
+  EXPECT_EQ(2, journal.size());
+  EXPECT_TRUE(journal.IsAcknowledged(MakeInvalidation("a", 2)));
+  EXPECT_FALSE(journal.IsAcknowledged(MakeInvalidation("b", 1)));
+  EXPECT_TRUE(journal.IsAcknowledged(MakeInvalidation("c", 1)));
+}
+
+/* Tests that an acknowledged system version does not hide a lower known
+ * version, and that known versions survive acks of unknown versions.
+ */
+TEST_F(AckJournalTest, SeparatesSystemVersions) {
+  AckJournal journal(10);
+  InvalidationP unknown_version = MakeInvalidation("a", 1000);
+  unknown_version.set_is_known_version(false);
+  journal.RecordAck(unknown_version);
+  EXPECT_FALSE(journal.IsAcknowledged(MakeInvalidation("a", 1)));
+
+  journal.RecordAck(MakeInvalidation("a", 5));
+  journal.RecordAck(unknown_version);
+  string serialized;
+  journal.Serialize(&serialized);
+  AckJournal restored(10);
+  ASSERT_TRUE(restored.Parse(serialized));
+  EXPECT_TRUE(restored.IsAcknowledged(MakeInvalidation("a", 5)));
+  EXPECT_FALSE(restored.IsAcknowledged(MakeInvalidation("a", 6)));
+
+  // The last acknowledged invalidation is the one whose ack is resent.
+  vector<InvalidationP> pending_acks;
+  restored.GetPendingAcks(&pending_acks);
+  ASSERT_EQ(1, static_cast<int>(pending_acks.size()));
+  EXPECT_FALSE(pending_acks[0].is_known_version());
+  EXPECT_EQ(1000, pending_acks[0].version());
+}
+
+/* Tests that the memory of the entries is accounted for as they are added,
+ * replaced, evicted and cleared.
+ */
+TEST_F(AckJournalTest, AccountsForMemoryUsage) {
+  AckJournal journal(2);
+  EXPECT_EQ(0, journal.GetMemoryUsage());
+  journal.RecordAck(MakeInvalidation("a", 1));
+  int64 entry_memory_usage = journal.GetMemoryUsage();
+  EXPECT_GT(entry_memory_usage, 0);
+
+  // Same-sized entries replace or evict each other.
+  journal.RecordAck(MakeInvalidation("a", 2));
+  EXPECT_EQ(entry_memory_usage, journal.GetMemoryUsage());
+  journal.RecordAck(MakeInvalidation("b", 1));
+  journal.RecordAck(MakeInvalidation("c", 1));
+  EXPECT_EQ(2 * entry_memory_usage, journal.GetMemoryUsage());
+
+  EXPECT_FALSE(journal.Parse("garbage"));
+  EXPECT_EQ(0, journal.GetMemoryUsage());
+}
+
+}  // namespace invalidation
@@ -0,0 +1,100 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A 64-bit integer that may be updated and read from any thread.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_ATOMIC_INT64_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_ATOMIC_INT64_H_
+
+#include "google/cacheinvalidation/deps/atomicops.h"
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+
+namespace invalidation {
+
+// A 64-bit counter or gauge with relaxed atomic updates, so that long-lived
+// counters do not wrap around on 32-bit platforms. It uses the 64-bit atomic
+// operations where the platform has them, and a lock elsewhere.
+//
+// This class is thread-safe.
+class AtomicInt64 {
+ public:
+  AtomicInt64() : value_(0) {}
+
+  /* Returns the value. */
+  int64 Load() const {
+#if defined(INVALIDATION_HAVE_ATOMIC64)
+    return NoBarrier_Load(&value_);
+#else
+    MutexLock m(&lock_);
+    return value_;
+#endif
+  }
+
+  /* Sets the value to |value|. */
+  void Store(int64 value) {
+#if defined(INVALIDATION_HAVE_ATOMIC64)
+    NoBarrier_Store(&value_, value);
+#else
+    MutexLock m(&lock_);
+    value_ = value;
+#endif
+  }
+
+  /* Adds |amount| to the value and returns the new value. */
+  int64 Increment(int64 amount) {
+#if defined(INVALIDATION_HAVE_ATOMIC64)
+    return NoBarrier_AtomicIncrement(&value_, amount);
+#else
+    MutexLock m(&lock_);
+    value_ += amount;
+    return value_;
+#endif
+  }
+
+  /* Raises the value to |value| if it is lower. */
+  void StoreMax(int64 value) {
+#if defined(INVALIDATION_HAVE_ATOMIC64)
+    Atomic64 old_value = NoBarrier_Load(&value_);
+    while (value > old_value) {
+      Atomic64 previous = NoBarrier_CompareAndSwap(&value_, old_value, value);
+      if (previous == old_value) {
+        break;
+      }
+      old_value = previous;
+    }
+#else
+    MutexLock m(&lock_);
+    if (value > value_) {
+      value_ = value;
+    }
+#endif
+  }
+
+ private:
+#if defined(INVALIDATION_HAVE_ATOMIC64)
+  Atomic64 value_;
+#else
+  /* Lock protecting |value_|. */
+  mutable Mutex lock_;
+
+  int64 value_;
+#endif
+
+  DISALLOW_COPY_AND_ASSIGN(AtomicInt64);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_ATOMIC_INT64_H_
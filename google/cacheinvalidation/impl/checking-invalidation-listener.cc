@@ -16,10 +16,24 @@
 // on the proper thread and calls the listener method on the listener thread.
 
 #include "google/cacheinvalidation/impl/checking-invalidation-listener.h"
+
+#include "google/cacheinvalidation/deps/string_util.h"
 #include "google/cacheinvalidation/impl/log-macro.h"
+#include "google/cacheinvalidation/impl/memory-usage.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+// Estimated memory used by a queued upcall besides the data it copies: the
+// closure, the closures wrapping it and the queue entry of the scheduler.
+static const int64 kUpcallMemoryUsage = 256;
+
+// Returns the estimated memory used by |ack_handle|.
+static int64 GetAckHandleMemoryUsage(const AckHandle& ack_handle) {
+  return sizeof(AckHandle) + ack_handle.handle_data().size();
+}
+
 CheckingInvalidationListener::CheckingInvalidationListener(
     InvalidationListener* delegate, Statistics* statistics,
     Scheduler* internal_scheduler, Scheduler* listener_scheduler,
@@ -28,6 +42,18 @@ CheckingInvalidationListener::CheckingInvalidationListener(
       statistics_(statistics),
       internal_scheduler_(internal_scheduler),
       listener_scheduler_(listener_scheduler),
+      listener_executor_(NULL),
+      max_pending_upcalls_(0),
+      max_held_objects_(0),
+      num_pending_upcalls_(0),
+      has_held_upcalls_(false),
+      drain_scheduled_(false),
+      pending_upcalls_memory_usage_(0),
+      held_client_(NULL),
+      held_invalidate_all_(false),
+      held_memory_usage_(0),
+      deferred_acks_memory_usage_(0),
+      next_deferred_ack_id_(0),
       logger_(logger) {
   CHECK(delegate != NULL);
   CHECK(statistics != NULL);
@@ -36,13 +62,31 @@ CheckingInvalidationListener::CheckingInvalidationListener(
   CHECK(logger != NULL);
 }
 
+CheckingInvalidationListener::~CheckingInvalidationListener() {
+  for (map<ObjectKey, HeldObject>::iterator iter = held_objects_.begin();
+       iter != held_objects_.end(); ++iter) {
+    for (size_t i = 0; i < iter->second.later_upcalls.size(); ++i) {
+      delete iter->second.later_upcalls[i].upcall;
+    }
+  }
+  for (size_t i = 0; i < held_after_all_upcalls_.size(); ++i) {
+    delete held_after_all_upcalls_[i].upcall;
+  }
+}
+
 void CheckingInvalidationListener::Invalidate(
     InvalidationClient* client, const Invalidation& invalidation,
     const AckHandle& ack_handle) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(Statistics::ListenerEventType_INVALIDATE);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  if (ShouldHoldUpcall()) {
+    HoldInvalidation(client, invalidation.object_id(), invalidation, true,
+                     ack_handle);
+    return;
+  }
+  ScheduleObjectUpcall(
+      invalidation.object_id(),
+      invalidation.payload().size() + ack_handle.handle_data().size(),
       NewPermanentCallback(
           delegate_, &InvalidationListener::Invalidate, client, invalidation,
           ack_handle));
@@ -54,8 +98,12 @@ void CheckingInvalidationListener::InvalidateUnknownVersion(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INVALIDATE_UNKNOWN);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  if (ShouldHoldUpcall()) {
+    HoldInvalidation(client, object_id, Invalidation(), false, ack_handle);
+    return;
+  }
+  ScheduleObjectUpcall(
+      object_id, ack_handle.handle_data().size(),
       NewPermanentCallback(
           delegate_, &InvalidationListener::InvalidateUnknownVersion, client,
           object_id, ack_handle));
@@ -66,8 +114,15 @@ void CheckingInvalidationListener::InvalidateAll(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INVALIDATE_ALL);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  if (ShouldHoldUpcall()) {
+    // An invalidateAll supersedes all the held invalidations.
+    statistics_->RecordUpcallEvent(Statistics::UpcallEventType_OVERFLOWED);
+    held_client_ = client;
+    CollapseToInvalidateAll();
+    held_all_acks_.push_back(ack_handle);
+    return;
+  }
+  ScheduleBarrierUpcall(
       NewPermanentCallback(
           delegate_, &InvalidationListener::InvalidateAll, client,
           ack_handle));
@@ -79,11 +134,12 @@ void CheckingInvalidationListener::InformRegistrationFailure(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INFORM_REGISTRATION_FAILURE);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
-          delegate_, &InvalidationListener::InformRegistrationFailure, client,
-          object_id, is_transient, error_message));
+  Closure* upcall = NewPermanentCallback(
+      delegate_, &InvalidationListener::InformRegistrationFailure, client,
+      object_id, is_transient, error_message);
+  if (!HoldObjectUpcall(object_id, error_message.size(), upcall)) {
+    ScheduleObjectUpcall(object_id, error_message.size(), upcall);
+  }
 }
 
 void CheckingInvalidationListener::InformRegistrationStatus(
@@ -92,11 +148,12 @@ void CheckingInvalidationListener::InformRegistrationStatus(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INFORM_REGISTRATION_STATUS);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
-      NewPermanentCallback(
-          delegate_, &InvalidationListener::InformRegistrationStatus, client,
-          object_id, reg_state));
+  Closure* upcall = NewPermanentCallback(
+      delegate_, &InvalidationListener::InformRegistrationStatus, client,
+      object_id, reg_state);
+  if (!HoldObjectUpcall(object_id, 0, upcall)) {
+    ScheduleObjectUpcall(object_id, 0, upcall);
+  }
 }
 
 void CheckingInvalidationListener::ReissueRegistrations(
@@ -104,8 +161,7 @@ void CheckingInvalidationListener::ReissueRegistrations(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_REISSUE_REGISTRATIONS);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleBarrierUpcall(
       NewPermanentCallback(
           delegate_, &InvalidationListener::ReissueRegistrations,
           client, prefix, prefix_len));
@@ -116,8 +172,7 @@ void CheckingInvalidationListener::InformError(
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   statistics_->RecordListenerEvent(
       Statistics::ListenerEventType_INFORM_ERROR);
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleBarrierUpcall(
       NewPermanentCallback(
           delegate_, &InvalidationListener::InformError, client, error_info));
 }
@@ -125,9 +180,309 @@ void CheckingInvalidationListener::InformError(
 void CheckingInvalidationListener::Ready(InvalidationClient* client) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   TLOG(logger_, INFO, "Informing app that ticl is ready");
-  listener_scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleBarrierUpcall(
       NewPermanentCallback(delegate_, &InvalidationListener::Ready, client));
 }
 
+bool CheckingInvalidationListener::TakeDeferredAcks(
+    const AckHandle& ack_handle, vector<AckHandle>* original_handles) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  map<string, vector<AckHandle> >::iterator iter =
+      deferred_acks_.find(ack_handle.handle_data());
+  if (iter == deferred_acks_.end()) {
+    return false;
+  }
+  deferred_acks_memory_usage_ -=
+      GetDeferredAcksMemoryUsage(iter->first, iter->second);
+  original_handles->swap(iter->second);
+  deferred_acks_.erase(iter);
+  return true;
+}
+
+bool CheckingInvalidationListener::ShouldHoldUpcall() {
+  if (max_pending_upcalls_ <= 0) {
+    return false;
+  }
+  // Decide and record under the same lock so that an upcall completing
+  // concurrently sees that a drain is needed.
+  MutexLock m(&lock_);
+  if (has_held_upcalls_ || (num_pending_upcalls_ >= max_pending_upcalls_)) {
+    has_held_upcalls_ = true;
+    return true;
+  }
+  return false;
+}
+
+void CheckingInvalidationListener::HoldInvalidation(
+    InvalidationClient* client, const ObjectId& object_id,
+    const Invalidation& invalidation, bool is_known_version,
+    const AckHandle& ack_handle) {
+  statistics_->RecordUpcallEvent(Statistics::UpcallEventType_OVERFLOWED);
+  held_client_ = client;
+  held_memory_usage_ += GetAckHandleMemoryUsage(ack_handle);
+  if (held_invalidate_all_) {
+    held_all_acks_.push_back(ack_handle);
+    return;
+  }
+  ObjectKey key(object_id.source(), object_id.name());
+  map<ObjectKey, HeldObject>::iterator iter = held_objects_.find(key);
+  if (iter != held_objects_.end()) {
+    // Several invalidations for the object: the application will be told that
+    // its version is unknown.
+    iter->second.ack_handles.push_back(ack_handle);
+    statistics_->RecordUpcallEvent(
+        Statistics::UpcallEventType_COLLAPSED_TO_UNKNOWN_VERSION);
+    return;
+  }
+  HeldObject* held = &held_objects_[key];
+  held->object_id = object_id;
+  held->invalidation = invalidation;
+  held->is_known_version = is_known_version;
+  held->ack_handles.push_back(ack_handle);
+  held_object_order_.push_back(key);
+  held_memory_usage_ += GetHeldObjectMemoryUsage(*held) -
+      GetAckHandleMemoryUsage(ack_handle);
+  if (static_cast<int>(held_objects_.size()) > max_held_objects_) {
+    CollapseToInvalidateAll();
+  }
+}
+
+bool CheckingInvalidationListener::HoldObjectUpcall(
+    const ObjectId& object_id, int64 data_size, Closure* upcall) {
+  vector<HeldUpcall>* held_upcalls;
+  if (held_invalidate_all_) {
+    held_upcalls = &held_after_all_upcalls_;
+  } else {
+    map<ObjectKey, HeldObject>::iterator iter =
+        held_objects_.find(ObjectKey(object_id.source(), object_id.name()));
+    if (iter == held_objects_.end()) {
+      return false;
+    }
+    held_upcalls = &iter->second.later_upcalls;
+  }
+  held_upcalls->push_back(HeldUpcall(object_id, data_size, upcall));
+  held_memory_usage_ +=
+      kUpcallMemoryUsage + object_id.name().size() + data_size;
+  return true;
+}
+
+void CheckingInvalidationListener::ScheduleHeldUpcalls(
+    vector<HeldUpcall>* held_upcalls) {
+  for (size_t i = 0; i < held_upcalls->size(); ++i) {
+    const HeldUpcall& held = (*held_upcalls)[i];
+    ScheduleObjectUpcall(held.object_id, held.data_size, held.upcall);
+    held_memory_usage_ -=
+        kUpcallMemoryUsage + held.object_id.name().size() + held.data_size;
+  }
+  held_upcalls->clear();
+}
+
+void CheckingInvalidationListener::CollapseToInvalidateAll() {
+  if (held_invalidate_all_) {
+    return;
+  }
+  if (!held_objects_.empty()) {
+    TLOG(logger_, INFO, "Collapsing %d held objects into an invalidate all",
+         held_objects_.size());
+    statistics_->RecordUpcallEvent(
+        Statistics::UpcallEventType_COLLAPSED_TO_INVALIDATE_ALL);
+  }
+  for (size_t i = 0; i < held_object_order_.size(); ++i) {
+    const HeldObject& held = held_objects_[held_object_order_[i]];
+    held_all_acks_.insert(held_all_acks_.end(), held.ack_handles.begin(),
+                          held.ack_handles.end());
+    held_after_all_upcalls_.insert(held_after_all_upcalls_.end(),
+                                   held.later_upcalls.begin(),
+                                   held.later_upcalls.end());
+    // Only the ack handles remain held.
+    held_memory_usage_ -= GetHeldObjectMemoryUsage(held);
+    for (size_t j = 0; j < held.ack_handles.size(); ++j) {
+      held_memory_usage_ += GetAckHandleMemoryUsage(held.ack_handles[j]);
+    }
+  }
+  held_objects_.clear();
+  held_object_order_.clear();
+  held_invalidate_all_ = true;
+}
+
+void CheckingInvalidationListener::DrainHeldUpcalls() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  {
+    MutexLock m(&lock_);
+    drain_scheduled_ = false;
+  }
+  while (true) {
+    {
+      MutexLock m(&lock_);
+      if (num_pending_upcalls_ >= max_pending_upcalls_) {
+        return;
+      }
+      if (!held_invalidate_all_ && held_object_order_.empty()) {
+        has_held_upcalls_ = false;
+        return;
+      }
+    }
+    if (held_invalidate_all_) {
+      AckHandle ack_handle = (held_all_acks_.size() == 1) ?
+          held_all_acks_[0] : MakeDeferredAckHandle(held_all_acks_);
+      held_all_acks_.clear();
+      held_invalidate_all_ = false;
+      ScheduleBarrierUpcall(
+          NewPermanentCallback(
+              delegate_, &InvalidationListener::InvalidateAll, held_client_,
+              ack_handle));
+      ScheduleHeldUpcalls(&held_after_all_upcalls_);
+      held_memory_usage_ = 0;
+      continue;
+    }
+    ObjectKey key = held_object_order_.front();
+    held_object_order_.pop_front();
+    HeldObject& held = held_objects_[key];
+    Closure* upcall;
+    if (held.ack_handles.size() > 1) {
+      upcall = NewPermanentCallback(
+          delegate_, &InvalidationListener::InvalidateUnknownVersion,
+          held_client_, held.object_id,
+          MakeDeferredAckHandle(held.ack_handles));
+    } else if (held.is_known_version) {
+      upcall = NewPermanentCallback(
+          delegate_, &InvalidationListener::Invalidate, held_client_,
+          held.invalidation, held.ack_handles[0]);
+    } else {
+      upcall = NewPermanentCallback(
+          delegate_, &InvalidationListener::InvalidateUnknownVersion,
+          held_client_, held.object_id, held.ack_handles[0]);
+    }
+    ScheduleObjectUpcall(held.object_id, held.invalidation.payload().size(),
+                         upcall);
+    ScheduleHeldUpcalls(&held.later_upcalls);
+    held_memory_usage_ -= GetHeldObjectMemoryUsage(held);
+    held_objects_.erase(key);
+  }
+}
+
+void CheckingInvalidationListener::GetMemoryUsage(
+    vector<pair<string, int64> >* usage) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  usage->push_back(make_pair("ListenerUpcalls",
+      static_cast<int64>(NoBarrier_Load(&pending_upcalls_memory_usage_))));
+  usage->push_back(make_pair("HeldUpcalls", held_memory_usage_));
+  usage->push_back(make_pair("DeferredAcks", deferred_acks_memory_usage_));
+}
+
+void CheckingInvalidationListener::CollapseHeldUpcalls() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (!held_objects_.empty()) {
+    CollapseToInvalidateAll();
+  }
+}
+
+int64 CheckingInvalidationListener::GetHeldObjectMemoryUsage(
+    const HeldObject& held) {
+  // The object is keyed in both |held_objects_| and |held_object_order_|, so
+  // its name is stored three times.
+  int64 memory_usage = MemoryUsage::kTreeNodeOverhead + sizeof(HeldObject) +
+      2 * sizeof(ObjectKey) + 3 * held.object_id.name().size() +
+      held.invalidation.payload().size();
+  for (size_t i = 0; i < held.ack_handles.size(); ++i) {
+    memory_usage += GetAckHandleMemoryUsage(held.ack_handles[i]);
+  }
+  return memory_usage;
+}
+
+int64 CheckingInvalidationListener::GetDeferredAcksMemoryUsage(
+    const string& handle_data, const vector<AckHandle>& ack_handles) {
+  int64 memory_usage = MemoryUsage::kTreeNodeOverhead +
+      MemoryUsage::OfString(handle_data) + sizeof(ack_handles);
+  for (size_t i = 0; i < ack_handles.size(); ++i) {
+    memory_usage += GetAckHandleMemoryUsage(ack_handles[i]);
+  }
+  return memory_usage;
+}
+
+AckHandle CheckingInvalidationListener::MakeDeferredAckHandle(
+    const vector<AckHandle>& ack_handles) {
+  // Fixed-width ids so that the handles sort in the order they are made.
+  string handle_data =
+      StringPrintf("deferred-ack-%010d", next_deferred_ack_id_++);
+  deferred_acks_[handle_data] = ack_handles;
+  deferred_acks_memory_usage_ +=
+      GetDeferredAcksMemoryUsage(handle_data, ack_handles);
+  if (static_cast<int>(deferred_acks_.size()) > kMaxDeferredAckHandles) {
+    map<string, vector<AckHandle> >::iterator oldest = deferred_acks_.begin();
+    TLOG(logger_, WARNING, "Dropping collapsed ack handle %s for %d acks",
+         oldest->first.c_str(), oldest->second.size());
+    deferred_acks_memory_usage_ -=
+        GetDeferredAcksMemoryUsage(oldest->first, oldest->second);
+    deferred_acks_.erase(oldest);
+  }
+  return AckHandle(handle_data);
+}
+
+void CheckingInvalidationListener::RunUpcall(Closure* upcall,
+                                             int64 memory_usage) {
+  upcall->Run();
+  delete upcall;
+  NoBarrier_AtomicIncrement(&pending_upcalls_memory_usage_,
+                            -static_cast<AtomicWord>(memory_usage));
+  if (max_pending_upcalls_ <= 0) {
+    return;
+  }
+  bool schedule_drain = false;
+  {
+    MutexLock m(&lock_);
+    --num_pending_upcalls_;
+    if (has_held_upcalls_ && !drain_scheduled_) {
+      drain_scheduled_ = true;
+      schedule_drain = true;
+    }
+  }
+  if (schedule_drain) {
+    internal_scheduler_->Schedule(
+        Scheduler::NoDelay(),
+        NewPermanentCallback(
+            this, &CheckingInvalidationListener::DrainHeldUpcalls));
+  }
+}
+
+Closure* CheckingInvalidationListener::TrackUpcall(Closure* upcall,
+                                                  int64 memory_usage) {
+  NoBarrier_AtomicIncrement(&pending_upcalls_memory_usage_,
+                            static_cast<AtomicWord>(memory_usage));
+  if (max_pending_upcalls_ > 0) {
+    int depth;
+    {
+      MutexLock m(&lock_);
+      depth = ++num_pending_upcalls_;
+    }
+    statistics_->RecordUpcallQueueDepth(depth);
+  }
+  return NewPermanentCallback(
+      this, &CheckingInvalidationListener::RunUpcall, upcall, memory_usage);
+}
+
+void CheckingInvalidationListener::ScheduleObjectUpcall(
+    const ObjectId& object_id, int64 data_size, Closure* upcall) {
+  upcall = TrackUpcall(
+      upcall, kUpcallMemoryUsage + object_id.name().size() + data_size);
+  upcall = statistics_->task_statistics()->Wrap(
+      "ListenerUpcall", internal_scheduler_, Scheduler::NoDelay(), upcall);
+  if (listener_executor_ != NULL) {
+    listener_executor_->ScheduleKeyed(object_id, upcall);
+  } else {
+    listener_scheduler_->Schedule(Scheduler::NoDelay(), upcall);
+  }
+}
+
+void CheckingInvalidationListener::ScheduleBarrierUpcall(Closure* upcall) {
+  upcall = TrackUpcall(upcall, kUpcallMemoryUsage);
+  upcall = statistics_->task_statistics()->Wrap(
+      "ListenerUpcall", internal_scheduler_, Scheduler::NoDelay(), upcall);
+  if (listener_executor_ != NULL) {
+    listener_executor_->ScheduleBarrier(upcall);
+  } else {
+    listener_scheduler_->Schedule(Scheduler::NoDelay(), upcall);
+  }
+}
+
 }  // namespace invalidation
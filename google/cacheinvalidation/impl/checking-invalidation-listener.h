@@ -18,22 +18,42 @@
 #ifndef GOOGLE_CACHEINVALIDATION_IMPL_CHECKING_INVALIDATION_LISTENER_H_
 #define GOOGLE_CACHEINVALIDATION_IMPL_CHECKING_INVALIDATION_LISTENER_H_
 
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "google/cacheinvalidation/include/invalidation-client.h"
 #include "google/cacheinvalidation/include/invalidation-listener.h"
 #include "google/cacheinvalidation/include/system-resources.h"
 #include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/atomicops.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/impl/keyed-serial-executor.h"
 #include "google/cacheinvalidation/impl/statistics.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::deque;
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
 class CheckingInvalidationListener : public InvalidationListener {
  public:
+  /* Maximum number of collapsed ack handles kept for expansion. */
+  static const int kMaxDeferredAckHandles = 1000;
+
   CheckingInvalidationListener(
       InvalidationListener* delegate, Statistics* statistics,
       Scheduler* internal_scheduler, Scheduler* listener_scheduler,
       Logger* logger);
 
-  virtual ~CheckingInvalidationListener() {}
+  /* Deletes the held upcalls that are not invalidations. */
+  virtual ~CheckingInvalidationListener();
 
   virtual void Invalidate(
       InvalidationClient* client, const Invalidation& invalidation,
@@ -67,7 +87,178 @@ class CheckingInvalidationListener : public InvalidationListener {
 
   virtual void Ready(InvalidationClient* client);
 
+  /* Makes upcalls run on |executor| instead of the listener scheduler: upcalls
+   * about an object run in order, in parallel with those for other objects,
+   * while Ready, InvalidateAll, ReissueRegistrations and InformError act as
+   * barriers. A NULL |executor| reverts to the listener scheduler. Space for
+   * |executor| is owned by the caller.
+   *
+   * REQUIRES: Called before the client is started.
+   */
+  void SetListenerExecutor(KeyedSerialExecutor* executor) {
+    listener_executor_ = executor;
+  }
+
+  /* Bounds the number of upcalls that are queued or running at any time to
+   * |max_pending_upcalls| (zero means no bound). Invalidation upcalls beyond
+   * the bound are held until the queue drains, with all the held
+   * invalidations for an object collapsed into a single
+   * InvalidateUnknownVersion upcall. Once more than |max_held_objects| objects
+   * have held invalidations, they are all collapsed into one InvalidateAll
+   * upcall. Other upcalls are not held, except that an upcall about an object
+   * with held invalidations (or while an InvalidateAll is held) waits behind
+   * them, so that the upcalls about any object keep their order.
+   *
+   * The ack handle given with a collapsed upcall stands for the handles of
+   * the invalidations it replaces; see TakeDeferredAcks.
+   *
+   * REQUIRES: Called before the client is started, with a positive
+   * |max_held_objects| if |max_pending_upcalls| is positive.
+   */
+  void SetUpcallQueueLimits(int max_pending_upcalls, int max_held_objects) {
+    CHECK((max_pending_upcalls <= 0) || (max_held_objects > 0));
+    max_pending_upcalls_ = max_pending_upcalls;
+    max_held_objects_ = max_held_objects;
+  }
+
+  /* If |ack_handle| was given with a collapsed upcall, stores the ack handles
+   * of the invalidations it replaced in |original_handles| and returns true.
+   * Otherwise returns false. Each collapsed handle is only expanded once.
+   *
+   * Only the most recent collapsed handles that have not been expanded are
+   * kept (see kMaxDeferredAckHandles): the invalidations replaced by an older
+   * handle are never acknowledged, as if the application had not acked them.
+   *
+   * REQUIRES: Called on the internal thread.
+   */
+  bool TakeDeferredAcks(const AckHandle& ack_handle,
+                        vector<AckHandle>* original_handles);
+
+  /* Appends the estimated memory used by the queued upcalls, the held
+   * invalidations and the ack handles replaced by collapsed ones, in bytes, to
+   * |usage|.
+   *
+   * REQUIRES: Called on the internal thread.
+   */
+  void GetMemoryUsage(vector<pair<string, int64> >* usage);
+
+  /* Collapses the held invalidations, if any, into a single InvalidateAll
+   * upcall, releasing their payloads.
+   *
+   * REQUIRES: Called on the internal thread.
+   */
+  void CollapseHeldUpcalls();
+
  private:
+  /* An upcall that is not an invalidation, held behind the invalidations
+   * for its object.
+   */
+  struct HeldUpcall {
+    HeldUpcall(const ObjectId& object_id_arg, int64 data_size_arg,
+               Closure* upcall_arg)
+        : object_id(object_id_arg), data_size(data_size_arg),
+          upcall(upcall_arg) {}
+
+    /* The object the upcall is about. */
+    ObjectId object_id;
+
+    /* Number of bytes of data copied by the upcall besides the object id. */
+    int64 data_size;
+
+    /* The upcall, owned by the listener. */
+    Closure* upcall;
+  };
+
+  /* The invalidations held for an object while the upcall queue is full. */
+  struct HeldObject {
+    HeldObject() : is_known_version(false) {}
+
+    /* The object. */
+    ObjectId object_id;
+
+    /* The first held invalidation, delivered as is if no other invalidation
+     * for the object is held.
+     */
+    Invalidation invalidation;
+
+    /* Whether |invalidation| is to be delivered with Invalidate rather than
+     * InvalidateUnknownVersion.
+     */
+    bool is_known_version;
+
+    /* The ack handles of all the held invalidations. */
+    vector<AckHandle> ack_handles;
+
+    /* The upcalls about the object received after its first held
+     * invalidation, to be scheduled after the held invalidations.
+     */
+    vector<HeldUpcall> later_upcalls;
+  };
+
+  /* Key for an object in |held_objects_|. */
+  typedef pair<int, string> ObjectKey;
+
+  /* Returns whether an invalidation upcall must be held rather than queued. If
+   * so, the caller must hold it.
+   */
+  bool ShouldHoldUpcall();
+
+  /* Holds an invalidation of |object_id| with |ack_handle| for |client|. If
+   * |is_known_version|, |invalidation| is the invalidation itself.
+   */
+  void HoldInvalidation(InvalidationClient* client, const ObjectId& object_id,
+      const Invalidation& invalidation, bool is_known_version,
+      const AckHandle& ack_handle);
+
+  /* If upcalls about |object_id| are held, holds |upcall| (see
+   * ScheduleObjectUpcall) behind them and returns true. Otherwise returns
+   * false.
+   */
+  bool HoldObjectUpcall(const ObjectId& object_id, int64 data_size,
+                        Closure* upcall);
+
+  /* Schedules the |held_upcalls| and clears them. */
+  void ScheduleHeldUpcalls(vector<HeldUpcall>* held_upcalls);
+
+  /* Moves the ack handles of all the held objects to |held_all_acks_|, and
+   * their other held upcalls to |held_after_all_upcalls_|.
+   */
+  void CollapseToInvalidateAll();
+
+  /* Queues as many held upcalls as the bound allows. */
+  void DrainHeldUpcalls();
+
+  /* Returns an ack handle standing for |ack_handles|. */
+  AckHandle MakeDeferredAckHandle(const vector<AckHandle>& ack_handles);
+
+  /* Returns the estimated memory used by |held|. */
+  static int64 GetHeldObjectMemoryUsage(const HeldObject& held);
+
+  /* Returns the estimated memory used by the entry of |deferred_acks_| with
+   * |handle_data| and |ack_handles|.
+   */
+  static int64 GetDeferredAcksMemoryUsage(const string& handle_data,
+                                          const vector<AckHandle>& ack_handles);
+
+  /* Runs |upcall| on the listener thread and accounts for its completion.
+   * |memory_usage| is the estimate given to TrackUpcall.
+   */
+  void RunUpcall(Closure* upcall, int64 memory_usage);
+
+  /* Wraps |upcall|, estimated to use |memory_usage| bytes, to account for it
+   * in the queue. Takes |lock_| only if the queue is bounded.
+   */
+  Closure* TrackUpcall(Closure* upcall, int64 memory_usage);
+
+  /* Schedules |upcall|, which concerns only |object_id| and copies
+   * |data_size| bytes of data besides the object id, for the delegate.
+   */
+  void ScheduleObjectUpcall(const ObjectId& object_id, int64 data_size,
+                            Closure* upcall);
+
+  /* Schedules |upcall|, which may concern any object, for the delegate. */
+  void ScheduleBarrierUpcall(Closure* upcall);
+
   /* The actual listener to which this listener delegates. */
   InvalidationListener* delegate_;
 
@@ -80,6 +271,83 @@ class CheckingInvalidationListener : public InvalidationListener {
   /* The scheduler for scheduling events for the delegate. */
   Scheduler* listener_scheduler_;
 
+  /* If not NULL, the executor used for events instead of
+   * |listener_scheduler_|.
+   */
+  KeyedSerialExecutor* listener_executor_;
+
+  /* Bound on the number of queued or running upcalls; zero if unbounded. */
+  int max_pending_upcalls_;
+
+  /* Number of objects with held invalidations beyond which they are collapsed
+   * into an InvalidateAll upcall.
+   */
+  int max_held_objects_;
+
+  /* Protects the fields accessed on both the internal and listener threads
+   * (below).
+   */
+  Mutex lock_;
+
+  /* Number of upcalls queued or running, counted only if the queue is
+   * bounded.
+   */
+  int num_pending_upcalls_;
+
+  /* Whether upcalls are being held, i.e., whether some upcall is held or
+   * about to be.
+   */
+  bool has_held_upcalls_;
+
+  /* Whether a DrainHeldUpcalls call is scheduled on the internal thread. */
+  bool drain_scheduled_;
+
+  /* Estimated memory used by the upcalls queued or running. A relaxed atomic
+   * word rather than a field under |lock_|, so that unbounded queues take no
+   * lock per upcall.
+   */
+  AtomicWord pending_upcalls_memory_usage_;
+
+  /* The fields below are only accessed on the internal thread. */
+
+  /* The client passed to the held upcalls. */
+  InvalidationClient* held_client_;
+
+  /* The objects with held invalidations, and the order in which they were
+   * first held.
+   */
+  map<ObjectKey, HeldObject> held_objects_;
+  deque<ObjectKey> held_object_order_;
+
+  /* Whether an InvalidateAll upcall is held, replacing all the held
+   * invalidations.
+   */
+  bool held_invalidate_all_;
+
+  /* Ack handles for the held InvalidateAll upcall. */
+  vector<AckHandle> held_all_acks_;
+
+  /* Upcalls held behind the held InvalidateAll upcall. */
+  vector<HeldUpcall> held_after_all_upcalls_;
+
+  /* Estimated memory used by the held invalidations and ack handles,
+   * maintained as they are held and released.
+   */
+  int64 held_memory_usage_;
+
+  /* The ack handles replaced by each collapsed ack handle given out and not
+   * expanded yet. Handles sort in the order in which they were given out.
+   */
+  map<string, vector<AckHandle> > deferred_acks_;
+
+  /* Estimated memory used by |deferred_acks_|, maintained as entries are
+   * added and removed.
+   */
+  int64 deferred_acks_memory_usage_;
+
+  /* Id used to generate the next collapsed ack handle. */
+  int next_deferred_ack_id_;
+
   Logger* logger_;
 };
 
@@ -0,0 +1,249 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the CheckingInvalidationListener class.
+
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/gmock.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/checking-invalidation-listener.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+#include "google/cacheinvalidation/test/test-utils.h"
+
+namespace invalidation {
+
+using ::testing::_;
+using ::testing::Eq;
+using ::testing::SaveArg;
+using ::testing::Sequence;
+using ::testing::StrictMock;
+
+class CheckingInvalidationListenerTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    logger.reset(new TestLogger());
+    internal_scheduler.reset(new SimpleDeterministicScheduler(logger.get()));
+    listener_scheduler.reset(new SimpleDeterministicScheduler(logger.get()));
+    statistics.reset(new Statistics());
+    checking_listener.reset(new CheckingInvalidationListener(
+        &listener, statistics.get(), internal_scheduler.get(),
+        listener_scheduler.get(), logger.get()));
+    internal_scheduler->StartScheduler();
+    listener_scheduler->StartScheduler();
+  }
+
+  /* Issues an invalidation of object |name| at |version| with an ack handle
+   * named after both.
+   */
+  void Invalidate(const string& name, int64 version) {
+    checking_listener->Invalidate(NULL, MakeInvalidation(name, version),
+                                  MakeAckHandle(name, version));
+  }
+
+  static Invalidation MakeInvalidation(const string& name, int64 version) {
+    return Invalidation(ObjectId(4, name), version);
+  }
+
+  static AckHandle MakeAckHandle(const string& name, int64 version) {
+    return AckHandle(name + SimpleItoa(version));
+  }
+
+  /* Runs the upcalls and the draining of held upcalls to completion. */
+  void RunUpcalls() {
+    for (int i = 0; i < 10; ++i) {
+      listener_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+      internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+    }
+  }
+
+  scoped_ptr<Logger> logger;
+  scoped_ptr<DeterministicScheduler> internal_scheduler;
+  scoped_ptr<DeterministicScheduler> listener_scheduler;
+  scoped_ptr<Statistics> statistics;
+  StrictMock<MockInvalidationListener> listener;
+  scoped_ptr<CheckingInvalidationListener> checking_listener;
+};
+
+/* Tests that invalidations beyond the bound are held, and that several held
+ * invalidations for an object collapse into one unknown-version upcall whose
+ * handle acknowledges all of them.
+ */
+TEST_F(CheckingInvalidationListenerTest, CollapseToUnknownVersion) {
+  checking_listener->SetUpcallQueueLimits(2, 10);
+  AckHandle collapsed_handle("");
+  EXPECT_CALL(listener, Invalidate(_, Eq(MakeInvalidation("o1", 1)),
+                                   Eq(MakeAckHandle("o1", 1))));
+  EXPECT_CALL(listener, Invalidate(_, Eq(MakeInvalidation("o2", 1)),
+                                   Eq(MakeAckHandle("o2", 1))));
+  EXPECT_CALL(listener, InvalidateUnknownVersion(_, Eq(ObjectId(4, "o1")), _))
+      .WillOnce(SaveArg<2>(&collapsed_handle));
+  EXPECT_CALL(listener, Invalidate(_, Eq(MakeInvalidation("o3", 1)),
+                                   Eq(MakeAckHandle("o3", 1))));
+
+  Invalidate("o1", 1);
+  Invalidate("o2", 1);
+  Invalidate("o1", 2);
+  Invalidate("o1", 3);
+  Invalidate("o3", 1);
+  RunUpcalls();
+
+  vector<AckHandle> original_handles;
+  ASSERT_TRUE(checking_listener->TakeDeferredAcks(collapsed_handle,
+                                                  &original_handles));
+  ASSERT_EQ(2, static_cast<int>(original_handles.size()));
+  EXPECT_EQ(MakeAckHandle("o1", 2), original_handles[0]);
+  EXPECT_EQ(MakeAckHandle("o1", 3), original_handles[1]);
+  EXPECT_FALSE(checking_listener->TakeDeferredAcks(collapsed_handle,
+                                                   &original_handles));
+
+  EXPECT_EQ(3, statistics->GetUpcallEventCounterForTest(
+      Statistics::UpcallEventType_OVERFLOWED));
+  EXPECT_EQ(1, statistics->GetUpcallEventCounterForTest(
+      Statistics::UpcallEventType_COLLAPSED_TO_UNKNOWN_VERSION));
+  EXPECT_EQ(2, statistics->GetUpcallQueueGaugeForTest(
+      Statistics::UpcallQueueGauge_MAX_DEPTH));
+}
+
+/* Tests that held invalidations for too many objects collapse into a single
+ * invalidateAll upcall.
+ */
+TEST_F(CheckingInvalidationListenerTest, CollapseToInvalidateAll) {
+  checking_listener->SetUpcallQueueLimits(1, 2);
+  AckHandle collapsed_handle("");
+  EXPECT_CALL(listener, Invalidate(_, Eq(MakeInvalidation("o1", 1)),
+                                   Eq(MakeAckHandle("o1", 1))));
+  EXPECT_CALL(listener, InvalidateAll(_, _))
+      .WillOnce(SaveArg<1>(&collapsed_handle));
+
+  Invalidate("o1", 1);
+  Invalidate("o2", 1);
+  Invalidate("o3", 1);
+  Invalidate("o4", 1);
+  RunUpcalls();
+
+  vector<AckHandle> original_handles;
+  ASSERT_TRUE(checking_listener->TakeDeferredAcks(collapsed_handle,
+                                                  &original_handles));
+  ASSERT_EQ(3, static_cast<int>(original_handles.size()));
+  EXPECT_EQ(1, statistics->GetUpcallEventCounterForTest(
+      Statistics::UpcallEventType_COLLAPSED_TO_INVALIDATE_ALL));
+}
+
+/* Tests that an upcall about an object with held invalidations is delivered
+ * after them, while upcalls about other objects are not held.
+ */
+TEST_F(CheckingInvalidationListenerTest, KeepsUpcallOrderPerObject) {
+  checking_listener->SetUpcallQueueLimits(1, 10);
+  Sequence o2_sequence;
+  EXPECT_CALL(listener, Invalidate(_, Eq(MakeInvalidation("o1", 1)), _));
+  EXPECT_CALL(listener, Invalidate(_, Eq(MakeInvalidation("o2", 1)), _))
+      .InSequence(o2_sequence);
+  EXPECT_CALL(listener, InformRegistrationStatus(
+      _, Eq(ObjectId(4, "o2")), InvalidationListener::REGISTERED))
+      .InSequence(o2_sequence);
+  EXPECT_CALL(listener, InformRegistrationStatus(
+      _, Eq(ObjectId(4, "o3")), InvalidationListener::REGISTERED));
+
+  Invalidate("o1", 1);
+  Invalidate("o2", 1);
+  checking_listener->InformRegistrationStatus(
+      NULL, ObjectId(4, "o2"), InvalidationListener::REGISTERED);
+  checking_listener->InformRegistrationStatus(
+      NULL, ObjectId(4, "o3"), InvalidationListener::REGISTERED);
+  RunUpcalls();
+}
+
+/* Tests that only the most recent collapsed ack handles are kept, and that
+ * their memory is accounted for until they are expanded.
+ */
+TEST_F(CheckingInvalidationListenerTest, BoundsDeferredAcks) {
+  checking_listener->SetUpcallQueueLimits(1, 1);
+  int num_collapsed = CheckingInvalidationListener::kMaxDeferredAckHandles + 1;
+  AckHandle first_handle("");
+  AckHandle last_handle("");
+  EXPECT_CALL(listener, Invalidate(_, _, _)).Times(num_collapsed);
+  EXPECT_CALL(listener, InvalidateAll(_, _))
+      .WillOnce(SaveArg<1>(&first_handle))
+      .WillRepeatedly(SaveArg<1>(&last_handle));
+
+  // Each round queues an invalidation and collapses the next two into an
+  // invalidateAll with a collapsed handle.
+  for (int i = 0; i < num_collapsed; ++i) {
+    Invalidate("o1", i);
+    Invalidate("o2", i);
+    Invalidate("o3", i);
+    RunUpcalls();
+  }
+
+  vector<pair<string, int64> > usage;
+  checking_listener->GetMemoryUsage(&usage);
+  ASSERT_EQ("DeferredAcks", usage[2].first);
+  int64 deferred_acks_memory_usage = usage[2].second;
+  EXPECT_GT(deferred_acks_memory_usage, 0);
+
+  vector<AckHandle> original_handles;
+  EXPECT_FALSE(checking_listener->TakeDeferredAcks(first_handle,
+                                                   &original_handles));
+  ASSERT_TRUE(checking_listener->TakeDeferredAcks(last_handle,
+                                                  &original_handles));
+  EXPECT_EQ(2, static_cast<int>(original_handles.size()));
+  usage.clear();
+  checking_listener->GetMemoryUsage(&usage);
+  EXPECT_LT(usage[2].second, deferred_acks_memory_usage);
+}
+
+/* Tests that the memory used by queued and held upcalls is accounted for
+ * until they run, and that collapsing the held upcalls releases their
+ * payloads.
+ */
+TEST_F(CheckingInvalidationListenerTest, AccountsForMemoryUsage) {
+  checking_listener->SetUpcallQueueLimits(1, 10);
+  EXPECT_CALL(listener, Invalidate(_, _, _));
+  EXPECT_CALL(listener, InvalidateAll(_, _));
+
+  checking_listener->Invalidate(
+      NULL, Invalidation(ObjectId(4, "o1"), 1, string(1000, 'a')),
+      MakeAckHandle("o1", 1));
+  checking_listener->Invalidate(
+      NULL, Invalidation(ObjectId(4, "o2"), 1, string(1000, 'b')),
+      MakeAckHandle("o2", 1));
+  vector<pair<string, int64> > usage;
+  checking_listener->GetMemoryUsage(&usage);
+  ASSERT_EQ(3, static_cast<int>(usage.size()));
+  EXPECT_EQ("ListenerUpcalls", usage[0].first);
+  EXPECT_GT(usage[0].second, 1000);
+  EXPECT_EQ("HeldUpcalls", usage[1].first);
+  EXPECT_GT(usage[1].second, 1000);
+  EXPECT_EQ("DeferredAcks", usage[2].first);
+  EXPECT_EQ(0, usage[2].second);
+
+  // Only the ack handle of the held invalidation remains.
+  checking_listener->CollapseHeldUpcalls();
+  usage.clear();
+  checking_listener->GetMemoryUsage(&usage);
+  EXPECT_GT(usage[1].second, 0);
+  EXPECT_LT(usage[1].second, 1000);
+
+  RunUpcalls();
+  usage.clear();
+  checking_listener->GetMemoryUsage(&usage);
+  EXPECT_EQ(0, usage[0].second);
+  EXPECT_EQ(0, usage[1].second);
+}
+
+}  // namespace invalidation
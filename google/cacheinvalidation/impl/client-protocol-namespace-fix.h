@@ -25,6 +25,9 @@
 namespace invalidation {
 
 // Client
+using ::ipc::invalidation::AckJournalEntryP;
+using ::ipc::invalidation::AckJournalP;
+using ::ipc::invalidation::ClientSnapshotP;
 using ::ipc::invalidation::PersistentStateBlob;
 using ::ipc::invalidation::PersistentTiclState;
 
@@ -32,6 +35,7 @@ using ::ipc::invalidation::PersistentTiclState;
 using ::ipc::invalidation::AckHandleP;
 using ::ipc::invalidation::ApplicationClientIdP;
 using ::ipc::invalidation::ClientConfigP;
+using ::ipc::invalidation::DebounceConfigP;
 using ::ipc::invalidation::ClientHeader;
 using ::ipc::invalidation::ClientVersion;
 using ::ipc::invalidation::ClientToServerMessage;
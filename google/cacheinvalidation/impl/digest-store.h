@@ -18,10 +18,14 @@
 #ifndef GOOGLE_CACHEINVALIDATION_IMPL_DIGEST_STORE_H_
 #define GOOGLE_CACHEINVALIDATION_IMPL_DIGEST_STORE_H_
 
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
 using INVALIDATION_STL_NAMESPACE::vector;
 
 template<typename ElementType>
@@ -77,9 +81,44 @@ class DigestStore {
   virtual void Remove(const vector<ElementType>& elements,
       vector<ElementType>* removed_elements) = 0;
 
+  /* Like Add(elements, added_elements), for elements given with the digests
+   * of the elements, computed earlier. Stores that do not use these digests
+   * ignore them.
+   */
+  virtual void AddDigested(
+      const vector<pair<string, ElementType> >& digested_elements,
+      vector<ElementType>* added_elements) {
+    vector<ElementType> elements;
+    for (size_t i = 0; i < digested_elements.size(); ++i) {
+      elements.push_back(digested_elements[i].second);
+    }
+    Add(elements, added_elements);
+  }
+
+  /* Like Remove(elements, removed_elements), for elements given with the
+   * digests of the elements, computed earlier. Stores that do not use these
+   * digests ignore them.
+   */
+  virtual void RemoveDigested(
+      const vector<pair<string, ElementType> >& digested_elements,
+      vector<ElementType>* removed_elements) {
+    vector<ElementType> elements;
+    for (size_t i = 0; i < digested_elements.size(); ++i) {
+      elements.push_back(digested_elements[i].second);
+    }
+    Remove(elements, removed_elements);
+  }
+
   /* Removes all elements in this and stores them in elements. */
   virtual void RemoveAll(vector<ElementType>* elements) = 0;
 
+  /* Returns an estimate of the memory used by the elements, in bytes. Stores
+   * that do not keep one return 0.
+   */
+  virtual int64 GetMemoryUsage() {
+    return 0;
+  }
+
   /* Returns a string representation of this digest store. */
   virtual string ToString() = 0;
 };
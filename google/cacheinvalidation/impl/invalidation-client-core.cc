@@ -26,6 +26,8 @@
 #include "google/cacheinvalidation/impl/exponential-backoff-delay-generator.h"
 #include "google/cacheinvalidation/impl/invalidation-client-util.h"
 #include "google/cacheinvalidation/impl/log-macro.h"
+#include "google/cacheinvalidation/impl/memory-usage.h"
+#include "google/cacheinvalidation/impl/object-id-digest-utils.h"
 #include "google/cacheinvalidation/impl/persistence-utils.h"
 #include "google/cacheinvalidation/impl/proto-converter.h"
 #include "google/cacheinvalidation/impl/proto-helpers.h"
@@ -37,6 +39,13 @@ namespace invalidation {
 using ::ipc::invalidation::RegistrationManagerStateP;
 
 const char* InvalidationClientCore::kClientTokenKey = "ClientToken";
+const char* InvalidationClientCore::kAckJournalKey = "ClientAckJournal";
+const int InvalidationClientCore::kSnapshotFormatVersion = 1;
+const int InvalidationClientCore::kMaxLatencyTrackedSources = 10;
+const int InvalidationClientCore::kMaxLatencyTrackedAcks = 1000;
+const int InvalidationClientCore::kAckHandleTagLength = 8;
+const int InvalidationClientCore::kMaxSupersededAckEntries = 1000;
+const int InvalidationClientCore::kMemorySoftCapRearmPercent = 90;
 
 // AcquireTokenTask
 
@@ -120,38 +129,89 @@ PersistentWriteTask::PersistentWriteTask(InvalidationClientCore* client)
 }
 
 bool PersistentWriteTask::RunTask() {
+  RegistrationSummary server_summary;
+  client_->registration_manager_.GetServerSummary(&server_summary);
   if (client_->client_token_.empty() ||
-      (client_->client_token_ == last_written_token_)) {
+      ((client_->client_token_ == last_written_token_) &&
+       (server_summary.SerializeAsString() ==
+        last_written_server_summary_.SerializeAsString()))) {
     // No work to be done
     return false;  // Do not reschedule
   }
 
-  // Persistent write needs to happen.
+  // Persistent write needs to happen. The server time is written along but
+  // does not cause writes by itself.
   PersistentTiclState state;
   state.set_client_token(client_->client_token_);
+  state.mutable_last_known_server_summary()->CopyFrom(server_summary);
+  state.set_last_known_server_time_ms(
+      client_->protocol_handler_.GetLastKnownServerTimeMs());
   string serialized_state;
   PersistenceUtils::SerializeState(state, client_->digest_fn_.get(),
       &serialized_state);
   client_->storage_->WriteKey(InvalidationClientCore::kClientTokenKey,
       serialized_state,
       NewPermanentCallback(this, &PersistentWriteTask::WriteCallback,
-          client_->client_token_));
+          client_->client_token_, server_summary));
   return true;  // Reschedule after timeout to make sure that write does happen.
 }
 
-void PersistentWriteTask::WriteCallback(const string& token, Status status) {
+void PersistentWriteTask::WriteCallback(
+    const string& token, const RegistrationSummary& server_summary,
+    Status status) {
   TLOG(client_->logger_, INFO, "Write state completed: %d, %s",
        status.IsSuccess(), status.message().c_str());
   if (status.IsSuccess()) {
     // Set lastWrittenToken to be the token that was written (NOT client_token_:
     // which could have changed while the write was happening).
     last_written_token_ = token;
+    last_written_server_summary_.CopyFrom(server_summary);
   } else {
     client_->statistics_->RecordError(
         Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE);
   }
 }
 
+// AckJournalWriteTask
+
+AckJournalWriteTask::AckJournalWriteTask(InvalidationClientCore* client)
+    : RecurringTask(
+        "AckJournalWrite",
+        client->internal_scheduler_,
+        client->logger_,
+        &client->smearer_,
+        client->CreateExpBackOffGenerator(TimeDelta::FromMilliseconds(
+            client->config_.write_retry_delay_ms())),
+        Scheduler::NoDelay(),
+        TimeDelta::FromMilliseconds(
+            client->config_.write_retry_delay_ms())),
+      client_(client) {
+}
+
+bool AckJournalWriteTask::RunTask() {
+  if (!client_->ack_journal_dirty_) {
+    return false;  // Do not reschedule
+  }
+  string serialized;
+  client_->ack_journal_->Serialize(&serialized);
+  client_->ack_journal_dirty_ = false;
+  client_->storage_->WriteKey(InvalidationClientCore::kAckJournalKey,
+      serialized,
+      NewPermanentCallback(this, &AckJournalWriteTask::WriteCallback));
+  return true;  // Reschedule after timeout to retry a failed write.
+}
+
+void AckJournalWriteTask::WriteCallback(Status status) {
+  if (!status.IsSuccess()) {
+    // Write the journal again on the next run.
+    client_->ack_journal_dirty_ = true;
+    client_->statistics_->RecordError(
+        Statistics::ClientErrorType_PERSISTENT_WRITE_FAILURE);
+    TLOG(client_->logger_, WARNING, "Could not write ack journal: %s",
+         status.message().c_str());
+  }
+}
+
 // HeartbeatTask
 
 HeartbeatTask::HeartbeatTask(InvalidationClientCore* client)
@@ -224,10 +284,34 @@ InvalidationClientCore::InvalidationClientCore(
           statistics_.get(), client_type, application_name, this,
           msg_validator_.get()),
       is_online_(true),
+      own_timer_coalescer_(new TimerCoalescer(internal_scheduler_,
+          statistics_.get(), logger_)),
+      timer_coalescer_(own_timer_coalescer_.get()),
+      debounced_objects_memory_usage_(0),
+      max_parsed_message_memory_usage_(0),
+      next_superseded_ack_seqno_(0),
+      superseded_acks_memory_usage_(0),
+      memory_soft_cap_exceeded_(false),
+      ack_journal_dirty_(false),
+      latency_tracker_(kMaxLatencyTrackedSources, kMaxLatencyTrackedAcks),
       random_(random) {
   storage_.get()->SetSystemResources(resources_);
+  storage_.get()->EnableWriteCoalescing(
+      TimeDelta::FromMilliseconds(config.write_coalescing_window_ms()),
+      statistics_.get());
+  for (int i = 0; i < config.debounce_config_size(); ++i) {
+    const DebounceConfigP& debounce_config = config.debounce_config(i);
+    if (debounce_config.window_ms() > 0) {
+      debounce_windows_[debounce_config.source()] =
+          TimeDelta::FromMilliseconds(debounce_config.window_ms());
+    }
+  }
+  if (config.ack_journal_size() > 0) {
+    ack_journal_.reset(new AckJournal(config.ack_journal_size()));
+  }
   application_client_id_.set_client_name(client_name);
   application_client_id_.set_client_type(client_type);
+  application_client_id_.SerializeToString(&ack_handle_tag_key_);
   CreateSchedulingTasks();
   RegisterWithNetwork(resources);
   TLOG(logger_, INFO, "Created client: %s", ToString().c_str());
@@ -247,11 +331,39 @@ void InvalidationClientCore::CreateSchedulingTasks() {
   acquire_token_task_.reset(new AcquireTokenTask(this));
   reg_sync_heartbeat_task_.reset(new RegSyncHeartbeatTask(this));
   persistent_write_task_.reset(new PersistentWriteTask(this));
+  ack_journal_write_task_.reset(new AckJournalWriteTask(this));
   heartbeat_task_.reset(new HeartbeatTask(this));
   batching_task_.reset(new BatchingTask(&protocol_handler_,
       &smearer_,
       TimeDelta::FromMilliseconds(
           config_.protocol_handler_config().batching_delay_ms())));
+
+  TaskStatistics* task_statistics = statistics_->task_statistics();
+  acquire_token_task_->SetTaskStatistics(task_statistics);
+  reg_sync_heartbeat_task_->SetTaskStatistics(task_statistics);
+  persistent_write_task_->SetTaskStatistics(task_statistics);
+  ack_journal_write_task_->SetTaskStatistics(task_statistics);
+  heartbeat_task_->SetTaskStatistics(task_statistics);
+  batching_task_->SetTaskStatistics(task_statistics);
+
+  if (config_.timer_slack_percent() > 0) {
+    int slack_percent = config_.timer_slack_percent();
+    acquire_token_task_->SetTimerCoalescer(timer_coalescer_, slack_percent);
+    reg_sync_heartbeat_task_->SetTimerCoalescer(timer_coalescer_,
+                                                slack_percent);
+    persistent_write_task_->SetTimerCoalescer(timer_coalescer_, slack_percent);
+    ack_journal_write_task_->SetTimerCoalescer(timer_coalescer_,
+                                               slack_percent);
+    heartbeat_task_->SetTimerCoalescer(timer_coalescer_, slack_percent);
+    batching_task_->SetTimerCoalescer(timer_coalescer_, slack_percent);
+  }
+}
+
+void InvalidationClientCore::SetTimerCoalescer(
+    TimerCoalescer* timer_coalescer) {
+  CHECK(!ticl_state_.IsStarted()) << "Ticl already started";
+  timer_coalescer_ = timer_coalescer;
+  CreateSchedulingTasks();
 }
 
 void InvalidationClientCore::InitConfig(ClientConfigP* config) {
@@ -283,11 +395,101 @@ void InvalidationClientCore::Start() {
   TLOG(logger_, INFO, "Starting with C++ config: %s",
        ProtoHelpers::ToString(config_).c_str());
 
+  if (snapshot_to_restore_.get() != NULL) {
+    StartFromSnapshot();
+    return;
+  }
+
   // Read the state blob and then schedule startInternal once the value is
   // there.
   ScheduleStartAfterReadingStateBlob();
 }
 
+bool InvalidationClientCore::ExportSnapshot(string* snapshot) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (!ticl_state_.IsStarted() || client_token_.empty()) {
+    TLOG(logger_, WARNING, "Cannot export snapshot of client not started: %s",
+         ToString().c_str());
+    return false;
+  }
+  ClientSnapshotP snapshot_proto;
+  snapshot_proto.set_format_version(kSnapshotFormatVersion);
+  snapshot_proto.set_client_token(client_token_);
+  snapshot_proto.set_should_send_registrations(should_send_registrations_);
+  snapshot_proto.set_last_known_server_time_ms(
+      protocol_handler_.GetLastKnownServerTimeMs());
+  registration_manager_.ExportState(&snapshot_proto);
+  protocol_handler_.ExportBatchedState(&snapshot_proto);
+  snapshot_proto.SerializeToString(snapshot);
+  TLOG(logger_, INFO, "Exported snapshot with %d registrations",
+       snapshot_proto.desired_registration_size());
+  return true;
+}
+
+bool InvalidationClientCore::SetSnapshotToRestore(const string& snapshot) {
+  CHECK(!ticl_state_.IsStarted()) << "Ticl already started";
+  scoped_ptr<ClientSnapshotP> snapshot_proto(new ClientSnapshotP());
+  if (!snapshot_proto->ParseFromString(snapshot) ||
+      !snapshot_proto->has_client_token() ||
+      snapshot_proto->client_token().empty()) {
+    TLOG(logger_, SEVERE, "Could not parse snapshot");
+    return false;
+  }
+  if (snapshot_proto->format_version() != kSnapshotFormatVersion) {
+    TLOG(logger_, SEVERE, "Unsupported snapshot format version: %d",
+         snapshot_proto->format_version());
+    return false;
+  }
+  snapshot_to_restore_.reset(snapshot_proto.release());
+  return true;
+}
+
+void InvalidationClientCore::StartFromSnapshot() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  CHECK(resources_->IsStarted()) << "Resources must be started before starting "
+      "the Ticl";
+  if (ack_journal_.get() != NULL) {
+    // Load the journal, so that it is not overwritten by the next acks.
+    storage_->ReadKey(kAckJournalKey,
+        NewPermanentCallback(this,
+            &InvalidationClientCore::ReadSnapshotAckJournalCallback));
+    return;
+  }
+  ResumeFromSnapshot();
+}
+
+void InvalidationClientCore::ReadSnapshotAckJournalCallback(
+    pair<Status, string> read_result) {
+  LoadAckJournal(read_result);
+  internal_scheduler_->Schedule(
+      Scheduler::NoDelay(),
+      NewPermanentCallback(this, &InvalidationClientCore::ResumeFromSnapshot));
+}
+
+void InvalidationClientCore::ResumeFromSnapshot() {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  // The acks pending in the journal need not be resent: those not sent yet
+  // are among the batched acks restored from the snapshot.
+  scoped_ptr<ClientSnapshotP> snapshot(snapshot_to_restore_.release());
+  TLOG(logger_, INFO, "Resuming from snapshot: %s",
+       ProtoHelpers::ToString(snapshot->client_token()).c_str());
+
+  // Restore the registrations first, so that the registrations reissued on
+  // ready are already known and not sent again.
+  registration_manager_.RestoreState(*snapshot);
+  protocol_handler_.RestoreLastKnownServerTimeMs(
+      snapshot->last_known_server_time_ms());
+  protocol_handler_.RestoreBatchedState(*snapshot, batching_task_.get());
+  should_send_registrations_ = snapshot->should_send_registrations();
+
+  // Setting the token finishes starting the Ticl.
+  set_nonce("");
+  set_client_token(snapshot->client_token());
+  heartbeat_task_.get()->EnsureScheduled("Startup-after-snapshot");
+  persistent_write_task_.get()->EnsureScheduled("Write-after-snapshot");
+  reg_sync_heartbeat_task_.get()->EnsureScheduled("Startup-after-snapshot");
+}
+
 void InvalidationClientCore::StartInternal(const string& serialized_state) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
 
@@ -326,6 +528,13 @@ void InvalidationClientCore::StartInternal(const string& serialized_state) {
     set_nonce("");
     set_client_token(persistent_state.client_token());
     should_send_registrations_ = false;
+    protocol_handler_.RestoreLastKnownServerTimeMs(
+        persistent_state.last_known_server_time_ms());
+    bool has_server_summary = persistent_state.has_last_known_server_summary();
+    if (has_server_summary) {
+      registration_manager_.RestoreServerSummary(
+          persistent_state.last_known_server_summary());
+    }
 
     // Schedule an info message for the near future. We delay a little bit to
     // allow the application to reissue its registrations locally and avoid
@@ -333,13 +542,29 @@ void InvalidationClientCore::StartInternal(const string& serialized_state) {
     internal_scheduler_->Schedule(TimeDelta::FromMilliseconds(
         config_.initial_persistent_heartbeat_delay_ms()),
         NewPermanentCallback(this,
-            &InvalidationClientCore::SendInfoMessageToServer, false, true));
+            &InvalidationClientCore::SendInfoMessageAfterRestart,
+            has_server_summary));
 
     // We need to ensure that heartbeats are sent, regardless of whether we
     // start fresh or from persistent state.  The line below ensures that they
     // are scheduled in the persistent startup case.  For the other case, the
     // task is scheduled when we acquire a token.
     heartbeat_task_.get()->EnsureScheduled("Startup-after-persistence");
+
+    // Resend the acks that may not have reached the server before the
+    // restart, so that it does not redeliver their invalidations.
+    if (ack_journal_.get() != NULL) {
+      vector<InvalidationP> pending_acks;
+      ack_journal_->GetPendingAcks(&pending_acks);
+      if (!pending_acks.empty()) {
+        TLOG(logger_, INFO, "Resending %d journaled acks",
+             static_cast<int>(pending_acks.size()));
+      }
+      for (size_t i = 0; i < pending_acks.size(); ++i) {
+        protocol_handler_.SendInvalidationAck(pending_acks[i],
+                                              batching_task_.get());
+      }
+    }
   } else {
     // If we had no persistent state or couldn't deserialize the state that we
     // had, start fresh.  Request a new client identifier.
@@ -360,6 +585,7 @@ void InvalidationClientCore::Stop() {
   if (ticl_state_.IsStarted()) {
     ticl_state_.Stop();
   }
+  buffered_register_operations_.clear();
 }
 
 void InvalidationClientCore::Register(const ObjectId& object_id) {
@@ -379,13 +605,39 @@ void InvalidationClientCore::Unregister(const ObjectId& object_id) {
 void InvalidationClientCore::PerformRegisterOperations(
     const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
-  CHECK(!object_ids.empty()) << "Must specify some object id";
+  vector<pair<string, ObjectIdP> > digested_object_ids;
+  DigestObjectIds(object_ids, digest_fn_.get(), &digested_object_ids);
+  PerformDigestedRegisterOperations(digested_object_ids, reg_op_type);
+}
+
+void InvalidationClientCore::DigestObjectIds(
+    const vector<ObjectId>& object_ids, DigestFunction* digest_fn,
+    vector<pair<string, ObjectIdP> >* digested_object_ids) {
+  digested_object_ids->reserve(object_ids.size());
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    ObjectIdP object_id_proto;
+    ProtoConverter::ConvertToObjectIdProto(object_ids[i], &object_id_proto);
+    digested_object_ids->push_back(make_pair(
+        ObjectIdDigestUtils::GetDigest(object_id_proto, digest_fn),
+        object_id_proto));
+  }
+}
+
+void InvalidationClientCore::PerformDigestedRegisterOperations(
+    const vector<pair<string, ObjectIdP> >& digested_object_ids,
+    RegistrationP::OpType reg_op_type) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  CHECK(!digested_object_ids.empty()) << "Must specify some object id";
 
   if (ticl_state_.IsStopped()) {
     // The Ticl has been stopped. This might be some old registration op
     // coming in. Just ignore instead of crashing.
     TLOG(logger_, SEVERE, "Ticl stopped: register (%d) of %d objects ignored.",
-         reg_op_type, object_ids.size());
+         reg_op_type, digested_object_ids.size());
+    return;
+  }
+  if (!ticl_state_.IsStarted() && config_.buffer_registrations_before_ready()) {
+    BufferRegisterOperations(digested_object_ids, reg_op_type);
     return;
   }
   if (!ticl_state_.IsStarted()) {
@@ -395,20 +647,19 @@ void InvalidationClientCore::PerformRegisterOperations(
     TLOG(logger_, SEVERE,
         "Ticl is not yet started; failing registration call; client = %s, "
          "num-objects = %d, op = %d",
-        this->ToString().c_str(), object_ids.size(), reg_op_type);
-    for (size_t i = 0; i < object_ids.size(); ++i) {
-      const ObjectId& object_id = object_ids[i];
+        this->ToString().c_str(), digested_object_ids.size(), reg_op_type);
+    for (size_t i = 0; i < digested_object_ids.size(); ++i) {
+      ObjectId object_id;
+      ProtoConverter::ConvertFromObjectIdProto(digested_object_ids[i].second,
+                                               &object_id);
       GetListener()->InformRegistrationFailure(this, object_id, true,
                                                "Client not yet ready");
     }
     return;
   }
 
-  vector<ObjectIdP> object_id_protos;
-  for (size_t i = 0; i < object_ids.size(); ++i) {
-    const ObjectId& object_id = object_ids[i];
-    ObjectIdP object_id_proto;
-    ProtoConverter::ConvertToObjectIdProto(object_id, &object_id_proto);
+  for (size_t i = 0; i < digested_object_ids.size(); ++i) {
+    const ObjectIdP& object_id_proto = digested_object_ids[i].second;
     Statistics::IncomingOperationType op_type =
         (reg_op_type == RegistrationP_OpType_REGISTER) ?
         Statistics::IncomingOperationType_REGISTRATION :
@@ -416,15 +667,14 @@ void InvalidationClientCore::PerformRegisterOperations(
     statistics_->RecordIncomingOperation(op_type);
     TLOG(logger_, INFO, "Register %s, %d",
          ProtoHelpers::ToString(object_id_proto).c_str(), reg_op_type);
-    object_id_protos.push_back(object_id_proto);
   }
 
 
   // Update the registration manager state, then have the protocol client send a
   // message.
   vector<ObjectIdP> object_id_protos_to_send;
-  registration_manager_.PerformOperations(object_id_protos, reg_op_type,
-      &object_id_protos_to_send);
+  registration_manager_.PerformDigestedOperations(digested_object_ids,
+      reg_op_type, &object_id_protos_to_send);
 
   // Check whether we should suppress sending registrations because we don't
   // yet know the server's summary.
@@ -433,6 +683,60 @@ void InvalidationClientCore::PerformRegisterOperations(
         object_id_protos_to_send, reg_op_type, batching_task_.get());
   }
   reg_sync_heartbeat_task_.get()->EnsureScheduled("PerformRegister");
+  EnforceMemorySoftCap();
+}
+
+void InvalidationClientCore::BufferRegisterOperations(
+    const vector<pair<string, ObjectIdP> >& digested_object_ids,
+    RegistrationP::OpType reg_op_type) {
+  Statistics::IncomingOperationType op_type =
+      (reg_op_type == RegistrationP_OpType_REGISTER) ?
+      Statistics::IncomingOperationType_REGISTRATION :
+      Statistics::IncomingOperationType_UNREGISTRATION;
+  for (size_t i = 0; i < digested_object_ids.size(); ++i) {
+    statistics_->RecordIncomingOperation(op_type);
+    TLOG(logger_, FINE, "Buffering register %s, %d",
+         ProtoHelpers::ToString(digested_object_ids[i].second).c_str(),
+         reg_op_type);
+
+    // A later operation on the object replaces an earlier one.
+    buffered_register_operations_[digested_object_ids[i].first] =
+        make_pair(digested_object_ids[i].second, reg_op_type);
+  }
+}
+
+void InvalidationClientCore::ApplyBufferedRegisterOperations() {
+  if (buffered_register_operations_.empty()) {
+    return;
+  }
+  TLOG(logger_, INFO, "Applying %d buffered registration operations",
+       static_cast<int>(buffered_register_operations_.size()));
+  vector<pair<string, ObjectIdP> > digested_oids[2];
+  RegistrationP::OpType op_types[2] = {
+    RegistrationP_OpType_REGISTER, RegistrationP_OpType_UNREGISTER
+  };
+  map<string, pair<ObjectIdP, RegistrationP::OpType> >::iterator iter;
+  for (iter = buffered_register_operations_.begin();
+       iter != buffered_register_operations_.end(); ++iter) {
+    int index = (iter->second.second == op_types[0]) ? 0 : 1;
+    digested_oids[index].push_back(
+        make_pair(iter->first, iter->second.first));
+  }
+  buffered_register_operations_.clear();
+
+  for (int i = 0; i < 2; ++i) {
+    if (digested_oids[i].empty()) {
+      continue;
+    }
+    vector<ObjectIdP> object_id_protos_to_send;
+    registration_manager_.PerformDigestedOperations(
+        digested_oids[i], op_types[i], &object_id_protos_to_send);
+    if (should_send_registrations_ && (!object_id_protos_to_send.empty())) {
+      protocol_handler_.SendRegistrations(
+          object_id_protos_to_send, op_types[i], batching_task_.get());
+    }
+  }
+  reg_sync_heartbeat_task_.get()->EnsureScheduled("BufferedRegister");
 }
 
 void InvalidationClientCore::Acknowledge(const AckHandle& acknowledge_handle) {
@@ -442,35 +746,123 @@ void InvalidationClientCore::Acknowledge(const AckHandle& acknowledge_handle) {
     // handle and statistics can only be acccessed on the scheduler thread.
     return;
   }
-  // Validate the ack handle.
 
+  // Parse and validate the ack handle. Currently, only invalidations have
+  // non-trivial ack handles.
+  InvalidationP invalidation;
+  if (!ParseAckHandleData(acknowledge_handle.handle_data(), &invalidation)) {
+    statistics_->RecordError(
+        Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE);
+    return;
+  }
+
+  // Also acknowledge the invalidations that were merged into this one by
+  // debouncing.
+  map<string, pair<int64, vector<AckHandle> > >::iterator superseded =
+      superseded_acks_.find(acknowledge_handle.handle_data());
+  if (superseded != superseded_acks_.end()) {
+    superseded_acks_memory_usage_ -= GetSupersededAcksMemoryUsage(
+        superseded->first, superseded->second.second);
+    vector<AckHandle> superseded_handles;
+    superseded_handles.swap(superseded->second.second);
+    superseded_ack_order_.erase(superseded->second.first);
+    superseded_acks_.erase(superseded);
+    for (size_t i = 0; i < superseded_handles.size(); ++i) {
+      InvalidationClientCore::Acknowledge(superseded_handles[i]);
+    }
+  }
+  statistics_->RecordIncomingOperation(
+      Statistics::IncomingOperationType_ACKNOWLEDGE);
+  protocol_handler_.SendInvalidationAck(invalidation, batching_task_.get());
+  latency_tracker_.RecordAck(invalidation,
+                             internal_scheduler_->GetCurrentTime());
+  if ((ack_journal_.get() != NULL) &&
+      !ProtoConverter::IsAllObjectIdP(invalidation.object_id())) {
+    ack_journal_->RecordAck(invalidation);
+    ScheduleAckJournalWrite();
+  }
+}
+
+string InvalidationClientCore::MakeAckHandleData(
+    const InvalidationP& invalidation) {
+  AckHandleP ack_handle;
+  ack_handle.mutable_object_id()->CopyFrom(invalidation.object_id());
+  if (invalidation.has_version()) {
+    ack_handle.set_version(invalidation.version());
+  }
+  if (invalidation.has_is_known_version()) {
+    ack_handle.set_is_known_version(invalidation.is_known_version());
+  }
+  if (invalidation.has_is_trickle_restart()) {
+    ack_handle.set_is_trickle_restart(invalidation.is_trickle_restart());
+  }
+  ack_handle.set_tag(ComputeAckHandleTag(ack_handle));
+  string serialized;
+  ack_handle.SerializeToString(&serialized);
+  return serialized;
+}
+
+bool InvalidationClientCore::ParseAckHandleData(const string& handle_data,
+                                                InvalidationP* invalidation) {
   // 1. Parse the ack handle first.
   AckHandleP ack_handle;
-  ack_handle.ParseFromString(acknowledge_handle.handle_data());
+  ack_handle.ParseFromString(handle_data);
   if (!ack_handle.IsInitialized()) {
     TLOG(logger_, WARNING, "Bad ack handle : %s",
-         ProtoHelpers::ToString(acknowledge_handle.handle_data()).c_str());
-    statistics_->RecordError(
-        Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE);
-    return;
+         ProtoHelpers::ToString(handle_data).c_str());
+    return false;
+  }
+
+  // 2. An old handle should have a valid invalidation, whose payload is not
+  // sent back.
+  if (ack_handle.has_invalidation()) {
+    if (!msg_validator_->IsValid(ack_handle.invalidation())) {
+      TLOG(logger_, WARNING, "Incorrect ack handle: %s",
+           ProtoHelpers::ToString(ack_handle).c_str());
+      return false;
+    }
+    invalidation->Swap(ack_handle.mutable_invalidation());
+    invalidation->clear_payload();
+    return true;
   }
 
-  // 2. Validate ack handle - it should have a valid invalidation.
-  if (!ack_handle.has_invalidation()
-      || !msg_validator_->IsValid(ack_handle.invalidation())) {
+  // 3. A compact handle should carry the tag computed when it was made. Its
+  // fields were validated with the invalidation then.
+  if (!ack_handle.has_object_id() || !ack_handle.has_tag()) {
     TLOG(logger_, WARNING, "Incorrect ack handle: %s",
          ProtoHelpers::ToString(ack_handle).c_str());
-    statistics_->RecordError(
-        Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE);
-    return;
+    return false;
+  }
+  string tag;
+  tag.swap(*ack_handle.mutable_tag());
+  ack_handle.clear_tag();
+  if (tag != ComputeAckHandleTag(ack_handle)) {
+    TLOG(logger_, WARNING, "Ack handle fails integrity check: %s",
+         ProtoHelpers::ToString(ack_handle).c_str());
+    return false;
+  }
+  invalidation->Clear();
+  invalidation->mutable_object_id()->Swap(ack_handle.mutable_object_id());
+  if (ack_handle.has_is_known_version()) {
+    invalidation->set_is_known_version(ack_handle.is_known_version());
+  }
+  if (ack_handle.has_version()) {
+    invalidation->set_version(ack_handle.version());
   }
+  if (ack_handle.has_is_trickle_restart()) {
+    invalidation->set_is_trickle_restart(ack_handle.is_trickle_restart());
+  }
+  return true;
+}
 
-  // Currently, only invalidations have non-trivial ack handle.
-  InvalidationP* invalidation = ack_handle.mutable_invalidation();
-  invalidation->clear_payload();  // Don't send the payload back.
-  statistics_->RecordIncomingOperation(
-      Statistics::IncomingOperationType_ACKNOWLEDGE);
-  protocol_handler_.SendInvalidationAck(*invalidation, batching_task_.get());
+string InvalidationClientCore::ComputeAckHandleTag(
+    const AckHandleP& ack_handle) {
+  string serialized;
+  ack_handle.SerializeToString(&serialized);
+  digest_fn_->Reset();
+  digest_fn_->Update(ack_handle_tag_key_);
+  digest_fn_->Update(serialized);
+  return digest_fn_->GetDigest().substr(0, kAckHandleTagLength);
 }
 
 string InvalidationClientCore::ToString() {
@@ -496,19 +888,29 @@ void InvalidationClientCore::HandleIncomingMessage(const string& message) {
     // Invalid message.
     return;
   }
+  // The serialized message and its parsed copy are held together.
+  int64 parsed_message_memory_usage =
+      MemoryUsage::OfString(message) + parsed_message.GetMemoryUsage();
+  if (parsed_message_memory_usage > max_parsed_message_memory_usage_) {
+    max_parsed_message_memory_usage_ = parsed_message_memory_usage;
+  }
 
   // Ensure we have either a matching token or a matching nonce.
-  if (!ValidateToken(parsed_message.header.token())) {
-    return;
-  }
+  Time token_check_start_time = internal_scheduler_->GetCurrentTime();
+  bool is_token_valid = ValidateToken(parsed_message.header.token());
 
   // Handle a token control message, if present.
-  if (parsed_message.token_control_message != NULL) {
+  if (is_token_valid && (parsed_message.token_control_message != NULL)) {
     statistics_->RecordReceivedMessage(
         Statistics::ReceivedMessageType_TOKEN_CONTROL);
     HandleTokenChanged(parsed_message.header.token(),
         parsed_message.token_control_message->new_token());
   }
+  statistics_->RecordLatency(Statistics::LatencyStage_TOKEN_CHECK,
+      internal_scheduler_->GetCurrentTime() - token_check_start_time);
+  if (!is_token_valid) {
+    return;
+  }
 
   // We might have lost our token or failed to acquire one. Ensure that we do
   // not proceed in either case.
@@ -521,6 +923,7 @@ void InvalidationClientCore::HandleIncomingMessage(const string& message) {
 
   // Handle the messages received from the server by calling the appropriate
   // listener method.
+  Time dispatch_start_time = internal_scheduler_->GetCurrentTime();
 
   // In the beginning inform the listener about the header (the caller is
   // already prepared to handle the fact that the same header is given to
@@ -530,7 +933,8 @@ void InvalidationClientCore::HandleIncomingMessage(const string& message) {
   if (parsed_message.invalidation_message != NULL) {
     statistics_->RecordReceivedMessage(
         Statistics::ReceivedMessageType_INVALIDATION);
-    HandleInvalidations(parsed_message.invalidation_message->invalidation());
+    HandleInvalidations(parsed_message.invalidation_message->invalidation(),
+                        parsed_message.server_time_ms);
   }
   if (parsed_message.registration_status_message != NULL) {
     statistics_->RecordReceivedMessage(
@@ -559,6 +963,9 @@ void InvalidationClientCore::HandleIncomingMessage(const string& message) {
         parsed_message.error_message->code(),
         parsed_message.error_message->description());
   }
+  statistics_->RecordLatency(Statistics::LatencyStage_LISTENER_DISPATCH,
+      internal_scheduler_->GetCurrentTime() - dispatch_start_time);
+  EnforceMemorySoftCap();
 }
 
 void InvalidationClientCore::HandleTokenChanged(
@@ -606,39 +1013,277 @@ void InvalidationClientCore::ScheduleAcquireToken(const string& debug_string) {
 }
 
 void InvalidationClientCore::HandleInvalidations(
-    const RepeatedPtrField<InvalidationP>& invalidations) {
+    const RepeatedPtrField<InvalidationP>& invalidations,
+    int64 server_time_ms) {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  Time now = internal_scheduler_->GetCurrentTime();
 
   for (int i = 0; i < invalidations.size(); ++i) {
     const InvalidationP& invalidation = invalidations.Get(i);
-    AckHandleP ack_handle_proto;
-    ack_handle_proto.mutable_invalidation()->CopyFrom(invalidation);
-    string serialized;
-    ack_handle_proto.SerializeToString(&serialized);
-    AckHandle ack_handle(serialized);
-    if (ProtoConverter::IsAllObjectIdP(invalidation.object_id())) {
+    bool is_all_objects =
+        ProtoConverter::IsAllObjectIdP(invalidation.object_id());
+    // An invalidate-all is always delivered: its version says nothing about
+    // the objects the application has processed.
+    if (!is_all_objects && (ack_journal_.get() != NULL) &&
+        ack_journal_->IsAcknowledged(invalidation)) {
+      // The application already processed this version (e.g., before a
+      // restart): acknowledge it again instead of redelivering it.
+      TLOG(logger_, INFO, "Acknowledging already acknowledged invalidation: %s",
+           ProtoHelpers::ToString(invalidation).c_str());
+      statistics_->RecordUpcallEvent(
+          Statistics::UpcallEventType_ALREADY_ACKNOWLEDGED);
+      InvalidationP ack(invalidation);
+      ack.clear_payload();
+      protocol_handler_.SendInvalidationAck(ack, batching_task_.get());
+      continue;
+    }
+    AckHandle ack_handle(MakeAckHandleData(invalidation));
+    latency_tracker_.RecordDelivery(invalidation, server_time_ms, now);
+    if (is_all_objects) {
       TLOG(logger_, INFO, "Issuing invalidate all");
       GetListener()->InvalidateAll(this, ack_handle);
+    } else if (!DebounceInvalidation(invalidation, ack_handle)) {
+      IssueInvalidation(invalidation, ack_handle);
+    }
+  }
+}
+
+void InvalidationClientCore::IssueInvalidation(
+    const InvalidationP& invalidation, const AckHandle& ack_handle) {
+  // Regular object. Could be unknown version or not.
+  Invalidation inv;
+  ProtoConverter::ConvertFromInvalidationProto(invalidation, &inv);
+  bool isSuppressed = invalidation.is_trickle_restart();
+  TLOG(logger_, INFO, "Issuing invalidate: %s",
+       ProtoHelpers::ToString(invalidation).c_str());
+
+  // Issue invalidate if the invalidation had a known version AND either
+  // no suppression has occurred or the client allows suppression.
+  if (invalidation.is_known_version() &&
+      (!isSuppressed || config_.allow_suppression())) {
+    GetListener()->Invalidate(this, inv, ack_handle);
+  } else {
+    // Unknown version
+    GetListener()->InvalidateUnknownVersion(this,
+                                            inv.object_id(), ack_handle);
+  }
+}
+
+bool InvalidationClientCore::DebounceInvalidation(
+    const InvalidationP& invalidation, const AckHandle& ack_handle) {
+  if (!invalidation.is_known_version()) {
+    return false;
+  }
+  map<int, TimeDelta>::iterator window =
+      debounce_windows_.find(invalidation.object_id().source());
+  if (window == debounce_windows_.end()) {
+    return false;
+  }
+  pair<int, string> key(invalidation.object_id().source(),
+                        invalidation.object_id().name());
+  map<pair<int, string>, DebouncedObject>::iterator iter =
+      debounced_objects_.find(key);
+  if (iter == debounced_objects_.end()) {
+    // Leading edge: deliver now and hold the invalidations that follow.
+    debounced_objects_memory_usage_ +=
+        GetDebouncedObjectMemoryUsage(key, debounced_objects_[key]);
+    internal_scheduler_->Schedule(window->second, NewPermanentCallback(
+        this, &InvalidationClientCore::FlushDebouncedObject, key));
+    return false;
+  }
+
+  // Merge into the held invalidation, keeping the highest version. Only the
+  // invalidations that are superseded count as debounced.
+  DebouncedObject* debounced = &iter->second;
+  debounced_objects_memory_usage_ -=
+      GetDebouncedObjectMemoryUsage(key, *debounced);
+  if (!debounced->has_pending) {
+    debounced->has_pending = true;
+    debounced->pending.CopyFrom(invalidation);
+    debounced->pending_ack_handle_data = ack_handle.handle_data();
+    debounced->is_trickle_restart = invalidation.is_trickle_restart();
+  } else {
+    debounced->is_trickle_restart |= invalidation.is_trickle_restart();
+    if (invalidation.version() > debounced->pending.version()) {
+      debounced->superseded_ack_handles.push_back(
+          AckHandle(debounced->pending_ack_handle_data));
+      debounced->pending.CopyFrom(invalidation);
+      debounced->pending_ack_handle_data = ack_handle.handle_data();
     } else {
-      // Regular object. Could be unknown version or not.
-      Invalidation inv;
-      ProtoConverter::ConvertFromInvalidationProto(invalidation, &inv);
-      bool isSuppressed = invalidation.is_trickle_restart();
-      TLOG(logger_, INFO, "Issuing invalidate: %s",
-           ProtoHelpers::ToString(invalidation).c_str());
+      debounced->superseded_ack_handles.push_back(ack_handle);
+    }
+    statistics_->RecordUpcallEvent(Statistics::UpcallEventType_DEBOUNCED);
+  }
+  debounced_objects_memory_usage_ +=
+      GetDebouncedObjectMemoryUsage(key, *debounced);
+  return true;
+}
 
-      // Issue invalidate if the invalidation had a known version AND either
-      // no suppression has occurred or the client allows suppression.
-      if (invalidation.is_known_version() &&
-          (!isSuppressed || config_.allow_suppression())) {
-        GetListener()->Invalidate(this, inv, ack_handle);
-      } else {
-        // Unknown version
-        GetListener()->InvalidateUnknownVersion(this,
-                                                inv.object_id(), ack_handle);
-      }
+void InvalidationClientCore::FlushDebouncedObject(pair<int, string> key) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  map<pair<int, string>, DebouncedObject>::iterator iter =
+      debounced_objects_.find(key);
+  if (iter == debounced_objects_.end()) {
+    return;
+  }
+  DebouncedObject* debounced = &iter->second;
+  debounced_objects_memory_usage_ -=
+      GetDebouncedObjectMemoryUsage(key, *debounced);
+  if (!debounced->has_pending || !ticl_state_.IsStarted()) {
+    // Nothing held: the window simply closes.
+    debounced_objects_.erase(iter);
+    return;
+  }
+
+  // Deliver the merged invalidation; this opens a new window for the object.
+  InvalidationP merged;
+  merged.CopyFrom(debounced->pending);
+  merged.set_is_trickle_restart(debounced->is_trickle_restart);
+  AckHandle ack_handle(debounced->pending_ack_handle_data);
+  if (!debounced->superseded_ack_handles.empty()) {
+    pair<int64, vector<AckHandle> >* superseded =
+        &superseded_acks_[ack_handle.handle_data()];
+    if (!superseded->second.empty()) {
+      // Delivered again: the entry becomes the most recent one.
+      superseded_ack_order_.erase(superseded->first);
+      superseded_acks_memory_usage_ -= GetSupersededAcksMemoryUsage(
+          ack_handle.handle_data(), superseded->second);
+    }
+    superseded->first = next_superseded_ack_seqno_++;
+    superseded_ack_order_[superseded->first] = ack_handle.handle_data();
+    superseded->second.insert(superseded->second.end(),
+                              debounced->superseded_ack_handles.begin(),
+                              debounced->superseded_ack_handles.end());
+    superseded_acks_memory_usage_ += GetSupersededAcksMemoryUsage(
+        ack_handle.handle_data(), superseded->second);
+    if (static_cast<int>(superseded_acks_.size()) > kMaxSupersededAckEntries) {
+      map<int64, string>::iterator oldest = superseded_ack_order_.begin();
+      const vector<AckHandle>& oldest_handles =
+          superseded_acks_[oldest->second].second;
+      TLOG(logger_, WARNING, "Dropping %d superseded ack handles",
+           oldest_handles.size());
+      superseded_acks_memory_usage_ -=
+          GetSupersededAcksMemoryUsage(oldest->second, oldest_handles);
+      superseded_acks_.erase(oldest->second);
+      superseded_ack_order_.erase(oldest);
+    }
+  }
+  debounced->has_pending = false;
+  debounced->pending.Clear();
+  debounced->pending_ack_handle_data.clear();
+  debounced->is_trickle_restart = false;
+  debounced->superseded_ack_handles.clear();
+  debounced_objects_memory_usage_ +=
+      GetDebouncedObjectMemoryUsage(key, *debounced);
+  internal_scheduler_->Schedule(
+      debounce_windows_[key.first],
+      NewPermanentCallback(
+          this, &InvalidationClientCore::FlushDebouncedObject, key));
+  IssueInvalidation(merged, ack_handle);
+}
+
+void InvalidationClientCore::FlushDebouncedObjects() {
+  vector<pair<int, string> > keys;
+  map<pair<int, string>, DebouncedObject>::iterator iter;
+  for (iter = debounced_objects_.begin(); iter != debounced_objects_.end();
+       ++iter) {
+    if (iter->second.has_pending) {
+      keys.push_back(iter->first);
     }
   }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    FlushDebouncedObject(keys[i]);
+  }
+}
+
+int64 InvalidationClientCore::GetDebouncedObjectMemoryUsage(
+    const pair<int, string>& key, const DebouncedObject& debounced) {
+  int64 memory_usage = MemoryUsage::kTreeNodeOverhead + sizeof(key) +
+      key.second.size() + sizeof(debounced);
+  if (debounced.has_pending) {
+    memory_usage += debounced.pending.ByteSize() +
+        debounced.pending_ack_handle_data.size();
+  }
+  for (size_t i = 0; i < debounced.superseded_ack_handles.size(); ++i) {
+    memory_usage += sizeof(AckHandle) +
+        debounced.superseded_ack_handles[i].handle_data().size();
+  }
+  return memory_usage;
+}
+
+int64 InvalidationClientCore::GetSupersededAcksMemoryUsage(
+    const string& handle_data, const vector<AckHandle>& ack_handles) {
+  // The handle data is the key of |superseded_acks_| and the value of
+  // |superseded_ack_order_|.
+  int64 memory_usage = 2 * (MemoryUsage::kTreeNodeOverhead +
+                            MemoryUsage::OfString(handle_data)) +
+      sizeof(pair<int64, vector<AckHandle> >) + sizeof(int64);
+  for (size_t i = 0; i < ack_handles.size(); ++i) {
+    memory_usage += sizeof(AckHandle) + ack_handles[i].handle_data().size();
+  }
+  return memory_usage;
+}
+
+void InvalidationClientCore::GetMemoryUsage(
+    vector<pair<string, int64> >* usage) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  size_t first = usage->size();
+  registration_manager_.GetMemoryUsage(usage);
+  protocol_handler_.GetMemoryUsage(usage);
+  GetListenerMemoryUsage(usage);
+  usage->push_back(make_pair("DebouncedInvalidations",
+                             debounced_objects_memory_usage_));
+  usage->push_back(make_pair("SupersededAcks",
+                             superseded_acks_memory_usage_));
+  usage->push_back(make_pair("AckJournal", (ack_journal_.get() == NULL) ?
+                             0 : ack_journal_->GetMemoryUsage()));
+  usage->push_back(make_pair("LatencyTracker",
+                             latency_tracker_.GetMemoryUsage()));
+  usage->push_back(make_pair("MaxParsedMessage",
+                             max_parsed_message_memory_usage_));
+  int64 total = 0;
+  for (size_t i = first; i < usage->size(); ++i) {
+    total += (*usage)[i].second;
+  }
+  usage->push_back(make_pair("Total", total));
+}
+
+void InvalidationClientCore::EnforceMemorySoftCap() {
+  int64 soft_cap = config_.memory_soft_cap_bytes();
+  if (soft_cap <= 0) {
+    return;
+  }
+  vector<pair<string, int64> > usage;
+  GetMemoryUsage(&usage);
+  // Leave out the total and the usages that degrading cannot reduce: the
+  // desired registrations and the high-water mark of the parsed messages.
+  int64 capped_usage = 0;
+  for (size_t i = 0; i + 1 < usage.size(); ++i) {
+    if ((usage[i].first != "RegistrationStore") &&
+        (usage[i].first != "MaxParsedMessage")) {
+      capped_usage += usage[i].second;
+    }
+  }
+  if (memory_soft_cap_exceeded_) {
+    if (capped_usage * 100 < soft_cap * kMemorySoftCapRearmPercent) {
+      TLOG(logger_, INFO, "Memory usage of %d KB back under soft cap",
+           static_cast<int>(capped_usage / 1024));
+      memory_soft_cap_exceeded_ = false;
+    }
+    return;
+  }
+  if (capped_usage <= soft_cap) {
+    return;
+  }
+  memory_soft_cap_exceeded_ = true;
+  statistics_->RecordError(
+      Statistics::ClientErrorType_MEMORY_SOFT_CAP_EXCEEDED);
+  TLOG(logger_, WARNING, "Memory usage of %d KB exceeds soft cap of %d KB",
+       static_cast<int>(capped_usage / 1024),
+       static_cast<int>(soft_cap / 1024));
+  FlushDebouncedObjects();
+  CollapseListenerUpcalls();
+  protocol_handler_.FlushBatchedMessages();
 }
 
 void InvalidationClientCore::HandleRegistrationStatus(
@@ -761,6 +1406,12 @@ void InvalidationClientCore::HandleErrorMessage(
 void InvalidationClientCore::HandleMessageSent() {
   CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
   last_message_send_time_ = internal_scheduler_->GetCurrentTime();
+  if ((ack_journal_.get() != NULL) && ack_journal_->HasPendingAcks() &&
+      !client_token_.empty()) {
+    // The message carried all the batched acks.
+    ack_journal_->MarkAcksSent();
+    ScheduleAckJournalWrite();
+  }
 }
 
 void InvalidationClientCore::HandleNetworkStatusChange(bool is_online) {
@@ -800,6 +1451,9 @@ void InvalidationClientCore::GetStatisticsAsSerializedProto(
     string* result) {
   vector<pair<string, int> > properties;
   statistics_->GetNonZeroStatistics(&properties);
+  statistics_->GetLatencyStatistics(&properties);
+  latency_tracker_.GetStatistics(&properties);
+  statistics_->task_statistics()->GetStatistics(&properties);
   InfoMessage info_message;
   for (size_t i = 0; i < properties.size(); ++i) {
     PropertyRecord* record = info_message.add_performance_counter();
@@ -826,8 +1480,15 @@ void InvalidationClientCore::HandleIncomingHeader(
     // in agreement with the server and we had any pending operations, we can
     // tell the listener that those operations have succeeded.
     vector<RegistrationP> upcalls;
+    RegistrationSummary previous_summary;
+    registration_manager_.GetServerSummary(&previous_summary);
     registration_manager_.InformServerRegistrationSummary(
         *header.registration_summary(), &upcalls);
+    if (previous_summary.SerializeAsString() !=
+        header.registration_summary()->SerializeAsString()) {
+      // Keep the persisted summary current for the next restart.
+      persistent_write_task_.get()->EnsureScheduled("Write-after-new-summary");
+    }
     TLOG(logger_, FINE,
         "Receivced new server registration summary (%s); will make %d upcalls",
          ProtoHelpers::ToString(*header.registration_summary()).c_str(),
@@ -879,6 +1540,20 @@ bool InvalidationClientCore::ValidateToken(const string& server_token) {
   return false;
 }
 
+void InvalidationClientCore::SendInfoMessageAfterRestart(
+    bool has_server_summary) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (has_server_summary && registration_manager_.IsStateInSyncWithServer()) {
+    // The server already has our registrations, so there is nothing to sync
+    // and registrations need no longer be suppressed.
+    TLOG(logger_, INFO, "Skipping info message after restart: registrations "
+         "match the persisted server summary");
+    should_send_registrations_ = true;
+    return;
+  }
+  SendInfoMessageToServer(false, true /* request server summary */);
+}
+
 void InvalidationClientCore::SendInfoMessageToServer(
     bool must_send_performance_counters, bool request_server_summary) {
   TLOG(logger_, INFO,
@@ -931,6 +1606,7 @@ void InvalidationClientCore::FinishStartingTiclAndInformListener() {
   CHECK(!ticl_state_.IsStarted());
 
   ticl_state_.Start();
+  ApplyBufferedRegisterOperations();
   GetListener()->Ready(this);
 
   // We are not currently persisting our registration digest, so regardless of
@@ -958,6 +1634,13 @@ void InvalidationClientCore::ReadCallback(
     TLOG(logger_, WARNING, "Could not read state blob: %s",
          read_result.first.message().c_str());
   }
+  if (ack_journal_.get() != NULL) {
+    storage_->ReadKey(kAckJournalKey,
+        NewPermanentCallback(this,
+            &InvalidationClientCore::ReadAckJournalCallback,
+            serialized_state));
+    return;
+  }
   // Call start now.
   internal_scheduler_->Schedule(
       Scheduler::NoDelay(),
@@ -965,6 +1648,33 @@ void InvalidationClientCore::ReadCallback(
           this, &InvalidationClientCore::StartInternal, serialized_state));
 }
 
+void InvalidationClientCore::ReadAckJournalCallback(
+    const string& serialized_state, pair<Status, string> read_result) {
+  LoadAckJournal(read_result);
+  internal_scheduler_->Schedule(
+      Scheduler::NoDelay(),
+      NewPermanentCallback(
+          this, &InvalidationClientCore::StartInternal, serialized_state));
+}
+
+void InvalidationClientCore::LoadAckJournal(
+    const pair<Status, string>& read_result) {
+  // A missing journal is normal, e.g. on the first start with it enabled.
+  if (read_result.first.IsSuccess() &&
+      !ack_journal_->Parse(read_result.second)) {
+    statistics_->RecordError(
+        Statistics::ClientErrorType_PERSISTENT_DESERIALIZATION_FAILURE);
+    TLOG(logger_, WARNING, "Could not parse ack journal");
+  }
+}
+
+void InvalidationClientCore::ScheduleAckJournalWrite() {
+  // The write is batched with those of the other acks handled before the
+  // task runs, so that each ack does not serialize the whole journal.
+  ack_journal_dirty_ = true;
+  ack_journal_write_task_.get()->EnsureScheduled("Write-ack-journal");
+}
+
 ExponentialBackoffDelayGenerator*
 InvalidationClientCore::CreateExpBackOffGenerator(
     const TimeDelta& initial_delay) {
@@ -17,20 +17,25 @@
 #ifndef GOOGLE_CACHEINVALIDATION_IMPL_INVALIDATION_CLIENT_CORE_H_
 #define GOOGLE_CACHEINVALIDATION_IMPL_INVALIDATION_CLIENT_CORE_H_
 
+#include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "google/cacheinvalidation/include/invalidation-client.h"
 #include "google/cacheinvalidation/include/invalidation-listener.h"
 #include "google/cacheinvalidation/deps/digest-function.h"
+#include "google/cacheinvalidation/impl/ack-journal.h"
 #include "google/cacheinvalidation/impl/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/impl/digest-store.h"
 #include "google/cacheinvalidation/impl/exponential-backoff-delay-generator.h"
+#include "google/cacheinvalidation/impl/invalidation-latency-tracker.h"
 #include "google/cacheinvalidation/impl/protocol-handler.h"
 #include "google/cacheinvalidation/impl/registration-manager.h"
 #include "google/cacheinvalidation/impl/run-state.h"
 #include "google/cacheinvalidation/impl/safe-storage.h"
 #include "google/cacheinvalidation/impl/smearer.h"
+#include "google/cacheinvalidation/impl/timer-coalescer.h"
 
 namespace invalidation {
 
@@ -77,9 +82,11 @@ class PersistentWriteTask : public RecurringTask {
 
  private:
   /* Handles the result of a request to write to persistent storage.
-   * |state| is the serialized state that was written.
+   * |token| and |server_summary| are the token and server summary that were
+   * written.
    */
-  void WriteCallback(const string& state, Status status);
+  void WriteCallback(const string& token,
+                     const RegistrationSummary& server_summary, Status status);
 
   InvalidationClientCore* client_;
 
@@ -87,6 +94,29 @@ class PersistentWriteTask : public RecurringTask {
    * successfully.
    */
   string last_written_token_;
+
+  /* The last server registration summary that was written to persistent
+   * state successfully.
+   */
+  RegistrationSummary last_written_server_summary_;
+};
+
+/* A task that writes the ack journal to persistent storage, once for all the
+ * acks recorded since its last run.
+ */
+class AckJournalWriteTask : public RecurringTask {
+ public:
+  explicit AckJournalWriteTask(InvalidationClientCore* client);
+  virtual ~AckJournalWriteTask() {}
+
+  // The actual implementation as required by the RecurringTask.
+  virtual bool RunTask();
+
+ private:
+  /* Handles the result of a request to write the journal. */
+  void WriteCallback(Status status);
+
+  InvalidationClientCore* client_;
 };
 
 /* A task for sending heartbeats to the server. */
@@ -198,6 +228,32 @@ class InvalidationClientCore : public InvalidationClient,
     registration_manager_.SetDigestStoreForTest(digest_store);
   }
 
+  /* Makes the recurring tasks of this client share timer wakeups through
+   * |timer_coalescer|, e.g., with the tasks of other clients in the same
+   * process. Coalescing only takes effect if config.timer_slack_percent is
+   * positive. Space for |timer_coalescer| is owned by the caller.
+   *
+   * REQUIRES: This method is called before Start, and |timer_coalescer| runs
+   * its tasks on this client's internal thread.
+   */
+  void SetTimerCoalescer(TimerCoalescer* timer_coalescer);
+
+  /* Stores a snapshot of the complete state of this client in |snapshot|, so
+   * that a client created from it, e.g., by another process during a deploy,
+   * can take over without acquiring a token or registering again. Returns
+   * false if the client is not started. The caller should stop this client
+   * right after the snapshot is taken.
+   */
+  bool ExportSnapshot(string* snapshot);
+
+  /* Makes Start resume from |snapshot|, as stored by ExportSnapshot, instead
+   * of the state in persistent storage. Returns false if |snapshot| cannot be
+   * parsed or has an unsupported format version.
+   *
+   * REQUIRES: This method is called before Start.
+   */
+  bool SetSnapshotToRestore(const string& snapshot);
+
   virtual void Start();
 
   virtual void Stop();
@@ -226,6 +282,36 @@ class InvalidationClientCore : public InvalidationClient,
   void PerformRegisterOperationsInternal(
       const vector<ObjectId>& object_ids, RegistrationP::OpType reg_op_type);
 
+  /* Like PerformRegisterOperations, for object ids given with their digests,
+   * as computed by DigestObjectIds.
+   */
+  void PerformDigestedRegisterOperations(
+      const vector<pair<string, ObjectIdP> >& digested_object_ids,
+      RegistrationP::OpType reg_op_type);
+
+  /* Converts |object_ids| to protocol buffers and stores them with their
+   * registration digests, computed with |digest_fn|, in
+   * |digested_object_ids|. The digests must be computed with the same kind
+   * of function as |digest_fn_|; since the function is given, this may run
+   * on any thread, e.g. to hash a bulk (un)registration on the caller's
+   * thread before it is handed to the internal one.
+   */
+  static void DigestObjectIds(
+      const vector<ObjectId>& object_ids, DigestFunction* digest_fn,
+      vector<pair<string, ObjectIdP> >* digested_object_ids);
+
+  /* Buffers the (un)registrations of |digested_object_ids| made before the
+   * Ticl is ready, to be applied once it has its token.
+   */
+  void BufferRegisterOperations(
+      const vector<pair<string, ObjectIdP> >& digested_object_ids,
+      RegistrationP::OpType reg_op_type);
+
+  /* Applies the buffered (un)registrations together, sending them to the
+   * server unless registrations are suppressed.
+   */
+  void ApplyBufferedRegisterOperations();
+
   virtual void Acknowledge(const AckHandle& acknowledge_handle);
 
   string ToString();
@@ -253,8 +339,56 @@ class InvalidationClientCore : public InvalidationClient,
   /* Gets statistics as a serialized InfoMessage. */
   void GetStatisticsAsSerializedProto(string* result);
 
+  /* Stores the non-zero counters of the client in |counters|, as pairs of
+   * the name of the counter and its value. Unlike
+   * GetStatisticsAsSerializedProto, may be called from any thread without
+   * scheduling work on the internal thread; see
+   * Statistics::GetNonZeroStatisticsSnapshot.
+   */
+  void GetStatisticsSnapshot(vector<pair<string, int64> >* counters) {
+    statistics_->GetNonZeroStatisticsSnapshot(counters);
+  }
+
+  /* Stores the estimated memory used by the internal structures of the
+   * client in |usage|, as pairs of the name of the structure and its size in
+   * bytes, followed by their sum, named "Total". The estimates are maintained
+   * as the structures change, so this does not walk them.
+   *
+   * REQUIRES: Called on the internal thread.
+   */
+  void GetMemoryUsage(vector<pair<string, int64> >* usage);
+
   /* The single key used to write all the Ticl state. */
   static const char* kClientTokenKey;
+
+  /* The key used to write the ack journal, if enabled. */
+  static const char* kAckJournalKey;
+
+  /* Version of the format of the snapshots made by ExportSnapshot. */
+  static const int kSnapshotFormatVersion;
+
+  /* Maximum number of sources whose invalidation latencies are tracked
+   * separately.
+   */
+  static const int kMaxLatencyTrackedSources;
+
+  /* Maximum number of invalidations whose acks are awaited to measure their
+   * processing latency.
+   */
+  static const int kMaxLatencyTrackedAcks;
+
+  /* Length in bytes of the integrity tags of compact ack handles. */
+  static const int kAckHandleTagLength;
+
+  /* Maximum number of delivered merged invalidations whose superseded ack
+   * handles are kept until they are acknowledged.
+   */
+  static const int kMaxSupersededAckEntries;
+
+  /* Percentage of the memory soft cap under which the memory usage must fall
+   * before exceeding the cap again counts as a new crossing.
+   */
+  static const int kMemorySoftCapRearmPercent;
  protected:
    /* Constructs a client.
     *
@@ -282,8 +416,19 @@ class InvalidationClientCore : public InvalidationClient,
 
   /* Returns the listener. */
   virtual InvalidationListener* GetListener() = 0;
+
+  /* Appends the estimated memory used by the upcalls queued or held for the
+   * listener to |usage|. Does nothing by default.
+   */
+  virtual void GetListenerMemoryUsage(vector<pair<string, int64> >* usage) {}
+
+  /* Reduces the memory used by the upcalls held for the listener, if any, at
+   * the cost of less precise upcalls. Does nothing by default.
+   */
+  virtual void CollapseListenerUpcalls() {}
  private:
   // Friend classes so that they can access the scheduler, logger, smearer, etc.
+  friend class AckJournalWriteTask;
   friend class AcquireTokenTask;
   friend class HeartbeatTask;
   friend class InvalidationClientFactoryTest;
@@ -302,11 +447,34 @@ class InvalidationClientCore : public InvalidationClient,
    */
   void StartInternal(const string& serialized_state);
 
+  /* Implementation of start from the snapshot set by SetSnapshotToRestore.
+   * Reads the ack journal first, if enabled, since the snapshot does not
+   * hold it.
+   */
+  void StartFromSnapshot();
+
+  /* Handles the result of reading the ack journal, then resumes from the
+   * snapshot.
+   */
+  void ReadSnapshotAckJournalCallback(pair<Status, string> read_result);
+
+  /* Restores the snapshot set by SetSnapshotToRestore and finishes starting
+   * the Ticl.
+   */
+  void ResumeFromSnapshot();
+
   void AcknowledgeInternal(const AckHandle& acknowledge_handle);
 
   /* Set client_token to NULL and schedule acquisition of the token. */
   void ScheduleAcquireToken(const string& debug_string);
 
+  /* Sends the info message that follows a restart from persistent state,
+   * unless |has_server_summary| (the persisted state had the server's
+   * registration summary) and the registrations reissued since the restart
+   * match it, in which case there is nothing to sync.
+   */
+  void SendInfoMessageAfterRestart(bool has_server_summary);
+
   /* Sends an info message to the server. If mustSendPerformanceCounters is
    * true, the performance counters are sent regardless of when they were sent
    * earlier.
@@ -338,6 +506,18 @@ class InvalidationClientCore : public InvalidationClient,
   /* Handles the result of a request to read from persistent storage. */
   void ReadCallback(pair<Status, string> read_result);
 
+  /* Handles the result of reading the ack journal, then starts the Ticl with
+   * the persistent |serialized_state|.
+   */
+  void ReadAckJournalCallback(const string& serialized_state,
+                              pair<Status, string> read_result);
+
+  /* Loads the ack journal from the result of reading it, if it was found. */
+  void LoadAckJournal(const pair<Status, string>& read_result);
+
+  /* Marks the ack journal as changed and schedules a write of it. */
+  void ScheduleAckJournalWrite();
+
   /* Finish starting the ticl and inform the listener that it is ready. */
   void FinishStartingTiclAndInformListener();
 
@@ -371,9 +551,62 @@ class InvalidationClientCore : public InvalidationClient,
   /* Processes a server message |header|. */
   void HandleIncomingHeader(const ServerMessageHeader& header);
 
-  /* Handles |invalidations| from the server. */
+  /* Handles |invalidations| from the server, sent at |server_time_ms|. */
   void HandleInvalidations(
-       const RepeatedPtrField<InvalidationP>& invalidations);
+       const RepeatedPtrField<InvalidationP>& invalidations,
+       int64 server_time_ms);
+
+  /* Returns the data of a compact ack handle for |invalidation|: its object
+   * id, version and version flags with an integrity tag, but no payload.
+   */
+  string MakeAckHandleData(const InvalidationP& invalidation);
+
+  /* Stores in |invalidation| the invalidation to acknowledge for the ack
+   * handle |handle_data|, without its payload. Accepts both the compact format
+   * and the old one carrying the whole invalidation. Returns whether the
+   * handle is valid.
+   */
+  bool ParseAckHandleData(const string& handle_data,
+                          InvalidationP* invalidation);
+
+  /* Returns the integrity tag of the compact ack handle |ack_handle|, whose
+   * tag must not be set.
+   */
+  string ComputeAckHandleTag(const AckHandleP& ack_handle);
+
+  /* Issues the listener upcall for |invalidation| of a regular object, with
+   * |ack_handle|.
+   */
+  void IssueInvalidation(const InvalidationP& invalidation,
+                         const AckHandle& ack_handle);
+
+  /* Returns whether |invalidation| (with |ack_handle|) is held because an
+   * invalidation of the same object was delivered within its source's
+   * debounce window. If not, and the source is debounced, opens a new window
+   * for the object.
+   */
+  bool DebounceInvalidation(const InvalidationP& invalidation,
+                            const AckHandle& ack_handle);
+
+  /* Ends the debounce window of the object with |key|, delivering the merged
+   * invalidation held for it, if any.
+   */
+  void FlushDebouncedObject(pair<int, string> key);
+
+  /* Ends the debounce windows of all the objects with held invalidations,
+   * delivering them now.
+   */
+  void FlushDebouncedObjects();
+
+  /* If the estimated memory used by the client crosses the soft cap of its
+   * configuration, records it and degrades to release memory: delivers the
+   * debounced invalidations, collapses the held listener upcalls and sends
+   * the batched messages, if any, as soon as possible. The registration
+   * store and the largest parsed message are left out: neither can be
+   * released. Nothing is done again until the usage falls under
+   * kMemorySoftCapRearmPercent of the cap.
+   */
+  void EnforceMemorySoftCap();
 
   /* Handles registration statusES from the server. */
   void HandleRegistrationStatus(
@@ -423,7 +656,13 @@ class InvalidationClientCore : public InvalidationClient,
   /* Application identifier for this client. */
   ApplicationClientIdP application_client_id_;
 
+  /* The serialized application client id, mixed into the integrity tags of
+   * compact ack handles so that handles of other clients are rejected.
+   */
+  string ack_handle_tag_key_;
+
   /* The function for computing the registration and persistence state digests.
+   * A Sha1DigestFunction; see DigestObjectIds.
    */
   scoped_ptr<DigestFunction> digest_fn_;
 
@@ -462,6 +701,102 @@ class InvalidationClientCore : public InvalidationClient,
   /* Last time a message was sent to the server. */
   Time last_message_send_time_;
 
+  /* The coalescer used by default to schedule the recurring tasks. */
+  scoped_ptr<TimerCoalescer> own_timer_coalescer_;
+
+  /* The coalescer through which the recurring tasks are scheduled; either
+   * own_timer_coalescer_ or one shared with other clients.
+   */
+  TimerCoalescer* timer_coalescer_;
+
+  /* Invalidations held for an object during its debounce window. */
+  struct DebouncedObject {
+    DebouncedObject() : has_pending(false), is_trickle_restart(false) {}
+
+    /* Whether an invalidation is held. */
+    bool has_pending;
+
+    /* The held invalidation with the highest version. */
+    InvalidationP pending;
+
+    /* The serialized ack handle of |pending|. */
+    string pending_ack_handle_data;
+
+    /* Whether any of the held invalidations was a restarted one. */
+    bool is_trickle_restart;
+
+    /* Ack handles of the held invalidations merged into |pending|. */
+    vector<AckHandle> superseded_ack_handles;
+  };
+
+  /* Returns the estimated memory used by the entry of |debounced_objects_|
+   * with |key| and |debounced|.
+   */
+  static int64 GetDebouncedObjectMemoryUsage(const pair<int, string>& key,
+                                             const DebouncedObject& debounced);
+
+  /* Returns the estimated memory used by the entry of |superseded_acks_| with
+   * |handle_data| and |ack_handles|, along with its |superseded_ack_order_|
+   * entry.
+   */
+  static int64 GetSupersededAcksMemoryUsage(
+      const string& handle_data, const vector<AckHandle>& ack_handles);
+
+  /* Debounce window for each debounced source. */
+  map<int, TimeDelta> debounce_windows_;
+
+  /* Objects with an open debounce window, keyed by source and name. */
+  map<pair<int, string>, DebouncedObject> debounced_objects_;
+
+  /* Estimated memory used by |debounced_objects_|, maintained as objects are
+   * debounced and flushed.
+   */
+  int64 debounced_objects_memory_usage_;
+
+  /* Largest estimated memory used by a server message while it is parsed. */
+  int64 max_parsed_message_memory_usage_;
+
+  /* Ack handles to acknowledge along with the handle of each merged
+   * invalidation that was delivered, keyed by that handle's data, with the
+   * sequence number of the entry. At most kMaxSupersededAckEntries are kept:
+   * the superseded invalidations of older entries are never acknowledged.
+   */
+  map<string, pair<int64, vector<AckHandle> > > superseded_acks_;
+
+  /* The keys of |superseded_acks_| by sequence number, oldest first. */
+  map<int64, string> superseded_ack_order_;
+
+  /* Sequence number of the next entry of |superseded_acks_|. */
+  int64 next_superseded_ack_seqno_;
+
+  /* Estimated memory used by |superseded_acks_| and |superseded_ack_order_|,
+   * maintained as entries are added and removed.
+   */
+  int64 superseded_acks_memory_usage_;
+
+  /* Whether the memory usage crossed the soft cap and has not fallen under
+   * kMemorySoftCapRearmPercent of it since.
+   */
+  bool memory_soft_cap_exceeded_;
+
+  /* The latest (un)registration of each object made before the Ticl was
+   * ready, keyed by the digest of the object.
+   */
+  map<string, pair<ObjectIdP, RegistrationP::OpType> >
+      buffered_register_operations_;
+
+  /* Snapshot to resume from on start, if any. */
+  scoped_ptr<ClientSnapshotP> snapshot_to_restore_;
+
+  /* Journal of the acknowledged invalidations, if enabled. */
+  scoped_ptr<AckJournal> ack_journal_;
+
+  /* Whether the ack journal changed since it was last written. */
+  bool ack_journal_dirty_;
+
+  /* Latencies of the invalidations delivered to the listener. */
+  InvalidationLatencyTracker latency_tracker_;
+
   /* A task for acquiring the token (if the client has no token). */
   scoped_ptr<AcquireTokenTask> acquire_token_task_;
 
@@ -473,6 +808,9 @@ class InvalidationClientCore : public InvalidationClient,
   /* Task for writing the state blob to persistent storage. */
   scoped_ptr<PersistentWriteTask> persistent_write_task_;
 
+  /* Task for writing the ack journal to persistent storage. */
+  scoped_ptr<AckJournalWriteTask> ack_journal_write_task_;
+
   /* A task for periodic heartbeats. */
   scoped_ptr<HeartbeatTask> heartbeat_task_;
 
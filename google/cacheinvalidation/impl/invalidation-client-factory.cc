@@ -18,7 +18,8 @@
 
 namespace invalidation {
 
-InvalidationClient* ClientFactory::Create(
+/* Constructs a client with the default configuration for |config|. */
+static InvalidationClientImpl* CreateWithDefaultConfig(
     SystemResources* resources,
     const InvalidationClientConfig& config,
     InvalidationListener* listener) {
@@ -32,6 +33,27 @@ InvalidationClient* ClientFactory::Create(
       client_config, config.application_name(), listener);
 }
 
+InvalidationClient* ClientFactory::Create(
+    SystemResources* resources,
+    const InvalidationClientConfig& config,
+    InvalidationListener* listener) {
+  return CreateWithDefaultConfig(resources, config, listener);
+}
+
+InvalidationClient* ClientFactory::CreateFromSnapshot(
+    SystemResources* resources,
+    const InvalidationClientConfig& config,
+    const string& snapshot,
+    InvalidationListener* listener) {
+  InvalidationClientImpl* client =
+      CreateWithDefaultConfig(resources, config, listener);
+  if (!client->SetSnapshotToRestore(snapshot)) {
+    delete client;
+    return NULL;
+  }
+  return client;
+}
+
 // Deprecated, please the factory function that takes an
 // InvalidationClientConfig instead.
 InvalidationClient* CreateInvalidationClient(
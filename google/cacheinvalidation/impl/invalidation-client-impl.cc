@@ -16,8 +16,83 @@
 
 #include "google/cacheinvalidation/impl/invalidation-client-impl.h"
 
+#include "google/cacheinvalidation/deps/atomicops.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
+
 namespace invalidation {
 
+// The number of operations a client has enqueued on its internal scheduler
+// and not deleted yet. Reference-counted, since enqueued operations may be
+// deleted after the client, e.g. by the scheduler on shutdown.
+class ScheduledOperationCounter {
+ public:
+  /* Creates a counter with no operation, referenced by its creator. */
+  ScheduledOperationCounter() : num_scheduled_(0), num_refs_(1) {}
+
+  void AddRef() {
+    NoBarrier_AtomicIncrement(&num_refs_, 1);
+  }
+
+  /* Drops a reference, deleting the counter when none is left. */
+  void Release() {
+    if (Barrier_AtomicIncrement(&num_refs_, -1) == 0) {
+      delete this;
+    }
+  }
+
+  void Increment() {
+    NoBarrier_AtomicIncrement(&num_scheduled_, 1);
+  }
+
+  void Decrement() {
+    NoBarrier_AtomicIncrement(&num_scheduled_, -1);
+  }
+
+  bool IsZero() const {
+    return NoBarrier_Load(&num_scheduled_) == 0;
+  }
+
+ private:
+  AtomicWord num_scheduled_;
+  AtomicWord num_refs_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScheduledOperationCounter);
+};
+
+// An operation enqueued on the internal scheduler. Counts as scheduled until
+// it is deleted, whether or not it ran, so that a scheduler dropping its
+// tasks (e.g., on shutdown) does not leave the count stuck. Deletes the inner
+// operation when it is itself deleted.
+class ScheduledOperation : public Closure {
+ public:
+  /* Creates a task running |operation|, counted in |counter|. Takes
+   * ownership of |operation|.
+   */
+  ScheduledOperation(ScheduledOperationCounter* counter, Closure* operation)
+      : counter_(counter), operation_(operation) {
+    counter_->AddRef();
+    counter_->Increment();
+  }
+
+  virtual ~ScheduledOperation() {
+    delete operation_;
+    counter_->Decrement();
+    counter_->Release();
+  }
+
+  virtual bool IsRepeatable() const {
+    return operation_->IsRepeatable();
+  }
+
+  virtual void Run() {
+    operation_->Run();
+  }
+
+ private:
+  ScheduledOperationCounter* counter_;
+  Closure* operation_;
+};
+
 InvalidationClientImpl::InvalidationClientImpl(
     SystemResources* resources, Random* random, int client_type,
     const string& client_name, const ClientConfigP& config,
@@ -26,54 +101,121 @@ InvalidationClientImpl::InvalidationClientImpl(
         config, application_name),
       listener_(new CheckingInvalidationListener(
             listener, GetStatistics(), resources->internal_scheduler(),
-            resources->listener_scheduler(), resources->logger())) {
+            resources->listener_scheduler(), resources->logger())),
+      scheduled_operations_(new ScheduledOperationCounter()),
+      running_inline_(false) {
+  listener_->SetUpcallQueueLimits(config.max_pending_upcalls(),
+                                  config.max_held_invalidation_objects());
+}
+
+InvalidationClientImpl::~InvalidationClientImpl() {
+  scheduled_operations_->Release();
 }
 
 void InvalidationClientImpl::Start() {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
+    ScheduleOperation(
         NewPermanentCallback(this, &InvalidationClientImpl::DoStart));
 }
 
 void InvalidationClientImpl::Stop() {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
+    ScheduleOperation(
         NewPermanentCallback(this, &InvalidationClientImpl::DoStop));
 }
 
 void InvalidationClientImpl::Register(const ObjectId& object_id) {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
+    if (CanRunInline()) {
+      running_inline_ = true;
+      InvalidationClientCore::Register(object_id);
+      running_inline_ = false;
+      return;
+    }
+    ScheduleOperation(
         NewPermanentCallback(this, &InvalidationClientImpl::DoRegister,
                              object_id));
 }
 
 void InvalidationClientImpl::Register(const vector<ObjectId>& object_ids) {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
-        NewPermanentCallback(this, &InvalidationClientImpl::DoBulkRegister,
-                             object_ids));
+    if (CanRunInline()) {
+      running_inline_ = true;
+      InvalidationClientCore::Register(object_ids);
+      running_inline_ = false;
+      return;
+    }
+    // Hash the objects here rather than on the internal thread, which may
+    // be busy, e.g. starting the Ticl.
+    Sha1DigestFunction digest_fn;
+    vector<pair<string, ObjectIdP> > digested_object_ids;
+    DigestObjectIds(object_ids, &digest_fn, &digested_object_ids);
+    ScheduleOperation(
+        NewPermanentCallback(this,
+            &InvalidationClientImpl::DoDigestedRegisterOperations,
+            digested_object_ids, RegistrationP_OpType_REGISTER));
 }
 
 void InvalidationClientImpl::Unregister(const ObjectId& object_id) {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
+    if (CanRunInline()) {
+      running_inline_ = true;
+      InvalidationClientCore::Unregister(object_id);
+      running_inline_ = false;
+      return;
+    }
+    ScheduleOperation(
         NewPermanentCallback(this, &InvalidationClientImpl::DoUnregister,
                              object_id));
 }
 
 void InvalidationClientImpl::Unregister(const vector<ObjectId>& object_ids) {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
-        NewPermanentCallback(this, &InvalidationClientImpl::DoBulkUnregister,
-                             object_ids));
+    if (CanRunInline()) {
+      running_inline_ = true;
+      InvalidationClientCore::Unregister(object_ids);
+      running_inline_ = false;
+      return;
+    }
+    // Hash the objects here rather than on the internal thread, which may
+    // be busy, e.g. starting the Ticl.
+    Sha1DigestFunction digest_fn;
+    vector<pair<string, ObjectIdP> > digested_object_ids;
+    DigestObjectIds(object_ids, &digest_fn, &digested_object_ids);
+    ScheduleOperation(
+        NewPermanentCallback(this,
+            &InvalidationClientImpl::DoDigestedRegisterOperations,
+            digested_object_ids, RegistrationP_OpType_UNREGISTER));
 }
 
 void InvalidationClientImpl::Acknowledge(const AckHandle& acknowledge_handle) {
-    GetInternalScheduler()->Schedule(
-        Scheduler::NoDelay(),
+    if (CanRunInline()) {
+      running_inline_ = true;
+      AcknowledgeOnInternalThread(acknowledge_handle);
+      running_inline_ = false;
+      return;
+    }
+    ScheduleOperation(
         NewPermanentCallback(this, &InvalidationClientImpl::DoAcknowledge,
                              acknowledge_handle));
 }
 
+void InvalidationClientImpl::AcknowledgeOnInternalThread(
+    const AckHandle& acknowledge_handle) {
+  // A handle given with a collapsed upcall acknowledges all the invalidations
+  // that it replaced.
+  vector<AckHandle> original_handles;
+  if (listener_->TakeDeferredAcks(acknowledge_handle, &original_handles)) {
+    for (size_t i = 0; i < original_handles.size(); ++i) {
+      InvalidationClientCore::Acknowledge(original_handles[i]);
+    }
+    return;
+  }
+  InvalidationClientCore::Acknowledge(acknowledge_handle);
+}
+
+bool InvalidationClientImpl::CanRunInline() {
+  return GetInternalScheduler()->IsRunningOnThread() && !running_inline_ &&
+      scheduled_operations_->IsZero();
+}
+
+void InvalidationClientImpl::ScheduleOperation(Closure* operation) {
+  GetInternalScheduler()->Schedule(Scheduler::NoDelay(),
+      new ScheduledOperation(scheduled_operations_, operation));
+}
+
 }  // namespace invalidation
@@ -28,6 +28,8 @@
 
 namespace invalidation {
 
+class ScheduledOperationCounter;
+
 class InvalidationClientImpl : public InvalidationClientCore {
  public:
   /* Constructs a client.
@@ -45,10 +47,16 @@ class InvalidationClientImpl : public InvalidationClientCore {
       const string& client_name, const ClientConfigP &config,
       const string& application_name, InvalidationListener* listener);
 
+  virtual ~InvalidationClientImpl();
+
   // These methods override those in InvalidationClientCore. Their
   // implementations all enqueue an event onto the work queue and
   // then delegate to the InvalidationClientCore method through one
-  // of the private DoYYY functions (below).
+  // of the private DoYYY functions (below). Register, Unregister and
+  // Acknowledge instead call the InvalidationClientCore method directly when
+  // that cannot be told apart from enqueuing (see CanRunInline). The bulk
+  // Register and Unregister compute the digests of their objects before
+  // enqueuing, on the caller's thread.
 
   virtual void Start();
 
@@ -64,6 +72,17 @@ class InvalidationClientImpl : public InvalidationClientCore {
 
   virtual void Acknowledge(const AckHandle& acknowledge_handle);
 
+  /* Delivers listener upcalls through |executor| so that upcalls for
+   * different objects may run in parallel (see
+   * CheckingInvalidationListener::SetListenerExecutor). Space for |executor|
+   * is owned by the caller.
+   *
+   * REQUIRES: Called before the client is started.
+   */
+  void SetListenerExecutor(KeyedSerialExecutor* executor) {
+    listener_->SetListenerExecutor(executor);
+  }
+
   /* Returns the listener that was registered by the caller. */
   InvalidationListener* GetInvalidationListenerForTest() {
     return listener_.get()->delegate();
@@ -74,7 +93,34 @@ class InvalidationClientImpl : public InvalidationClientCore {
     return listener_.get();
   }
 
+  virtual void GetListenerMemoryUsage(vector<pair<string, int64> >* usage) {
+    listener_->GetMemoryUsage(usage);
+  }
+
+  virtual void CollapseListenerUpcalls() {
+    listener_->CollapseHeldUpcalls();
+  }
+
  private:
+  /* Returns whether an operation may run inline rather than being enqueued:
+   * the caller must be on the internal thread, no enqueued operation may be
+   * waiting to run (so that operations still run in call order), and no
+   * operation may be running further up the stack (so that the core is never
+   * reentered, e.g. from a listener hosted on the internal scheduler that
+   * runs tasks synchronously).
+   */
+  bool CanRunInline();
+
+  /* Enqueues |operation| on the internal scheduler. Space for |operation| is
+   * owned by the callee.
+   */
+  void ScheduleOperation(Closure* operation);
+
+  /* Acknowledges |acknowledge_handle|, expanding it first if it was given
+   * with a collapsed listener upcall.
+   */
+  void AcknowledgeOnInternalThread(const AckHandle& acknowledge_handle);
+
   /*
    * All of these methods simply delegate to the superclass implementation. They
    * exist so that NewPermanentCallback objects created in
@@ -96,16 +142,14 @@ class InvalidationClientImpl : public InvalidationClientCore {
     this->InvalidationClientCore::Unregister(object_id);
   }
 
-  void DoBulkRegister(const vector<ObjectId>& object_ids) {
-    this->InvalidationClientCore::Register(object_ids);
-  }
-
-  void DoBulkUnregister(const vector<ObjectId>& object_ids) {
-    this->InvalidationClientCore::Unregister(object_ids);
+  void DoDigestedRegisterOperations(
+      const vector<pair<string, ObjectIdP> >& digested_object_ids,
+      RegistrationP::OpType reg_op_type) {
+    PerformDigestedRegisterOperations(digested_object_ids, reg_op_type);
   }
 
   void DoAcknowledge(const AckHandle& acknowledge_handle) {
-    this->InvalidationClientCore::Acknowledge(acknowledge_handle);
+    AcknowledgeOnInternalThread(acknowledge_handle);
   }
 
   /*
@@ -114,6 +158,17 @@ class InvalidationClientImpl : public InvalidationClientCore {
    */
   scoped_ptr<CheckingInvalidationListener> listener_;
 
+  /* Counts the operations enqueued on the internal scheduler that have not
+   * been deleted yet. Shared with those operations, which may outlive the
+   * client.
+   */
+  ScheduledOperationCounter* scheduled_operations_;
+
+  /* Whether an operation is running inline. Only accessed on the internal
+   * thread.
+   */
+  bool running_inline_;
+
   DISALLOW_COPY_AND_ASSIGN(InvalidationClientImpl);
 };
 
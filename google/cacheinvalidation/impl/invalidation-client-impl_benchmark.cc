@@ -0,0 +1,85 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmark of the startup of a client, from Start to its first invalidation,
+// against a FakeInvalidationServer on virtual time. The measured time is the
+// time of the whole startup, simulation included; the label reports how much
+// virtual time passed until the first invalidation arrived.
+
+#include "google/cacheinvalidation/client_protocol.pb.h"
+#include "google/cacheinvalidation/deps/benchmark.h"
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/test/fleet-simulation.h"
+
+namespace invalidation {
+
+using ::ipc::invalidation::ObjectSource_Type_TEST;
+
+/* Virtual time passed between two invalidations of the first object. */
+static const int kInvalidationStepMs = 1;
+
+/* Virtual time after which a startup is deemed stuck. */
+static const int kMaxStartupMs = 60000;
+
+/* Starts a client registering for as many objects as the second argument,
+ * before Start if the first argument is 1 and on Ready if it is 0, and runs
+ * until the client receives an invalidation. The server invalidates the
+ * first object of the client every kInvalidationStepMs.
+ */
+static void BM_StartToFirstInvalidation(benchmark::State& state) {
+  bool register_before_start = (state.range(0) != 0);
+  int num_registrations = state.range(1);
+  FleetSimulationConfig config;
+  config.num_clients = 1;
+  config.registrations_per_client = num_registrations;
+  config.register_before_start = register_before_start;
+  config.client_config.set_buffer_registrations_before_ready(
+      register_before_start);
+  config.server_config.num_objects = num_registrations;
+  ObjectIdP first_object_id;
+  first_object_id.set_source(ObjectSource_Type_TEST);
+  first_object_id.set_name("oid0");
+
+  TimeDelta step = TimeDelta::FromMilliseconds(kInvalidationStepMs);
+  TimeDelta startup_time;
+  while (state.KeepRunning()) {
+    FleetSimulation simulation(config);
+    simulation.StartClients();
+    startup_time = TimeDelta();
+    while (simulation.GetNumInvalidatedClients() == 0) {
+      CHECK(startup_time < TimeDelta::FromMilliseconds(kMaxStartupMs))
+          << "Client received no invalidation";
+      simulation.server()->Invalidate(first_object_id);
+      simulation.RunFor(step);
+      startup_time += step;
+    }
+  }
+  state.SetLabel(StringPrintf("%s, first invalidation after %d ms",
+      register_before_start ? "registered before start" : "registered on ready",
+      static_cast<int>(startup_time.InMilliseconds())));
+  state.SetItemsProcessed(
+      static_cast<int64>(state.iterations()) * num_registrations);
+}
+BENCHMARK(BM_StartToFirstInvalidation)
+    ->ArgPair(0, 100)
+    ->ArgPair(1, 100)
+    ->ArgPair(0, 10000)
+    ->ArgPair(1, 10000)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace invalidation
+
+BENCHMARK_MAIN();
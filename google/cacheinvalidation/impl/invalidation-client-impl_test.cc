@@ -23,10 +23,12 @@
 #include "google/cacheinvalidation/deps/gmock.h"
 #include "google/cacheinvalidation/deps/googletest.h"
 #include "google/cacheinvalidation/deps/random.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
 #include "google/cacheinvalidation/deps/string_util.h"
 #include "google/cacheinvalidation/impl/basic-system-resources.h"
 #include "google/cacheinvalidation/impl/constants.h"
 #include "google/cacheinvalidation/impl/invalidation-client-impl.h"
+#include "google/cacheinvalidation/impl/persistence-utils.h"
 #include "google/cacheinvalidation/impl/statistics.h"
 #include "google/cacheinvalidation/impl/throttle.h"
 #include "google/cacheinvalidation/impl/ticl-message-validator.h"
@@ -37,7 +39,9 @@
 namespace invalidation {
 
 using ::ipc::invalidation::ClientType_Type_TEST;
+using ::ipc::invalidation::DebounceConfigP;
 using ::ipc::invalidation::RegistrationManagerStateP;
+using ::ipc::invalidation::ObjectSource_Type_INTERNAL;
 using ::ipc::invalidation::ObjectSource_Type_TEST;
 using ::ipc::invalidation::StatusP_Code_PERMANENT_FAILURE;
 using ::testing::_;
@@ -55,6 +59,7 @@ using ::testing::Return;
 using ::testing::ReturnPointee;
 using ::testing::SaveArg;
 using ::testing::SetArgPointee;
+using ::testing::StrEq;
 using ::testing::StrictMock;
 using ::testing::proto::WhenDeserializedAs;
 
@@ -74,6 +79,13 @@ ACTION(InvokeReadCallbackFailure) {
   delete arg1;
 }
 
+// Given the ReadCallback of Storage::ReadKey as argument 1, invokes it with a
+// success status code and |value|.
+ACTION_P(InvokeReadCallbackSuccess, value) {
+  arg1->Run(pair<Status, string>(Status(Status::SUCCESS, ""), value));
+  delete arg1;
+}
+
 // Given the WriteCallback of Storage::WriteKey as argument 2, invokes it with
 // a success status code.
 ACTION(InvokeWriteCallbackSuccess) {
@@ -160,6 +172,38 @@ class InvalidationClientImplTest : public UnitTestBase {
         .WillOnce(InvokeWriteCallbackSuccess());
   }
 
+  // Acknowledges a malformed ack handle, optionally after stopping the client,
+  // and saves the number of ack handle failures recorded right after the call
+  // in |num_failures|. Must be run on the internal scheduler.
+  void AcknowledgeBadHandle(bool stop_first, int* num_failures) {
+    if (stop_first) {
+      client.get()->Stop();
+    }
+    client.get()->Acknowledge(AckHandle("bad handle"));
+    *num_failures = client.get()->GetStatisticsForTest()
+        ->GetClientErrorCounterForTest(
+            Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE);
+  }
+
+  // Gives the client an invalidation of |object_id| at |version|.
+  void SendInvalidation(const ObjectIdP& object_id, int64 version) {
+    InvalidationP invalidation;
+    invalidation.mutable_object_id()->CopyFrom(object_id);
+    invalidation.set_is_known_version(true);
+    invalidation.set_version(version);
+    ServerToClientMessage message;
+    InitServerHeader(client.get()->GetClientToken(), message.mutable_header());
+    message.mutable_invalidation_message()->add_invalidation()->CopyFrom(
+        invalidation);
+    ProcessIncomingMessage(message, MessageHandlingDelay());
+  }
+
+  // Exports a snapshot of the client into |snapshot|. Must be run on the
+  // internal scheduler.
+  void ExportSnapshot(string* snapshot) {
+    ASSERT_TRUE(client.get()->ExportSnapshot(snapshot));
+  }
+
   //
   // Test state maintained for every test.
   //
@@ -184,6 +228,22 @@ TEST_F(InvalidationClientImplTest, Start) {
   StartClient();
 }
 
+// Tests that the statistics snapshot may be taken off the internal thread and
+// reflects the initialize message sent on start.
+TEST_F(InvalidationClientImplTest, StatisticsSnapshot) {
+  SetExpectationsForTiclStart(1);
+  StartClient();
+  vector<pair<string, int64> > counters;
+  client.get()->GetStatisticsSnapshot(&counters);
+  int64 initialize_messages = 0;
+  for (size_t i = 0; i < counters.size(); ++i) {
+    if (counters[i].first == "SentMessageType.INITIALIZE") {
+      initialize_messages = counters[i].second;
+    }
+  }
+  EXPECT_EQ(1, initialize_messages);
+}
+
 // Tests that GenerateNonce generates a unique nonce on every call.
 TEST_F(InvalidationClientImplTest, GenerateNonce) {
   // Create a random number generated seeded with the current time.
@@ -328,6 +388,60 @@ TEST_F(InvalidationClientImplTest, Invalidations) {
   ASSERT_TRUE(CompareMessages(expected_msg, actual_msg));
 }
 
+// Tests that ack handles do not carry the payload of their invalidation, that
+// a tampered handle is rejected and that a handle in the old format, carrying
+// the whole invalidation, is still accepted.
+TEST_F(InvalidationClientImplTest, CompactAckHandles) {
+  SetExpectationsForTiclStart(2);
+  vector<ObjectIdP> oid_protos;
+  vector<InvalidationP> invalidations;
+  InitTestObjectIds(1, &oid_protos);
+  MakeInvalidationsFromObjectIds(oid_protos, &invalidations);
+  invalidations[0].set_payload(string(10000, 'x'));
+
+  vector<AckHandle> ack_handles;
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _))
+      .WillOnce(SaveArgToVector<2>(&ack_handles));
+  StartClient();
+  ServerToClientMessage message;
+  InitServerHeader(client.get()->GetClientToken(), message.mutable_header());
+  InitInvalidationMessage(invalidations,
+      message.mutable_invalidation_message());
+  ProcessIncomingMessage(message, MessageHandlingDelay());
+  ASSERT_EQ(1, static_cast<int>(ack_handles.size()));
+  EXPECT_GT(100, static_cast<int>(ack_handles[0].handle_data().size()));
+
+  AckHandleP tampered;
+  tampered.ParseFromString(ack_handles[0].handle_data());
+  tampered.set_version(tampered.version() + 1);
+  string tampered_data;
+  tampered.SerializeToString(&tampered_data);
+  AckHandleP old_format;
+  old_format.mutable_invalidation()->CopyFrom(invalidations[0]);
+  string old_format_data;
+  old_format.SerializeToString(&old_format_data);
+
+  client.get()->Acknowledge(AckHandle(tampered_data));
+  client.get()->Acknowledge(ack_handles[0]);
+  client.get()->Acknowledge(AckHandle(old_format_data));
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  EXPECT_EQ(1, client.get()->GetStatisticsForTest()
+      ->GetClientErrorCounterForTest(
+          Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE));
+
+  // Both handles ack the invalidation, without its payload.
+  ClientToServerMessage client_msg;
+  client_msg.ParseFromString(outgoing_messages[1]);
+  ASSERT_TRUE(client_msg.has_invalidation_ack_message());
+  invalidations[0].clear_payload();
+  invalidations.push_back(invalidations[0]);
+  InvalidationMessage expected_msg;
+  InitInvalidationMessage(invalidations, &expected_msg);
+  ASSERT_TRUE(CompareMessages(expected_msg,
+                              client_msg.invalidation_ack_message()));
+}
+
 // Give a registration sync request message and an info request message to the
 // client and wait for the sync message and the info message to go out.
 TEST_F(InvalidationClientImplTest, ServerRequests) {
@@ -501,4 +615,463 @@ TEST_F(InvalidationClientImplTest, Heartbeats) {
   internal_scheduler->PassTime(EndOfTestWaitTime());
 }
 
+// Tests that an operation called on the internal thread runs inline when
+// nothing is enqueued, and is enqueued behind earlier operations otherwise.
+TEST_F(InvalidationClientImplTest, InlineOperations) {
+  int num_failures = -1;
+  internal_scheduler->Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+      this, &InvalidationClientImplTest::AcknowledgeBadHandle, false,
+      &num_failures));
+  internal_scheduler->PassTime(MessageHandlingDelay());
+  ASSERT_EQ(1, num_failures);
+
+  // The Stop is enqueued, so the ack must be enqueued behind it.
+  internal_scheduler->Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+      this, &InvalidationClientImplTest::AcknowledgeBadHandle, true,
+      &num_failures));
+  internal_scheduler->PassTime(MessageHandlingDelay());
+  ASSERT_EQ(1, num_failures);
+  ASSERT_EQ(2, client.get()->GetStatisticsForTest()
+      ->GetClientErrorCounterForTest(
+          Statistics::ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE));
+}
+
+// Tests that operations still enqueued when the client is deleted can be
+// deleted by the scheduler afterwards.
+TEST_F(InvalidationClientImplTest, OperationsOutliveClient) {
+  // Called off the internal thread, so both operations are enqueued.
+  client.get()->Start();
+  client.get()->Stop();
+
+  // The scheduler deletes the operations without running them when it is
+  // deleted, after the client.
+  client.reset();
+}
+
+// Tests that a client restarting from persistent state that holds a server
+// summary matching its registrations sends no info message.
+TEST_F(InvalidationClientImplTest, WarmStartSkipsInfoMessage) {
+  PersistentTiclState state;
+  state.set_client_token("old token");
+  state.mutable_last_known_server_summary()->CopyFrom(*reg_summary);
+  state.set_last_known_server_time_ms(1000);
+  Sha1DigestFunction digest_fn;
+  string serialized_state;
+  PersistenceUtils::SerializeState(state, &digest_fn, &serialized_state);
+
+  EXPECT_CALL(*network, SendMessage(_)).Times(0);
+  EXPECT_CALL(*storage, ReadKey(_, _))
+      .WillOnce(InvokeReadCallbackSuccess(serialized_state));
+  EXPECT_CALL(listener, Ready(Eq(client.get())));
+  EXPECT_CALL(listener, ReissueRegistrations(Eq(client.get()), _, _));
+  EXPECT_CALL(*storage, WriteKey(_, _, _))
+      .WillRepeatedly(InvokeWriteCallbackSuccess());
+
+  client.get()->Start();
+  internal_scheduler->PassTime(
+      TimeDelta::FromMilliseconds(
+          config.initial_persistent_heartbeat_delay_ms()) +
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+}
+
+// Tests a client that buffers the registrations made before it is ready.
+class InvalidationClientImplBufferingTest : public InvalidationClientImplTest {
+ public:
+  virtual void SetUp() {
+    config.set_buffer_registrations_before_ready(true);
+    InvalidationClientImplTest::SetUp();
+  }
+};
+
+// Tests that registrations made before the Ticl is ready are applied together
+// and sent once it has a token.
+TEST_F(InvalidationClientImplBufferingTest, SendsBufferedRegistrations) {
+  SetExpectationsForTiclStart(2);
+
+  vector<ObjectIdP> oid_protos;
+  vector<ObjectId> oids;
+  InitTestObjectIds(3, &oid_protos);
+  ConvertFromObjectIdProtos(oid_protos, &oids);
+
+  // Register all the objects and unregister the last one before starting: only
+  // the net registrations are sent.
+  client.get()->Register(oids);
+  client.get()->Unregister(oids[2]);
+  StartClient();
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+
+  ClientToServerMessage client_msg;
+  client_msg.ParseFromString(outgoing_messages[1]);
+  ASSERT_TRUE(client_msg.has_registration_message());
+  oid_protos.pop_back();
+  RegistrationMessage expected_msg;
+  InitRegistrationMessage(oid_protos, true, &expected_msg);
+  ASSERT_TRUE(CompareMessages(expected_msg, client_msg.registration_message()));
+}
+
+// Tests that a client created from the snapshot of a started client resumes
+// with its token and registrations, without reading persistent state or
+// sending an initialize message.
+TEST_F(InvalidationClientImplTest, ResumesFromSnapshot) {
+  SetExpectationsForTiclStart(2);
+  StartClient();
+  vector<ObjectIdP> oid_protos;
+  vector<ObjectId> oids;
+  InitTestObjectIds(3, &oid_protos);
+  ConvertFromObjectIdProtos(oid_protos, &oids);
+  client.get()->Register(oids);
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+
+  string snapshot;
+  internal_scheduler->Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+      this, &InvalidationClientImplTest::ExportSnapshot, &snapshot));
+  internal_scheduler->PassTime(MessageHandlingDelay());
+  client.get()->Stop();
+  internal_scheduler->PassTime(MessageHandlingDelay());
+
+  // The new client takes over the network and the storage.
+  InitCommonExpectations();
+  EXPECT_CALL(*storage, WriteKey(_, _, _))
+      .WillRepeatedly(InvokeWriteCallbackSuccess());
+  EXPECT_CALL(*network, SendMessage(_))
+      .WillRepeatedly(SaveArgToVector<0>(&outgoing_messages));
+  int num_old_messages = outgoing_messages.size();
+  scoped_ptr<InvalidationClientImpl> new_client(new InvalidationClientImpl(
+      resources.get(), new Random(0), ClientType_Type_TEST, "clientName",
+      config, "InvClientTest", &listener));
+  ASSERT_FALSE(new_client.get()->SetSnapshotToRestore("bad snapshot"));
+  ASSERT_TRUE(new_client.get()->SetSnapshotToRestore(snapshot));
+  EXPECT_CALL(listener, Ready(Eq(new_client.get())));
+  EXPECT_CALL(listener, ReissueRegistrations(Eq(new_client.get()), _, _));
+  new_client.get()->Start();
+  internal_scheduler->PassTime(MessageHandlingDelay());
+
+  ASSERT_TRUE(new_client.get()->IsStartedForTest());
+  ASSERT_EQ("new token", new_client.get()->GetClientToken());
+  string serialized_state;
+  new_client.get()->GetRegistrationManagerStateAsSerializedProto(
+      &serialized_state);
+  RegistrationManagerStateP reg_state;
+  reg_state.ParseFromString(serialized_state);
+  ASSERT_EQ(3, reg_state.registered_objects_size());
+
+  // A new registration is sent with the token of the snapshot, and no
+  // message carries an initialize message.
+  new_client.get()->Register(ObjectId(oids[0].source(), "new object"));
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  ASSERT_LT(num_old_messages, static_cast<int>(outgoing_messages.size()));
+  for (size_t i = num_old_messages; i < outgoing_messages.size(); ++i) {
+    ClientToServerMessage client_msg;
+    client_msg.ParseFromString(outgoing_messages[i]);
+    EXPECT_FALSE(client_msg.has_initialize_message());
+    EXPECT_EQ("new token", client_msg.header().client_token());
+  }
+}
+
+// Tests the debouncing of invalidations for a source with a debounce window.
+class InvalidationClientImplDebounceTest : public InvalidationClientImplTest {
+ public:
+  virtual void SetUp() {
+    DebounceConfigP* debounce_config = config.add_debounce_config();
+    debounce_config->set_source(ObjectSource_Type_TEST);
+    debounce_config->set_window_ms(kDebounceWindowMs);
+    InvalidationClientImplTest::SetUp();
+  }
+
+  static const int kDebounceWindowMs = 1000;
+};
+
+// Tests that invalidations of an object within the debounce window are merged
+// into one upcall for the highest version, and that acking it also acks the
+// merged invalidations.
+TEST_F(InvalidationClientImplDebounceTest, MergesWithinWindow) {
+  SetExpectationsForTiclStart(2);
+  vector<ObjectIdP> oid_protos;
+  InitTestObjectIds(1, &oid_protos);
+
+  vector<Invalidation> saved_invs;
+  vector<AckHandle> ack_handles;
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _))
+      .Times(2)
+      .WillRepeatedly(DoAll(SaveArgToVector<1>(&saved_invs),
+                            SaveArgToVector<2>(&ack_handles)));
+  StartClient();
+
+  // The first invalidation is delivered at once; the next ones are held.
+  SendInvalidation(oid_protos[0], 1);
+  SendInvalidation(oid_protos[0], 3);
+  SendInvalidation(oid_protos[0], 2);
+  ASSERT_EQ(1, static_cast<int>(saved_invs.size()));
+  EXPECT_EQ(1, saved_invs[0].version());
+
+  // At the end of the window, the highest version is delivered.
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(kDebounceWindowMs));
+  ASSERT_EQ(2, static_cast<int>(saved_invs.size()));
+  EXPECT_EQ(3, saved_invs[1].version());
+  EXPECT_EQ(1, client.get()->GetStatisticsForTest()
+      ->GetUpcallEventCounterForTest(Statistics::UpcallEventType_DEBOUNCED));
+
+  // Acking it acks both held invalidations.
+  client.get()->Acknowledge(ack_handles[1]);
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  ClientToServerMessage client_msg;
+  client_msg.ParseFromString(outgoing_messages[1]);
+  ASSERT_TRUE(client_msg.has_invalidation_ack_message());
+  EXPECT_EQ(2, client_msg.invalidation_ack_message().invalidation_size());
+}
+
+// Tests the client with a memory soft cap small enough that any unacked
+// invalidation exceeds it.
+class InvalidationClientImplMemorySoftCapTest
+    : public InvalidationClientImplTest {
+ public:
+  virtual void SetUp() {
+    config.set_memory_soft_cap_bytes(1);
+    InvalidationClientImplTest::SetUp();
+  }
+};
+
+// Tests that the soft cap is acted on once when it is crossed, not on every
+// message while the usage stays above it, and that degrading sends no message
+// when nothing is batched.
+TEST_F(InvalidationClientImplMemorySoftCapTest, ActsOnCrossing) {
+  SetExpectationsForTiclStart(1);
+  vector<ObjectIdP> oid_protos;
+  InitTestObjectIds(1, &oid_protos);
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _)).Times(3);
+  StartClient();
+  EXPECT_EQ(0, client.get()->GetStatisticsForTest()
+      ->GetClientErrorCounterForTest(
+          Statistics::ClientErrorType_MEMORY_SOFT_CAP_EXCEEDED));
+
+  // The invalidations wait for acks, keeping the usage above the cap.
+  SendInvalidation(oid_protos[0], 1);
+  SendInvalidation(oid_protos[0], 2);
+  SendInvalidation(oid_protos[0], 3);
+  EXPECT_EQ(1, client.get()->GetStatisticsForTest()
+      ->GetClientErrorCounterForTest(
+          Statistics::ClientErrorType_MEMORY_SOFT_CAP_EXCEEDED));
+
+  // Only the initialize message was sent.
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  EXPECT_EQ(1, static_cast<int>(outgoing_messages.size()));
+}
+
+// Tests the client with an ack journal.
+class InvalidationClientImplAckJournalTest : public InvalidationClientImplTest {
+ public:
+  virtual void SetUp() {
+    config.set_ack_journal_size(kAckJournalSize);
+    InvalidationClientImplTest::SetUp();
+  }
+
+  // Gives the client the invalidations of |object_ids| at |version|, a known
+  // version if |is_known_version| and a system version otherwise.
+  void SendInvalidations(const vector<ObjectIdP>& object_ids, int64 version,
+                         bool is_known_version) {
+    ServerToClientMessage message;
+    InitServerHeader(client.get()->GetClientToken(), message.mutable_header());
+    for (size_t i = 0; i < object_ids.size(); ++i) {
+      InvalidationP* invalidation =
+          message.mutable_invalidation_message()->add_invalidation();
+      invalidation->mutable_object_id()->CopyFrom(object_ids[i]);
+      invalidation->set_is_known_version(is_known_version);
+      invalidation->set_version(version);
+    }
+    ProcessIncomingMessage(message, MessageHandlingDelay());
+  }
+
+  static const int kAckJournalSize = 10;
+};
+
+// Tests that an acked invalidation is not redelivered while an acked
+// invalidate-all is, since the journal must not hold all-objects ids.
+TEST_F(InvalidationClientImplAckJournalTest, RedeliversInvalidateAll) {
+  SetExpectationsForTiclStart(3);
+  EXPECT_CALL(*storage, ReadKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                _))
+      .WillOnce(InvokeReadCallbackFailure());
+  EXPECT_CALL(*storage, WriteKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                 _, _))
+      .WillRepeatedly(InvokeWriteCallbackSuccess());
+
+  vector<ObjectIdP> oid_protos;
+  InitTestObjectIds(1, &oid_protos);
+  ObjectIdP all_objects_id;
+  all_objects_id.set_source(ObjectSource_Type_INTERNAL);
+  all_objects_id.set_name("");
+  oid_protos.push_back(all_objects_id);
+
+  vector<AckHandle> ack_handles;
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _))
+      .WillOnce(SaveArgToVector<2>(&ack_handles));
+  EXPECT_CALL(listener, InvalidateAll(Eq(client.get()), _))
+      .Times(2)
+      .WillRepeatedly(SaveArgToVector<1>(&ack_handles));
+  StartClient();
+
+  SendInvalidations(oid_protos, 5, true);
+  ASSERT_EQ(2, static_cast<int>(ack_handles.size()));
+  client.get()->Acknowledge(ack_handles[0]);
+  client.get()->Acknowledge(ack_handles[1]);
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+
+  // Only the invalidate-all reaches the listener again; the invalidation is
+  // acked again at once.
+  SendInvalidations(oid_protos, 5, true);
+  ASSERT_EQ(3, static_cast<int>(ack_handles.size()));
+  EXPECT_EQ(1, client.get()->GetStatisticsForTest()
+      ->GetUpcallEventCounterForTest(
+          Statistics::UpcallEventType_ALREADY_ACKNOWLEDGED));
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  ClientToServerMessage client_msg;
+  client_msg.ParseFromString(outgoing_messages[2]);
+  ASSERT_TRUE(client_msg.has_invalidation_ack_message());
+  ASSERT_EQ(1, client_msg.invalidation_ack_message().invalidation_size());
+  EXPECT_EQ(oid_protos[0].name(), client_msg.invalidation_ack_message()
+      .invalidation(0).object_id().name());
+}
+
+// Tests that the acks handled before the journal is written are written
+// together, and that sending them writes the journal once more when the write
+// task runs again.
+TEST_F(InvalidationClientImplAckJournalTest, BatchesJournalWrites) {
+  SetExpectationsForTiclStart(2);
+  EXPECT_CALL(*storage, ReadKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                _))
+      .WillOnce(InvokeReadCallbackFailure());
+  vector<string> journals;
+  EXPECT_CALL(*storage, WriteKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                 _, _))
+      .WillRepeatedly(DoAll(SaveArgToVector<1>(&journals),
+                            InvokeWriteCallbackSuccess()));
+
+  vector<ObjectIdP> oid_protos;
+  InitTestObjectIds(3, &oid_protos);
+  vector<AckHandle> ack_handles;
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _))
+      .Times(3)
+      .WillRepeatedly(SaveArgToVector<2>(&ack_handles));
+  StartClient();
+  SendInvalidations(oid_protos, 5, true);
+  ASSERT_EQ(3, static_cast<int>(ack_handles.size()));
+  for (size_t i = 0; i < ack_handles.size(); ++i) {
+    client.get()->Acknowledge(ack_handles[i]);
+  }
+  EXPECT_TRUE(journals.empty());
+  internal_scheduler->PassTime(MessageHandlingDelay());
+  ASSERT_EQ(1, static_cast<int>(journals.size()));
+  AckJournal journal(kAckJournalSize);
+  ASSERT_TRUE(journal.Parse(journals[0]));
+  EXPECT_EQ(3, journal.size());
+
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  EXPECT_EQ(1, static_cast<int>(journals.size()));
+  internal_scheduler->PassTime(
+      TimeDelta::FromMilliseconds(4 * config.write_retry_delay_ms()));
+  ASSERT_EQ(2, static_cast<int>(journals.size()));
+  ASSERT_TRUE(journal.Parse(journals[1]));
+  EXPECT_FALSE(journal.HasPendingAcks());
+}
+
+// Tests that an acked unknown-version invalidation, whose system version is
+// in a separate version space, does not suppress a lower known version.
+TEST_F(InvalidationClientImplAckJournalTest, DeliversKnownVersionAfterSystem) {
+  SetExpectationsForTiclStart(2);
+  EXPECT_CALL(*storage, ReadKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                _))
+      .WillOnce(InvokeReadCallbackFailure());
+  EXPECT_CALL(*storage, WriteKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                 _, _))
+      .WillRepeatedly(InvokeWriteCallbackSuccess());
+
+  vector<ObjectIdP> oid_protos;
+  InitTestObjectIds(1, &oid_protos);
+  vector<AckHandle> ack_handles;
+  EXPECT_CALL(listener, InvalidateUnknownVersion(Eq(client.get()), _, _))
+      .WillOnce(SaveArgToVector<2>(&ack_handles));
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _))
+      .WillOnce(SaveArgToVector<2>(&ack_handles));
+  StartClient();
+
+  SendInvalidations(oid_protos, 1000000, false);
+  ASSERT_EQ(1, static_cast<int>(ack_handles.size()));
+  client.get()->Acknowledge(ack_handles[0]);
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+
+  SendInvalidations(oid_protos, 1, true);
+  EXPECT_EQ(2, static_cast<int>(ack_handles.size()));
+  EXPECT_EQ(0, client.get()->GetStatisticsForTest()
+      ->GetUpcallEventCounterForTest(
+          Statistics::UpcallEventType_ALREADY_ACKNOWLEDGED));
+}
+
+// Tests that a client resuming from a snapshot loads the ack journal, so that
+// it does not redeliver the invalidations acked before the snapshot.
+TEST_F(InvalidationClientImplAckJournalTest, LoadsJournalWithSnapshot) {
+  SetExpectationsForTiclStart(2);
+  EXPECT_CALL(*storage, ReadKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                _))
+      .WillOnce(InvokeReadCallbackFailure());
+  string journal;
+  EXPECT_CALL(*storage, WriteKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                 _, _))
+      .WillRepeatedly(DoAll(SaveArg<1>(&journal),
+                            InvokeWriteCallbackSuccess()));
+
+  vector<ObjectIdP> oid_protos;
+  InitTestObjectIds(1, &oid_protos);
+  vector<AckHandle> ack_handles;
+  EXPECT_CALL(listener, Invalidate(Eq(client.get()), _, _))
+      .WillOnce(SaveArgToVector<2>(&ack_handles));
+  StartClient();
+  SendInvalidations(oid_protos, 5, true);
+  ASSERT_EQ(1, static_cast<int>(ack_handles.size()));
+  client.get()->Acknowledge(ack_handles[0]);
+  internal_scheduler->PassTime(
+      GetMaxBatchingDelay(config.protocol_handler_config()));
+  ASSERT_FALSE(journal.empty());
+
+  string snapshot;
+  internal_scheduler->Schedule(Scheduler::NoDelay(), NewPermanentCallback(
+      this, &InvalidationClientImplTest::ExportSnapshot, &snapshot));
+  internal_scheduler->PassTime(MessageHandlingDelay());
+  client.get()->Stop();
+  internal_scheduler->PassTime(MessageHandlingDelay());
+
+  // The new client reads the journal written by the old one and acks the
+  // invalidation again instead of delivering it.
+  InitCommonExpectations();
+  EXPECT_CALL(*storage, ReadKey(StrEq(InvalidationClientCore::kAckJournalKey),
+                                _))
+      .WillOnce(InvokeReadCallbackSuccess(journal));
+  EXPECT_CALL(*storage, WriteKey(_, _, _))
+      .WillRepeatedly(InvokeWriteCallbackSuccess());
+  EXPECT_CALL(*network, SendMessage(_))
+      .WillRepeatedly(SaveArgToVector<0>(&outgoing_messages));
+  scoped_ptr<InvalidationClientImpl> new_client(new InvalidationClientImpl(
+      resources.get(), new Random(0), ClientType_Type_TEST, "clientName",
+      config, "InvClientTest", &listener));
+  ASSERT_TRUE(new_client.get()->SetSnapshotToRestore(snapshot));
+  EXPECT_CALL(listener, Ready(Eq(new_client.get())));
+  EXPECT_CALL(listener, ReissueRegistrations(Eq(new_client.get()), _, _));
+  new_client.get()->Start();
+  internal_scheduler->PassTime(MessageHandlingDelay());
+  ASSERT_TRUE(new_client.get()->IsStartedForTest());
+
+  SendInvalidations(oid_protos, 5, true);
+  EXPECT_EQ(1, new_client.get()->GetStatisticsForTest()
+      ->GetUpcallEventCounterForTest(
+          Statistics::UpcallEventType_ALREADY_ACKNOWLEDGED));
+}
+
 }  // namespace invalidation
@@ -0,0 +1,155 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tracks the end-to-end latencies of invalidations, from their emission by the
+// server to their acknowledgement by the application.
+
+#include "google/cacheinvalidation/impl/invalidation-latency-tracker.h"
+
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/invalidation-client-util.h"
+#include "google/cacheinvalidation/impl/memory-usage.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+void InvalidationLatencyTracker::RecordDelivery(
+    const InvalidationP& invalidation, int64 server_time_ms, Time now) {
+  int64 clock_offset_ms =
+      InvalidationClientUtil::GetTimeInMillis(now) - server_time_ms;
+  if (!has_min_clock_offset_ || (clock_offset_ms < min_clock_offset_ms_)) {
+    has_min_clock_offset_ = true;
+    min_clock_offset_ms_ = clock_offset_ms;
+  }
+  TimeDelta delivery_latency =
+      TimeDelta::FromMilliseconds(clock_offset_ms - min_clock_offset_ms_);
+  delivery_latency_.Record(delivery_latency);
+  GetOrAddSource(invalidation.object_id().source())->delivery.Record(
+      delivery_latency);
+
+  InvalidationKey key = GetKey(invalidation);
+  map<InvalidationKey, pair<int64, Time> >::iterator iter =
+      pending_acks_.find(key);
+  if (iter != pending_acks_.end()) {
+    // Redelivered: measure from the latest receipt.
+    ErasePendingAck(iter);
+  } else if (static_cast<int>(pending_acks_.size()) >= max_pending_acks_) {
+    // Stop waiting for the ack of the oldest invalidation.
+    ErasePendingAck(pending_acks_.find(pending_ack_order_.begin()->second));
+  }
+  int64 seqno = next_pending_ack_seqno_++;
+  pending_acks_[key] = make_pair(seqno, now);
+  pending_ack_order_[seqno] = key;
+  pending_acks_memory_usage_ += GetPendingAckMemoryUsage(key);
+}
+
+void InvalidationLatencyTracker::RecordAck(const InvalidationP& invalidation,
+                                           Time now) {
+  map<InvalidationKey, pair<int64, Time> >::iterator iter =
+      pending_acks_.find(GetKey(invalidation));
+  if (iter == pending_acks_.end()) {
+    return;
+  }
+  TimeDelta processing_latency = now - iter->second.second;
+  ErasePendingAck(iter);
+  processing_latency_.Record(processing_latency);
+  map<int, SourceLatencies>::iterator source =
+      sources_.find(invalidation.object_id().source());
+  if (source != sources_.end()) {
+    source->second.processing.Record(processing_latency);
+  }
+}
+
+int64 InvalidationLatencyTracker::GetMemoryUsage() const {
+  return sources_.size() * (MemoryUsage::kTreeNodeOverhead + sizeof(int) +
+                            sizeof(SourceLatencies)) +
+      pending_acks_memory_usage_;
+}
+
+const InvalidationLatencyTracker::SourceLatencies*
+InvalidationLatencyTracker::GetSourceLatencies(int source) const {
+  map<int, SourceLatencies>::const_iterator iter = sources_.find(source);
+  return (iter == sources_.end()) ? NULL : &iter->second;
+}
+
+void InvalidationLatencyTracker::GetStatistics(
+    vector<pair<string, int> >* statistics) const {
+  if (delivery_latency_.count() > 0) {
+    delivery_latency_.GetSummary("InvalidationLatency.DELIVERY.", statistics);
+  }
+  if (processing_latency_.count() > 0) {
+    processing_latency_.GetSummary("InvalidationLatency.PROCESSING.",
+                                   statistics);
+  }
+  map<int, SourceLatencies>::const_iterator iter;
+  for (iter = sources_.begin(); iter != sources_.end(); ++iter) {
+    string prefix = StringPrintf("InvalidationLatency.source_%d.", iter->first);
+    statistics->push_back(make_pair(prefix + "count", iter->second.count));
+    if (iter->second.delivery.count() > 0) {
+      iter->second.delivery.GetSummary(prefix + "DELIVERY.", statistics);
+    }
+    if (iter->second.processing.count() > 0) {
+      iter->second.processing.GetSummary(prefix + "PROCESSING.", statistics);
+    }
+  }
+}
+
+InvalidationLatencyTracker::SourceLatencies*
+InvalidationLatencyTracker::GetOrAddSource(int source) {
+  map<int, SourceLatencies>::iterator iter = sources_.find(source);
+  if (iter != sources_.end()) {
+    ++iter->second.count;
+    return &iter->second;
+  }
+  int count = 0;
+  if (static_cast<int>(sources_.size()) >= max_sources_) {
+    // Replace the source with the fewest invalidations.
+    map<int, SourceLatencies>::iterator fewest = sources_.begin();
+    for (iter = sources_.begin(); iter != sources_.end(); ++iter) {
+      if (iter->second.count < fewest->second.count) {
+        fewest = iter;
+      }
+    }
+    count = fewest->second.count;
+    sources_.erase(fewest);
+  }
+  SourceLatencies* latencies = &sources_[source];
+  latencies->count = count + 1;
+  return latencies;
+}
+
+InvalidationLatencyTracker::InvalidationKey
+InvalidationLatencyTracker::GetKey(const InvalidationP& invalidation) {
+  return InvalidationKey(make_pair(invalidation.object_id().source(),
+                                   invalidation.object_id().name()),
+                         invalidation.version());
+}
+
+int64 InvalidationLatencyTracker::GetPendingAckMemoryUsage(
+    const InvalidationKey& key) {
+  // The key is stored in both maps.
+  return 2 * (MemoryUsage::kTreeNodeOverhead + sizeof(key) +
+              key.first.second.size()) +
+      sizeof(pair<int64, Time>) + sizeof(int64);
+}
+
+void InvalidationLatencyTracker::ErasePendingAck(
+    map<InvalidationKey, pair<int64, Time> >::iterator iter) {
+  pending_acks_memory_usage_ -= GetPendingAckMemoryUsage(iter->first);
+  pending_ack_order_.erase(iter->second.first);
+  pending_acks_.erase(iter);
+}
+
+}  // namespace invalidation
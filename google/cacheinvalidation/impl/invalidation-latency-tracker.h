@@ -0,0 +1,190 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tracks the end-to-end latencies of invalidations, from their emission by the
+// server to their acknowledgement by the application.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_INVALIDATION_LATENCY_TRACKER_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_INVALIDATION_LATENCY_TRACKER_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/impl/latency-histogram.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// Records two latencies for each invalidation delivered to the application:
+//
+// - Delivery latency: from the server time of the message carrying the
+//   invalidation to its receipt by the client. The clocks of the client and
+//   the server are not synchronized, so the latency is measured relative to
+//   the smallest difference between the client and server times seen so far,
+//   i.e., the fastest delivery counts as instantaneous.
+// - Processing latency: from the receipt of the invalidation to its
+//   acknowledgement by the application, including the time spent in the
+//   listener queue.
+//
+// Both are recorded overall and for the sources with the most invalidations.
+// Sources are counted with the Space-Saving algorithm: when a new source
+// arrives and all the per-source slots are taken, the source with the fewest
+// invalidations is replaced and the new one inherits its count, so that
+// heavy sources settle in the slots. Memory use is bounded by the number of
+// sources and pending acks given at construction; when too many acks are
+// pending, e.g. because the application leaves some invalidations unacked,
+// the oldest one is no longer tracked.
+//
+// This class is not thread-safe.
+class InvalidationLatencyTracker {
+ public:
+  /* The latencies of the invalidations of one source. */
+  struct SourceLatencies {
+    SourceLatencies() : count(0) {}
+
+    /* Number of invalidations counted for the source (an overestimate if it
+     * replaced another source).
+     */
+    int count;
+
+    /* Delivery latencies since the source took its slot. */
+    LatencyHistogram delivery;
+
+    /* Processing latencies since the source took its slot. */
+    LatencyHistogram processing;
+  };
+
+  /* Creates a tracker keeping per-source latencies for at most
+   * |max_sources| sources and waiting for the acks of at most
+   * |max_pending_acks| invalidations.
+   */
+  InvalidationLatencyTracker(int max_sources, int max_pending_acks)
+      : max_sources_(max_sources), max_pending_acks_(max_pending_acks),
+        has_min_clock_offset_(false), min_clock_offset_ms_(0),
+        next_pending_ack_seqno_(0), pending_acks_memory_usage_(0) {}
+
+  /* Records that |invalidation|, sent by the server at |server_time_ms|, was
+   * received at |now| and is being delivered to the application.
+   */
+  void RecordDelivery(const InvalidationP& invalidation, int64 server_time_ms,
+                      Time now);
+
+  /* Records that the application acknowledged |invalidation| at |now|. Does
+   * nothing if its delivery was not recorded or is no longer tracked.
+   */
+  void RecordAck(const InvalidationP& invalidation, Time now);
+
+  /* Returns the delivery latencies of all the invalidations. */
+  const LatencyHistogram& delivery_latency() const {
+    return delivery_latency_;
+  }
+
+  /* Returns the processing latencies of all the invalidations. */
+  const LatencyHistogram& processing_latency() const {
+    return processing_latency_;
+  }
+
+  /* Returns the number of invalidations waiting for an ack. */
+  int num_pending_acks() const {
+    return pending_acks_.size();
+  }
+
+  /* Returns the estimated memory used by the per-source latencies and the
+   * invalidations waiting for an ack, in bytes.
+   */
+  int64 GetMemoryUsage() const;
+
+  /* Returns the latencies of |source|, or NULL if it has no slot. */
+  const SourceLatencies* GetSourceLatencies(int source) const;
+
+  /* Appends summaries of the latencies to |statistics|, e.g.,
+   * "InvalidationLatency.DELIVERY.p99_us" and
+   * "InvalidationLatency.source_4.PROCESSING.p50_us".
+   */
+  void GetStatistics(vector<pair<string, int> >* statistics) const;
+
+ private:
+  /* Key of an invalidation: its source, name and version. */
+  typedef pair<pair<int, string>, int64> InvalidationKey;
+
+  /* Returns the slot of |source|, taking one if needed. */
+  SourceLatencies* GetOrAddSource(int source);
+
+  /* Returns the key of |invalidation|. */
+  static InvalidationKey GetKey(const InvalidationP& invalidation);
+
+  /* Returns the estimated memory used by the pending ack of |key|, in both
+   * |pending_acks_| and |pending_ack_order_|.
+   */
+  static int64 GetPendingAckMemoryUsage(const InvalidationKey& key);
+
+  /* Stops waiting for the ack of the invalidation at |iter|. */
+  void ErasePendingAck(
+      map<InvalidationKey, pair<int64, Time> >::iterator iter);
+
+  /* Maximum number of sources with per-source latencies. */
+  int max_sources_;
+
+  /* Maximum number of invalidations waiting for an ack. */
+  int max_pending_acks_;
+
+  /* Whether |min_clock_offset_ms_| is set. */
+  bool has_min_clock_offset_;
+
+  /* Smallest difference between the client time at receipt and the server
+   * time seen so far.
+   */
+  int64 min_clock_offset_ms_;
+
+  /* Latencies of all the invalidations. */
+  LatencyHistogram delivery_latency_;
+  LatencyHistogram processing_latency_;
+
+  /* Latencies of the sources with a slot. */
+  map<int, SourceLatencies> sources_;
+
+  /* Sequence number and receipt time of the invalidations waiting for an
+   * ack.
+   */
+  map<InvalidationKey, pair<int64, Time> > pending_acks_;
+
+  /* The keys of |pending_acks_| by sequence number, i.e., oldest receipt
+   * first.
+   */
+  map<int64, InvalidationKey> pending_ack_order_;
+
+  /* Sequence number of the next entry of |pending_acks_|. */
+  int64 next_pending_ack_seqno_;
+
+  /* Estimated memory used by |pending_acks_| and |pending_ack_order_|,
+   * maintained as entries are added and removed.
+   */
+  int64 pending_acks_memory_usage_;
+
+  DISALLOW_COPY_AND_ASSIGN(InvalidationLatencyTracker);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_INVALIDATION_LATENCY_TRACKER_H_
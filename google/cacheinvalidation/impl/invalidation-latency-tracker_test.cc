@@ -0,0 +1,158 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the InvalidationLatencyTracker class.
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/impl/invalidation-latency-tracker.h"
+
+namespace invalidation {
+
+class InvalidationLatencyTrackerTest : public testing::Test {
+ public:
+  /* Returns an invalidation of object |name| of |source| at |version|. */
+  static InvalidationP MakeInvalidation(int source, const string& name,
+                                        int64 version) {
+    InvalidationP invalidation;
+    invalidation.mutable_object_id()->set_source(source);
+    invalidation.mutable_object_id()->set_name(name);
+    invalidation.set_is_known_version(true);
+    invalidation.set_version(version);
+    return invalidation;
+  }
+
+  /* Returns the client time |ms| milliseconds after the epoch. */
+  static Time AtMs(int64 ms) {
+    return Time() + TimeDelta::FromMilliseconds(ms);
+  }
+};
+
+/* Tests that delivery latencies are relative to the fastest delivery and that
+ * processing latencies span from receipt to ack.
+ */
+TEST_F(InvalidationLatencyTrackerTest, RecordsLatencies) {
+  InvalidationLatencyTracker tracker(10, 10);
+
+  // The client clock is 5 s ahead of the server clock.
+  tracker.RecordDelivery(MakeInvalidation(4, "a", 1), 1000, AtMs(6030));
+  tracker.RecordDelivery(MakeInvalidation(4, "b", 1), 2000, AtMs(7010));
+  tracker.RecordDelivery(MakeInvalidation(4, "c", 1), 3000, AtMs(8050));
+  EXPECT_EQ(3, tracker.delivery_latency().count());
+  EXPECT_EQ(40, tracker.delivery_latency().max().InMilliseconds());
+
+  tracker.RecordAck(MakeInvalidation(4, "a", 1), AtMs(6130));
+  tracker.RecordAck(MakeInvalidation(4, "a", 1), AtMs(6230));  // Duplicate.
+  tracker.RecordAck(MakeInvalidation(4, "b", 2), AtMs(7110));  // Unknown.
+  EXPECT_EQ(1, tracker.processing_latency().count());
+  EXPECT_EQ(100, tracker.processing_latency().max().InMilliseconds());
+
+  const InvalidationLatencyTracker::SourceLatencies* source =
+      tracker.GetSourceLatencies(4);
+  ASSERT_TRUE(source != NULL);
+  EXPECT_EQ(3, source->count);
+  EXPECT_EQ(1, source->processing.count());
+
+  vector<pair<string, int> > statistics;
+  tracker.GetStatistics(&statistics);
+  bool found = false;
+  const string name = "InvalidationLatency.source_4.PROCESSING.max_us";
+  for (size_t i = 0; i < statistics.size(); ++i) {
+    if (statistics[i].first == name) {
+      EXPECT_EQ(100000, statistics[i].second);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+}
+
+/* Tests that a new source replaces the one with the fewest invalidations when
+ * all the slots are taken.
+ */
+TEST_F(InvalidationLatencyTrackerTest, KeepsHeavySources) {
+  InvalidationLatencyTracker tracker(2, 10);
+  for (int i = 0; i < 3; ++i) {
+    tracker.RecordDelivery(MakeInvalidation(1, "a", i), 0, AtMs(0));
+  }
+  tracker.RecordDelivery(MakeInvalidation(2, "a", 1), 0, AtMs(0));
+  tracker.RecordDelivery(MakeInvalidation(3, "a", 1), 0, AtMs(0));
+  EXPECT_TRUE(tracker.GetSourceLatencies(1) != NULL);
+  EXPECT_TRUE(tracker.GetSourceLatencies(2) == NULL);
+  ASSERT_TRUE(tracker.GetSourceLatencies(3) != NULL);
+  EXPECT_EQ(2, tracker.GetSourceLatencies(3)->count);
+  EXPECT_EQ(5, tracker.delivery_latency().count());
+}
+
+/* Tests that, past the limit of pending acks, the oldest unacked invalidation
+ * stops being tracked, so that new ones are still measured.
+ */
+TEST_F(InvalidationLatencyTrackerTest, EvictsOldestPendingAck) {
+  InvalidationLatencyTracker tracker(10, 2);
+  tracker.RecordDelivery(MakeInvalidation(4, "a", 1), 0, AtMs(0));
+  tracker.RecordDelivery(MakeInvalidation(4, "b", 1), 0, AtMs(10));
+  for (int i = 0; i < 5; ++i) {
+    tracker.RecordDelivery(MakeInvalidation(4, "unacked", i), 0,
+                           AtMs(30 + i));
+  }
+  tracker.RecordDelivery(MakeInvalidation(4, "c", 1), 0, AtMs(100));
+  EXPECT_EQ(2, tracker.num_pending_acks());
+
+  tracker.RecordAck(MakeInvalidation(4, "a", 1), AtMs(200));  // Evicted.
+  tracker.RecordAck(MakeInvalidation(4, "b", 1), AtMs(200));  // Evicted.
+  EXPECT_EQ(0, tracker.processing_latency().count());
+  tracker.RecordAck(MakeInvalidation(4, "c", 1), AtMs(150));
+  EXPECT_EQ(1, tracker.processing_latency().count());
+  EXPECT_EQ(50, tracker.processing_latency().max().InMilliseconds());
+  EXPECT_EQ(1, tracker.num_pending_acks());
+}
+
+/* Tests that a redelivered invalidation is not evicted before older ones. */
+TEST_F(InvalidationLatencyTrackerTest, RedeliveryRefreshesPendingAck) {
+  InvalidationLatencyTracker tracker(10, 2);
+  tracker.RecordDelivery(MakeInvalidation(4, "a", 1), 0, AtMs(0));
+  tracker.RecordDelivery(MakeInvalidation(4, "b", 1), 0, AtMs(10));
+  tracker.RecordDelivery(MakeInvalidation(4, "a", 1), 0, AtMs(20));
+  tracker.RecordDelivery(MakeInvalidation(4, "c", 1), 0, AtMs(30));
+
+  tracker.RecordAck(MakeInvalidation(4, "b", 1), AtMs(100));  // Evicted.
+  EXPECT_EQ(0, tracker.processing_latency().count());
+  tracker.RecordAck(MakeInvalidation(4, "a", 1), AtMs(100));
+  EXPECT_EQ(1, tracker.processing_latency().count());
+  EXPECT_EQ(80, tracker.processing_latency().max().InMilliseconds());
+}
+
+/* Tests that the memory of the pending acks is accounted for until they are
+ * acked or evicted.
+ */
+TEST_F(InvalidationLatencyTrackerTest, AccountsForMemoryUsage) {
+  InvalidationLatencyTracker tracker(10, 2);
+  tracker.RecordDelivery(MakeInvalidation(4, "a", 1), 0, AtMs(0));
+  tracker.RecordAck(MakeInvalidation(4, "a", 1), AtMs(10));
+  int64 source_memory_usage = tracker.GetMemoryUsage();
+  EXPECT_GT(source_memory_usage, 0);
+
+  tracker.RecordDelivery(MakeInvalidation(4, "b", 1), 0, AtMs(20));
+  int64 pending_ack_memory_usage =
+      tracker.GetMemoryUsage() - source_memory_usage;
+  EXPECT_GT(pending_ack_memory_usage, 0);
+  tracker.RecordDelivery(MakeInvalidation(4, "c", 1), 0, AtMs(30));
+  tracker.RecordDelivery(MakeInvalidation(4, "d", 1), 0, AtMs(40));
+  EXPECT_EQ(source_memory_usage + 2 * pending_ack_memory_usage,
+            tracker.GetMemoryUsage());
+
+  tracker.RecordAck(MakeInvalidation(4, "c", 1), AtMs(50));
+  tracker.RecordAck(MakeInvalidation(4, "d", 1), AtMs(50));
+  EXPECT_EQ(source_memory_usage, tracker.GetMemoryUsage());
+}
+
+}  // namespace invalidation
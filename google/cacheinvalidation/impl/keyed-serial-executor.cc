@@ -0,0 +1,151 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An executor that runs tasks for different object ids in parallel on a pool
+// of workers while preserving the order of the tasks for any one object id.
+
+#include "google/cacheinvalidation/impl/keyed-serial-executor.h"
+
+#include "google/cacheinvalidation/deps/logging.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+KeyedSerialExecutor::KeyedSerialExecutor(const vector<Scheduler*>& workers)
+    : workers_(workers), lane_busy_(workers.size(), false),
+      num_busy_lanes_(0), barrier_running_(false) {
+  CHECK(!workers_.empty()) << "Need at least one worker";
+  segments_.push_back(new Segment(workers_.size()));
+}
+
+KeyedSerialExecutor::~KeyedSerialExecutor() {
+  for (size_t i = 0; i < segments_.size(); ++i) {
+    Segment* segment = segments_[i];
+    for (size_t lane = 0; lane < segment->lanes.size(); ++lane) {
+      for (size_t j = 0; j < segment->lanes[lane].size(); ++j) {
+        delete segment->lanes[lane][j];
+      }
+    }
+    delete segment->barrier;
+    delete segment;
+  }
+}
+
+size_t KeyedSerialExecutor::GetLane(const ObjectId& key) {
+  // FNV-1a over the source and the name.
+  uint32 hash = 2166136261u;
+  hash = (hash ^ static_cast<uint32>(key.source())) * 16777619u;
+  const string& name = key.name();
+  for (size_t i = 0; i < name.size(); ++i) {
+    hash = (hash ^ static_cast<uint8>(name[i])) * 16777619u;
+  }
+  return hash % workers_.size();
+}
+
+KeyedSerialExecutor::Segment* KeyedSerialExecutor::GetOpenSegment() {
+  if (segments_.back()->barrier != NULL) {
+    segments_.push_back(new Segment(workers_.size()));
+  }
+  return segments_.back();
+}
+
+void KeyedSerialExecutor::ScheduleKeyed(const ObjectId& key, Closure* task) {
+  vector<Dispatch> dispatches;
+  {
+    MutexLock m(&lock_);
+    Segment* segment = GetOpenSegment();
+    segment->lanes[GetLane(key)].push_back(task);
+    ++segment->num_queued;
+    CollectReadyTasks(&dispatches);
+  }
+  RunDispatches(dispatches);
+}
+
+void KeyedSerialExecutor::ScheduleBarrier(Closure* task) {
+  vector<Dispatch> dispatches;
+  {
+    MutexLock m(&lock_);
+    GetOpenSegment()->barrier = task;
+    CollectReadyTasks(&dispatches);
+  }
+  RunDispatches(dispatches);
+}
+
+void KeyedSerialExecutor::CollectReadyTasks(vector<Dispatch>* dispatches) {
+  if (barrier_running_) {
+    return;
+  }
+  Segment* segment = segments_.front();
+
+  // Start the head task of every idle lane.
+  for (size_t lane = 0; lane < segment->lanes.size(); ++lane) {
+    if (!lane_busy_[lane] && !segment->lanes[lane].empty()) {
+      Closure* task = segment->lanes[lane].front();
+      segment->lanes[lane].pop_front();
+      --segment->num_queued;
+      lane_busy_[lane] = true;
+      ++num_busy_lanes_;
+      dispatches->push_back(make_pair(workers_[lane], NewPermanentCallback(
+          this, &KeyedSerialExecutor::RunKeyedTask, lane, task)));
+    }
+  }
+
+  // Once everything before the barrier has completed, run the barrier and
+  // retire the segment. The next segment starts when the barrier completes.
+  if ((segment->barrier != NULL) && (segment->num_queued == 0) &&
+      (num_busy_lanes_ == 0)) {
+    barrier_running_ = true;
+    dispatches->push_back(make_pair(workers_[0], NewPermanentCallback(
+        this, &KeyedSerialExecutor::RunBarrier, segment->barrier)));
+    segments_.pop_front();
+    delete segment;
+    if (segments_.empty()) {
+      segments_.push_back(new Segment(workers_.size()));
+    }
+  }
+}
+
+void KeyedSerialExecutor::RunDispatches(const vector<Dispatch>& dispatches) {
+  for (size_t i = 0; i < dispatches.size(); ++i) {
+    dispatches[i].first->Schedule(Scheduler::NoDelay(), dispatches[i].second);
+  }
+}
+
+void KeyedSerialExecutor::RunKeyedTask(size_t lane, Closure* task) {
+  task->Run();
+  delete task;
+  vector<Dispatch> dispatches;
+  {
+    MutexLock m(&lock_);
+    lane_busy_[lane] = false;
+    --num_busy_lanes_;
+    CollectReadyTasks(&dispatches);
+  }
+  RunDispatches(dispatches);
+}
+
+void KeyedSerialExecutor::RunBarrier(Closure* task) {
+  task->Run();
+  delete task;
+  vector<Dispatch> dispatches;
+  {
+    MutexLock m(&lock_);
+    barrier_running_ = false;
+    CollectReadyTasks(&dispatches);
+  }
+  RunDispatches(dispatches);
+}
+
+}  // namespace invalidation
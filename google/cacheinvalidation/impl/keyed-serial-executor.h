@@ -0,0 +1,154 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An executor that runs tasks for different object ids in parallel on a pool
+// of workers while preserving the order of the tasks for any one object id.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_KEYED_SERIAL_EXECUTOR_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_KEYED_SERIAL_EXECUTOR_H_
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::deque;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// Tasks are partitioned by object id into one lane per worker; a lane has at
+// most one task running at any time, so the tasks for an object id run in the
+// order in which they were scheduled while different lanes proceed in
+// parallel.
+//
+// Lanes are chosen by hashing the object id, so unrelated objects that hash
+// to the same lane also run one at a time: a slow task delays the tasks
+// queued behind it for every object of its lane, not just its own. The
+// throughput is thus bounded by the busiest lane, and a workload dominated by
+// a few hot objects gains little from more workers.
+//
+// A barrier task runs only after every task scheduled before it has
+// completed, and no task scheduled after it starts until the barrier has
+// completed. This is used for upcalls such as Ready or InvalidateAll whose
+// effects span all objects.
+//
+// This class is thread-safe.
+class KeyedSerialExecutor {
+ public:
+  /* Creates an executor that runs tasks on |workers|. Each worker must run
+   * the tasks given to it one at a time (e.g., a single-threaded scheduler),
+   * and throughput scales with the number of workers.
+   *
+   * Space for the workers is owned by the caller.
+   */
+  explicit KeyedSerialExecutor(const vector<Scheduler*>& workers);
+
+  /* Deletes the tasks that have not been handed to a worker yet.
+   *
+   * REQUIRES: No task handed to a worker is still pending.
+   */
+  ~KeyedSerialExecutor();
+
+  /* Schedules |task| to run after all the tasks previously scheduled for
+   * |key| and after all previously scheduled barriers. Space for |task| is
+   * owned by the callee.
+   */
+  void ScheduleKeyed(const ObjectId& key, Closure* task);
+
+  /* Schedules |task| to run after all previously scheduled tasks and before
+   * any task scheduled afterwards. Space for |task| is owned by the callee.
+   */
+  void ScheduleBarrier(Closure* task);
+
+ private:
+  /* The tasks scheduled between two consecutive barriers, followed by the
+   * barrier that closes them (NULL if no barrier has been scheduled yet).
+   */
+  struct Segment {
+    explicit Segment(size_t num_lanes)
+        : lanes(num_lanes), num_queued(0), barrier(NULL) {}
+
+    /* Tasks waiting to be handed to a worker, per lane. */
+    vector<deque<Closure*> > lanes;
+
+    /* Number of tasks in all the lanes. */
+    int num_queued;
+
+    /* The barrier closing this segment. */
+    Closure* barrier;
+  };
+
+  /* A task ready to be handed to a worker. */
+  typedef pair<Scheduler*, Closure*> Dispatch;
+
+  /* Returns the lane on which the tasks for |key| run. */
+  size_t GetLane(const ObjectId& key);
+
+  /* Returns the segment to which new tasks are added.
+   *
+   * REQUIRES: |lock_| is held.
+   */
+  Segment* GetOpenSegment();
+
+  /* Moves every task that can start now to |dispatches|.
+   *
+   * REQUIRES: |lock_| is held.
+   */
+  void CollectReadyTasks(vector<Dispatch>* dispatches);
+
+  /* Hands the |dispatches| to their workers.
+   *
+   * REQUIRES: |lock_| is not held, since a worker may run tasks inline.
+   */
+  static void RunDispatches(const vector<Dispatch>& dispatches);
+
+  /* Runs |task| on the worker of |lane| and starts the tasks it unblocks. */
+  void RunKeyedTask(size_t lane, Closure* task);
+
+  /* Runs the barrier |task| and starts the tasks it unblocks. */
+  void RunBarrier(Closure* task);
+
+  /* The workers on which the tasks are run, one per lane. */
+  vector<Scheduler*> workers_;
+
+  /* Protects all the fields below. */
+  Mutex lock_;
+
+  /* Segments in scheduling order; only the first one may have tasks running.
+   * Never empty.
+   */
+  deque<Segment*> segments_;
+
+  /* Whether a task from each lane is running on its worker. */
+  vector<bool> lane_busy_;
+
+  /* Number of lanes that have a task running. */
+  int num_busy_lanes_;
+
+  /* Whether a barrier is running. */
+  bool barrier_running_;
+
+  DISALLOW_COPY_AND_ASSIGN(KeyedSerialExecutor);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_KEYED_SERIAL_EXECUTOR_H_
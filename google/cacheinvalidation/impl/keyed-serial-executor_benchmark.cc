@@ -0,0 +1,215 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Throughput benchmark of the KeyedSerialExecutor: runs a burst of
+// invalidation-like tasks over many objects on pools of worker threads of
+// increasing size, to show how upcall throughput scales with cores.
+
+#include <pthread.h>
+
+#include <deque>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/benchmark.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/keyed-serial-executor.h"
+
+namespace invalidation {
+
+/* Number of tasks run per iteration of the benchmark. */
+static const int kNumTasks = 10000;
+
+/* Number of SHA-1 digests computed by each task, standing for the
+ * application's work on an invalidation (a few microseconds).
+ */
+static const int kDigestsPerTask = 20;
+
+// A scheduler running its tasks one at a time, in order, on its own thread.
+// Delays are not supported: the executor only schedules tasks to run now.
+class ThreadScheduler : public Scheduler {
+ public:
+  ThreadScheduler() : stopping_(false) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    CHECK(pthread_create(&thread_, NULL, &ThreadScheduler::RunThread,
+                         this) == 0);
+  }
+
+  virtual ~ThreadScheduler() {
+    pthread_mutex_lock(&lock_);
+    stopping_ = true;
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+    pthread_join(thread_, NULL);
+    for (size_t i = 0; i < tasks_.size(); ++i) {
+      delete tasks_[i];
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  virtual void Schedule(TimeDelta delay, Closure* task) {
+    CHECK(delay == Scheduler::NoDelay()) << "Delays are not supported";
+    pthread_mutex_lock(&lock_);
+    tasks_.push_back(task);
+    pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&lock_);
+  }
+
+  virtual bool IsRunningOnThread() const {
+    return pthread_equal(pthread_self(), thread_);
+  }
+
+  virtual Time GetCurrentTime() const {
+    return Time::Now();
+  }
+
+  virtual void SetSystemResources(SystemResources* resources) {
+    // Nothing to do.
+  }
+
+ private:
+  static void* RunThread(void* arg) {
+    reinterpret_cast<ThreadScheduler*>(arg)->RunTasks();
+    return NULL;
+  }
+
+  /* Runs the tasks as they are scheduled, until the scheduler is deleted. */
+  void RunTasks() {
+    pthread_mutex_lock(&lock_);
+    while (true) {
+      while (!stopping_ && tasks_.empty()) {
+        pthread_cond_wait(&cond_, &lock_);
+      }
+      if (stopping_) {
+        break;
+      }
+      Closure* task = tasks_.front();
+      tasks_.pop_front();
+      pthread_mutex_unlock(&lock_);
+      task->Run();
+      delete task;
+      pthread_mutex_lock(&lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  pthread_t thread_;
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+  std::deque<Closure*> tasks_;
+  bool stopping_;
+};
+
+// Counts the completed tasks and lets the benchmark wait for all of them.
+class CompletionCounter {
+ public:
+  CompletionCounter() : remaining_(0) {
+    pthread_mutex_init(&lock_, NULL);
+    pthread_cond_init(&cond_, NULL);
+  }
+
+  ~CompletionCounter() {
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&lock_);
+  }
+
+  void Reset(int count) {
+    pthread_mutex_lock(&lock_);
+    remaining_ = count;
+    pthread_mutex_unlock(&lock_);
+  }
+
+  /* Does the work of one task, then counts it as completed. */
+  void RunTask() {
+    Sha1DigestFunction digest_fn;
+    for (int i = 0; i < kDigestsPerTask; ++i) {
+      digest_fn.Reset();
+      digest_fn.Update("invalidation payload");
+      digest_fn.GetDigest();
+    }
+    pthread_mutex_lock(&lock_);
+    if (--remaining_ == 0) {
+      pthread_cond_signal(&cond_);
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+  void Wait() {
+    pthread_mutex_lock(&lock_);
+    while (remaining_ > 0) {
+      pthread_cond_wait(&cond_, &lock_);
+    }
+    pthread_mutex_unlock(&lock_);
+  }
+
+ private:
+  pthread_mutex_t lock_;
+  pthread_cond_t cond_;
+  int remaining_;
+};
+
+/* Runs kNumTasks tasks spread over as many objects as the second argument on
+ * as many workers as the first argument.
+ */
+static void BM_KeyedSerialExecutorThroughput(benchmark::State& state) {
+  int num_workers = state.range(0);
+  int num_objects = state.range(1);
+  vector<ThreadScheduler*> workers;
+  vector<Scheduler*> worker_ptrs;
+  for (int i = 0; i < num_workers; ++i) {
+    workers.push_back(new ThreadScheduler());
+    worker_ptrs.push_back(workers.back());
+  }
+  vector<ObjectId> object_ids;
+  for (int i = 0; i < num_objects; ++i) {
+    object_ids.push_back(ObjectId(4, StringPrintf("oid%d", i)));
+  }
+  CompletionCounter counter;
+  scoped_ptr<KeyedSerialExecutor> executor(
+      new KeyedSerialExecutor(worker_ptrs));
+  while (state.KeepRunning()) {
+    counter.Reset(kNumTasks);
+    for (int i = 0; i < kNumTasks; ++i) {
+      executor->ScheduleKeyed(object_ids[i % num_objects],
+          NewPermanentCallback(&counter, &CompletionCounter::RunTask));
+    }
+    counter.Wait();
+  }
+
+  // The workers may still be returning from their last task into the
+  // executor: stop them first.
+  for (size_t i = 0; i < workers.size(); ++i) {
+    delete workers[i];
+  }
+  executor.reset();
+  state.SetItemsProcessed(static_cast<int64>(state.iterations()) * kNumTasks);
+}
+BENCHMARK(BM_KeyedSerialExecutorThroughput)
+    ->ArgPair(1, 1000)
+    ->ArgPair(2, 1000)
+    ->ArgPair(4, 1000)
+    ->ArgPair(8, 1000)
+    ->ArgPair(8, 1)
+    ->UseRealTime();
+
+}  // namespace invalidation
+
+BENCHMARK_MAIN();
@@ -0,0 +1,130 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the KeyedSerialExecutor class.
+
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/keyed-serial-executor.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+
+namespace invalidation {
+
+class KeyedSerialExecutorTest : public testing::Test {
+ public:
+  static const int kNumWorkers = 2;
+
+  virtual void SetUp() {
+    logger.reset(new TestLogger());
+    vector<Scheduler*> worker_ptrs;
+    for (int i = 0; i < kNumWorkers; ++i) {
+      workers[i].reset(new SimpleDeterministicScheduler(logger.get()));
+      workers[i]->StartScheduler();
+      worker_ptrs.push_back(workers[i].get());
+    }
+    executor.reset(new KeyedSerialExecutor(worker_ptrs));
+    runs.clear();
+  }
+
+  /* Records that the task with the given label ran. */
+  void RecordRun(string label) {
+    runs.push_back(label);
+  }
+
+  /* Schedules a task labeled |label| for the object named |name|. */
+  void ScheduleKeyed(const string& name, const string& label) {
+    ObjectId object_id(4, name);
+    executor->ScheduleKeyed(object_id,
+        NewPermanentCallback(this, &KeyedSerialExecutorTest::RecordRun,
+                             label));
+  }
+
+  /* Schedules a barrier labeled |label|. */
+  void ScheduleBarrier(const string& label) {
+    executor->ScheduleBarrier(
+        NewPermanentCallback(this, &KeyedSerialExecutorTest::RecordRun,
+                             label));
+  }
+
+  /* Lets the workers run in reverse order until all tasks have run. */
+  void RunWorkers() {
+    for (int round = 0; round < 10; ++round) {
+      for (int i = kNumWorkers - 1; i >= 0; --i) {
+        workers[i]->PassTime(TimeDelta::FromMilliseconds(10));
+      }
+    }
+  }
+
+  /* Returns the position of |label| in the run order, or -1. */
+  int RunIndex(const string& label) {
+    for (size_t i = 0; i < runs.size(); ++i) {
+      if (runs[i] == label) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  scoped_ptr<Logger> logger;
+  scoped_ptr<DeterministicScheduler> workers[kNumWorkers];
+  scoped_ptr<KeyedSerialExecutor> executor;
+  vector<string> runs;
+};
+
+/* Tests that tasks for the same object run in scheduling order. */
+TEST_F(KeyedSerialExecutorTest, PerKeyOrder) {
+  for (int i = 0; i < 5; ++i) {
+    ScheduleKeyed("a", "a" + SimpleItoa(i));
+    ScheduleKeyed("b", "b" + SimpleItoa(i));
+    ScheduleKeyed("c", "c" + SimpleItoa(i));
+  }
+  RunWorkers();
+  ASSERT_EQ(15, static_cast<int>(runs.size()));
+  const char* names[] = {"a", "b", "c"};
+  for (int n = 0; n < 3; ++n) {
+    for (int i = 1; i < 5; ++i) {
+      string name(names[n]);
+      EXPECT_LT(RunIndex(name + SimpleItoa(i - 1)),
+                RunIndex(name + SimpleItoa(i)));
+    }
+  }
+}
+
+/* Tests that a barrier runs after all earlier tasks and before all later
+ * ones, even if the later ones are on an idle worker.
+ */
+TEST_F(KeyedSerialExecutorTest, BarrierOrder) {
+  ScheduleKeyed("a", "a0");
+  ScheduleKeyed("b", "b0");
+  ScheduleKeyed("c", "c0");
+  ScheduleBarrier("barrier");
+  ScheduleKeyed("a", "a1");
+  ScheduleKeyed("b", "b1");
+  ScheduleKeyed("c", "c1");
+  RunWorkers();
+  ASSERT_EQ(7, static_cast<int>(runs.size()));
+  int barrier_index = RunIndex("barrier");
+  EXPECT_EQ(3, barrier_index);
+  EXPECT_LT(RunIndex("a0"), barrier_index);
+  EXPECT_LT(RunIndex("b0"), barrier_index);
+  EXPECT_LT(RunIndex("c0"), barrier_index);
+  EXPECT_GT(RunIndex("a1"), barrier_index);
+  EXPECT_GT(RunIndex("b1"), barrier_index);
+  EXPECT_GT(RunIndex("c1"), barrier_index);
+}
+
+}  // namespace invalidation
@@ -0,0 +1,136 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A fixed-size histogram of latencies with log-linear buckets.
+
+#include "google/cacheinvalidation/impl/latency-histogram.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+const int LatencyHistogram::kSubBucketBits;
+const int LatencyHistogram::kSubBuckets;
+const int LatencyHistogram::kMaxValueBits;
+const int LatencyHistogram::kNumBuckets;
+
+LatencyHistogram::LatencyHistogram()
+    : count_(0), total_us_(0), max_us_(0) {
+  for (int i = 0; i < kNumBuckets; ++i) {
+    buckets_[i] = 0;
+  }
+}
+
+void LatencyHistogram::Record(TimeDelta latency) {
+  int64 value_us = latency.InMicroseconds();
+  if (value_us < 0) {
+    value_us = 0;
+  }
+  ++buckets_[GetBucket(value_us)];
+  ++count_;
+  total_us_ += value_us;
+  if (value_us > max_us_) {
+    max_us_ = value_us;
+  }
+}
+
+TimeDelta LatencyHistogram::GetPercentile(int percentile) const {
+  if (count_ == 0) {
+    return TimeDelta::FromMicroseconds(0);
+  }
+  // Rank (1-based) of the latency at the percentile.
+  int64 rank = (count_ * percentile + 99) / 100;
+  if (rank < 1) {
+    rank = 1;
+  }
+  int64 seen = 0;
+  for (int i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i];
+    if (seen >= rank) {
+      int64 upper_bound_us = GetBucketUpperBoundUs(i);
+      return TimeDelta::FromMicroseconds(
+          upper_bound_us < max_us_ ? upper_bound_us : max_us_);
+    }
+  }
+  return max();
+}
+
+void LatencyHistogram::GetSummary(const string& prefix,
+    vector<pair<string, int> >* summary) const {
+  summary->push_back(make_pair(prefix + "count", static_cast<int>(count_)));
+  summary->push_back(make_pair(prefix + "mean_us",
+      static_cast<int>(mean().InMicroseconds())));
+  summary->push_back(make_pair(prefix + "p50_us",
+      static_cast<int>(GetPercentile(50).InMicroseconds())));
+  summary->push_back(make_pair(prefix + "p99_us",
+      static_cast<int>(GetPercentile(99).InMicroseconds())));
+  summary->push_back(make_pair(prefix + "max_us",
+      static_cast<int>(max().InMicroseconds())));
+}
+
+int LatencyHistogram::GetBucket(int64 value_us) {
+  if (value_us < kSubBuckets) {
+    return static_cast<int>(value_us);
+  }
+  // Position of the highest bit set.
+  int high_bit = 0;
+  for (int64 v = value_us; v > 1; v >>= 1) {
+    ++high_bit;
+  }
+  if (high_bit >= kMaxValueBits) {
+    return kNumBuckets - 1;
+  }
+  // The bits below the highest one select the linear bucket.
+  int shift = high_bit - kSubBucketBits;
+  return (shift + 1) * kSubBuckets +
+      static_cast<int>((value_us >> shift) - kSubBuckets);
+}
+
+AtomicLatencyHistogram::AtomicLatencyHistogram() {
+}
+
+void AtomicLatencyHistogram::Record(TimeDelta latency) {
+  int64 value_us = latency.InMicroseconds();
+  if (value_us < 0) {
+    value_us = 0;
+  }
+  buckets_[LatencyHistogram::GetBucket(value_us)].Increment(1);
+  count_.Increment(1);
+  total_us_.Increment(value_us);
+  max_us_.StoreMax(value_us);
+}
+
+void AtomicLatencyHistogram::GetSnapshot(LatencyHistogram* histogram) const {
+  // Sum the buckets rather than reading |count_|, so that the percentiles of
+  // the snapshot are consistent with its count.
+  histogram->count_ = 0;
+  for (int i = 0; i < LatencyHistogram::kNumBuckets; ++i) {
+    histogram->buckets_[i] = buckets_[i].Load();
+    histogram->count_ += histogram->buckets_[i];
+  }
+  histogram->total_us_ = total_us_.Load();
+  histogram->max_us_ = max_us_.Load();
+}
+
+int64 LatencyHistogram::GetBucketUpperBoundUs(int bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int shift = bucket / kSubBuckets - 1;
+  int64 lower_bound_us =
+      static_cast<int64>(kSubBuckets + bucket % kSubBuckets) << shift;
+  return lower_bound_us + (static_cast<int64>(1) << shift) - 1;
+}
+
+}  // namespace invalidation
@@ -0,0 +1,148 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A fixed-size histogram of latencies with log-linear buckets.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_LATENCY_HISTOGRAM_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_LATENCY_HISTOGRAM_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/atomic-int64.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// Counts latencies in buckets whose width doubles with every power of two
+// microseconds, each power of two being split into kSubBuckets linear buckets,
+// so that the relative error of a bucket is bounded by 1 / kSubBuckets.
+// Latencies under kSubBuckets microseconds each get their own bucket, and
+// latencies of 2^kMaxValueBits microseconds (over an hour) or more all fall
+// in the last one.
+//
+// Recording neither allocates nor takes locks. This class is not thread-safe;
+// see AtomicLatencyHistogram below for a thread-safe one.
+class LatencyHistogram {
+ public:
+  /* Log2 of the number of linear buckets per power of two. */
+  static const int kSubBucketBits = 2;
+
+  /* Number of linear buckets per power of two. */
+  static const int kSubBuckets = 1 << kSubBucketBits;
+
+  /* Number of bits of the largest latency counted precisely, in
+   * microseconds.
+   */
+  static const int kMaxValueBits = 32;
+
+  /* Number of buckets. */
+  static const int kNumBuckets =
+      (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets;
+
+  LatencyHistogram();
+
+  /* Records |latency|. Negative latencies are recorded as zero. */
+  void Record(TimeDelta latency);
+
+  /* Returns the number of latencies recorded. */
+  int64 count() const {
+    return count_;
+  }
+
+  /* Returns the largest latency recorded, or zero if none. */
+  TimeDelta max() const {
+    return TimeDelta::FromMicroseconds(max_us_);
+  }
+
+  /* Returns the mean of the latencies recorded, or zero if none. */
+  TimeDelta mean() const {
+    return TimeDelta::FromMicroseconds(
+        count_ == 0 ? 0 : total_us_ / count_);
+  }
+
+  /* Returns an upper bound of the |percentile|-th percentile (between 0 and
+   * 100) of the latencies recorded: the upper end of the bucket holding it,
+   * but no more than the largest latency. Returns zero if none.
+   */
+  TimeDelta GetPercentile(int percentile) const;
+
+  /* Appends to |summary| the number of latencies recorded, their mean, 50th
+   * and 99th percentiles and maximum in microseconds, named |prefix| followed
+   * by "count", "mean_us", "p50_us", "p99_us" and "max_us".
+   */
+  void GetSummary(const string& prefix,
+                  vector<pair<string, int> >* summary) const;
+
+  /* Returns the bucket of a latency of |value_us| microseconds. */
+  static int GetBucket(int64 value_us);
+
+  /* Returns the largest latency in |bucket|, in microseconds. */
+  static int64 GetBucketUpperBoundUs(int bucket);
+
+ private:
+  friend class AtomicLatencyHistogram;
+
+  /* Number of latencies recorded in each bucket. */
+  int64 buckets_[kNumBuckets];
+
+  /* Number of latencies recorded. */
+  int64 count_;
+
+  /* Sum of the latencies recorded, in microseconds. */
+  int64 total_us_;
+
+  /* Largest latency recorded, in microseconds. */
+  int64 max_us_;
+};
+
+// A LatencyHistogram whose counts are relaxed 64-bit atomic integers, so that
+// latencies may be recorded on any thread, without locks where the platform
+// has 64-bit atomic operations. Reading takes a snapshot, which may miss some
+// of the latencies being recorded concurrently.
+class AtomicLatencyHistogram {
+ public:
+  AtomicLatencyHistogram();
+
+  /* Records |latency|. Negative latencies are recorded as zero. */
+  void Record(TimeDelta latency);
+
+  /* Stores the latencies recorded so far in |histogram|. */
+  void GetSnapshot(LatencyHistogram* histogram) const;
+
+ private:
+  /* Number of latencies recorded in each bucket. */
+  AtomicInt64 buckets_[LatencyHistogram::kNumBuckets];
+
+  /* Number of latencies recorded. */
+  AtomicInt64 count_;
+
+  /* Sum of the latencies recorded, in microseconds. */
+  AtomicInt64 total_us_;
+
+  /* Largest latency recorded, in microseconds. */
+  AtomicInt64 max_us_;
+
+  DISALLOW_COPY_AND_ASSIGN(AtomicLatencyHistogram);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_LATENCY_HISTOGRAM_H_
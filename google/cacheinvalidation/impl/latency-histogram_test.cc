@@ -0,0 +1,103 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the LatencyHistogram class.
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/impl/latency-histogram.h"
+
+namespace invalidation {
+
+/* Tests that every latency falls in a bucket whose bounds contain it, with a
+ * relative error bounded by the number of linear buckets per power of two.
+ */
+TEST(LatencyHistogramTest, BucketBounds) {
+  int64 values[] = {0, 1, 3, 4, 7, 8, 9, 1000, 65535, 65536, 123456789,
+                    (static_cast<int64>(1) << 32) - 1};
+  int previous_bucket = -1;
+  for (size_t i = 0; i < arraysize(values); ++i) {
+    int bucket = LatencyHistogram::GetBucket(values[i]);
+    EXPECT_LE(previous_bucket, bucket);
+    EXPECT_LT(bucket, LatencyHistogram::kNumBuckets);
+    int64 upper_bound_us = LatencyHistogram::GetBucketUpperBoundUs(bucket);
+    EXPECT_LE(values[i], upper_bound_us);
+    EXPECT_LE(upper_bound_us - values[i],
+              values[i] / LatencyHistogram::kSubBuckets);
+    if (bucket > 0) {
+      EXPECT_GT(values[i], LatencyHistogram::GetBucketUpperBoundUs(bucket - 1));
+    }
+    previous_bucket = bucket;
+  }
+  EXPECT_EQ(LatencyHistogram::kNumBuckets - 1,
+            LatencyHistogram::GetBucket(static_cast<int64>(1) << 40));
+}
+
+/* Tests the summary of the recorded latencies. */
+TEST(LatencyHistogramTest, Summary) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0, histogram.count());
+  EXPECT_EQ(0, histogram.GetPercentile(50).InMicroseconds());
+
+  // 98 latencies of 100 us, one of 1000 us and one of 5000 us.
+  for (int i = 0; i < 98; ++i) {
+    histogram.Record(TimeDelta::FromMicroseconds(100));
+  }
+  histogram.Record(TimeDelta::FromMicroseconds(1000));
+  histogram.Record(TimeDelta::FromMicroseconds(5000));
+  EXPECT_EQ(100, histogram.count());
+  EXPECT_EQ(5000, histogram.max().InMicroseconds());
+  EXPECT_EQ(158, histogram.mean().InMicroseconds());
+
+  int64 p50_us = histogram.GetPercentile(50).InMicroseconds();
+  EXPECT_LE(100, p50_us);
+  EXPECT_GE(125, p50_us);
+  int64 p99_us = histogram.GetPercentile(99).InMicroseconds();
+  EXPECT_LE(1000, p99_us);
+  EXPECT_GE(1250, p99_us);
+  EXPECT_EQ(5000, histogram.GetPercentile(100).InMicroseconds());
+
+  // Negative latencies count as zero.
+  histogram.Record(TimeDelta::FromMicroseconds(-10));
+  EXPECT_EQ(101, histogram.count());
+  EXPECT_EQ(0, histogram.GetPercentile(0).InMicroseconds());
+}
+
+/* Tests that a snapshot of an atomic histogram matches a plain histogram
+ * recording the same latencies, including ones beyond 32 bits.
+ */
+TEST(LatencyHistogramTest, AtomicSnapshot) {
+  AtomicLatencyHistogram atomic_histogram;
+  LatencyHistogram expected;
+  LatencyHistogram snapshot;
+  atomic_histogram.GetSnapshot(&snapshot);
+  EXPECT_EQ(0, snapshot.count());
+
+  // The sum and maximum exceed 32 bits, which must not wrap around.
+  int64 values[] = {-10, 0, 100, 100, 1000, 5000, 123456789, 5000000000LL};
+  for (size_t i = 0; i < arraysize(values); ++i) {
+    atomic_histogram.Record(TimeDelta::FromMicroseconds(values[i]));
+    expected.Record(TimeDelta::FromMicroseconds(values[i]));
+  }
+  atomic_histogram.GetSnapshot(&snapshot);
+  EXPECT_EQ(expected.count(), snapshot.count());
+  EXPECT_EQ(expected.max().InMicroseconds(), snapshot.max().InMicroseconds());
+  EXPECT_EQ(expected.mean().InMicroseconds(),
+            snapshot.mean().InMicroseconds());
+  for (int percentile = 0; percentile <= 100; percentile += 10) {
+    EXPECT_EQ(expected.GetPercentile(percentile).InMicroseconds(),
+              snapshot.GetPercentile(percentile).InMicroseconds());
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,665 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A Storage implementation that keeps all keys in a single append-only log
+// file of checksummed records, memory-mapped for reads.
+
+#include "google/cacheinvalidation/impl/log-structured-storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/impl/log-macro.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+/* Magic string at the start of every log. */
+static const char kLogMagic[] = "TICLLOG1";
+static const size_t kLogMagicSize = sizeof(kLogMagic) - 1;
+
+/* Size of the fixed part of a record: crc, type, key and value lengths. */
+static const size_t kRecordHeaderSize = 13;
+
+/* Logs smaller than this are never compacted. */
+static const size_t kMinCompactionBytes = 64 * 1024;
+
+/* Mappings are at least this large, so that appends to a small log do not
+ * each need a new mapping.
+ */
+static const size_t kMinMappingBytes = 64 * 1024;
+
+/* Table for the CRC-32 (IEEE 802.3) of the records. */
+class Crc32Table {
+ public:
+  Crc32Table() {
+    for (uint32 i = 0; i < 256; ++i) {
+      uint32 crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc & 1) ? (0xEDB88320U ^ (crc >> 1)) : (crc >> 1);
+      }
+      entries_[i] = crc;
+    }
+  }
+
+  /* Returns the CRC-32 of the |size| bytes at |data|. */
+  uint32 Compute(const char* data, size_t size) const {
+    uint32 crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; ++i) {
+      crc = entries_[(crc ^ static_cast<uint8>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFU;
+  }
+
+ private:
+  uint32 entries_[256];
+};
+
+static const Crc32Table kCrc32Table;
+
+/* Appends |value| to |out| in little-endian order. */
+static void AppendUint32(uint32 value, string* out) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+/* Returns the little-endian integer at |data|. */
+static uint32 ReadUint32(const char* data) {
+  uint32 value = 0;
+  for (int i = 3; i >= 0; --i) {
+    value = (value << 8) | static_cast<uint8>(data[i]);
+  }
+  return value;
+}
+
+LogStructuredStorage::LogStructuredStorage(
+    const string& path, Scheduler* io_scheduler)
+    : path_(path),
+      io_scheduler_(io_scheduler),
+      commit_delay_(Scheduler::NoDelay()),
+      logger_(NULL),
+      fd_(-1),
+      file_size_(0),
+      mapped_data_(NULL),
+      mapped_size_(0),
+      live_bytes_(0),
+      sync_scheduled_(false),
+      compacting_(false) {
+}
+
+LogStructuredStorage::~LogStructuredStorage() {
+  vector<WriteKeyCallback*> writes;
+  vector<DeleteKeyCallback*> deletes;
+  bool synced = true;
+  {
+    MutexLock m(&lock_);
+    writes.swap(pending_writes_);
+    deletes.swap(pending_deletes_);
+    if (fd_ >= 0) {
+      synced = SyncLocked();
+      Unmap();
+      close(fd_);
+      fd_ = -1;
+    }
+  }
+  Status status = synced ? Status(Status::SUCCESS, "") :
+      Status(Status::TRANSIENT_FAILURE, "Sync failed");
+  for (size_t i = 0; i < writes.size(); ++i) {
+    writes[i]->Run(status);
+    delete writes[i];
+  }
+  for (size_t i = 0; i < deletes.size(); ++i) {
+    deletes[i]->Run(synced);
+    delete deletes[i];
+  }
+}
+
+Status LogStructuredStorage::Open() {
+  MutexLock m(&lock_);
+  CHECK(fd_ < 0) << "Already open: " << path_;
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ < 0) {
+    return Status(Status::PERMANENT_FAILURE,
+                  "Cannot open " + path_ + ": " + strerror(errno));
+  }
+  struct stat file_stat;
+  if (fstat(fd_, &file_stat) != 0) {
+    close(fd_);
+    fd_ = -1;
+    return Status(Status::PERMANENT_FAILURE, "Cannot stat " + path_);
+  }
+  size_t size = static_cast<size_t>(file_stat.st_size);
+  if (size == 0) {
+    if (!WriteFully(fd_, kLogMagic, kLogMagicSize, 0) || !SyncLocked()) {
+      close(fd_);
+      fd_ = -1;
+      return Status(Status::PERMANENT_FAILURE, "Cannot initialize " + path_);
+    }
+    size = kLogMagicSize;
+  }
+  file_size_ = size;
+  if (!EnsureMapped() || (size < kLogMagicSize) ||
+      (memcmp(mapped_data_, kLogMagic, kLogMagicSize) != 0)) {
+    Unmap();
+    close(fd_);
+    fd_ = -1;
+    return Status(Status::PERMANENT_FAILURE, "Not a log: " + path_);
+  }
+
+  // Rebuild the index, stopping at the first record that is not whole. A
+  // batch is applied only if all its records are whole.
+  size_t offset = kLogMagicSize;
+  RecordType type;
+  string key;
+  RecordLocation location;
+  while (ParseRecordLocked(offset, &type, &key, &location)) {
+    if (type != RecordType_BATCH) {
+      ApplyRecordLocked(type, key, location);
+      offset += location.size;
+      continue;
+    }
+    if (location.value_size != 4) {
+      break;
+    }
+    uint32 num_records = ReadUint32(mapped_data_ + location.value_offset);
+    size_t batch_end = offset + location.size;
+    vector<RecordType> types;
+    vector<string> keys;
+    vector<RecordLocation> locations;
+    while ((types.size() < num_records) &&
+           ParseRecordLocked(batch_end, &type, &key, &location) &&
+           (type != RecordType_BATCH)) {
+      types.push_back(type);
+      keys.push_back(key);
+      locations.push_back(location);
+      batch_end += location.size;
+    }
+    if (types.size() < num_records) {
+      break;
+    }
+    for (size_t i = 0; i < types.size(); ++i) {
+      ApplyRecordLocked(types[i], keys[i], locations[i]);
+    }
+    offset = batch_end;
+  }
+  if (offset < size) {
+    // Cut off the torn tail so that later appends follow a whole record.
+    if ((ftruncate(fd_, offset) != 0) || !SyncLocked()) {
+      Unmap();
+      close(fd_);
+      fd_ = -1;
+      return Status(Status::PERMANENT_FAILURE, "Cannot truncate " + path_);
+    }
+    file_size_ = offset;
+  }
+  return Status(Status::SUCCESS, "");
+}
+
+void LogStructuredStorage::SetSystemResources(SystemResources* resources) {
+  MutexLock m(&lock_);
+  logger_ = resources->logger();
+}
+
+void LogStructuredStorage::WriteKey(const string& key, const string& value,
+    WriteKeyCallback* done) {
+  Status status(Status::SUCCESS, "");
+  bool compact = false;
+  {
+    MutexLock m(&lock_);
+    if (fd_ < 0) {
+      status = Status(Status::PERMANENT_FAILURE, "Storage is not open");
+    } else if (!AppendRecords(
+        vector<pair<string, string> >(1, make_pair(key, value)), NULL)) {
+      status = Status(Status::TRANSIENT_FAILURE, "Append failed");
+    } else if (io_scheduler_ != NULL) {
+      pending_writes_.push_back(done);
+      ScheduleSyncLocked();
+      return;
+    } else if (!SyncLocked()) {
+      status = Status(Status::TRANSIENT_FAILURE, "Sync failed");
+    } else {
+      compact = ShouldCompactLocked();
+    }
+  }
+  done->Run(status);
+  delete done;
+  if (compact) {
+    Compact();
+  }
+}
+
+void LogStructuredStorage::ReadKey(const string& key, ReadKeyCallback* done) {
+  StatusStringPair result(Status(Status::SUCCESS, ""), "");
+  {
+    MutexLock m(&lock_);
+    map<string, RecordLocation>::iterator iter = index_.find(key);
+    if (iter == index_.end()) {
+      result.first = Status(Status::PERMANENT_FAILURE, "Key not found");
+    } else if (!EnsureMapped()) {
+      result.first = Status(Status::TRANSIENT_FAILURE, "Cannot map log");
+    } else {
+      result.second.assign(mapped_data_ + iter->second.value_offset,
+                           iter->second.value_size);
+    }
+  }
+  done->Run(result);
+  delete done;
+}
+
+void LogStructuredStorage::DeleteKey(const string& key,
+                                     DeleteKeyCallback* done) {
+  bool result = true;
+  {
+    MutexLock m(&lock_);
+    if (fd_ < 0) {
+      result = false;
+    } else if (index_.find(key) == index_.end()) {
+      // Nothing to delete.
+    } else if (!AppendRecords(vector<pair<string, string> >(), &key)) {
+      result = false;
+    } else if (io_scheduler_ != NULL) {
+      pending_deletes_.push_back(done);
+      ScheduleSyncLocked();
+      return;
+    } else {
+      result = SyncLocked();
+    }
+  }
+  done->Run(result);
+  delete done;
+}
+
+void LogStructuredStorage::ReadAllKeys(ReadAllKeysCallback* key_callback) {
+  ReadAllKeysWithPrefix("", key_callback);
+}
+
+void LogStructuredStorage::ReadAllKeysWithPrefix(
+    const string& prefix, ReadAllKeysCallback* key_callback) {
+  vector<string> keys;
+  {
+    MutexLock m(&lock_);
+    map<string, RecordLocation>::iterator iter;
+    for (iter = index_.lower_bound(prefix);
+         (iter != index_.end()) &&
+             (iter->first.compare(0, prefix.size(), prefix) == 0);
+         ++iter) {
+      keys.push_back(iter->first);
+    }
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    key_callback->Run(StatusStringPair(Status(Status::SUCCESS, ""), keys[i]));
+  }
+  key_callback->Run(StatusStringPair(Status(Status::SUCCESS, ""), ""));
+}
+
+void LogStructuredStorage::WriteKeys(
+    const vector<pair<string, string> >& key_values, WriteKeyCallback* done) {
+  Status status(Status::SUCCESS, "");
+  bool compact = false;
+  {
+    MutexLock m(&lock_);
+    if (fd_ < 0) {
+      status = Status(Status::PERMANENT_FAILURE, "Storage is not open");
+    } else if (key_values.empty()) {
+      // Nothing to write.
+    } else if (!AppendRecords(key_values, NULL)) {
+      status = Status(Status::TRANSIENT_FAILURE, "Append failed");
+    } else if (io_scheduler_ != NULL) {
+      pending_writes_.push_back(done);
+      ScheduleSyncLocked();
+      return;
+    } else if (!SyncLocked()) {
+      status = Status(Status::TRANSIENT_FAILURE, "Sync failed");
+    } else {
+      compact = ShouldCompactLocked();
+    }
+  }
+  done->Run(status);
+  delete done;
+  if (compact) {
+    Compact();
+  }
+}
+
+void LogStructuredStorage::ReadKeys(const vector<string>& keys,
+                                    ReadKeysCallback* done) {
+  vector<StatusStringPair> results;
+  {
+    MutexLock m(&lock_);
+    bool mapped = EnsureMapped();
+    for (size_t i = 0; i < keys.size(); ++i) {
+      results.push_back(StatusStringPair(Status(Status::SUCCESS, ""), ""));
+      map<string, RecordLocation>::iterator iter = index_.find(keys[i]);
+      if (iter == index_.end()) {
+        results.back().first =
+            Status(Status::PERMANENT_FAILURE, "Key not found");
+      } else if (!mapped) {
+        results.back().first =
+            Status(Status::TRANSIENT_FAILURE, "Cannot map log");
+      } else {
+        results.back().second.assign(
+            mapped_data_ + iter->second.value_offset,
+            iter->second.value_size);
+      }
+    }
+  }
+  done->Run(results);
+  delete done;
+}
+
+size_t LogStructuredStorage::GetLogSizeForTest() {
+  MutexLock m(&lock_);
+  return file_size_;
+}
+
+bool LogStructuredStorage::CompactForTest() {
+  return Compact();
+}
+
+void LogStructuredStorage::EncodeRecord(
+    RecordType type, const string& key, const string& value, string* out) {
+  size_t start = out->size();
+  AppendUint32(0, out);  // Placeholder for the CRC.
+  out->push_back(static_cast<char>(type));
+  AppendUint32(key.size(), out);
+  AppendUint32(value.size(), out);
+  out->append(key);
+  out->append(value);
+  uint32 crc = kCrc32Table.Compute(out->data() + start + 4,
+                                   out->size() - start - 4);
+  for (int i = 0; i < 4; ++i) {
+    (*out)[start + i] = static_cast<char>((crc >> (8 * i)) & 0xFF);
+  }
+}
+
+bool LogStructuredStorage::ParseRecordLocked(
+    size_t offset, RecordType* type, string* key, RecordLocation* location) {
+  if (file_size_ - offset < kRecordHeaderSize) {
+    return false;
+  }
+  const char* record = mapped_data_ + offset;
+  uint32 crc = ReadUint32(record);
+  char record_type = record[4];
+  uint64 key_size = ReadUint32(record + 5);
+  uint64 value_size = ReadUint32(record + 9);
+  uint64 record_size = kRecordHeaderSize + key_size + value_size;
+  if ((record_size > file_size_ - offset) ||
+      (kCrc32Table.Compute(record + 4, record_size - 4) != crc) ||
+      ((record_type != RecordType_PUT) && (record_type != RecordType_DELETE) &&
+       (record_type != RecordType_BATCH))) {
+    return false;
+  }
+  *type = static_cast<RecordType>(record_type);
+  key->assign(record + kRecordHeaderSize, key_size);
+  location->offset = offset;
+  location->size = record_size;
+  location->value_offset = offset + kRecordHeaderSize + key_size;
+  location->value_size = value_size;
+  return true;
+}
+
+void LogStructuredStorage::ApplyRecordLocked(
+    RecordType type, const string& key, const RecordLocation& location) {
+  map<string, RecordLocation>::iterator iter = index_.find(key);
+  if (iter != index_.end()) {
+    live_bytes_ -= iter->second.size;
+    index_.erase(iter);
+  }
+  if (type == RecordType_PUT) {
+    index_[key] = location;
+    live_bytes_ += location.size;
+  }
+}
+
+bool LogStructuredStorage::AppendRecords(
+    const vector<pair<string, string> >& puts, const string* deleted_key) {
+  // A batch header makes several records all-or-nothing on recovery.
+  size_t num_records = puts.size() + ((deleted_key != NULL) ? 1 : 0);
+  string data;
+  if (num_records > 1) {
+    string count;
+    AppendUint32(num_records, &count);
+    EncodeRecord(RecordType_BATCH, "", count, &data);
+  }
+  vector<RecordLocation> locations;
+  for (size_t i = 0; i < puts.size(); ++i) {
+    RecordLocation location;
+    location.offset = file_size_ + data.size();
+    location.value_offset =
+        location.offset + kRecordHeaderSize + puts[i].first.size();
+    location.value_size = puts[i].second.size();
+    EncodeRecord(RecordType_PUT, puts[i].first, puts[i].second, &data);
+    location.size = file_size_ + data.size() - location.offset;
+    locations.push_back(location);
+  }
+  if (deleted_key != NULL) {
+    EncodeRecord(RecordType_DELETE, *deleted_key, "", &data);
+  }
+
+  if (!WriteFully(fd_, data.data(), data.size(), file_size_)) {
+    // Drop any partial record so that the next append follows a whole one.
+    if (ftruncate(fd_, file_size_) != 0 && logger_ != NULL) {
+      TLOG(logger_, SEVERE, "Cannot truncate %s after failed append",
+           path_.c_str());
+    }
+    return false;
+  }
+  for (size_t i = 0; i < puts.size(); ++i) {
+    ApplyRecordLocked(RecordType_PUT, puts[i].first, locations[i]);
+  }
+  if (deleted_key != NULL) {
+    ApplyRecordLocked(RecordType_DELETE, *deleted_key, RecordLocation());
+  }
+  file_size_ += data.size();
+  return true;
+}
+
+bool LogStructuredStorage::WriteFully(
+    int fd, const char* data, size_t size, size_t offset) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+bool LogStructuredStorage::EnsureMapped() {
+  if ((mapped_data_ != NULL) && (mapped_size_ >= file_size_)) {
+    return true;
+  }
+  Unmap();
+  // Map beyond the end of the file so that later appends, which are visible
+  // through a shared mapping, rarely need a new one. Only bytes below
+  // |file_size_| are ever read.
+  size_t size = kMinMappingBytes;
+  while (size < file_size_) {
+    size *= 2;
+  }
+  void* data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    if (logger_ != NULL) {
+      TLOG(logger_, SEVERE, "Cannot map %s: %s", path_.c_str(),
+           strerror(errno));
+    }
+    return false;
+  }
+  mapped_data_ = static_cast<char*>(data);
+  mapped_size_ = size;
+  return true;
+}
+
+void LogStructuredStorage::Unmap() {
+  if (mapped_data_ != NULL) {
+    munmap(mapped_data_, mapped_size_);
+    mapped_data_ = NULL;
+    mapped_size_ = 0;
+  }
+}
+
+bool LogStructuredStorage::SyncLocked() {
+  if (fsync(fd_) != 0) {
+    if (logger_ != NULL) {
+      TLOG(logger_, SEVERE, "Cannot sync %s: %s", path_.c_str(),
+           strerror(errno));
+    }
+    return false;
+  }
+  return true;
+}
+
+void LogStructuredStorage::SyncPending() {
+  vector<WriteKeyCallback*> writes;
+  vector<DeleteKeyCallback*> deletes;
+  bool synced;
+  bool compact;
+  {
+    MutexLock m(&lock_);
+    sync_scheduled_ = false;
+    writes.swap(pending_writes_);
+    deletes.swap(pending_deletes_);
+    synced = SyncLocked();
+    compact = synced && ShouldCompactLocked();
+  }
+  Status status = synced ? Status(Status::SUCCESS, "") :
+      Status(Status::TRANSIENT_FAILURE, "Sync failed");
+  for (size_t i = 0; i < writes.size(); ++i) {
+    writes[i]->Run(status);
+    delete writes[i];
+  }
+  for (size_t i = 0; i < deletes.size(); ++i) {
+    deletes[i]->Run(synced);
+    delete deletes[i];
+  }
+  if (compact) {
+    Compact();
+  }
+}
+
+void LogStructuredStorage::ScheduleSyncLocked() {
+  if (!sync_scheduled_) {
+    sync_scheduled_ = true;
+    io_scheduler_->Schedule(
+        commit_delay_,
+        NewPermanentCallback(this, &LogStructuredStorage::SyncPending));
+  }
+}
+
+bool LogStructuredStorage::ShouldCompactLocked() {
+  return (file_size_ >= kMinCompactionBytes) &&
+      (file_size_ - kLogMagicSize > 2 * live_bytes_);
+}
+
+bool LogStructuredStorage::Compact() {
+  // Copy the live records under the lock, then write them out without it.
+  string data(kLogMagic, kLogMagicSize);
+  map<string, RecordLocation> compact_index;
+  size_t compacted_size;
+  {
+    MutexLock m(&lock_);
+    if (compacting_ || (fd_ < 0) || !EnsureMapped()) {
+      return false;
+    }
+    compacting_ = true;
+    compacted_size = file_size_;
+    map<string, RecordLocation>::iterator iter;
+    for (iter = index_.begin(); iter != index_.end(); ++iter) {
+      RecordLocation location = iter->second;
+      size_t offset = data.size();
+      data.append(mapped_data_ + location.offset, location.size);
+      location.value_offset =
+          offset + (location.value_offset - location.offset);
+      location.offset = offset;
+      compact_index[iter->first] = location;
+    }
+  }
+  string compact_path = path_ + ".compact";
+  int compact_fd = open(compact_path.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                        0644);
+  bool ok = (compact_fd >= 0) &&
+      WriteFully(compact_fd, data.data(), data.size(), 0);
+
+  MutexLock m(&lock_);
+  compacting_ = false;
+
+  // Carry over the records appended meanwhile; they follow whole records.
+  size_t tail_size = file_size_ - compacted_size;
+  ok = ok && ((tail_size == 0) ||
+              (EnsureMapped() &&
+               WriteFully(compact_fd, mapped_data_ + compacted_size,
+                          tail_size, data.size()))) &&
+      (fsync(compact_fd) == 0) &&
+      (rename(compact_path.c_str(), path_.c_str()) == 0);
+  if (!ok) {
+    if (logger_ != NULL) {
+      TLOG(logger_, WARNING, "Compaction of %s failed", path_.c_str());
+    }
+    if (compact_fd >= 0) {
+      close(compact_fd);
+    }
+    unlink(compact_path.c_str());
+    return false;
+  }
+
+  // Make the rename durable before dropping the old log.
+  size_t slash = path_.rfind('/');
+  string dir = (slash == string::npos) ? "." : path_.substr(0, slash + 1);
+  int dir_fd = open(dir.c_str(), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  if (logger_ != NULL) {
+    TLOG(logger_, INFO, "Compacted %s from %d to %d bytes", path_.c_str(),
+         static_cast<int>(file_size_),
+         static_cast<int>(data.size() + tail_size));
+  }
+
+  // Keys written since the copy point into the tail; the others still have
+  // the record that was copied.
+  map<string, RecordLocation>::iterator iter;
+  for (iter = index_.begin(); iter != index_.end(); ++iter) {
+    RecordLocation* location = &iter->second;
+    if (location->offset >= compacted_size) {
+      location->offset = location->offset - compacted_size + data.size();
+      location->value_offset =
+          location->value_offset - compacted_size + data.size();
+    } else {
+      *location = compact_index[iter->first];
+    }
+  }
+  Unmap();
+  close(fd_);
+  fd_ = compact_fd;
+  file_size_ = data.size() + tail_size;
+  return EnsureMapped();
+}
+
+}  // namespace invalidation
@@ -0,0 +1,282 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A Storage implementation that keeps all keys in a single append-only log
+// file of checksummed records, memory-mapped for reads.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_LOG_STRUCTURED_STORAGE_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_LOG_STRUCTURED_STORAGE_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// The log starts with a magic string, followed by records of the form
+//
+//   crc32 (4) | type (1) | key length (4) | value length (4) | key | value
+//
+// with integers in little-endian order and the CRC covering everything after
+// it. A write appends a PUT record and a delete appends a DELETE record; the
+// latest record for a key wins. A batch of writes is appended as a BATCH
+// record, holding the number of records in the batch, followed by their PUT
+// records. The whole file is mapped into memory, and an
+// in-memory index maps each live key to its value in the mapping, so a read is
+// an index lookup.
+//
+// On open, the log is scanned once to build the index. A record that is
+// truncated or fails its CRC (e.g., a write torn by a crash) ends the log: it
+// and everything after it are cut off, so only whole records are ever seen. A
+// batch with a record cut off is cut off as a whole, so batches are
+// all-or-nothing.
+//
+// Writes are made durable with fsync. If an I/O scheduler is given, the
+// fsyncs are done on it and shared by all the writes and deletes issued since
+// the previous one (group commit), whose callbacks run on the I/O scheduler
+// once their records are durable; otherwise each operation syncs before
+// running its callback. When superseded records make up most of the log, the
+// live records are copied to a new log that atomically replaces the old one
+// (compaction), on the I/O scheduler if there is one. Compaction copies the
+// live records under the lock but writes them out without it, so reads and
+// writes proceed meanwhile; the records they append are carried over to the
+// new log before it replaces the old one.
+//
+// This class is thread-safe.
+class LogStructuredStorage : public Storage {
+ public:
+  /* Creates a storage whose log is at |path|. If |io_scheduler| is not NULL,
+   * syncs and compactions run on it. Space for |io_scheduler| is owned by the
+   * caller.
+   */
+  LogStructuredStorage(const string& path, Scheduler* io_scheduler);
+
+  /* Syncs the log and runs the callbacks still waiting for a sync.
+   *
+   * REQUIRES: The I/O scheduler will not run any task scheduled by this
+   * object (e.g., it has been stopped).
+   */
+  virtual ~LogStructuredStorage();
+
+  /* Opens (creating it if needed) and recovers the log, cutting off any torn
+   * tail. Returns a failure status if the file cannot be opened or is not a
+   * log.
+   *
+   * REQUIRES: Called once, before any other method.
+   */
+  Status Open();
+
+  /* Delays each group sync by |delay| after the first write or delete it
+   * covers, so that more operations share it (default: no delay).
+   *
+   * REQUIRES: An I/O scheduler was given, and called before any write.
+   */
+  void SetCommitDelay(TimeDelta delay) {
+    commit_delay_ = delay;
+  }
+
+  // All public methods below are methods of the Storage interface.
+  virtual void SetSystemResources(SystemResources* resources);
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done);
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done);
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done);
+
+  /* Calls |key_callback| with each live key, then with an empty key, before
+   * returning.
+   */
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback);
+
+  /* Appends all the pairs in one batch, so they are written atomically. */
+  virtual void WriteKeys(const vector<pair<string, string> >& key_values,
+                         WriteKeyCallback* done);
+
+  virtual void ReadKeys(const vector<string>& keys, ReadKeysCallback* done);
+
+  /* Calls |key_callback| with each live key that starts with |prefix|, then
+   * with an empty key, before returning. Caller continues to own
+   * |key_callback|.
+   */
+  void ReadAllKeysWithPrefix(const string& prefix,
+                             ReadAllKeysCallback* key_callback);
+
+  /* Returns the size of the log in bytes. */
+  size_t GetLogSizeForTest();
+
+  /* Compacts the log immediately, regardless of the amount of garbage. */
+  bool CompactForTest();
+
+ private:
+  /* Type of a log record. */
+  enum RecordType {
+    RecordType_PUT = 1,
+    RecordType_DELETE = 2,
+    RecordType_BATCH = 3,
+  };
+
+  /* Location of a live record in the log. */
+  struct RecordLocation {
+    RecordLocation() : offset(0), size(0), value_offset(0), value_size(0) {}
+
+    /* Offset and size of the whole record. */
+    size_t offset;
+    size_t size;
+
+    /* Offset and size of the value in the record. */
+    size_t value_offset;
+    size_t value_size;
+  };
+
+  /* Appends the encoding of a record of type |type| for |key| and |value| to
+   * |out|.
+   */
+  static void EncodeRecord(RecordType type, const string& key,
+                           const string& value, string* out);
+
+  /* Parses the record at |offset| into |type|, |key| and |location|. Returns
+   * false if the record is not whole.
+   *
+   * REQUIRES: lock_ is held, and the log is mapped.
+   */
+  bool ParseRecordLocked(size_t offset, RecordType* type, string* key,
+                         RecordLocation* location);
+
+  /* Updates the index with the record of type |type| for |key| at
+   * |location|.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  void ApplyRecordLocked(RecordType type, const string& key,
+                         const RecordLocation& location);
+
+  /* Appends PUT records for |puts| and, if |deleted_key| is not NULL, a DELETE
+   * record for it to the log, in one batch if there are several, and updates
+   * the index. Returns whether the append succeeded.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  bool AppendRecords(const vector<pair<string, string> >& puts,
+                     const string* deleted_key);
+
+  /* Writes |size| bytes at |data| to |fd| at |offset|, retrying on partial
+   * writes. Returns whether all bytes were written.
+   */
+  static bool WriteFully(int fd, const char* data, size_t size, size_t offset);
+
+  /* Maps the first |file_size_| bytes of the log, replacing the current
+   * mapping if it is smaller. Returns whether the mapping succeeded.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  bool EnsureMapped();
+
+  /* Unmaps the log.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  void Unmap();
+
+  /* Syncs the log and returns whether the sync succeeded.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  bool SyncLocked();
+
+  /* Syncs the writes and deletes issued since the last sync and runs their
+   * callbacks. Runs on the I/O scheduler.
+   */
+  void SyncPending();
+
+  /* Schedules SyncPending if it is not already scheduled.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  void ScheduleSyncLocked();
+
+  /* Returns whether enough of the log is garbage to be worth compacting.
+   *
+   * REQUIRES: lock_ is held.
+   */
+  bool ShouldCompactLocked();
+
+  /* Copies the live records to a new log that replaces the current one.
+   * Returns whether the compaction succeeded; on failure, or if another
+   * compaction is running, the current log is kept.
+   *
+   * REQUIRES: lock_ is not held.
+   */
+  bool Compact();
+
+  /* Path of the log file. */
+  string path_;
+
+  /* Scheduler for syncs and compactions, or NULL to do them inline. */
+  Scheduler* io_scheduler_;
+
+  /* How long a group sync waits for more operations to cover. */
+  TimeDelta commit_delay_;
+
+  /* Logger from the system resources, or NULL before SetSystemResources. */
+  Logger* logger_;
+
+  /* Protects all the fields below. */
+  Mutex lock_;
+
+  /* Descriptor of the log file, or -1 if it is not open. */
+  int fd_;
+
+  /* Number of bytes of whole records in the log, including the magic. */
+  size_t file_size_;
+
+  /* The read-only mapping of the log and its size. */
+  char* mapped_data_;
+  size_t mapped_size_;
+
+  /* Location of the latest record of each live key. */
+  map<string, RecordLocation> index_;
+
+  /* Total size of the records in |index_|. */
+  size_t live_bytes_;
+
+  /* Callbacks of the writes and deletes waiting for the next sync. */
+  vector<WriteKeyCallback*> pending_writes_;
+  vector<DeleteKeyCallback*> pending_deletes_;
+
+  /* Whether a SyncPending call is scheduled. */
+  bool sync_scheduled_;
+
+  /* Whether a compaction is writing out the live records. */
+  bool compacting_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogStructuredStorage);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_LOG_STRUCTURED_STORAGE_H_
@@ -0,0 +1,224 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the LogStructuredStorage class.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/log-structured-storage.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+class LogStructuredStorageTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    const char* tmp_dir = getenv("TEST_TMPDIR");
+    path = string(tmp_dir != NULL ? tmp_dir : "/tmp") + "/ticl-log-" +
+        SimpleItoa(getpid());
+    unlink(path.c_str());
+    logger.reset(new TestLogger());
+    io_scheduler.reset(new SimpleDeterministicScheduler(logger.get()));
+    io_scheduler->StartScheduler();
+    write_statuses.clear();
+  }
+
+  virtual void TearDown() {
+    storage.reset();
+    unlink(path.c_str());
+  }
+
+  /* (Re)opens the log, syncing on the I/O scheduler iff |group_sync|. */
+  void Reopen(bool group_sync) {
+    storage.reset();
+    storage.reset(new LogStructuredStorage(
+        path, group_sync ? io_scheduler.get() : NULL));
+    ASSERT_TRUE(storage->Open().IsSuccess());
+  }
+
+  void RecordWrite(Status status) {
+    write_statuses.push_back(status);
+  }
+
+  void RecordRead(StatusStringPair result) {
+    read_value = result.first.IsSuccess() ? result.second : "<missing>";
+  }
+
+  void RecordKey(StatusStringPair result) {
+    keys.push_back(result.second);
+  }
+
+  void RecordReads(vector<StatusStringPair> results) {
+    read_values.clear();
+    for (size_t i = 0; i < results.size(); ++i) {
+      read_values.push_back(
+          results[i].first.IsSuccess() ? results[i].second : "<missing>");
+    }
+  }
+
+  void RecordDelete(bool result) {
+    delete_result = result;
+  }
+
+  void Write(const string& key, const string& value) {
+    storage->WriteKey(key, value,
+        NewPermanentCallback(this, &LogStructuredStorageTest::RecordWrite));
+  }
+
+  /* Returns the value of |key|, or "<missing>" if it cannot be read. */
+  string Read(const string& key) {
+    storage->ReadKey(key,
+        NewPermanentCallback(this, &LogStructuredStorageTest::RecordRead));
+    return read_value;
+  }
+
+  string path;
+  scoped_ptr<Logger> logger;
+  scoped_ptr<DeterministicScheduler> io_scheduler;
+  scoped_ptr<LogStructuredStorage> storage;
+  vector<Status> write_statuses;
+  string read_value;
+  vector<string> read_values;
+  vector<string> keys;
+  bool delete_result;
+};
+
+/* Tests that writes and deletes survive reopening the log. */
+TEST_F(LogStructuredStorageTest, Reopen) {
+  Reopen(false);
+  Write("a", "1");
+  Write("b", "2");
+  Write("a", "3");
+  storage->DeleteKey("b",
+      NewPermanentCallback(this, &LogStructuredStorageTest::RecordDelete));
+  EXPECT_TRUE(delete_result);
+  ASSERT_EQ(3, static_cast<int>(write_statuses.size()));
+
+  Reopen(false);
+  EXPECT_EQ("3", Read("a"));
+  EXPECT_EQ("<missing>", Read("b"));
+  ReadAllKeysCallback* key_callback =
+      NewPermanentCallback(this, &LogStructuredStorageTest::RecordKey);
+  storage->ReadAllKeys(key_callback);
+  delete key_callback;
+  // The last call marks the end of the keys.
+  ASSERT_EQ(2, static_cast<int>(keys.size()));
+  EXPECT_EQ("a", keys[0]);
+  EXPECT_EQ("", keys[1]);
+}
+
+/* Tests that a torn record at the end of the log is cut off on open and that
+ * later appends are readable.
+ */
+TEST_F(LogStructuredStorageTest, TornTail) {
+  Reopen(false);
+  Write("a", "1");
+  Write("b", "2");
+  storage.reset();
+  size_t whole_size;
+  {
+    FILE* file = fopen(path.c_str(), "ab");
+    ASSERT_TRUE(file != NULL);
+    whole_size = ftell(file);
+    fputs("\x12\x34\x56\x78\x01garbage", file);
+    fclose(file);
+  }
+
+  Reopen(false);
+  EXPECT_EQ(whole_size, storage->GetLogSizeForTest());
+  EXPECT_EQ("1", Read("a"));
+  EXPECT_EQ("2", Read("b"));
+  Write("c", "3");
+  Reopen(false);
+  EXPECT_EQ("2", Read("b"));
+  EXPECT_EQ("3", Read("c"));
+}
+
+/* Tests that a batch is written and read as a whole, and that a batch with a
+ * torn record is dropped as a whole on recovery.
+ */
+TEST_F(LogStructuredStorageTest, Batch) {
+  Reopen(false);
+  vector<pair<string, string> > batch;
+  batch.push_back(make_pair("a", "1"));
+  batch.push_back(make_pair("b", "2"));
+  storage->WriteKeys(batch,
+      NewPermanentCallback(this, &LogStructuredStorageTest::RecordWrite));
+  size_t first_batch_size = storage->GetLogSizeForTest();
+  batch[0].second = "3";
+  batch[1].second = "4";
+  storage->WriteKeys(batch,
+      NewPermanentCallback(this, &LogStructuredStorageTest::RecordWrite));
+  size_t second_batch_size = storage->GetLogSizeForTest();
+  storage.reset();
+
+  // Tear the last record of the second batch.
+  ASSERT_EQ(0, truncate(path.c_str(), second_batch_size - 1));
+  Reopen(false);
+  EXPECT_EQ(first_batch_size, storage->GetLogSizeForTest());
+  vector<string> keys_to_read;
+  keys_to_read.push_back("a");
+  keys_to_read.push_back("b");
+  keys_to_read.push_back("c");
+  storage->ReadKeys(keys_to_read,
+      NewPermanentCallback(this, &LogStructuredStorageTest::RecordReads));
+  ASSERT_EQ(3, static_cast<int>(read_values.size()));
+  EXPECT_EQ("1", read_values[0]);
+  EXPECT_EQ("2", read_values[1]);
+  EXPECT_EQ("<missing>", read_values[2]);
+}
+
+/* Tests that a log made mostly of superseded records is compacted. */
+TEST_F(LogStructuredStorageTest, Compaction) {
+  Reopen(false);
+  string value(1000, 'x');
+  for (int i = 0; i < 200; ++i) {
+    Write("k", value + SimpleItoa(i));
+  }
+  Write("other", "v");
+  EXPECT_LT(storage->GetLogSizeForTest(), static_cast<size_t>(64 * 1024));
+  EXPECT_EQ(value + "199", Read("k"));
+  ASSERT_TRUE(storage->CompactForTest());
+  Reopen(false);
+  EXPECT_EQ(value + "199", Read("k"));
+  EXPECT_EQ("v", Read("other"));
+}
+
+/* Tests that writes issued before a sync share it and complete together. */
+TEST_F(LogStructuredStorageTest, GroupSync) {
+  Reopen(true);
+  Write("a", "1");
+  Write("b", "2");
+  Write("c", "3");
+  EXPECT_EQ(0, static_cast<int>(write_statuses.size()));
+  EXPECT_EQ("2", Read("b"));
+  io_scheduler->PassTime(TimeDelta::FromMilliseconds(1));
+  ASSERT_EQ(3, static_cast<int>(write_statuses.size()));
+  for (size_t i = 0; i < write_statuses.size(); ++i) {
+    EXPECT_TRUE(write_statuses[i].IsSuccess());
+  }
+}
+
+}  // namespace invalidation
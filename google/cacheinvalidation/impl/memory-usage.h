@@ -0,0 +1,62 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Estimates of the memory used by the entries of the Ticl's data structures.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_MEMORY_USAGE_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_MEMORY_USAGE_H_
+
+#include <string>
+
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::string;
+
+// The estimates are meant for capacity planning, not exact accounting: the
+// heap memory of a proto is approximated by its encoded size, and the
+// overhead of the allocator is ignored. They are cheap enough to maintain
+// incrementally as entries are added to and removed from a structure.
+class MemoryUsage {
+ public:
+  /* Estimated overhead of a node of a balanced tree (std::map or std::set):
+   * three links and the color, padded.
+   */
+  static const int64 kTreeNodeOverhead = 4 * sizeof(void*);
+
+  /* Returns the estimated memory used by |str|. */
+  static int64 OfString(const string& str) {
+    return sizeof(string) + str.size();
+  }
+
+  /* Returns the estimated memory used by |proto|. */
+  template<typename ProtoType>
+  static int64 OfProto(const ProtoType& proto) {
+    return sizeof(ProtoType) + proto.ByteSize();
+  }
+
+  /* Returns the estimated memory used by an entry of a tree-based map or set
+   * holding |element|.
+   */
+  template<typename ProtoType>
+  static int64 OfTreeEntry(const ProtoType& element) {
+    return kTreeNodeOverhead + OfProto(element);
+  }
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_MEMORY_USAGE_H_
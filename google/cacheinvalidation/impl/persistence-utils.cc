@@ -19,11 +19,13 @@
 namespace invalidation {
 
 void PersistenceUtils::SerializeState(
-    PersistentTiclState state, DigestFunction* digest_fn, string* result) {
-  string mac = GenerateMac(state, digest_fn);
+    const PersistentTiclState& state, DigestFunction* digest_fn,
+    string* result) {
+  // Serialize the state once, straight into the blob, and sign those bytes.
   PersistentStateBlob blob;
-  blob.mutable_ticl_state()->CopyFrom(state);
-  blob.set_authentication_code(mac);
+  string* serialized_state = blob.mutable_serialized_ticl_state();
+  state.SerializeToString(serialized_state);
+  blob.set_authentication_code(GenerateMac(*serialized_state, digest_fn));
   blob.SerializeToString(result);
 }
 
@@ -39,8 +41,19 @@ bool PersistenceUtils::DeserializeState(
   }
 
   // Check the mac in the envelope against the recomputed mac from the state.
-  ticl_state->CopyFrom(state_blob.ticl_state());
-  const string& mac = GenerateMac(*ticl_state, digest_fn);
+  string mac;
+  if (state_blob.has_serialized_ticl_state()) {
+    mac = GenerateMac(state_blob.serialized_ticl_state(), digest_fn);
+    if ((mac == state_blob.authentication_code()) &&
+        !ticl_state->ParseFromString(state_blob.serialized_ticl_state())) {
+      TLOG(logger, WARNING, "could not parse Ticl state");
+      return false;
+    }
+  } else {
+    // Legacy blob: the mac is over a reserialization of the state.
+    ticl_state->CopyFrom(state_blob.ticl_state());
+    mac = GenerateMac(*ticl_state, digest_fn);
+  }
   if (mac != state_blob.authentication_code()) {
     TLOG(logger, WARNING, "Ticl state failed MAC check: computed %s vs %s",
          mac.c_str(), state_blob.authentication_code().c_str());
@@ -53,8 +66,13 @@ string PersistenceUtils::GenerateMac(
     const PersistentTiclState& state, DigestFunction* digest_fn) {
   string serialized;
   state.SerializeToString(&serialized);
+  return GenerateMac(serialized, digest_fn);
+}
+
+string PersistenceUtils::GenerateMac(
+    const string& serialized_state, DigestFunction* digest_fn) {
   digest_fn->Reset();
-  digest_fn->Update(serialized);
+  digest_fn->Update(serialized_state);
   return digest_fn->GetDigest();
 }
 
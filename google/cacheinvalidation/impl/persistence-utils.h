@@ -30,7 +30,8 @@ class PersistenceUtils {
  public:
   /* Serializes a Ticl state blob. */
   static void SerializeState(
-      PersistentTiclState state, DigestFunction* digest_fn, string* result);
+      const PersistentTiclState& state, DigestFunction* digest_fn,
+      string* result);
 
   /* Deserializes a Ticl state blob. Returns whether the parsed state could be
    * parsed.
@@ -43,6 +44,10 @@ class PersistenceUtils {
   static string GenerateMac(
       const PersistentTiclState& state, DigestFunction* digest_fn);
 
+  /* Returns a message authentication code over the serialized state. */
+  static string GenerateMac(
+      const string& serialized_state, DigestFunction* digest_fn);
+
  private:
   PersistenceUtils() {
     // Prevent instantiation.
@@ -0,0 +1,76 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the PersistenceUtils class.
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
+#include "google/cacheinvalidation/impl/persistence-utils.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+
+namespace invalidation {
+
+class PersistenceUtilsTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    logger.reset(new TestLogger());
+    digest_fn.reset(new Sha1DigestFunction());
+    state.set_client_token("token");
+    state.set_last_message_send_time_ms(12345);
+  }
+
+  scoped_ptr<Logger> logger;
+  scoped_ptr<DigestFunction> digest_fn;
+  PersistentTiclState state;
+};
+
+/* Tests that a serialized state is read back, and that a blob whose state
+ * bytes were altered is rejected.
+ */
+TEST_F(PersistenceUtilsTest, RoundTrip) {
+  string serialized;
+  PersistenceUtils::SerializeState(state, digest_fn.get(), &serialized);
+  PersistentTiclState read_state;
+  ASSERT_TRUE(PersistenceUtils::DeserializeState(
+      logger.get(), serialized, digest_fn.get(), &read_state));
+  EXPECT_EQ("token", read_state.client_token());
+  EXPECT_EQ(12345, read_state.last_message_send_time_ms());
+
+  PersistentStateBlob blob;
+  ASSERT_TRUE(blob.ParseFromString(serialized));
+  EXPECT_FALSE(blob.has_ticl_state());
+  PersistentTiclState other_state(state);
+  other_state.set_client_token("other-token");
+  other_state.SerializeToString(blob.mutable_serialized_ticl_state());
+  blob.SerializeToString(&serialized);
+  EXPECT_FALSE(PersistenceUtils::DeserializeState(
+      logger.get(), serialized, digest_fn.get(), &read_state));
+}
+
+/* Tests that blobs in the legacy format are still read. */
+TEST_F(PersistenceUtilsTest, ReadsLegacyBlob) {
+  PersistentStateBlob blob;
+  blob.mutable_ticl_state()->CopyFrom(state);
+  blob.set_authentication_code(
+      PersistenceUtils::GenerateMac(state, digest_fn.get()));
+  string serialized;
+  blob.SerializeToString(&serialized);
+  PersistentTiclState read_state;
+  ASSERT_TRUE(PersistenceUtils::DeserializeState(
+      logger.get(), serialized, digest_fn.get(), &read_state));
+  EXPECT_EQ("token", read_state.client_token());
+}
+
+}  // namespace invalidation
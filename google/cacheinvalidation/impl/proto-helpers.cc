@@ -279,6 +279,13 @@ DEFINE_TO_STRING(RateLimitP) {
   END();
 }
 
+DEFINE_TO_STRING(DebounceConfigP) {
+  BEGIN();
+  OPTIONAL(source);
+  OPTIONAL(window_ms);
+  END();
+}
+
 DEFINE_TO_STRING(ProtocolHandlerConfigP) {
   BEGIN();
   OPTIONAL(batching_delay_ms);
@@ -298,6 +305,14 @@ DEFINE_TO_STRING(ClientConfigP) {
   OPTIONAL(is_transient);
   OPTIONAL(initial_persistent_heartbeat_delay_ms);
   OPTIONAL(protocol_handler_config);
+  OPTIONAL(timer_slack_percent);
+  OPTIONAL(max_pending_upcalls);
+  OPTIONAL(max_held_invalidation_objects);
+  REPEATED(debounce_config);
+  OPTIONAL(write_coalescing_window_ms);
+  OPTIONAL(ack_journal_size);
+  OPTIONAL(buffer_registrations_before_ready);
+  OPTIONAL(memory_soft_cap_bytes);
   END();
 }
 
@@ -344,6 +359,11 @@ DEFINE_TO_STRING(InvalidationP) {
 DEFINE_TO_STRING(AckHandleP) {
   BEGIN();
   OPTIONAL(invalidation);
+  OPTIONAL(object_id);
+  OPTIONAL(version);
+  OPTIONAL(is_known_version);
+  OPTIONAL(is_trickle_restart);
+  OPTIONAL(tag);
   END();
 }
 
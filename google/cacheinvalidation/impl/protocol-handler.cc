@@ -52,6 +52,8 @@ void ParsedMessage::InitFrom(const ServerToClientMessage& raw_message) {
      base_message.header().has_registration_summary() ?
           &base_message.header().registration_summary() : NULL);
 
+  server_time_ms = base_message.header().server_time_ms();
+
   token_control_message = base_message.has_token_control_message() ?
       &base_message.token_control_message() : NULL;
 
@@ -94,6 +96,8 @@ ProtocolHandler::ProtocolHandler(
       statistics_(statistics),
       batcher_(resources->logger(), statistics),
       client_type_(client_type) {
+  throttle_.SetStatistics(statistics);
+
   // Initialize client version.
   ProtoHelpers::InitClientVersion(resources->platform(), application_name,
       &client_version_);
@@ -123,8 +127,14 @@ void ProtocolHandler::InitConfigForTest(ProtocolHandlerConfigP* config) {
 
 bool ProtocolHandler::HandleIncomingMessage(const string& incoming_message,
       ParsedMessage* parsed_message) {
+  statistics_->RecordTraffic(Statistics::TrafficCounter_RECEIVED_BYTES,
+                             incoming_message.size());
+  Time parse_start_time = internal_scheduler_->GetCurrentTime();
   ServerToClientMessage message;
   message.ParseFromString(incoming_message);
+  Time validation_start_time = internal_scheduler_->GetCurrentTime();
+  statistics_->RecordLatency(Statistics::LatencyStage_MESSAGE_PARSE,
+                             validation_start_time - parse_start_time);
   if (!message.IsInitialized()) {
     TLOG(logger_, WARNING, "Incoming message is unparseable: %s",
          ProtoHelpers::ToString(incoming_message).c_str());
@@ -136,7 +146,10 @@ bool ProtocolHandler::HandleIncomingMessage(const string& incoming_message,
   TLOG(logger_, FINE, "Incoming message: %s",
        ProtoHelpers::ToString(message).c_str());
 
-  if (!msg_validator_->IsValid(message)) {
+  bool is_valid = msg_validator_->IsValid(message);
+  statistics_->RecordLatency(Statistics::LatencyStage_MESSAGE_VALIDATION,
+      internal_scheduler_->GetCurrentTime() - validation_start_time);
+  if (!is_valid) {
     statistics_->RecordError(
         Statistics::ClientErrorType_INCOMING_MESSAGE_FAILURE);
     TLOG(logger_, SEVERE, "Received invalid message: %s",
@@ -171,6 +184,24 @@ bool ProtocolHandler::HandleIncomingMessage(const string& incoming_message,
     return false;  // Ignore all other messages in the envelope.
   }
 
+  if (message.has_invalidation_message()) {
+    const InvalidationMessage& invalidation_message =
+        message.invalidation_message();
+    statistics_->RecordTraffic(
+        Statistics::TrafficCounter_RECEIVED_INVALIDATIONS,
+        invalidation_message.invalidation_size());
+    for (int i = 0; i < invalidation_message.invalidation_size(); ++i) {
+      statistics_->RecordTraffic(
+          Statistics::TrafficCounter_RECEIVED_PAYLOAD_BYTES,
+          invalidation_message.invalidation(i).payload().size());
+    }
+  }
+  if (message.has_registration_status_message()) {
+    statistics_->RecordTraffic(
+        Statistics::TrafficCounter_RECEIVED_REGISTRATION_STATUSES,
+        message.registration_status_message().registration_status_size());
+  }
+
   if (message_header.server_time_ms() > last_known_server_time_ms_) {
     last_known_server_time_ms_ = message_header.server_time_ms();
   }
@@ -284,6 +315,14 @@ void ProtocolHandler::SendInvalidationAck(const InvalidationP& invalidation,
   batching_task->EnsureScheduled("Send-ack");
 }
 
+void ProtocolHandler::RestoreBatchedState(const ClientSnapshotP& snapshot,
+    BatchingTask* batching_task) {
+  CHECK(internal_scheduler_->IsRunningOnThread()) << "Not on internal thread";
+  if (batcher_.RestoreState(snapshot)) {
+    batching_task->EnsureScheduled("Send-after-snapshot");
+  }
+}
+
 void ProtocolHandler::SendRegistrationSyncSubtree(
     const RegistrationSubtree& reg_subtree,
     BatchingTask* batching_task) {
@@ -305,6 +344,7 @@ void ProtocolHandler::SendMessageToServer() {
     return;
   }
 
+  Time send_start_time = internal_scheduler_->GetCurrentTime();
   const bool has_client_token(!listener_->GetClientToken().empty());
   ClientToServerMessage builder;
   if (!batcher_.ToBuilder(&builder, has_client_token)) {
@@ -329,7 +369,11 @@ void ProtocolHandler::SendMessageToServer() {
   statistics_->RecordSentMessage(Statistics::SentMessageType_TOTAL);
   string serialized;
   builder.SerializeToString(&serialized);
+  statistics_->RecordTraffic(Statistics::TrafficCounter_SENT_BYTES,
+                             serialized.size());
   network_->SendMessage(serialized);
+  statistics_->RecordLatency(Statistics::LatencyStage_MESSAGE_SEND,
+      internal_scheduler_->GetCurrentTime() - send_start_time);
 
   // Record that the message was sent. We do this inline to match what the
   // Java Ticl, which is constrained by Android requirements, does.
@@ -382,12 +426,17 @@ bool Batcher::ToBuilder(ClientToServerMessage* builder, bool has_client_token) {
     InitAckMessage(builder->mutable_invalidation_ack_message());
     statistics_->RecordSentMessage(
         Statistics::SentMessageType_INVALIDATION_ACK);
+    statistics_->RecordTraffic(
+        Statistics::TrafficCounter_SENT_INVALIDATION_ACKS,
+        builder->invalidation_ack_message().invalidation_size());
   }
 
   // Check regs.
   if (!pending_registrations_.empty()) {
     InitRegistrationMessage(builder->mutable_registration_message());
     statistics_->RecordSentMessage(Statistics::SentMessageType_REGISTRATION);
+    statistics_->RecordTraffic(Statistics::TrafficCounter_SENT_REGISTRATIONS,
+        builder->registration_message().registration_size());
   }
 
   // Check reg substrees.
@@ -398,8 +447,15 @@ bool Batcher::ToBuilder(ClientToServerMessage* builder, bool has_client_token) {
     for (iter = pending_reg_subtrees_.begin();
          iter != pending_reg_subtrees_.end(); ++iter) {
       sync_message->add_subtree()->CopyFrom(*iter);
+      statistics_->RecordTraffic(
+          Statistics::TrafficCounter_SENT_SUBTREE_OBJECTS,
+          iter->registered_object_size());
     }
+    statistics_->RecordTraffic(
+        Statistics::TrafficCounter_SENT_REGISTRATION_SUBTREES,
+        sync_message->subtree_size());
     pending_reg_subtrees_.clear();
+    pending_reg_subtrees_memory_usage_ = 0;
     statistics_->RecordSentMessage(
         Statistics::SentMessageType_REGISTRATION_SYNC);
   }
@@ -413,6 +469,50 @@ bool Batcher::ToBuilder(ClientToServerMessage* builder, bool has_client_token) {
   return true;
 }
 
+void Batcher::GetMemoryUsage(vector<pair<string, int64> >* usage) {
+  usage->push_back(make_pair("BatchedRegistrations",
+                             pending_registrations_memory_usage_));
+  usage->push_back(make_pair("BatchedAcks",
+                             pending_acked_invalidations_memory_usage_));
+  usage->push_back(make_pair("BatchedRegSubtrees",
+                             pending_reg_subtrees_memory_usage_));
+}
+
+void Batcher::ExportState(ClientSnapshotP* snapshot) {
+  map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>::iterator reg_iter;
+  for (reg_iter = pending_registrations_.begin();
+       reg_iter != pending_registrations_.end(); ++reg_iter) {
+    ProtoHelpers::InitRegistrationP(reg_iter->first, reg_iter->second,
+        snapshot->add_batched_registration());
+  }
+  set<InvalidationP, ProtoCompareLess>::iterator ack_iter;
+  for (ack_iter = pending_acked_invalidations_.begin();
+       ack_iter != pending_acked_invalidations_.end(); ++ack_iter) {
+    snapshot->add_batched_ack()->CopyFrom(*ack_iter);
+  }
+  set<RegistrationSubtree, ProtoCompareLess>::iterator subtree_iter;
+  for (subtree_iter = pending_reg_subtrees_.begin();
+       subtree_iter != pending_reg_subtrees_.end(); ++subtree_iter) {
+    snapshot->add_batched_reg_subtree()->CopyFrom(*subtree_iter);
+  }
+}
+
+bool Batcher::RestoreState(const ClientSnapshotP& snapshot) {
+  for (int i = 0; i < snapshot.batched_registration_size(); ++i) {
+    const RegistrationP& registration = snapshot.batched_registration(i);
+    AddRegistration(registration.object_id(), registration.op_type());
+  }
+  for (int i = 0; i < snapshot.batched_ack_size(); ++i) {
+    AddAck(snapshot.batched_ack(i));
+  }
+  for (int i = 0; i < snapshot.batched_reg_subtree_size(); ++i) {
+    AddRegSubtree(snapshot.batched_reg_subtree(i));
+  }
+  return (snapshot.batched_registration_size() > 0) ||
+      (snapshot.batched_ack_size() > 0) ||
+      (snapshot.batched_reg_subtree_size() > 0);
+}
+
 void Batcher::InitRegistrationMessage(
     RegistrationMessage* reg_message) {
   CHECK(!pending_registrations_.empty());
@@ -425,6 +525,7 @@ void Batcher::InitRegistrationMessage(
         reg_message->add_registration());
   }
   pending_registrations_.clear();
+  pending_registrations_memory_usage_ = 0;
 }
 
 void Batcher::InitAckMessage(InvalidationMessage* ack_message) {
@@ -437,6 +538,7 @@ void Batcher::InitAckMessage(InvalidationMessage* ack_message) {
     ack_message->add_invalidation()->CopyFrom(*iter);
   }
   pending_acked_invalidations_.clear();
+  pending_acked_invalidations_memory_usage_ = 0;
 }
 
 }  // namespace invalidation
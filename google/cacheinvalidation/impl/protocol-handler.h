@@ -28,6 +28,7 @@
 #include "google/cacheinvalidation/deps/scoped_ptr.h"
 #include "google/cacheinvalidation/impl/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/impl/invalidation-client-util.h"
+#include "google/cacheinvalidation/impl/memory-usage.h"
 #include "google/cacheinvalidation/impl/proto-helpers.h"
 #include "google/cacheinvalidation/impl/recurring-task.h"
 #include "google/cacheinvalidation/impl/statistics.h"
@@ -116,12 +117,20 @@ struct ParsedMessage {
   const InfoRequestMessage* info_request_message;
   const ErrorMessage* error_message;
 
+  /* Server time of the message, in milliseconds. */
+  int64 server_time_ms;
+
   /*
    * Initializes an instance from a |raw_message|. This function makes a copy of
    * the message internally.
    */
   void InitFrom(const ServerToClientMessage& raw_message);
 
+  /* Returns the estimated memory used by this message. */
+  int64 GetMemoryUsage() const {
+    return sizeof(ParsedMessage) + base_message.ByteSize();
+  }
+
  private:
   ServerToClientMessage base_message;
   DISALLOW_COPY_AND_ASSIGN(ParsedMessage);
@@ -133,7 +142,10 @@ struct ParsedMessage {
 class Batcher {
  public:
   Batcher(Logger* logger, Statistics* statistics)
-      : logger_(logger), statistics_(statistics) {}
+      : logger_(logger), statistics_(statistics),
+        pending_registrations_memory_usage_(0),
+        pending_acked_invalidations_memory_usage_(0),
+        pending_reg_subtrees_memory_usage_(0) {}
 
   /* Sets the initialize |message| to be sent to the server. */
   void SetInitializeMessage(const InitializeMessage* message) {
@@ -148,19 +160,53 @@ class Batcher {
   /* Adds a registration on |object_id| to be sent to the server. */
   void AddRegistration(const ObjectIdP& object_id,
                        const RegistrationP::OpType& reg_op_type) {
+    if (pending_registrations_.find(object_id) ==
+        pending_registrations_.end()) {
+      pending_registrations_memory_usage_ +=
+          MemoryUsage::OfTreeEntry(object_id) + sizeof(reg_op_type);
+    }
     pending_registrations_[object_id] = reg_op_type;
   }
 
   /* Adds an acknowledgment of |invalidation| to be sent to the server. */
   void AddAck(const InvalidationP& invalidation) {
-    pending_acked_invalidations_.insert(invalidation);
+    if (pending_acked_invalidations_.insert(invalidation).second) {
+      pending_acked_invalidations_memory_usage_ +=
+          MemoryUsage::OfTreeEntry(invalidation);
+    }
   }
 
   /* Adds a registration subtree |reg_subtree| to be sent to the server. */
   void AddRegSubtree(const RegistrationSubtree& reg_subtree) {
-    pending_reg_subtrees_.insert(reg_subtree);
+    if (pending_reg_subtrees_.insert(reg_subtree).second) {
+      pending_reg_subtrees_memory_usage_ +=
+          MemoryUsage::OfTreeEntry(reg_subtree);
+    }
+  }
+
+  /* Appends the estimated memory used by the pending registrations, acks and
+   * registration subtrees, in bytes, to |usage|.
+   */
+  void GetMemoryUsage(vector<pair<string, int64> >* usage);
+
+  /* Returns whether any registration, ack or registration subtree is
+   * pending.
+   */
+  bool HasPendingOperations() const {
+    return !pending_registrations_.empty() ||
+        !pending_acked_invalidations_.empty() || !pending_reg_subtrees_.empty();
   }
 
+  /* Adds the pending registrations, acks and registration subtrees to
+   * |snapshot|.
+   */
+  void ExportState(ClientSnapshotP* snapshot);
+
+  /* Adds the batched operations in |snapshot| to those to be sent. Returns
+   * whether there were any.
+   */
+  bool RestoreState(const ClientSnapshotP& snapshot);
+
   /*
    * Builds a message from the batcher state and resets the batcher. Returns
    * whether the message could be built.
@@ -202,6 +248,13 @@ class Batcher {
   /* Set of pending registration sub trees for registration sync. */
   set<RegistrationSubtree, ProtoCompareLess> pending_reg_subtrees_;
 
+  /* Estimated memory used by the pending registrations, acks and registration
+   * subtrees, maintained as they are added and removed.
+   */
+  int64 pending_registrations_memory_usage_;
+  int64 pending_acked_invalidations_memory_usage_;
+  int64 pending_reg_subtrees_memory_usage_;
+
   /* Pending initialization message to send to the server, if any. */
   scoped_ptr<const InitializeMessage> pending_initialize_message_;
 
@@ -285,6 +338,20 @@ class ProtocolHandler {
     return next_message_send_time_ms_;
   }
 
+  /* Returns the largest server time seen in a message from the server. */
+  int64 GetLastKnownServerTimeMs() {
+    return last_known_server_time_ms_;
+  }
+
+  /* Restores the largest known server time, e.g., from persistent state. The
+   * time never moves backwards.
+   */
+  void RestoreLastKnownServerTimeMs(int64 server_time_ms) {
+    if (server_time_ms > last_known_server_time_ms_) {
+      last_known_server_time_ms_ = server_time_ms;
+    }
+  }
+
   /* Sends a message to the server to request a client token.
    *
    * Arguments:
@@ -325,6 +392,34 @@ class ProtocolHandler {
   void SendInvalidationAck(const InvalidationP& invalidation,
                            BatchingTask* batching_task);
 
+  /* Adds the operations batched to be sent to the server to |snapshot|. */
+  void ExportBatchedState(ClientSnapshotP* snapshot) {
+    batcher_.ExportState(snapshot);
+  }
+
+  /* Appends the estimated memory used by the operations batched to be sent to
+   * the server, in bytes, to |usage|.
+   */
+  void GetMemoryUsage(vector<pair<string, int64> >* usage) {
+    batcher_.GetMemoryUsage(usage);
+  }
+
+  /* Sends the operations batched to be sent to the server as soon as the rate
+   * limits allow, instead of waiting for the batching task. Does nothing if
+   * no operation is batched.
+   */
+  void FlushBatchedMessages() {
+    if (batcher_.HasPendingOperations()) {
+      throttle_.Fire();
+    }
+  }
+
+  /* Restores the operations batched in |snapshot| and schedules them to be
+   * sent using |batching_task|.
+   */
+  void RestoreBatchedState(const ClientSnapshotP& snapshot,
+                           BatchingTask* batching_task);
+
   /* Sends a single registration subtree to the server.
    *
    * Arguments:
@@ -0,0 +1,483 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks for the hot paths of the protocol layer: handling server
+// messages, batching and sending client messages, the registration store, the
+// throttle, the message validator and message formatting.
+//
+// All the inputs are built deterministically and the benchmarks are named
+// after the path and the size of their input, so that their results can be
+// compared across releases, e.g., by running with --benchmark_format=json.
+
+#include "google/cacheinvalidation/client_protocol.pb.h"
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/deps/benchmark.h"
+#include "google/cacheinvalidation/deps/gmock.h"
+#include "google/cacheinvalidation/deps/random.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/basic-system-resources.h"
+#include "google/cacheinvalidation/impl/invalidation-client-core.h"
+#include "google/cacheinvalidation/impl/protocol-handler.h"
+#include "google/cacheinvalidation/impl/proto-helpers.h"
+#include "google/cacheinvalidation/impl/simple-registration-store.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+#include "google/cacheinvalidation/impl/throttle.h"
+#include "google/cacheinvalidation/impl/ticl-message-validator.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-utils.h"
+
+namespace invalidation {
+
+using ::ipc::invalidation::ClientType_Type_TEST;
+using ::ipc::invalidation::InfoRequestMessage_InfoType_GET_PERFORMANCE_COUNTERS;
+using ::testing::NiceMock;
+
+/* The token of the benchmarked client. */
+static const char kClientToken[] = "benchmark-token";
+
+/* Size of the payload of the benchmarked invalidations. */
+static const int kPayloadSize = 100;
+
+// A logger that drops all messages, so that writing them does not dominate
+// the measurements. The arguments of the log statements are still evaluated,
+// as they are in production.
+class NullLogger : public Logger {
+ public:
+  virtual void Log(LogLevel level, const char* file, int line,
+                   const char* format, ...) {}
+
+  virtual void SetSystemResources(SystemResources* resources) {}
+};
+
+// A network channel that drops outgoing messages.
+class NullNetwork : public NetworkChannel {
+ public:
+  NullNetwork() {}
+
+  virtual ~NullNetwork() {
+    for (size_t i = 0; i < receivers_.size(); ++i) {
+      delete receivers_[i];
+    }
+  }
+
+  virtual void SendMessage(const string& outgoing_message) {}
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver) {
+    delete incoming_receiver;
+  }
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver) {
+    receivers_.push_back(network_status_receiver);
+  }
+
+  virtual void SetSystemResources(SystemResources* resources) {}
+
+ private:
+  vector<NetworkStatusCallback*> receivers_;
+};
+
+// A protocol listener for a client that holds a token and no registrations.
+class FakeProtocolListener : public ProtocolListener {
+ public:
+  FakeProtocolListener() {
+    UnitTestBase::InitZeroRegistrationSummary(&summary_);
+  }
+
+  virtual void HandleMessageSent() {}
+
+  virtual void HandleNetworkStatusChange(bool is_online) {}
+
+  virtual void GetRegistrationSummary(RegistrationSummary* summary) {
+    summary->CopyFrom(summary_);
+  }
+
+  virtual string GetClientToken() {
+    return kClientToken;
+  }
+
+ private:
+  RegistrationSummary summary_;
+};
+
+// A protocol handler running on a deterministic scheduler whose time only
+// moves when a benchmark passes it.
+class ProtocolHandlerEnvironment {
+ public:
+  ProtocolHandlerEnvironment()
+      : logger_(new NullLogger()),
+        internal_scheduler_(new SimpleDeterministicScheduler(logger_)),
+        resources_(logger_, internal_scheduler_,
+                   new NiceMock<MockScheduler>(), new NullNetwork(),
+                   new NiceMock<MockStorage>(), "benchmark"),
+        random_(0),
+        smearer_(&random_, 0),
+        validator_(logger_) {
+    internal_scheduler_->SetInitialTime(Time() + TimeDelta::FromDays(9));
+    internal_scheduler_->StartScheduler();
+    resources_.Start();
+    ProtocolHandlerConfigP config;
+    ProtocolHandler::InitConfig(&config);
+    protocol_handler_.reset(new ProtocolHandler(
+        config, &resources_, &smearer_, &statistics_, ClientType_Type_TEST,
+        "benchmark", &listener_, &validator_));
+    batching_task_.reset(new BatchingTask(protocol_handler_.get(), &smearer_,
+        TimeDelta::FromMilliseconds(config.batching_delay_ms())));
+  }
+
+  ProtocolHandler* protocol_handler() {
+    return protocol_handler_.get();
+  }
+
+  BatchingTask* batching_task() {
+    return batching_task_.get();
+  }
+
+ private:
+  /* Owned by |resources_|. */
+  Logger* logger_;
+  DeterministicScheduler* internal_scheduler_;
+
+  BasicSystemResources resources_;
+  Random random_;
+  Smearer smearer_;
+  Statistics statistics_;
+  TiclMessageValidator validator_;
+  FakeProtocolListener listener_;
+  scoped_ptr<ProtocolHandler> protocol_handler_;
+  scoped_ptr<BatchingTask> batching_task_;
+};
+
+/* Stores |count| test object ids in |object_ids|. */
+static void MakeObjectIds(int count, vector<ObjectIdP>* object_ids) {
+  UnitTestBase::InitTestObjectIds(count, object_ids);
+}
+
+/* Stores invalidations, with payloads, of |count| objects in |invalidations|.
+ */
+static void MakeInvalidations(int count, vector<InvalidationP>* invalidations) {
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(count, &object_ids);
+  UnitTestBase::MakeInvalidationsFromObjectIds(object_ids, invalidations);
+  for (size_t i = 0; i < invalidations->size(); ++i) {
+    (*invalidations)[i].set_payload(string(kPayloadSize, 'p'));
+  }
+}
+
+/* The mixes of server messages handled by BM_HandleIncomingMessage. */
+enum ServerMessageMix {
+  /* A header alone, as in a heartbeat response. */
+  SERVER_MESSAGE_HEARTBEAT,
+
+  /* A few invalidations. */
+  SERVER_MESSAGE_INVALIDATIONS,
+
+  /* The statuses of a bulk registration. */
+  SERVER_MESSAGE_REGISTRATION_STATUSES,
+
+  /* Many invalidations, registration statuses and an info request. */
+  SERVER_MESSAGE_BULK,
+};
+
+/* Returns the name of |mix|. */
+static const char* GetServerMessageMixName(ServerMessageMix mix) {
+  switch (mix) {
+    case SERVER_MESSAGE_HEARTBEAT:
+      return "heartbeat";
+    case SERVER_MESSAGE_INVALIDATIONS:
+      return "invalidations";
+    case SERVER_MESSAGE_REGISTRATION_STATUSES:
+      return "registration_statuses";
+    case SERVER_MESSAGE_BULK:
+      return "bulk";
+  }
+  return "unknown";
+}
+
+/* Stores a server message of |mix| in |message|. */
+static void MakeServerMessage(ServerMessageMix mix,
+                              ServerToClientMessage* message) {
+  ServerHeader* header = message->mutable_header();
+  ProtoHelpers::InitProtocolVersion(header->mutable_protocol_version());
+  header->set_client_token(kClientToken);
+  UnitTestBase::InitZeroRegistrationSummary(
+      header->mutable_registration_summary());
+  header->set_server_time_ms(1000000);
+  header->set_message_id("1");
+
+  int num_invalidations = 0;
+  int num_registration_statuses = 0;
+  switch (mix) {
+    case SERVER_MESSAGE_HEARTBEAT:
+      break;
+    case SERVER_MESSAGE_INVALIDATIONS:
+      num_invalidations = 5;
+      break;
+    case SERVER_MESSAGE_REGISTRATION_STATUSES:
+      num_registration_statuses = 100;
+      break;
+    case SERVER_MESSAGE_BULK:
+      num_invalidations = 100;
+      num_registration_statuses = 20;
+      message->mutable_info_request_message()->add_info_type(
+          InfoRequestMessage_InfoType_GET_PERFORMANCE_COUNTERS);
+      break;
+  }
+  vector<InvalidationP> invalidations;
+  MakeInvalidations(num_invalidations, &invalidations);
+  for (size_t i = 0; i < invalidations.size(); ++i) {
+    message->mutable_invalidation_message()->add_invalidation()->CopyFrom(
+        invalidations[i]);
+  }
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(num_registration_statuses, &object_ids);
+  vector<RegistrationStatus> registration_statuses;
+  UnitTestBase::MakeRegistrationStatusesFromObjectIds(
+      object_ids, true, true, &registration_statuses);
+  for (size_t i = 0; i < registration_statuses.size(); ++i) {
+    message->mutable_registration_status_message()->add_registration_status()
+        ->CopyFrom(registration_statuses[i]);
+  }
+}
+
+/* Stores a client message with |count| registrations and |count| acks in
+ * |message|.
+ */
+static void MakeClientMessage(int count, ClientToServerMessage* message) {
+  ClientHeader* header = message->mutable_header();
+  ProtoHelpers::InitProtocolVersion(header->mutable_protocol_version());
+  header->set_client_token(kClientToken);
+  UnitTestBase::InitZeroRegistrationSummary(
+      header->mutable_registration_summary());
+  header->set_client_time_ms(1000000);
+  header->set_max_known_server_time_ms(1000000);
+  header->set_message_id("1");
+  header->set_client_type(ClientType_Type_TEST);
+
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(count, &object_ids);
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    ProtoHelpers::InitRegistrationP(object_ids[i],
+        RegistrationP_OpType_REGISTER,
+        message->mutable_registration_message()->add_registration());
+  }
+  vector<InvalidationP> invalidations;
+  MakeInvalidations(count, &invalidations);
+  for (size_t i = 0; i < invalidations.size(); ++i) {
+    message->mutable_invalidation_ack_message()->add_invalidation()->CopyFrom(
+        invalidations[i]);
+  }
+}
+
+/* Parses, validates and dispatches a serialized server message of the mix
+ * given as argument.
+ */
+static void BM_HandleIncomingMessage(benchmark::State& state) {
+  ServerMessageMix mix = static_cast<ServerMessageMix>(state.range(0));
+  ServerToClientMessage message;
+  MakeServerMessage(mix, &message);
+  string serialized;
+  message.SerializeToString(&serialized);
+  ProtocolHandlerEnvironment environment;
+  while (state.KeepRunning()) {
+    ParsedMessage parsed_message;
+    CHECK(environment.protocol_handler()->HandleIncomingMessage(
+        serialized, &parsed_message));
+  }
+  state.SetLabel(GetServerMessageMixName(mix));
+  state.SetBytesProcessed(
+      static_cast<int64>(state.iterations()) * serialized.size());
+}
+BENCHMARK(BM_HandleIncomingMessage)
+    ->Arg(SERVER_MESSAGE_HEARTBEAT)
+    ->Arg(SERVER_MESSAGE_INVALIDATIONS)
+    ->Arg(SERVER_MESSAGE_REGISTRATION_STATUSES)
+    ->Arg(SERVER_MESSAGE_BULK);
+
+/* Batches as many registrations and acks as the argument, then builds and
+ * sends the message holding them.
+ */
+static void BM_SendMessageToServer(benchmark::State& state) {
+  int count = state.range(0);
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(count, &object_ids);
+  vector<InvalidationP> invalidations;
+  MakeInvalidations(count, &invalidations);
+  ProtocolHandlerEnvironment environment;
+  ProtocolHandler* protocol_handler = environment.protocol_handler();
+  while (state.KeepRunning()) {
+    protocol_handler->SendRegistrations(object_ids,
+        RegistrationP_OpType_REGISTER, environment.batching_task());
+    for (size_t i = 0; i < invalidations.size(); ++i) {
+      protocol_handler->SendInvalidationAck(invalidations[i],
+                                            environment.batching_task());
+    }
+    protocol_handler->SendMessageToServer();
+  }
+  state.SetItemsProcessed(static_cast<int64>(state.iterations()) * count * 2);
+}
+BENCHMARK(BM_SendMessageToServer)->RangeMultiplier(10)->Range(1, 1000);
+
+/* Adds as many objects as the argument to an empty registration store in one
+ * call, which computes the digest once.
+ */
+static void BM_RegistrationStoreBulkAdd(benchmark::State& state) {
+  int count = state.range(0);
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(count, &object_ids);
+  Sha1DigestFunction digest_function;
+  while (state.KeepRunning()) {
+    SimpleRegistrationStore store(&digest_function);
+    vector<ObjectIdP> added;
+    store.Add(object_ids, &added);
+    CHECK(store.size() == count);
+  }
+  state.SetItemsProcessed(static_cast<int64>(state.iterations()) * count);
+}
+BENCHMARK(BM_RegistrationStoreBulkAdd)
+    ->RangeMultiplier(32)->Range(1 << 10, 1 << 20)
+    ->Unit(benchmark::kMillisecond);
+
+/* Adds then removes one object in a registration store holding as many
+ * objects as the argument; each change recomputes the digest of the store.
+ */
+static void BM_RegistrationStoreAddRemove(benchmark::State& state) {
+  int count = state.range(0);
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(count + 1, &object_ids);
+  ObjectIdP extra_object_id = object_ids.back();
+  object_ids.pop_back();
+  Sha1DigestFunction digest_function;
+  SimpleRegistrationStore store(&digest_function);
+  vector<ObjectIdP> added;
+  store.Add(object_ids, &added);
+  while (state.KeepRunning()) {
+    store.Add(extra_object_id);
+    store.Remove(extra_object_id);
+  }
+  state.SetItemsProcessed(static_cast<int64>(state.iterations()) * 2);
+}
+BENCHMARK(BM_RegistrationStoreAddRemove)
+    ->RangeMultiplier(32)->Range(1 << 10, 1 << 20)
+    ->Unit(benchmark::kMicrosecond);
+
+/* Returns the digest of a registration store holding as many objects as the
+ * argument.
+ */
+static void BM_RegistrationStoreGetDigest(benchmark::State& state) {
+  int count = state.range(0);
+  vector<ObjectIdP> object_ids;
+  MakeObjectIds(count, &object_ids);
+  Sha1DigestFunction digest_function;
+  SimpleRegistrationStore store(&digest_function);
+  vector<ObjectIdP> added;
+  store.Add(object_ids, &added);
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(store.GetDigest());
+  }
+}
+BENCHMARK(BM_RegistrationStoreGetDigest)
+    ->RangeMultiplier(32)->Range(1 << 10, 1 << 20);
+
+/* Fires a throttle with the default rate limits of the protocol handler. With
+ * an argument of 0, enough time passes between calls for all of them to be
+ * allowed; with 1, time stands still, so that the calls are rate limited.
+ */
+static void BM_ThrottleFire(benchmark::State& state) {
+  bool is_limited = (state.range(0) != 0);
+  NullLogger logger;
+  SimpleDeterministicScheduler scheduler(&logger);
+  scheduler.StartScheduler();
+  ProtocolHandlerConfigP config;
+  ProtocolHandler::InitConfig(&config);
+  Throttle throttle(config.rate_limit(), &scheduler,
+                    NewPermanentCallback(&benchmark::ClobberMemory));
+  TimeDelta step = TimeDelta::FromMinutes(1);
+  while (state.KeepRunning()) {
+    throttle.Fire();
+    if (!is_limited) {
+      scheduler.PassTime(step, step);
+    }
+  }
+  state.SetLabel(is_limited ? "limited" : "allowed");
+}
+BENCHMARK(BM_ThrottleFire)->Arg(0)->Arg(1);
+
+/* Validates a server message of the mix given as argument. */
+static void BM_ValidateServerMessage(benchmark::State& state) {
+  ServerMessageMix mix = static_cast<ServerMessageMix>(state.range(0));
+  ServerToClientMessage message;
+  MakeServerMessage(mix, &message);
+  NullLogger logger;
+  TiclMessageValidator validator(&logger);
+  while (state.KeepRunning()) {
+    CHECK(validator.IsValid(message));
+  }
+  state.SetLabel(GetServerMessageMixName(mix));
+}
+BENCHMARK(BM_ValidateServerMessage)
+    ->Arg(SERVER_MESSAGE_HEARTBEAT)
+    ->Arg(SERVER_MESSAGE_INVALIDATIONS)
+    ->Arg(SERVER_MESSAGE_REGISTRATION_STATUSES)
+    ->Arg(SERVER_MESSAGE_BULK);
+
+/* Validates a client message with as many registrations and acks as the
+ * argument.
+ */
+static void BM_ValidateClientMessage(benchmark::State& state) {
+  ClientToServerMessage message;
+  MakeClientMessage(state.range(0), &message);
+  NullLogger logger;
+  TiclMessageValidator validator(&logger);
+  while (state.KeepRunning()) {
+    CHECK(validator.IsValid(message));
+  }
+}
+BENCHMARK(BM_ValidateClientMessage)->RangeMultiplier(10)->Range(1, 1000);
+
+/* Formats a client message with as many registrations and acks as the
+ * argument, as done when logging each sent message.
+ */
+static void BM_ClientMessageToString(benchmark::State& state) {
+  ClientToServerMessage message;
+  MakeClientMessage(state.range(0), &message);
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(ProtoHelpers::ToString(message));
+  }
+}
+BENCHMARK(BM_ClientMessageToString)->RangeMultiplier(10)->Range(1, 1000);
+
+/* Formats a server message of the mix given as argument, as done when logging
+ * each received message.
+ */
+static void BM_ServerMessageToString(benchmark::State& state) {
+  ServerMessageMix mix = static_cast<ServerMessageMix>(state.range(0));
+  ServerToClientMessage message;
+  MakeServerMessage(mix, &message);
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(ProtoHelpers::ToString(message));
+  }
+  state.SetLabel(GetServerMessageMixName(mix));
+}
+BENCHMARK(BM_ServerMessageToString)
+    ->Arg(SERVER_MESSAGE_HEARTBEAT)
+    ->Arg(SERVER_MESSAGE_INVALIDATIONS)
+    ->Arg(SERVER_MESSAGE_REGISTRATION_STATUSES)
+    ->Arg(SERVER_MESSAGE_BULK);
+
+}  // namespace invalidation
+
+BENCHMARK_MAIN();
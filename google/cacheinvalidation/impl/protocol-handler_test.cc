@@ -476,6 +476,86 @@ TEST_F(ProtocolHandlerTest, IncomingCompositeMessage) {
   ASSERT_TRUE(parsed_message.info_request_message != NULL);
 }
 
+// Checks that sending a message counts its bytes and the elements it holds.
+TEST_F(ProtocolHandlerTest, TrafficCountersForSentMessage) {
+  token = "test token";
+  vector<ObjectIdP> oids;
+  InitTestObjectIds(3, &oids);
+  vector<ObjectIdP> oid_vec(oids.begin(), oids.begin() + 2);
+  internal_scheduler->Schedule(
+      Scheduler::NoDelay(),
+      NewPermanentCallback(
+          protocol_handler.get(), &ProtocolHandler::SendRegistrations,
+          oid_vec, RegistrationP_OpType_REGISTER, batching_task.get()));
+  vector<InvalidationP> invalidations;
+  MakeInvalidationsFromObjectIds(oids, &invalidations);
+  internal_scheduler->Schedule(
+      Scheduler::NoDelay(),
+      NewPermanentCallback(
+          protocol_handler.get(), &ProtocolHandler::SendInvalidationAck,
+          invalidations[0], batching_task.get()));
+  RegistrationSubtree subtree;
+  subtree.add_registered_object()->CopyFrom(oids[1]);
+  subtree.add_registered_object()->CopyFrom(oids[2]);
+  internal_scheduler->Schedule(
+      Scheduler::NoDelay(),
+      NewPermanentCallback(
+          protocol_handler.get(), &ProtocolHandler::SendRegistrationSyncSubtree,
+          subtree, batching_task.get()));
+
+  AddExpectationForHandleMessageSent();
+  string actual_serialized;
+  EXPECT_CALL(*network, SendMessage(_))
+      .WillOnce(SaveArg<0>(&actual_serialized));
+  internal_scheduler->PassTime(GetMaxBatchingDelay(config));
+
+  EXPECT_EQ(static_cast<int64>(actual_serialized.size()),
+            statistics->GetTrafficCounterForTest(
+                Statistics::TrafficCounter_SENT_BYTES));
+  EXPECT_EQ(2, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_SENT_REGISTRATIONS));
+  EXPECT_EQ(1, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_SENT_INVALIDATION_ACKS));
+  EXPECT_EQ(1, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_SENT_REGISTRATION_SUBTREES));
+  EXPECT_EQ(2, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_SENT_SUBTREE_OBJECTS));
+}
+
+// Checks that receiving a message counts its bytes and the elements it holds.
+TEST_F(ProtocolHandlerTest, TrafficCountersForReceivedMessage) {
+  ServerToClientMessage message;
+  token = "test token";
+  InitServerHeader(token, message.mutable_header());
+  vector<ObjectIdP> object_ids;
+  InitTestObjectIds(2, &object_ids);
+  vector<InvalidationP> invalidations;
+  MakeInvalidationsFromObjectIds(object_ids, &invalidations);
+  invalidations[0].set_payload("payload");
+  for (size_t i = 0; i < invalidations.size(); ++i) {
+    message.mutable_invalidation_message()->add_invalidation()->CopyFrom(
+        invalidations[i]);
+  }
+  vector<RegistrationStatus> registration_statuses;
+  MakeRegistrationStatusesFromObjectIds(object_ids, true, true,
+                                        &registration_statuses);
+  message.mutable_registration_status_message()->add_registration_status()
+      ->CopyFrom(registration_statuses[0]);
+
+  ParsedMessage parsed_message;
+  ASSERT_TRUE(ProcessMessage(message, &parsed_message));
+
+  EXPECT_EQ(static_cast<int64>(message.ByteSize()),
+            statistics->GetTrafficCounterForTest(
+                Statistics::TrafficCounter_RECEIVED_BYTES));
+  EXPECT_EQ(2, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_RECEIVED_INVALIDATIONS));
+  EXPECT_EQ(7, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_RECEIVED_PAYLOAD_BYTES));
+  EXPECT_EQ(1, statistics->GetTrafficCounterForTest(
+      Statistics::TrafficCounter_RECEIVED_REGISTRATION_STATUSES));
+}
+
 // Test that the protocol handler drops an invalid message.
 TEST_F(ProtocolHandlerTest, InvalidInboundMessage) {
   // Make an invalid message (omit protocol version from header).
@@ -25,7 +25,8 @@ RecurringTask::RecurringTask(string name, Scheduler* scheduler, Logger* logger,
     TimeDelta initial_delay, TimeDelta timeout_delay) : name_(name),
     scheduler_(scheduler), logger_(logger), smearer_(smearer),
     delay_generator_(delay_generator), initial_delay_(initial_delay),
-    timeout_delay_(timeout_delay), is_scheduled_(false) {
+    timeout_delay_(timeout_delay), is_scheduled_(false),
+    timer_coalescer_(NULL), timer_slack_percent_(0), task_statistics_(NULL) {
 }
 
 void RecurringTask::EnsureScheduled(string debug_reason) {
@@ -53,8 +54,23 @@ void RecurringTask::EnsureScheduled(bool is_retry, string debug_reason) {
   TLOG(logger_, FINE, "[%s] Scheduling %d with a delay %d, Now = %d",
        debug_reason.c_str(), name_.c_str(), delay.ToInternalValue(),
        scheduler_->GetCurrentTime().ToInternalValue());
-  scheduler_->Schedule(delay, NewPermanentCallback(this,
-       &RecurringTask::RunTaskAndRescheduleIfNeeded));
+  Closure* task =
+      NewPermanentCallback(this, &RecurringTask::RunTaskAndRescheduleIfNeeded);
+  if (timer_coalescer_ != NULL) {
+    TimeDelta slack = delay * timer_slack_percent_ / 100;
+    if (task_statistics_ != NULL) {
+      // The task is meant to run at its wakeup, which the coalescer may delay
+      // within the slack: only the time past it is lateness.
+      task = task_statistics_->Wrap(name_, scheduler_,
+          timer_coalescer_->GetWakeupDelay(delay, slack), task);
+    }
+    timer_coalescer_->Schedule(delay, slack, task);
+  } else {
+    if (task_statistics_ != NULL) {
+      task = task_statistics_->Wrap(name_, scheduler_, delay, task);
+    }
+    scheduler_->Schedule(delay, task);
+  }
   is_scheduled_ = true;
 }
 
@@ -33,6 +33,8 @@
 #include "google/cacheinvalidation/include/system-resources.h"
 #include "google/cacheinvalidation/impl/exponential-backoff-delay-generator.h"
 #include "google/cacheinvalidation/impl/smearer.h"
+#include "google/cacheinvalidation/impl/task-statistics.h"
+#include "google/cacheinvalidation/impl/timer-coalescer.h"
 
 namespace invalidation {
 
@@ -70,6 +72,28 @@ class RecurringTask {
    */
   void EnsureScheduled(string debug_reason);
 
+  /* Makes subsequent schedulings of this task go through |timer_coalescer|,
+   * allowing each run to be delayed by up to |slack_percent| percent of its
+   * delay so that it can share a wakeup with other tasks. A NULL
+   * |timer_coalescer| schedules directly on the scheduler again.
+   *
+   * Space for |timer_coalescer| is owned by the caller.
+   */
+  void SetTimerCoalescer(TimerCoalescer* timer_coalescer, int slack_percent) {
+    timer_coalescer_ = timer_coalescer;
+    timer_slack_percent_ = slack_percent;
+  }
+
+  /* Records the lateness, queue depth and run time of the subsequent runs of
+   * this task in |task_statistics| under the name of the task. A NULL
+   * |task_statistics| stops the recording.
+   *
+   * Space for |task_statistics| is owned by the caller.
+   */
+  void SetTaskStatistics(TaskStatistics* task_statistics) {
+    task_statistics_ = task_statistics;
+  }
+
   /* Space for the returned Smearer is still owned by this class. */
   Smearer* smearer() {
     return smearer_;
@@ -120,6 +144,17 @@ class RecurringTask {
   /* If the task has been currently scheduled. */
   bool is_scheduled_;
 
+  /* If not NULL, the coalescer through which the task is scheduled. */
+  TimerCoalescer* timer_coalescer_;
+
+  /* Slack allowed when scheduling through |timer_coalescer_|, as a percentage
+   * of the delay.
+   */
+  int timer_slack_percent_;
+
+  /* If not NULL, the statistics in which the runs of the task are recorded. */
+  TaskStatistics* task_statistics_;
+
   DISALLOW_COPY_AND_ASSIGN(RecurringTask);
 };
 
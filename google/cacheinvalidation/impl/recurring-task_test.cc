@@ -19,6 +19,8 @@
 #include "google/cacheinvalidation/deps/random.h"
 #include "google/cacheinvalidation/deps/string_util.h"
 #include "google/cacheinvalidation/impl/recurring-task.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+#include "google/cacheinvalidation/impl/timer-coalescer.h"
 #include "google/cacheinvalidation/test/deterministic-scheduler.h"
 #include "google/cacheinvalidation/test/test-logger.h"
 #include "google/cacheinvalidation/test/test-utils.h"
@@ -205,6 +207,126 @@ TEST_F(RecurringTaskTest, ExponentialBackoffTask) {
   ASSERT_EQ(kDefaultNumRuns, task.current_runs);
 }
 
+/* Tests that the runs of a task are recorded in its task statistics. */
+TEST_F(RecurringTaskTest, RecordsTaskStatistics) {
+  TaskStatistics task_statistics;
+  TestTask task(scheduler.get(), logger.get(), smearer.get(), NULL,
+                "InstrumentedTask", 1);
+  task.SetTaskStatistics(&task_statistics);
+  task.EnsureScheduled("testRecordsTaskStatistics");
+
+  LatencyHistogram lateness;
+  LatencyHistogram run_time;
+  int queue_depth;
+  ASSERT_TRUE(task_statistics.GetTaskStatisticsForTest(
+      "InstrumentedTask", &lateness, &run_time, &queue_depth));
+  EXPECT_EQ(1, queue_depth);
+  EXPECT_EQ(0, lateness.count());
+
+  scheduler->PassTime(end_of_test_delay);
+  ASSERT_EQ(1, task.current_runs);
+  ASSERT_TRUE(task_statistics.GetTaskStatisticsForTest(
+      "InstrumentedTask", &lateness, &run_time, &queue_depth));
+  EXPECT_EQ(0, queue_depth);
+  EXPECT_EQ(1, lateness.count());
+  EXPECT_EQ(1, run_time.count());
+  EXPECT_FALSE(task_statistics.GetTaskStatisticsForTest(
+      "OtherTask", &lateness, &run_time, &queue_depth));
+  delete delay_generator;
+}
+
+/* Tests that the slack granted to a coalesced task does not count as
+ * lateness.
+ */
+TEST_F(RecurringTaskTest, CoalescingSlackIsNotLateness) {
+  Statistics statistics;
+  TimerCoalescer timer_coalescer(scheduler.get(), &statistics, logger.get());
+  TaskStatistics task_statistics;
+  TestTask task(scheduler.get(), logger.get(), smearer.get(), NULL,
+                "CoalescedTask", 1);
+  task.SetTaskStatistics(&task_statistics);
+  task.SetTimerCoalescer(&timer_coalescer, 100);
+  Time start = scheduler->GetCurrentTime();
+  task.EnsureScheduled("testCoalescingSlackIsNotLateness");
+
+  // Nothing else is pending, so the task waits out all of its slack.
+  scheduler->PassTime(TestTask::initial_delay);
+  EXPECT_EQ(0, task.current_runs);
+  scheduler->PassTime(end_of_test_delay);
+  ASSERT_EQ(1, task.current_runs);
+  EXPECT_EQ(0, timer_coalescer.GetPendingWakeupCountForTest());
+
+  LatencyHistogram lateness;
+  LatencyHistogram run_time;
+  int queue_depth;
+  ASSERT_TRUE(task_statistics.GetTaskStatisticsForTest(
+      "CoalescedTask", &lateness, &run_time, &queue_depth));
+  EXPECT_EQ(1, lateness.count());
+  EXPECT_EQ(TimeDelta(), lateness.max());
+  EXPECT_LT(start + TestTask::initial_delay, scheduler->GetCurrentTime());
+  delete delay_generator;
+}
+
+/* A task that records whether it was deleted. */
+class DeletionRecordingTask : public Closure {
+ public:
+  explicit DeletionRecordingTask(bool* deleted) : deleted_(deleted) {}
+
+  virtual ~DeletionRecordingTask() {
+    *deleted_ = true;
+  }
+
+  virtual bool IsRepeatable() const {
+    return false;
+  }
+
+  virtual void Run() {}
+
+ private:
+  bool* deleted_;
+};
+
+/* Tests that a wrapped task deleted without running, as a scheduler may do on
+ * shutdown, deletes its inner task and no longer counts as queued.
+ */
+TEST_F(RecurringTaskTest, DroppedWrappedTask) {
+  TaskStatistics task_statistics;
+  bool deleted = false;
+  Closure* task = task_statistics.Wrap(
+      "DroppedTask", scheduler.get(), Scheduler::NoDelay(),
+      new DeletionRecordingTask(&deleted));
+
+  LatencyHistogram lateness;
+  LatencyHistogram run_time;
+  int queue_depth;
+  ASSERT_TRUE(task_statistics.GetTaskStatisticsForTest(
+      "DroppedTask", &lateness, &run_time, &queue_depth));
+  EXPECT_EQ(1, queue_depth);
+
+  delete task;
+  EXPECT_TRUE(deleted);
+  ASSERT_TRUE(task_statistics.GetTaskStatisticsForTest(
+      "DroppedTask", &lateness, &run_time, &queue_depth));
+  EXPECT_EQ(0, queue_depth);
+  EXPECT_EQ(0, lateness.count());
+  delete delay_generator;
+}
+
+/* Tests that a wrapped task may be deleted after its task statistics, as a
+ * scheduler outliving the client does on shutdown.
+ */
+TEST_F(RecurringTaskTest, WrappedTaskOutlivesStatistics) {
+  scoped_ptr<TaskStatistics> task_statistics(new TaskStatistics());
+  bool deleted = false;
+  Closure* task = task_statistics->Wrap(
+      "DroppedTask", scheduler.get(), Scheduler::NoDelay(),
+      new DeletionRecordingTask(&deleted));
+  task_statistics.reset();
+  delete task;
+  EXPECT_TRUE(deleted);
+  delete delay_generator;
+}
+
 /* Tests a one-shot task (i.e. no repetition) that is run twice. */
 TEST_F(RecurringTaskTest, OneShotTask) {
   /* Create a no-repeating task and pass time - make sure that the task runs
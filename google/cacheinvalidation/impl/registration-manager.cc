@@ -20,15 +20,19 @@
 
 #include "google/cacheinvalidation/impl/client-protocol-namespace-fix.h"
 #include "google/cacheinvalidation/impl/log-macro.h"
+#include "google/cacheinvalidation/impl/memory-usage.h"
 #include "google/cacheinvalidation/impl/proto-helpers.h"
 #include "google/cacheinvalidation/impl/simple-registration-store.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
 RegistrationManager::RegistrationManager(
     Logger* logger, Statistics* statistics, DigestFunction* digest_function)
     : desired_registrations_(new SimpleRegistrationStore(digest_function)),
       statistics_(statistics),
+      pending_operations_memory_usage_(0),
       logger_(logger) {
   // Initialize the server summary with a 0 size and the digest corresponding to
   // it.  Using defaultInstance would wrong since the server digest will not
@@ -42,7 +46,7 @@ void RegistrationManager::PerformOperations(
   // Record that we have pending operations on the objects.
   vector<ObjectIdP>::const_iterator iter = object_ids.begin();
   for (; iter != object_ids.end(); iter++) {
-    pending_operations_[*iter] = reg_op_type;
+    SetPendingOperation(*iter, reg_op_type);
   }
   // Update the digest appropriately.
   if (reg_op_type == RegistrationP_OpType_REGISTER) {
@@ -52,6 +56,53 @@ void RegistrationManager::PerformOperations(
   }
 }
 
+void RegistrationManager::PerformDigestedOperations(
+    const vector<pair<string, ObjectIdP> >& digested_object_ids,
+    RegistrationP::OpType reg_op_type, vector<ObjectIdP>* oids_to_send) {
+  // Record that we have pending operations on the objects.
+  for (size_t i = 0; i < digested_object_ids.size(); ++i) {
+    SetPendingOperation(digested_object_ids[i].second, reg_op_type);
+  }
+  // Update the digest appropriately.
+  if (reg_op_type == RegistrationP_OpType_REGISTER) {
+    desired_registrations_->AddDigested(digested_object_ids, oids_to_send);
+  } else {
+    desired_registrations_->RemoveDigested(digested_object_ids, oids_to_send);
+  }
+}
+
+void RegistrationManager::ExportState(ClientSnapshotP* snapshot) {
+  vector<ObjectIdP> desired_oids;
+  desired_registrations_->GetElements(kEmptyPrefix, 0, &desired_oids);
+  for (size_t i = 0; i < desired_oids.size(); ++i) {
+    snapshot->add_desired_registration()->CopyFrom(desired_oids[i]);
+  }
+  map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>::iterator iter;
+  for (iter = pending_operations_.begin(); iter != pending_operations_.end();
+       ++iter) {
+    ProtoHelpers::InitRegistrationP(iter->first, iter->second,
+        snapshot->add_pending_operation());
+  }
+  snapshot->mutable_last_known_server_summary()->CopyFrom(
+      last_known_server_summary_);
+}
+
+void RegistrationManager::RestoreState(const ClientSnapshotP& snapshot) {
+  CHECK(desired_registrations_->size() == 0);
+  CHECK(pending_operations_.empty());
+  vector<ObjectIdP> desired_oids(snapshot.desired_registration().begin(),
+                                 snapshot.desired_registration().end());
+  vector<ObjectIdP> added_oids;
+  desired_registrations_->Add(desired_oids, &added_oids);
+  for (int i = 0; i < snapshot.pending_operation_size(); ++i) {
+    const RegistrationP& operation = snapshot.pending_operation(i);
+    SetPendingOperation(operation.object_id(), operation.op_type());
+  }
+  if (snapshot.has_last_known_server_summary()) {
+    last_known_server_summary_.CopyFrom(snapshot.last_known_server_summary());
+  }
+}
+
 void RegistrationManager::GetRegistrations(
     const string& digest_prefix, int prefix_len, RegistrationSubtree* builder) {
   vector<ObjectIdP> oids;
@@ -79,7 +130,7 @@ void RegistrationManager::HandleRegistrationStatus(
     // for it, so remove it from the pendingOperations map. (It may or may not
     // have existed in the map, since we can receive spontaneous status messages
     // from the server.)
-    pending_operations_.erase(object_id_proto);
+    ErasePendingOperation(object_id_proto);
 
     // We start off with the local-processing set as success, then potentially
     // fail.
@@ -123,6 +174,30 @@ void RegistrationManager::GetClientSummary(RegistrationSummary* summary) {
   summary->set_registration_digest(desired_registrations_->GetDigest());
 }
 
+void RegistrationManager::GetMemoryUsage(
+    vector<pair<string, int64> >* usage) {
+  usage->push_back(make_pair("RegistrationStore",
+                             desired_registrations_->GetMemoryUsage()));
+  usage->push_back(make_pair("PendingOperations",
+                             pending_operations_memory_usage_));
+}
+
+void RegistrationManager::SetPendingOperation(const ObjectIdP& object_id,
+                                              RegistrationP::OpType op_type) {
+  if (pending_operations_.find(object_id) == pending_operations_.end()) {
+    pending_operations_memory_usage_ +=
+        MemoryUsage::OfTreeEntry(object_id) + sizeof(op_type);
+  }
+  pending_operations_[object_id] = op_type;
+}
+
+void RegistrationManager::ErasePendingOperation(const ObjectIdP& object_id) {
+  if (pending_operations_.erase(object_id) > 0) {
+    pending_operations_memory_usage_ -=
+        MemoryUsage::OfTreeEntry(object_id) + sizeof(RegistrationP::OpType);
+  }
+}
+
 string RegistrationManager::ToString() {
   return StringPrintf(
       "Last known digest: %s, Requested regs: %s",
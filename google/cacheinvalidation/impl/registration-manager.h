@@ -62,6 +62,13 @@ class RegistrationManager {
                          RegistrationP::OpType reg_op_type,
                          vector<ObjectIdP>* oids_to_send);
 
+  /* Like PerformOperations, for object ids given with their digests, computed
+   * earlier with the digest function of this manager.
+   */
+  void PerformDigestedOperations(
+      const vector<pair<string, ObjectIdP> >& digested_object_ids,
+      RegistrationP::OpType reg_op_type, vector<ObjectIdP>* oids_to_send);
+
   /* Initializes a registration subtree for registrations where the digest of
    * the object id begins with the prefix digest_prefix of prefix_len bits. This
    * method may also return objects whose digest prefix does not match
@@ -101,7 +108,7 @@ class RegistrationManager {
     for (; pending_iter != pending_operations_.end(); pending_iter++) {
       result->push_back(pending_iter->first);
     }
-    pending_operations_.clear();
+    ClearPendingOperations();
 
     // De-dup result.
     set<ObjectIdP, ProtoCompareLess> unique_oids(result->begin(),
@@ -124,6 +131,25 @@ class RegistrationManager {
     server_summary->CopyFrom(last_known_server_summary_);
   }
 
+  /* Restores the last known summary from the server, e.g., from persistent
+   * state, without making any upcalls.
+   */
+  void RestoreServerSummary(const RegistrationSummary& server_summary) {
+    last_known_server_summary_.CopyFrom(server_summary);
+  }
+
+  /* Adds the desired registrations, the pending operations and the last known
+   * server summary to |snapshot|.
+   */
+  void ExportState(ClientSnapshotP* snapshot);
+
+  /* Restores the desired registrations, the pending operations and the last
+   * known server summary from |snapshot|, without making any upcalls.
+   *
+   * REQUIRES: There are no desired registrations or pending operations.
+   */
+  void RestoreState(const ClientSnapshotP& snapshot);
+
   /* Informs the manager of a new registration state summary from the server.
    * Modifies upcalls to contain zero or more RegistrationP. For each added
    * RegistrationP, the caller should make an inform-registration-status upcall
@@ -144,7 +170,7 @@ class RegistrationManager {
             pending_iter->second, &reg_p);
         upcalls->push_back(reg_p);
       }
-      pending_operations_.clear();
+      ClearPendingOperations();
     }
   }
 
@@ -160,12 +186,32 @@ class RegistrationManager {
          summary.registration_digest());
   }
 
+  /* Appends the estimated memory used by the desired registrations and the
+   * pending operations, in bytes, to |usage|.
+   */
+  void GetMemoryUsage(vector<pair<string, int64> >* usage);
+
   string ToString();
 
   // Empty hash prefix.
   static const char* kEmptyPrefix;
 
  private:
+  /* Records a pending |op_type| operation on |object_id|, replacing any
+   * earlier one.
+   */
+  void SetPendingOperation(const ObjectIdP& object_id,
+                           RegistrationP::OpType op_type);
+
+  /* Removes the pending operation on |object_id|, if any. */
+  void ErasePendingOperation(const ObjectIdP& object_id);
+
+  /* Removes all the pending operations. */
+  void ClearPendingOperations() {
+    pending_operations_.clear();
+    pending_operations_memory_usage_ = 0;
+  }
+
   /* The set of regisrations that the application has requested for. */
   scoped_ptr<DigestStore<ObjectIdP> > desired_registrations_;
 
@@ -190,6 +236,11 @@ class RegistrationManager {
   map<ObjectIdP, RegistrationP::OpType, ProtoCompareLess>
       pending_operations_;
 
+  /* Estimated memory used by |pending_operations_|, maintained as operations
+   * are added and removed.
+   */
+  int64 pending_operations_memory_usage_;
+
   Logger* logger_;
 };
 
@@ -18,47 +18,411 @@
 
 #include "google/cacheinvalidation/impl/safe-storage.h"
 
+#include "google/cacheinvalidation/deps/logging.h"
+
 namespace invalidation {
 
+SafeStorage::~SafeStorage() {
+  map<string, KeyState>::iterator iter;
+  for (iter = key_states_.begin(); iter != key_states_.end(); ++iter) {
+    for (size_t i = 0; i < iter->second.pending_callbacks.size(); ++i) {
+      delete iter->second.pending_callbacks[i];
+    }
+    for (size_t i = 0; i < iter->second.in_flight_callbacks.size(); ++i) {
+      delete iter->second.in_flight_callbacks[i];
+    }
+  }
+  for (size_t i = 0; i < queued_batches_.size(); ++i) {
+    BatchWrite* batch = queued_batches_[i];
+    delete batch->done;
+    for (size_t j = 0; j < batch->superseded.size(); ++j) {
+      delete batch->superseded[j];
+    }
+    delete batch;
+  }
+}
+
 void SafeStorage::SetSystemResources(SystemResources* resources) {
   scheduler_ = resources->internal_scheduler();
 }
 
 void SafeStorage::WriteKey(const string& key, const string& value,
     WriteKeyCallback* done) {
-  delegate_->WriteKey(key, value,
-      NewPermanentCallback(this, &SafeStorage::WriteCallback, done));
+  if (statistics_ == NULL) {
+    delegate_->WriteKey(key, value,
+        NewPermanentCallback(this, &SafeStorage::WriteCallback, done));
+    return;
+  }
+  KeyState* state = &key_states_[key];
+  if (state->has_pending) {
+    statistics_->RecordStorageEvent(
+        Statistics::StorageEventType_COALESCED_WRITE);
+  }
+  state->has_pending = true;
+  state->pending_value = value;
+  state->pending_callbacks.push_back(done);
+  if (!CanIssueWrite(*state) || state->flush_scheduled) {
+    // Issued when the write in flight or the waiting batch finishes, or the
+    // window passes.
+    return;
+  }
+  if (coalescing_window_ <= Scheduler::NoDelay()) {
+    IssueWrite(key);
+  } else {
+    state->flush_scheduled = true;
+    scheduler_->Schedule(coalescing_window_,
+        NewPermanentCallback(this, &SafeStorage::FlushKey, key));
+  }
+}
+
+void SafeStorage::FlushKey(string key) {
+  map<string, KeyState>::iterator iter = key_states_.find(key);
+  if (iter == key_states_.end()) {
+    return;
+  }
+  iter->second.flush_scheduled = false;
+  if (!CanIssueWrite(iter->second)) {
+    // The held write is issued when the write in flight or the waiting batch
+    // finishes.
+    return;
+  }
+  if (iter->second.has_pending) {
+    IssueWrite(key);
+  } else {
+    key_states_.erase(iter);
+  }
+}
+
+void SafeStorage::IssueWrite(const string& key) {
+  KeyState* state = &key_states_[key];
+  state->has_pending = false;
+  state->in_flight = true;
+  state->in_flight_readable = true;
+  state->in_flight_value.swap(state->pending_value);
+  state->pending_value.clear();
+  state->in_flight_callbacks.swap(state->pending_callbacks);
+  state->in_flight_start_time = scheduler_->GetCurrentTime();
+  statistics_->RecordStorageEvent(Statistics::StorageEventType_PHYSICAL_WRITE);
+  delegate_->WriteKey(key, state->in_flight_value,
+      NewPermanentCallback(this, &SafeStorage::CoalescedWriteCallback, key));
+}
+
+void SafeStorage::CoalescedWriteCallback(string key, Status status) {
+  ScheduleCallback(
+      NewPermanentCallback(this, &SafeStorage::FinishCoalescedWrite, key,
+                           status));
+}
+
+void SafeStorage::FinishCoalescedWrite(string key, Status status) {
+  map<string, KeyState>::iterator iter = key_states_.find(key);
+  CHECK(iter != key_states_.end()) << "No write in flight for " << key;
+  statistics_->RecordLatency(Statistics::LatencyStage_STORAGE_WRITE,
+      scheduler_->GetCurrentTime() - iter->second.in_flight_start_time);
+  vector<WriteKeyCallback*> callbacks;
+  EndKeyWrite(key, &callbacks);
+  if (!queued_batches_.empty()) {
+    IssueQueuedBatches();
+  }
+  for (size_t i = 0; i < callbacks.size(); ++i) {
+    callbacks[i]->Run(status);
+    delete callbacks[i];
+  }
+}
+
+void SafeStorage::EndKeyWrite(const string& key,
+                              vector<WriteKeyCallback*>* callbacks) {
+  map<string, KeyState>::iterator iter = key_states_.find(key);
+  CHECK(iter != key_states_.end()) << "No write in flight for " << key;
+  KeyState* state = &iter->second;
+  state->in_flight = false;
+  state->in_flight_readable = false;
+  state->in_flight_value.clear();
+  callbacks->swap(state->in_flight_callbacks);
+  if (state->has_pending) {
+    // The value written was superseded: its writers get the status of the
+    // write carrying the later value.
+    state->pending_callbacks.insert(state->pending_callbacks.begin(),
+                                    callbacks->begin(), callbacks->end());
+    callbacks->clear();
+    if (!state->flush_scheduled && (state->num_queued_batches == 0)) {
+      IssueWrite(key);
+    }
+  } else if (!state->flush_scheduled && (state->num_queued_batches == 0)) {
+    key_states_.erase(iter);
+  }
+}
+
+void SafeStorage::ScheduleCallback(Closure* callback) {
+  if (statistics_ != NULL) {
+    callback = statistics_->task_statistics()->Wrap(
+        "StorageCallback", scheduler_, Scheduler::NoDelay(), callback);
+  }
+  scheduler_->Schedule(Scheduler::NoDelay(), callback);
 }
 
 void SafeStorage::WriteCallback(WriteKeyCallback* done, Status status) {
-  scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleCallback(
       /* Owns 'done'. */ NewPermanentCallback(done, status));
 }
 
 void SafeStorage::ReadKey(const string& key, ReadKeyCallback* done) {
+  map<string, KeyState>::iterator iter = key_states_.find(key);
+  string value;
+  if ((iter != key_states_.end()) &&
+      GetUnpersistedValue(iter->second, &value)) {
+    // Read your writes: return the latest value, even if not persisted yet.
+    ScheduleCallback(
+        /* Owns 'done'. */ NewPermanentCallback(done,
+            StatusStringPair(Status(Status::SUCCESS, ""), value)));
+    return;
+  }
+  if (statistics_ != NULL) {
+    delegate_->ReadKey(key,
+        NewPermanentCallback(this, &SafeStorage::TimedReadCallback, done,
+                             scheduler_->GetCurrentTime()));
+    return;
+  }
   delegate_->ReadKey(key,
       NewPermanentCallback(this, &SafeStorage::ReadCallback, done));
 }
 
 void SafeStorage::ReadCallback(ReadKeyCallback* done,
     StatusStringPair read_result) {
-  scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleCallback(
       /* Owns 'done'. */ NewPermanentCallback(done, read_result));
 }
 
+void SafeStorage::TimedReadCallback(ReadKeyCallback* done, Time start_time,
+    StatusStringPair read_result) {
+  ScheduleCallback(
+      NewPermanentCallback(this, &SafeStorage::FinishTimedRead, done,
+                           start_time, read_result));
+}
+
+void SafeStorage::FinishTimedRead(ReadKeyCallback* done, Time start_time,
+    StatusStringPair read_result) {
+  statistics_->RecordLatency(Statistics::LatencyStage_STORAGE_READ,
+      scheduler_->GetCurrentTime() - start_time);
+  done->Run(read_result);
+  delete done;
+}
+
 void SafeStorage::DeleteKey(const string& key, DeleteKeyCallback* done) {
+  map<string, KeyState>::iterator iter = key_states_.find(key);
+  if (iter != key_states_.end()) {
+    // The delete supersedes the held write, which is never issued, and the
+    // value of the write in flight.
+    KeyState* state = &iter->second;
+    state->in_flight_readable = false;
+    state->has_queued_value = false;
+    state->queued_value.clear();
+    state->has_pending = false;
+    state->pending_value.clear();
+    for (size_t i = 0; i < state->pending_callbacks.size(); ++i) {
+      ScheduleCallback(
+          /* Owns the callback. */ NewPermanentCallback(
+              state->pending_callbacks[i],
+              Status(Status::SUCCESS, "Superseded by delete")));
+    }
+    state->pending_callbacks.clear();
+    if (!state->in_flight && !state->flush_scheduled &&
+        (state->num_queued_batches == 0)) {
+      key_states_.erase(iter);
+    }
+  }
   delegate_->DeleteKey(key,
       NewPermanentCallback(this, &SafeStorage::DeleteCallback, done));
 }
 
 void SafeStorage::DeleteCallback(DeleteKeyCallback* done, bool result) {
-  scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleCallback(
       /* Owns 'done'. */ NewPermanentCallback(done, result));
 }
 
+void SafeStorage::WriteKeys(const vector<pair<string, string> >& key_values,
+                            WriteKeyCallback* done) {
+  BatchWrite* batch = new BatchWrite();
+  batch->key_values = key_values;
+  batch->done = done;
+  if (statistics_ == NULL) {
+    delegate_->WriteKeys(key_values,
+        NewPermanentCallback(this, &SafeStorage::BatchWriteCallback, batch));
+    return;
+  }
+  bool must_wait = false;
+  for (size_t i = 0; i < key_values.size(); ++i) {
+    map<string, KeyState>::iterator iter =
+        key_states_.find(key_values[i].first);
+    if ((iter != key_states_.end()) &&
+        (iter->second.in_flight || (iter->second.num_queued_batches > 0))) {
+      must_wait = true;
+    }
+  }
+  for (size_t i = 0; i < key_values.size(); ++i) {
+    KeyState* state = &key_states_[key_values[i].first];
+    if (state->has_pending) {
+      statistics_->RecordStorageEvent(
+          Statistics::StorageEventType_COALESCED_WRITE);
+      state->has_pending = false;
+      state->pending_value.clear();
+      batch->superseded.insert(batch->superseded.end(),
+                               state->pending_callbacks.begin(),
+                               state->pending_callbacks.end());
+      state->pending_callbacks.clear();
+    }
+    if (must_wait) {
+      ++state->num_queued_batches;
+      state->has_queued_value = true;
+      state->queued_value = key_values[i].second;
+    }
+  }
+  if (must_wait) {
+    // Issuing the batch now could land an older value last, and splitting it
+    // into single-key writes would lose its atomicity: issue it once the
+    // writes ahead of it finish.
+    queued_batches_.push_back(batch);
+    return;
+  }
+  IssueBatch(batch);
+}
+
+void SafeStorage::IssueBatch(BatchWrite* batch) {
+  for (size_t i = 0; i < batch->key_values.size(); ++i) {
+    KeyState* state = &key_states_[batch->key_values[i].first];
+    if (!state->in_flight) {
+      // Not a key repeated in the batch.
+      batch->keys.push_back(batch->key_values[i].first);
+    }
+    state->in_flight = true;
+    state->in_flight_readable = true;
+    state->in_flight_value = batch->key_values[i].second;
+  }
+  statistics_->RecordStorageEvent(Statistics::StorageEventType_PHYSICAL_WRITE);
+  batch->start_time = scheduler_->GetCurrentTime();
+  delegate_->WriteKeys(batch->key_values,
+      NewPermanentCallback(this, &SafeStorage::BatchWriteCallback, batch));
+}
+
+void SafeStorage::IssueQueuedBatches() {
+  deque<BatchWrite*> still_queued;
+  // Keys of the earlier batches that still wait, which later batches must not
+  // overtake.
+  set<string> waiting_keys;
+  while (!queued_batches_.empty()) {
+    BatchWrite* batch = queued_batches_.front();
+    queued_batches_.pop_front();
+    bool can_issue = true;
+    for (size_t i = 0; i < batch->key_values.size(); ++i) {
+      const string& key = batch->key_values[i].first;
+      map<string, KeyState>::iterator iter = key_states_.find(key);
+      CHECK(iter != key_states_.end()) << "No state for waiting key " << key;
+      if (iter->second.in_flight || (waiting_keys.count(key) > 0)) {
+        can_issue = false;
+      }
+    }
+    if (!can_issue) {
+      for (size_t i = 0; i < batch->key_values.size(); ++i) {
+        waiting_keys.insert(batch->key_values[i].first);
+      }
+      still_queued.push_back(batch);
+      continue;
+    }
+    for (size_t i = 0; i < batch->key_values.size(); ++i) {
+      KeyState* state = &key_states_[batch->key_values[i].first];
+      if (--state->num_queued_batches == 0) {
+        state->has_queued_value = false;
+        state->queued_value.clear();
+      }
+    }
+    IssueBatch(batch);
+  }
+  queued_batches_.swap(still_queued);
+}
+
+bool SafeStorage::GetUnpersistedValue(const KeyState& state, string* value) {
+  if (state.has_pending) {
+    *value = state.pending_value;
+  } else if (state.has_queued_value) {
+    *value = state.queued_value;
+  } else if (state.in_flight_readable) {
+    *value = state.in_flight_value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void SafeStorage::BatchWriteCallback(BatchWrite* batch, Status status) {
+  ScheduleCallback(
+      NewPermanentCallback(this, &SafeStorage::FinishBatchWrite, batch,
+                           status));
+}
+
+void SafeStorage::FinishBatchWrite(BatchWrite* batch, Status status) {
+  if (statistics_ != NULL) {
+    statistics_->RecordLatency(Statistics::LatencyStage_STORAGE_WRITE,
+        scheduler_->GetCurrentTime() - batch->start_time);
+  }
+  for (size_t i = 0; i < batch->keys.size(); ++i) {
+    // The batch carries no single-key callbacks, but issues the writes held
+    // for its keys while it was in flight.
+    vector<WriteKeyCallback*> callbacks;
+    EndKeyWrite(batch->keys[i], &callbacks);
+    CHECK(callbacks.empty());
+  }
+  if (!queued_batches_.empty()) {
+    IssueQueuedBatches();
+  }
+  batch->done->Run(status);
+  delete batch->done;
+  for (size_t i = 0; i < batch->superseded.size(); ++i) {
+    batch->superseded[i]->Run(status);
+    delete batch->superseded[i];
+  }
+  delete batch;
+}
+
+void SafeStorage::ReadKeys(const vector<string>& keys,
+                           ReadKeysCallback* done) {
+  // Serve the keys with a held or in-flight value here and read the others
+  // from the delegate.
+  vector<StatusStringPair>* results = new vector<StatusStringPair>(
+      keys.size(), StatusStringPair(Status(Status::SUCCESS, ""), ""));
+  vector<int>* positions = new vector<int>();
+  vector<string> delegate_keys;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    map<string, KeyState>::iterator iter = key_states_.find(keys[i]);
+    if ((iter == key_states_.end()) ||
+        !GetUnpersistedValue(iter->second, &(*results)[i].second)) {
+      positions->push_back(i);
+      delegate_keys.push_back(keys[i]);
+    }
+  }
+  if (delegate_keys.empty()) {
+    delete positions;
+    ScheduleCallback(
+        /* Owns 'done'. */ NewPermanentCallback(done, *results));
+    delete results;
+    return;
+  }
+  delegate_->ReadKeys(delegate_keys,
+      NewPermanentCallback(this, &SafeStorage::BatchReadCallback, done,
+                           results, positions));
+}
+
+void SafeStorage::BatchReadCallback(ReadKeysCallback* done,
+                                    vector<StatusStringPair>* results,
+                                    vector<int>* positions,
+                                    vector<StatusStringPair> read_results) {
+  for (size_t i = 0; i < positions->size(); ++i) {
+    (*results)[(*positions)[i]] = read_results[i];
+  }
+  ScheduleCallback(
+      /* Owns 'done'. */ NewPermanentCallback(done, *results));
+  delete results;
+  delete positions;
+}
+
 void SafeStorage::ReadAllKeys(ReadAllKeysCallback* key_callback) {
   delegate_->ReadAllKeys(
       NewPermanentCallback(this, &SafeStorage::ReadAllCallback, key_callback));
@@ -66,8 +430,7 @@ void SafeStorage::ReadAllKeys(ReadAllKeysCallback* key_callback) {
 
 void SafeStorage::ReadAllCallback(ReadAllKeysCallback* key_callback,
     StatusStringPair result) {
-  scheduler_->Schedule(
-      Scheduler::NoDelay(),
+  ScheduleCallback(
       /* Owns 'key_callback'. */ NewPermanentCallback(key_callback, result));
 }
 
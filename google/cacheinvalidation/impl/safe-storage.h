@@ -19,20 +19,60 @@
 #ifndef GOOGLE_CACHEINVALIDATION_IMPL_SAFE_STORAGE_H_
 #define GOOGLE_CACHEINVALIDATION_IMPL_SAFE_STORAGE_H_
 
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "google/cacheinvalidation/include/system-resources.h"
 #include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/statistics.h"
 
 namespace invalidation {
 
+using INVALIDATION_STL_NAMESPACE::deque;
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::set;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
 // An implementation of the Storage resource that schedules the callbacks on the
 // given scheduler thread.
+//
+// If write coalescing is enabled, writes to a key are also coalesced: a write
+// is held for the coalescing window, and a write issued while an earlier one
+// is held or in flight replaces its value (last writer wins), so that at most
+// one write per key is in flight and only the latest value is written. The
+// callbacks of all the coalesced writes are called with the status of the
+// write that finally persisted their value or a later one. Reads of a key
+// return the latest value written, even if it is not persisted yet.
 class SafeStorage : public Storage {
  public:
   /* Creates a new instance. Storage for |delegate| is owned by caller. */
-  explicit SafeStorage(Storage* delegate) : delegate_(delegate) {
+  explicit SafeStorage(Storage* delegate)
+      : delegate_(delegate), scheduler_(NULL), statistics_(NULL) {
   }
 
-  virtual ~SafeStorage() {}
+  virtual ~SafeStorage();
+
+  /* Enables write coalescing with the given |window| (which may be zero, in
+   * which case only writes issued while another one is in flight are
+   * coalesced). Physical and coalesced writes, and the latencies of the
+   * delegate's writes and reads, are recorded in |statistics|. Space for
+   * |statistics| is owned by the caller.
+   *
+   * REQUIRES: Called before any write, and all calls to this object are
+   * made on the scheduler thread.
+   */
+  void EnableWriteCoalescing(TimeDelta window, Statistics* statistics) {
+    coalescing_window_ = window;
+    statistics_ = statistics;
+  }
 
   // All public methods below are methods of the Storage interface.
   virtual void SetSystemResources(SystemResources* resources);
@@ -46,13 +86,169 @@ class SafeStorage : public Storage {
 
   virtual void ReadAllKeys(ReadAllKeysCallback* key_callback);
 
+  /* Forwards the batch to the delegate as one operation. Held writes to keys
+   * in the batch are superseded by it, and their callbacks get its status.
+   * If coalescing is enabled, the batch counts as the write in flight of each
+   * of its keys; if one of them already has a write in flight, or an earlier
+   * batch waiting for one, the batch waits until those finish and is then
+   * forwarded as one operation, so that at most one write per key is in
+   * flight and the pairs are still written all or nothing. Writes to its keys
+   * issued while it waits are held until it finishes.
+   */
+  virtual void WriteKeys(const vector<pair<string, string> >& key_values,
+                         WriteKeyCallback* done);
+
+  virtual void ReadKeys(const vector<string>& keys, ReadKeysCallback* done);
+
  private:
+  /* The coalescing state of a key with a held or in-flight write. */
+  struct KeyState {
+    KeyState()
+        : has_pending(false), num_queued_batches(0), has_queued_value(false),
+          in_flight(false), in_flight_readable(false), flush_scheduled(false) {}
+
+    /* Whether a write is held, waiting to be issued. */
+    bool has_pending;
+
+    /* Value of the held write. */
+    string pending_value;
+
+    /* Callbacks of the writes coalesced into the held write. */
+    vector<WriteKeyCallback*> pending_callbacks;
+
+    /* Number of the batches writing the key that wait to be issued. */
+    int num_queued_batches;
+
+    /* Whether |queued_value| is the value of the key in a waiting batch,
+     * i.e., has not been deleted since.
+     */
+    bool has_queued_value;
+
+    /* Value of the key in the last waiting batch writing it. */
+    string queued_value;
+
+    /* Whether a write to the delegate is in flight. */
+    bool in_flight;
+
+    /* Whether |in_flight_value| is the latest value of the key, i.e., has not
+     * been deleted since.
+     */
+    bool in_flight_readable;
+
+    /* Value of the write in flight. */
+    string in_flight_value;
+
+    /* Callbacks of the writes carried by the write in flight. */
+    vector<WriteKeyCallback*> in_flight_callbacks;
+
+    /* When the write in flight was issued to the delegate. */
+    Time in_flight_start_time;
+
+    /* Whether a FlushKey call is scheduled. */
+    bool flush_scheduled;
+  };
+
+  /* A batch of writes issued to the delegate as one operation. */
+  struct BatchWrite {
+    /* The pairs written. */
+    vector<pair<string, string> > key_values;
+
+    /* The distinct keys written once the batch is issued, if coalescing is
+     * enabled.
+     */
+    vector<string> keys;
+
+    /* Callback of the batch. */
+    WriteKeyCallback* done;
+
+    /* Callbacks of the held writes superseded by the batch. */
+    vector<WriteKeyCallback*> superseded;
+
+    /* When the batch was issued to the delegate. */
+    Time start_time;
+  };
+
+  /* Issues the held write for |key| once its window has passed. */
+  void FlushKey(string key);
+
+  /* Issues the held write for |key| to the delegate. */
+  void IssueWrite(const string& key);
+
+  /* Returns whether the held write for |key|, whose state is |state|, may be
+   * issued now: no write to the key is in flight and no batch writing it
+   * waits to be issued.
+   */
+  static bool CanIssueWrite(const KeyState& state) {
+    return !state.in_flight && (state.num_queued_batches == 0);
+  }
+
+  /* Stores the latest value of the key whose state is |state| in |value| and
+   * returns true if it has not been persisted yet.
+   */
+  static bool GetUnpersistedValue(const KeyState& state, string* value);
+
+  /* Issues |batch| to the delegate, marking its keys as in flight. */
+  void IssueBatch(BatchWrite* batch);
+
+  /* Issues, in order, the waiting batches none of whose keys is in flight or
+   * written by an earlier waiting batch.
+   */
+  void IssueQueuedBatches();
+
+  /* Callback invoked when a coalesced write of |key| finishes. */
+  void CoalescedWriteCallback(string key, Status status);
+
+  /* Completes the in-flight write of |key| with |status| on the scheduler
+   * thread, issuing the held write, if any.
+   */
+  void FinishCoalescedWrite(string key, Status status);
+
+  /* Marks the write in flight for |key| as finished, issuing the held write,
+   * if any. Moves the callbacks to run with the status of the finished write
+   * to |callbacks|.
+   */
+  void EndKeyWrite(const string& key, vector<WriteKeyCallback*>* callbacks);
+
+  /* Schedules |callback| on the scheduler thread, recording its lateness,
+   * queue depth and run time if statistics are recorded.
+   */
+  void ScheduleCallback(Closure* callback);
+
   /* Callback invoked when WriteKey finishes. */
   void WriteCallback(WriteKeyCallback* done, Status status);
 
+  /* Callback invoked when the delegate's WriteKeys finishes. */
+  void BatchWriteCallback(BatchWrite* batch, Status status);
+
+  /* Completes |batch| with |status| on the scheduler thread. Space for
+   * |batch| is owned by the callee.
+   */
+  void FinishBatchWrite(BatchWrite* batch, Status status);
+
+  /* Callback invoked when the delegate's ReadKeys finishes. Stores its
+   * |read_results| in |results| at |positions| and passes |results| to
+   * |done|. Space for |results| and |positions| is owned by the callee.
+   */
+  void BatchReadCallback(ReadKeysCallback* done,
+                         vector<StatusStringPair>* results,
+                         vector<int>* positions,
+                         vector<StatusStringPair> read_results);
+
   /* Callback invoked when ReadKey finishes. */
   void ReadCallback(ReadKeyCallback* done, StatusStringPair read_result);
 
+  /* Callback invoked when a read of the delegate issued at |start_time|
+   * finishes if statistics are recorded.
+   */
+  void TimedReadCallback(ReadKeyCallback* done, Time start_time,
+                         StatusStringPair read_result);
+
+  /* Records the latency of a read issued at |start_time| and passes
+   * |read_result| to |done| on the scheduler thread.
+   */
+  void FinishTimedRead(ReadKeyCallback* done, Time start_time,
+                       StatusStringPair read_result);
+
   /* Callback invoked when DeleteKey finishes. */
   void DeleteCallback(DeleteKeyCallback* done, bool result);
 
@@ -65,6 +261,22 @@ class SafeStorage : public Storage {
 
   /* The scheduler on which the callbacks are scheduled. */
   Scheduler* scheduler_;
+
+  /* Statistics recording the writes and storage latencies if coalescing is
+   * enabled; NULL otherwise.
+   */
+  Statistics* statistics_;
+
+  /* How long a write is held before being issued. */
+  TimeDelta coalescing_window_;
+
+  /* Coalescing state of the keys with held, waiting or in-flight writes. */
+  map<string, KeyState> key_states_;
+
+  /* The batches waiting for writes in flight to their keys, in the order they
+   * were issued.
+   */
+  deque<BatchWrite*> queued_batches_;
 };
 
 }  // namespace invalidation
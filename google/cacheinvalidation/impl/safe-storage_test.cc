@@ -0,0 +1,262 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the SafeStorage class.
+
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/gmock.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/impl/safe-storage.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+#include "google/cacheinvalidation/test/test-utils.h"
+
+namespace invalidation {
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::Eq;
+using ::testing::SaveArg;
+
+class SafeStorageTest : public UnitTestBase {
+ public:
+  virtual void SetUp() {
+    UnitTestBase::SetUp();
+    safe_storage.reset(new SafeStorage(storage));
+    safe_storage->SetSystemResources(resources.get());
+    safe_storage->EnableWriteCoalescing(TimeDelta::FromMilliseconds(10),
+                                        statistics.get());
+  }
+
+  /* Records the status of a finished write. */
+  void RecordWrite(Status status) {
+    write_statuses.push_back(status);
+  }
+
+  /* Records the value returned by a read. */
+  void RecordRead(StatusStringPair result) {
+    read_values.push_back(result.second);
+  }
+
+  /* Writes |value| to key "k". */
+  void Write(const string& value) {
+    safe_storage->WriteKey("k", value,
+        NewPermanentCallback(this, &SafeStorageTest::RecordWrite));
+  }
+
+  /* Writes the pairs k=|k_value| and j=|j_value| in one batch. */
+  void WriteBatch(const string& k_value, const string& j_value) {
+    vector<pair<string, string> > key_values;
+    key_values.push_back(make_pair("k", k_value));
+    key_values.push_back(make_pair("j", j_value));
+    safe_storage->WriteKeys(key_values,
+        NewPermanentCallback(this, &SafeStorageTest::RecordWrite));
+  }
+
+  /* Reads key "k". */
+  void Read() {
+    safe_storage->ReadKey("k",
+        NewPermanentCallback(this, &SafeStorageTest::RecordRead));
+  }
+
+  /* Runs |*done| with |status|, deleting it. */
+  static void Finish(WriteKeyCallback** done, Status status) {
+    ASSERT_TRUE(*done != NULL);
+    (*done)->Run(status);
+    delete *done;
+    *done = NULL;
+  }
+
+  scoped_ptr<SafeStorage> safe_storage;
+  vector<Status> write_statuses;
+  vector<string> read_values;
+};
+
+/* Tests that writes to a key within the window, and while a write is in
+ * flight, are coalesced into one write of the latest value, that reads see
+ * the latest value, and that all writers get the final status.
+ */
+TEST_F(SafeStorageTest, CoalescesWrites) {
+  WriteKeyCallback* first_done = NULL;
+  WriteKeyCallback* second_done = NULL;
+  EXPECT_CALL(*storage, WriteKey(Eq("k"), Eq("v3"), _))
+      .WillOnce(SaveArg<2>(&first_done));
+  EXPECT_CALL(*storage, WriteKey(Eq("k"), Eq("v5"), _))
+      .WillOnce(SaveArg<2>(&second_done));
+
+  Write("v1");
+  Write("v2");
+  Write("v3");
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(first_done != NULL);
+
+  // Writes issued while "v3" is in flight are held until it finishes.
+  Write("v4");
+  Write("v5");
+  safe_storage->ReadKey("k",
+      NewPermanentCallback(this, &SafeStorageTest::RecordRead));
+  first_done->Run(Status(Status::SUCCESS, ""));
+  delete first_done;
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(second_done != NULL);
+  EXPECT_EQ(0, static_cast<int>(write_statuses.size()));
+
+  second_done->Run(Status(Status::PERMANENT_FAILURE, "disk full"));
+  delete second_done;
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+
+  ASSERT_EQ(1, static_cast<int>(read_values.size()));
+  EXPECT_EQ("v5", read_values[0]);
+  ASSERT_EQ(5, static_cast<int>(write_statuses.size()));
+  for (size_t i = 0; i < write_statuses.size(); ++i) {
+    EXPECT_TRUE(write_statuses[i].IsPermanentFailure());
+  }
+  EXPECT_EQ(2, statistics->GetStorageEventCounterForTest(
+      Statistics::StorageEventType_PHYSICAL_WRITE));
+  EXPECT_EQ(3, statistics->GetStorageEventCounterForTest(
+      Statistics::StorageEventType_COALESCED_WRITE));
+}
+
+/* Tests that a batch supersedes the held writes to its keys, and that writes
+ * issued while it is in flight are held until it finishes.
+ */
+TEST_F(SafeStorageTest, BatchIsWriteInFlight) {
+  WriteKeyCallback* batch_done = NULL;
+  WriteKeyCallback* write_done = NULL;
+  EXPECT_CALL(*storage, WriteKeys(_, _))
+      .WillOnce(SaveArg<1>(&batch_done));
+  EXPECT_CALL(*storage, WriteKey(Eq("k"), Eq("v3"), _))
+      .WillOnce(SaveArg<2>(&write_done));
+
+  Write("v1");
+  WriteBatch("v2", "x");
+  Read();
+  Write("v3");
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(write_done == NULL);
+
+  Finish(&batch_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_EQ(2, static_cast<int>(write_statuses.size()));
+  Finish(&write_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+
+  ASSERT_EQ(1, static_cast<int>(read_values.size()));
+  EXPECT_EQ("v2", read_values[0]);
+  EXPECT_EQ(3, static_cast<int>(write_statuses.size()));
+  EXPECT_EQ(2, statistics->GetStorageEventCounterForTest(
+      Statistics::StorageEventType_PHYSICAL_WRITE));
+  EXPECT_EQ(1, statistics->GetStorageEventCounterForTest(
+      Statistics::StorageEventType_COALESCED_WRITE));
+}
+
+/* Tests that a batch with a key whose write is in flight waits for that
+ * write and is then written as one batch, that reads see its values while it
+ * waits, and that writes issued meanwhile are held until it finishes.
+ */
+TEST_F(SafeStorageTest, BatchWaitsForWriteInFlight) {
+  WriteKeyCallback* first_done = NULL;
+  WriteKeyCallback* batch_done = NULL;
+  WriteKeyCallback* write_done = NULL;
+  vector<pair<string, string> > batch_key_values;
+  EXPECT_CALL(*storage, WriteKey(Eq("k"), Eq("v1"), _))
+      .WillOnce(SaveArg<2>(&first_done));
+  EXPECT_CALL(*storage, WriteKeys(_, _))
+      .WillOnce(DoAll(SaveArg<0>(&batch_key_values),
+                      SaveArg<1>(&batch_done)));
+  EXPECT_CALL(*storage, WriteKey(Eq("k"), Eq("v3"), _))
+      .WillOnce(SaveArg<2>(&write_done));
+
+  Write("v1");
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  WriteBatch("v2", "x");
+  Read();
+  Write("v3");
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(batch_done == NULL);
+  ASSERT_TRUE(write_done == NULL);
+
+  // The value of "v1" was superseded, so its writer waits for "v3" too.
+  Finish(&first_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(batch_done != NULL);
+  ASSERT_EQ(2, static_cast<int>(batch_key_values.size()));
+  EXPECT_EQ("v2", batch_key_values[0].second);
+  EXPECT_EQ("x", batch_key_values[1].second);
+  ASSERT_TRUE(write_done == NULL);
+  EXPECT_EQ(0, static_cast<int>(write_statuses.size()));
+
+  Finish(&batch_done, Status(Status::TRANSIENT_FAILURE, "busy"));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_EQ(1, static_cast<int>(write_statuses.size()));
+  EXPECT_TRUE(write_statuses[0].IsTransientFailure());
+  Finish(&write_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+
+  ASSERT_EQ(1, static_cast<int>(read_values.size()));
+  EXPECT_EQ("v2", read_values[0]);
+  ASSERT_EQ(3, static_cast<int>(write_statuses.size()));
+  EXPECT_TRUE(write_statuses[1].IsSuccess());
+  EXPECT_TRUE(write_statuses[2].IsSuccess());
+  EXPECT_EQ(3, statistics->GetStorageEventCounterForTest(
+      Statistics::StorageEventType_PHYSICAL_WRITE));
+}
+
+/* Tests that a batch waiting behind another one with a common key is issued
+ * only after it, even once its other keys are free.
+ */
+TEST_F(SafeStorageTest, BatchesKeepTheirOrder) {
+  WriteKeyCallback* first_done = NULL;
+  WriteKeyCallback* first_batch_done = NULL;
+  WriteKeyCallback* second_batch_done = NULL;
+  vector<pair<string, string> > first_batch;
+  vector<pair<string, string> > second_batch;
+  EXPECT_CALL(*storage, WriteKey(Eq("k"), Eq("v1"), _))
+      .WillOnce(SaveArg<2>(&first_done));
+  EXPECT_CALL(*storage, WriteKeys(_, _))
+      .WillOnce(DoAll(SaveArg<0>(&first_batch),
+                      SaveArg<1>(&first_batch_done)))
+      .WillOnce(DoAll(SaveArg<0>(&second_batch),
+                      SaveArg<1>(&second_batch_done)));
+
+  Write("v1");
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  WriteBatch("v2", "x");
+  WriteBatch("v3", "y");
+  Read();
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(first_batch_done == NULL);
+
+  Finish(&first_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(first_batch_done != NULL);
+  EXPECT_EQ("v2", first_batch[0].second);
+  ASSERT_TRUE(second_batch_done == NULL);
+
+  Finish(&first_batch_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+  ASSERT_TRUE(second_batch_done != NULL);
+  ASSERT_EQ(2, static_cast<int>(second_batch.size()));
+  EXPECT_EQ("v3", second_batch[0].second);
+  EXPECT_EQ("y", second_batch[1].second);
+  Finish(&second_batch_done, Status(Status::SUCCESS, ""));
+  internal_scheduler->PassTime(TimeDelta::FromMilliseconds(10));
+
+  ASSERT_EQ(1, static_cast<int>(read_values.size()));
+  EXPECT_EQ("v3", read_values[0]);
+  EXPECT_EQ(3, static_cast<int>(write_statuses.size()));
+}
+
+}  // namespace invalidation
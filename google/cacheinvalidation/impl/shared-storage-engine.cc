@@ -0,0 +1,129 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A storage engine shared by the clients of a process, each of which gets a
+// Storage with its own key namespace.
+
+#include "google/cacheinvalidation/impl/shared-storage-engine.h"
+
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+
+namespace invalidation {
+
+TenantStorage::TenantStorage(SharedStorageEngine* engine,
+                             const string& tenant)
+    : engine_(engine), tenant_(tenant) {
+  // Length-prefixing the name keeps one tenant's prefix from being a prefix
+  // of another's.
+  key_prefix_ = SimpleItoa(tenant.size()) + ":" + tenant + ":";
+}
+
+void TenantStorage::WriteKey(const string& key, const string& value,
+                             WriteKeyCallback* done) {
+  Time start_time = engine_->io_scheduler_->GetCurrentTime();
+  engine_->log_->WriteKey(key_prefix_ + key, value,
+      NewPermanentCallback(this, &TenantStorage::WriteCallback, start_time,
+                           done));
+}
+
+void TenantStorage::WriteCallback(Time start_time, WriteKeyCallback* done,
+                                  Status status) {
+  if (status.IsSuccess()) {
+    engine_->RecordWriteLatency(
+        tenant_, engine_->io_scheduler_->GetCurrentTime() - start_time);
+  }
+  done->Run(status);
+  delete done;
+}
+
+void TenantStorage::ReadKey(const string& key, ReadKeyCallback* done) {
+  engine_->log_->ReadKey(key_prefix_ + key, done);
+}
+
+void TenantStorage::DeleteKey(const string& key, DeleteKeyCallback* done) {
+  engine_->log_->DeleteKey(key_prefix_ + key, done);
+}
+
+void TenantStorage::ReadAllKeys(ReadAllKeysCallback* key_callback) {
+  ReadAllKeysCallback* strip_callback =
+      NewPermanentCallback(this, &TenantStorage::ReadAllCallback,
+                           key_callback);
+  engine_->log_->ReadAllKeysWithPrefix(key_prefix_, strip_callback);
+  delete strip_callback;
+}
+
+void TenantStorage::WriteKeys(
+    const vector<pair<string, string> >& key_values, WriteKeyCallback* done) {
+  vector<pair<string, string> > prefixed_key_values(key_values);
+  for (size_t i = 0; i < prefixed_key_values.size(); ++i) {
+    prefixed_key_values[i].first.insert(0, key_prefix_);
+  }
+  Time start_time = engine_->io_scheduler_->GetCurrentTime();
+  engine_->log_->WriteKeys(prefixed_key_values,
+      NewPermanentCallback(this, &TenantStorage::WriteCallback, start_time,
+                           done));
+}
+
+void TenantStorage::ReadKeys(const vector<string>& keys,
+                             ReadKeysCallback* done) {
+  vector<string> prefixed_keys;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    prefixed_keys.push_back(key_prefix_ + keys[i]);
+  }
+  engine_->log_->ReadKeys(prefixed_keys, done);
+}
+
+void TenantStorage::ReadAllCallback(ReadAllKeysCallback* key_callback,
+                                    StatusStringPair result) {
+  result.second.erase(0, key_prefix_.size());
+  key_callback->Run(result);
+}
+
+SharedStorageEngine::SharedStorageEngine(
+    const string& path, Scheduler* io_scheduler, TimeDelta commit_interval)
+    : io_scheduler_(io_scheduler),
+      log_(new LogStructuredStorage(path, io_scheduler)) {
+  CHECK(io_scheduler != NULL) << "An I/O scheduler is required";
+  log_->SetCommitDelay(commit_interval);
+}
+
+TenantStorage* SharedStorageEngine::NewTenantStorage(const string& tenant) {
+  return new TenantStorage(this, tenant);
+}
+
+bool SharedStorageEngine::GetTenantWriteStats(const string& tenant,
+                                              TenantWriteStats* stats) {
+  MutexLock m(&lock_);
+  map<string, TenantWriteStats>::iterator iter = tenant_stats_.find(tenant);
+  if (iter == tenant_stats_.end()) {
+    return false;
+  }
+  *stats = iter->second;
+  return true;
+}
+
+void SharedStorageEngine::RecordWriteLatency(const string& tenant,
+                                             TimeDelta latency) {
+  MutexLock m(&lock_);
+  TenantWriteStats* stats = &tenant_stats_[tenant];
+  ++stats->num_writes;
+  stats->total_latency += latency;
+  if (latency > stats->max_latency) {
+    stats->max_latency = latency;
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,168 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A storage engine shared by the clients of a process, each of which gets a
+// Storage with its own key namespace.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_SHARED_STORAGE_ENGINE_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_SHARED_STORAGE_ENGINE_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/log-structured-storage.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class SharedStorageEngine;
+
+// The Storage of one tenant of a SharedStorageEngine. Its keys are stored in
+// the shared log under a prefix that no other tenant's keys have.
+class TenantStorage : public Storage {
+ public:
+  // All public methods below are methods of the Storage interface.
+
+  /* Does nothing: the shared log does not belong to any one client's
+   * resources.
+   */
+  virtual void SetSystemResources(SystemResources* resources) {}
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done);
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done);
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done);
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback);
+
+  virtual void WriteKeys(const vector<pair<string, string> >& key_values,
+                         WriteKeyCallback* done);
+
+  virtual void ReadKeys(const vector<string>& keys, ReadKeysCallback* done);
+
+ private:
+  friend class SharedStorageEngine;
+
+  TenantStorage(SharedStorageEngine* engine, const string& tenant);
+
+  /* Callback invoked when the write started at |start_time| is durable. */
+  void WriteCallback(Time start_time, WriteKeyCallback* done, Status status);
+
+  /* Strips the tenant prefix from a key found by ReadAllKeys. */
+  void ReadAllCallback(ReadAllKeysCallback* key_callback,
+                       StatusStringPair result);
+
+  /* The engine holding the shared log. */
+  SharedStorageEngine* engine_;
+
+  /* Name of the tenant. */
+  string tenant_;
+
+  /* Prefix of the tenant's keys in the shared log. */
+  string key_prefix_;
+
+  DISALLOW_COPY_AND_ASSIGN(TenantStorage);
+};
+
+// Hosts the storage of all the clients of a process in one LogStructuredStorage
+// so that they share its costs: the log is scanned once at startup for all
+// tenants, after which each tenant's reads are index lookups, and the writes
+// of all the tenants go through one commit queue that makes them durable with
+// one fsync per commit interval.
+//
+// This class is thread-safe.
+class SharedStorageEngine {
+ public:
+  /* Write latencies of a tenant, from the WriteKey call to the durable
+   * commit.
+   */
+  struct TenantWriteStats {
+    TenantWriteStats() : num_writes(0) {}
+
+    int num_writes;
+    TimeDelta total_latency;
+    TimeDelta max_latency;
+  };
+
+  /* Creates an engine whose log is at |path|. Commits run on |io_scheduler|,
+   * which must not be NULL, and cover the writes issued during the
+   * |commit_interval| after the first one. Space for |io_scheduler| is owned
+   * by the caller.
+   */
+  SharedStorageEngine(const string& path, Scheduler* io_scheduler,
+                      TimeDelta commit_interval);
+
+  /* REQUIRES: All the tenant storages have been deleted, and |io_scheduler|
+   * will not run any task scheduled by this engine.
+   */
+  ~SharedStorageEngine() {}
+
+  /* Opens the shared log, reading the state of all the tenants. Returns a
+   * failure status if it cannot be opened.
+   *
+   * REQUIRES: Called once, before any tenant storage is used.
+   */
+  Status Open() {
+    return log_->Open();
+  }
+
+  /* Returns a new storage for |tenant|. Space for the result is owned by the
+   * caller (e.g., by the tenant's SystemResources), and it must be deleted
+   * before this engine.
+   */
+  TenantStorage* NewTenantStorage(const string& tenant);
+
+  /* Stores the write latencies of |tenant| in |stats|. Returns false if the
+   * tenant has not completed any write.
+   */
+  bool GetTenantWriteStats(const string& tenant, TenantWriteStats* stats);
+
+ private:
+  friend class TenantStorage;
+
+  /* Records that a write of |tenant| became durable after |latency|. */
+  void RecordWriteLatency(const string& tenant, TimeDelta latency);
+
+  /* Scheduler on which the commits run. */
+  Scheduler* io_scheduler_;
+
+  /* The log shared by all the tenants. */
+  scoped_ptr<LogStructuredStorage> log_;
+
+  /* Protects |tenant_stats_|. */
+  Mutex lock_;
+
+  /* Write latencies of each tenant. */
+  map<string, TenantWriteStats> tenant_stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedStorageEngine);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_SHARED_STORAGE_ENGINE_H_
@@ -0,0 +1,131 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the SharedStorageEngine class.
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/shared-storage-engine.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+
+namespace invalidation {
+
+class SharedStorageEngineTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    const char* tmp_dir = getenv("TEST_TMPDIR");
+    path = string(tmp_dir != NULL ? tmp_dir : "/tmp") + "/ticl-shared-" +
+        SimpleItoa(getpid());
+    unlink(path.c_str());
+    logger.reset(new TestLogger());
+    io_scheduler.reset(new SimpleDeterministicScheduler(logger.get()));
+    io_scheduler->StartScheduler();
+    num_writes_done = 0;
+  }
+
+  virtual void TearDown() {
+    tenant_a.reset();
+    tenant_b.reset();
+    engine.reset();
+    unlink(path.c_str());
+  }
+
+  /* (Re)creates the engine and the storages of tenants "a" and "b". */
+  void Reopen() {
+    tenant_a.reset();
+    tenant_b.reset();
+    engine.reset();
+    engine.reset(new SharedStorageEngine(path, io_scheduler.get(),
+                                         TimeDelta::FromMilliseconds(5)));
+    ASSERT_TRUE(engine->Open().IsSuccess());
+    tenant_a.reset(engine->NewTenantStorage("a"));
+    tenant_b.reset(engine->NewTenantStorage("b"));
+  }
+
+  void RecordWrite(Status status) {
+    EXPECT_TRUE(status.IsSuccess());
+    ++num_writes_done;
+  }
+
+  void RecordRead(StatusStringPair result) {
+    read_value = result.first.IsSuccess() ? result.second : "<missing>";
+  }
+
+  void RecordKey(StatusStringPair result) {
+    keys.push_back(result.second);
+  }
+
+  void Write(Storage* storage, const string& key, const string& value) {
+    storage->WriteKey(key, value,
+        NewPermanentCallback(this, &SharedStorageEngineTest::RecordWrite));
+  }
+
+  string Read(Storage* storage, const string& key) {
+    storage->ReadKey(key,
+        NewPermanentCallback(this, &SharedStorageEngineTest::RecordRead));
+    return read_value;
+  }
+
+  string path;
+  scoped_ptr<Logger> logger;
+  scoped_ptr<DeterministicScheduler> io_scheduler;
+  scoped_ptr<SharedStorageEngine> engine;
+  scoped_ptr<TenantStorage> tenant_a;
+  scoped_ptr<TenantStorage> tenant_b;
+  int num_writes_done;
+  string read_value;
+  vector<string> keys;
+};
+
+/* Tests that the tenants' writes commit together at the end of the commit
+ * interval, that their namespaces are separate, and that their state is read
+ * back after a restart.
+ */
+TEST_F(SharedStorageEngineTest, SharedCommit) {
+  Reopen();
+  Write(tenant_a.get(), "token", "token-a");
+  io_scheduler->PassTime(TimeDelta::FromMilliseconds(2));
+  Write(tenant_b.get(), "token", "token-b");
+  EXPECT_EQ(0, num_writes_done);
+  io_scheduler->PassTime(TimeDelta::FromMilliseconds(3));
+  EXPECT_EQ(2, num_writes_done);
+
+  SharedStorageEngine::TenantWriteStats stats;
+  ASSERT_TRUE(engine->GetTenantWriteStats("a", &stats));
+  EXPECT_EQ(1, stats.num_writes);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(5), stats.max_latency);
+  ASSERT_TRUE(engine->GetTenantWriteStats("b", &stats));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(3), stats.max_latency);
+
+  Reopen();
+  EXPECT_EQ("token-a", Read(tenant_a.get(), "token"));
+  EXPECT_EQ("token-b", Read(tenant_b.get(), "token"));
+  ReadAllKeysCallback* key_callback =
+      NewPermanentCallback(this, &SharedStorageEngineTest::RecordKey);
+  tenant_a->ReadAllKeys(key_callback);
+  delete key_callback;
+  // The last call marks the end of the keys.
+  ASSERT_EQ(2, static_cast<int>(keys.size()));
+  EXPECT_EQ("token", keys[0]);
+  EXPECT_EQ("", keys[1]);
+}
+
+}  // namespace invalidation
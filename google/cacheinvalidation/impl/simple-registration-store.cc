@@ -16,6 +16,7 @@
 
 #include "google/cacheinvalidation/impl/simple-registration-store.h"
 
+#include "google/cacheinvalidation/impl/memory-usage.h"
 #include "google/cacheinvalidation/impl/object-id-digest-utils.h"
 
 namespace invalidation {
@@ -24,7 +25,7 @@ bool SimpleRegistrationStore::Add(const ObjectIdP& oid) {
   const string digest = ObjectIdDigestUtils::GetDigest(oid, digest_function_);
   bool will_add = (registrations_.find(digest) == registrations_.end());
   if (will_add) {
-    registrations_[digest] = oid;
+    InsertRegistration(digest, oid);
     RecomputeDigest();
   }
   return will_add;
@@ -37,7 +38,7 @@ void SimpleRegistrationStore::Add(const vector<ObjectIdP>& oids,
     const string digest = ObjectIdDigestUtils::GetDigest(oid, digest_function_);
     bool will_add = (registrations_.find(digest) == registrations_.end());
     if (will_add) {
-      registrations_[digest] = oid;
+      InsertRegistration(digest, oid);
       oids_to_send->push_back(oid);
     }
   }
@@ -49,9 +50,10 @@ void SimpleRegistrationStore::Add(const vector<ObjectIdP>& oids,
 
 bool SimpleRegistrationStore::Remove(const ObjectIdP& oid) {
   const string digest = ObjectIdDigestUtils::GetDigest(oid, digest_function_);
-  bool will_remove = (registrations_.find(digest) != registrations_.end());
+  map<string, ObjectIdP>::iterator iter = registrations_.find(digest);
+  bool will_remove = (iter != registrations_.end());
   if (will_remove) {
-    registrations_.erase(digest);
+    EraseRegistration(iter);
     RecomputeDigest();
   }
   return will_remove;
@@ -62,9 +64,10 @@ void SimpleRegistrationStore::Remove(const vector<ObjectIdP>& oids,
   for (size_t i = 0; i < oids.size(); ++i) {
     const ObjectIdP& oid = oids[i];
     const string digest = ObjectIdDigestUtils::GetDigest(oid, digest_function_);
-    bool will_remove = (registrations_.find(digest) != registrations_.end());
+    map<string, ObjectIdP>::iterator iter = registrations_.find(digest);
+    bool will_remove = (iter != registrations_.end());
     if (will_remove) {
-      registrations_.erase(digest);
+      EraseRegistration(iter);
       oids_to_send->push_back(oid);
     }
   }
@@ -74,12 +77,46 @@ void SimpleRegistrationStore::Remove(const vector<ObjectIdP>& oids,
   }
 }
 
+void SimpleRegistrationStore::AddDigested(
+    const vector<pair<string, ObjectIdP> >& digested_oids,
+    vector<ObjectIdP>* oids_to_send) {
+  for (size_t i = 0; i < digested_oids.size(); ++i) {
+    const string& digest = digested_oids[i].first;
+    if (registrations_.find(digest) == registrations_.end()) {
+      InsertRegistration(digest, digested_oids[i].second);
+      oids_to_send->push_back(digested_oids[i].second);
+    }
+  }
+  if (!oids_to_send->empty()) {
+    // Only recompute the digest if we made changes.
+    RecomputeDigest();
+  }
+}
+
+void SimpleRegistrationStore::RemoveDigested(
+    const vector<pair<string, ObjectIdP> >& digested_oids,
+    vector<ObjectIdP>* oids_to_send) {
+  for (size_t i = 0; i < digested_oids.size(); ++i) {
+    map<string, ObjectIdP>::iterator iter =
+        registrations_.find(digested_oids[i].first);
+    if (iter != registrations_.end()) {
+      EraseRegistration(iter);
+      oids_to_send->push_back(digested_oids[i].second);
+    }
+  }
+  if (!oids_to_send->empty()) {
+    // Only recompute the digest if we made changes.
+    RecomputeDigest();
+  }
+}
+
 void SimpleRegistrationStore::RemoveAll(vector<ObjectIdP>* oids) {
   for (map<string, ObjectIdP>::const_iterator iter = registrations_.begin();
        iter != registrations_.end(); ++iter) {
     oids->push_back(iter->second);
   }
   registrations_.clear();
+  memory_usage_ = 0;
   RecomputeDigest();
 }
 
@@ -104,4 +141,22 @@ void SimpleRegistrationStore::RecomputeDigest() {
       registrations_, digest_function_);
 }
 
+void SimpleRegistrationStore::InsertRegistration(const string& digest,
+                                                 const ObjectIdP& oid) {
+  registrations_[digest] = oid;
+  memory_usage_ += GetRegistrationMemoryUsage(digest, oid);
+}
+
+void SimpleRegistrationStore::EraseRegistration(
+    map<string, ObjectIdP>::iterator iter) {
+  memory_usage_ -= GetRegistrationMemoryUsage(iter->first, iter->second);
+  registrations_.erase(iter);
+}
+
+int64 SimpleRegistrationStore::GetRegistrationMemoryUsage(
+    const string& digest, const ObjectIdP& oid) {
+  return MemoryUsage::kTreeNodeOverhead + MemoryUsage::OfString(digest) +
+      MemoryUsage::OfProto(oid);
+}
+
 }  // namespace invalidation
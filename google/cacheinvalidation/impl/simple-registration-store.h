@@ -31,7 +31,7 @@ using INVALIDATION_STL_NAMESPACE::map;
 class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
  public:
   explicit SimpleRegistrationStore(DigestFunction* digest_function)
-      : digest_function_(digest_function) {
+      : digest_function_(digest_function), memory_usage_(0) {
     RecomputeDigest();
   }
 
@@ -47,6 +47,14 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
   virtual void Remove(const vector<ObjectIdP>& oids,
                       vector<ObjectIdP>* oids_to_send);
 
+  virtual void AddDigested(
+      const vector<pair<string, ObjectIdP> >& digested_oids,
+      vector<ObjectIdP>* oids_to_send);
+
+  virtual void RemoveDigested(
+      const vector<pair<string, ObjectIdP> >& digested_oids,
+      vector<ObjectIdP>* oids_to_send);
+
   virtual void RemoveAll(vector<ObjectIdP>* oids);
 
   virtual bool Contains(const ObjectIdP& oid);
@@ -62,6 +70,10 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
   virtual void GetElements(const string& oid_digest_prefix, int prefix_len,
                            vector<ObjectIdP>* result);
 
+  virtual int64 GetMemoryUsage() {
+    return memory_usage_;
+  }
+
   virtual string ToString() {
     return StringPrintf("SimpleRegistrationStore: %d registrations",
                         static_cast<int>(registrations_.size()));
@@ -71,6 +83,21 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
   /* Recomputes the digests over all objects and sets this.digest. */
   void RecomputeDigest();
 
+  /* Adds |oid| with digest |digest| to the registrations.
+   *
+   * REQUIRES: |digest| is not in the registrations.
+   */
+  void InsertRegistration(const string& digest, const ObjectIdP& oid);
+
+  /* Removes the registration at |iter|. */
+  void EraseRegistration(map<string, ObjectIdP>::iterator iter);
+
+  /* Returns the estimated memory used by a registration of |oid| with digest
+   * |digest|.
+   */
+  static int64 GetRegistrationMemoryUsage(const string& digest,
+                                          const ObjectIdP& oid);
+
   /* All the registrations in the store mappd from the digest to the ibject id.
    */
   map<string, ObjectIdP> registrations_;
@@ -80,6 +107,11 @@ class SimpleRegistrationStore : public DigestStore<ObjectIdP> {
 
   /* The memoized digest of all objects in registrations. */
   string digest_;
+
+  /* Estimated memory used by the registrations, maintained as they are added
+   * and removed.
+   */
+  int64 memory_usage_;
 };
 
 }  // namespace invalidation
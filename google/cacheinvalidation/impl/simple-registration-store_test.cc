@@ -0,0 +1,137 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the SimpleRegistrationStore class.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
+#include "google/cacheinvalidation/impl/object-id-digest-utils.h"
+#include "google/cacheinvalidation/impl/simple-registration-store.h"
+#include "google/cacheinvalidation/test/test-utils.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+class SimpleRegistrationStoreTest : public testing::Test {
+ public:
+  SimpleRegistrationStoreTest()
+      : store(&digest_function), expected_store(&digest_function) {}
+
+  virtual void SetUp() {
+    UnitTestBase::InitTestObjectIds(3, &oids);
+  }
+
+  /* Stores |object_ids| with their digests in |digested_oids|. */
+  void Digest(const vector<ObjectIdP>& object_ids,
+              vector<pair<string, ObjectIdP> >* digested_oids) {
+    for (size_t i = 0; i < object_ids.size(); ++i) {
+      digested_oids->push_back(make_pair(
+          ObjectIdDigestUtils::GetDigest(object_ids[i], &digest_function),
+          object_ids[i]));
+    }
+  }
+
+  Sha1DigestFunction digest_function;
+
+  /* The store under test, changed through the digested operations. */
+  SimpleRegistrationStore store;
+
+  /* A store changed through the plain operations, for comparison. */
+  SimpleRegistrationStore expected_store;
+
+  vector<ObjectIdP> oids;
+};
+
+/* Tests that AddDigested adds the objects not already in the store, returns
+ * them and leaves the store as Add would.
+ */
+TEST_F(SimpleRegistrationStoreTest, AddDigested) {
+  ASSERT_TRUE(store.Add(oids[0]));
+  ASSERT_TRUE(expected_store.Add(oids[0]));
+
+  vector<pair<string, ObjectIdP> > digested_oids;
+  Digest(oids, &digested_oids);
+  vector<ObjectIdP> oids_to_send;
+  store.AddDigested(digested_oids, &oids_to_send);
+  vector<ObjectIdP> expected_oids_to_send;
+  expected_store.Add(oids, &expected_oids_to_send);
+
+  ASSERT_EQ(2, static_cast<int>(oids_to_send.size()));
+  ASSERT_EQ(expected_oids_to_send.size(), oids_to_send.size());
+  for (size_t i = 0; i < oids_to_send.size(); ++i) {
+    EXPECT_EQ(expected_oids_to_send[i].SerializeAsString(),
+              oids_to_send[i].SerializeAsString());
+  }
+  EXPECT_EQ(3, store.size());
+  for (size_t i = 0; i < oids.size(); ++i) {
+    EXPECT_TRUE(store.Contains(oids[i]));
+  }
+  EXPECT_EQ(expected_store.GetDigest(), store.GetDigest());
+  EXPECT_EQ(expected_store.GetMemoryUsage(), store.GetMemoryUsage());
+}
+
+/* Tests that RemoveDigested removes the objects in the store, returns them
+ * and leaves the store as Remove would.
+ */
+TEST_F(SimpleRegistrationStoreTest, RemoveDigested) {
+  vector<ObjectIdP> added_oids;
+  store.Add(oids, &added_oids);
+  added_oids.clear();
+  expected_store.Add(oids, &added_oids);
+  vector<ObjectIdP> removed_oids;
+  removed_oids.push_back(oids[1]);
+  ObjectIdP missing_oid;
+  missing_oid.set_source(oids[1].source());
+  missing_oid.set_name("missing");
+  removed_oids.push_back(missing_oid);
+
+  vector<pair<string, ObjectIdP> > digested_oids;
+  Digest(removed_oids, &digested_oids);
+  vector<ObjectIdP> oids_to_send;
+  store.RemoveDigested(digested_oids, &oids_to_send);
+  vector<ObjectIdP> expected_oids_to_send;
+  expected_store.Remove(removed_oids, &expected_oids_to_send);
+
+  ASSERT_EQ(1, static_cast<int>(oids_to_send.size()));
+  EXPECT_EQ(oids[1].SerializeAsString(), oids_to_send[0].SerializeAsString());
+  EXPECT_EQ(2, store.size());
+  EXPECT_FALSE(store.Contains(oids[1]));
+  EXPECT_EQ(expected_store.GetDigest(), store.GetDigest());
+  EXPECT_EQ(expected_store.GetMemoryUsage(), store.GetMemoryUsage());
+}
+
+/* Tests that digested operations that change nothing keep the digest. */
+TEST_F(SimpleRegistrationStoreTest, DigestedNoOps) {
+  vector<ObjectIdP> added_oids;
+  store.Add(oids, &added_oids);
+  string digest = store.GetDigest();
+
+  vector<pair<string, ObjectIdP> > digested_oids;
+  Digest(oids, &digested_oids);
+  vector<ObjectIdP> oids_to_send;
+  store.AddDigested(digested_oids, &oids_to_send);
+  EXPECT_TRUE(oids_to_send.empty());
+  EXPECT_EQ(digest, store.GetDigest());
+
+  store.RemoveDigested(vector<pair<string, ObjectIdP> >(), &oids_to_send);
+  EXPECT_TRUE(oids_to_send.empty());
+  EXPECT_EQ(digest, store.GetDigest());
+}
+
+}  // namespace invalidation
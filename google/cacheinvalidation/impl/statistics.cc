@@ -68,6 +68,53 @@ const char* Statistics::ClientErrorType_names[] = {
   "TOKEN_MISMATCH",
   "TOKEN_MISSING_FAILURE",
   "TOKEN_TRANSIENT_FAILURE",
+  "MEMORY_SOFT_CAP_EXCEEDED",
+};
+
+const char* Statistics::TimerEventType_names[] = {
+  "WAKEUP_SCHEDULED",
+  "WAKEUP_SAVED",
+};
+
+const char* Statistics::UpcallEventType_names[] = {
+  "OVERFLOWED",
+  "COLLAPSED_TO_UNKNOWN_VERSION",
+  "COLLAPSED_TO_INVALIDATE_ALL",
+  "DEBOUNCED",
+  "ALREADY_ACKNOWLEDGED",
+};
+
+const char* Statistics::StorageEventType_names[] = {
+  "PHYSICAL_WRITE",
+  "COALESCED_WRITE",
+};
+
+const char* Statistics::TrafficCounter_names[] = {
+  "SENT_BYTES",
+  "RECEIVED_BYTES",
+  "SENT_REGISTRATIONS",
+  "SENT_INVALIDATION_ACKS",
+  "SENT_REGISTRATION_SUBTREES",
+  "SENT_SUBTREE_OBJECTS",
+  "RECEIVED_INVALIDATIONS",
+  "RECEIVED_PAYLOAD_BYTES",
+  "RECEIVED_REGISTRATION_STATUSES",
+};
+
+const char* Statistics::LatencyStage_names[] = {
+  "MESSAGE_PARSE",
+  "MESSAGE_VALIDATION",
+  "TOKEN_CHECK",
+  "LISTENER_DISPATCH",
+  "MESSAGE_SEND",
+  "THROTTLE_DELAY",
+  "STORAGE_WRITE",
+  "STORAGE_READ",
+};
+
+const char* Statistics::UpcallQueueGauge_names[] = {
+  "DEPTH",
+  "MAX_DEPTH",
 };
 
 Statistics::Statistics() {
@@ -76,10 +123,28 @@ Statistics::Statistics() {
   InitializeMap(incoming_operation_types_, IncomingOperationType_MAX + 1);
   InitializeMap(listener_event_types_, ListenerEventType_MAX + 1);
   InitializeMap(client_error_types_, ClientErrorType_MAX + 1);
+  InitializeMap(timer_event_types_, TimerEventType_MAX + 1);
+  InitializeMap(upcall_event_types_, UpcallEventType_MAX + 1);
+  InitializeMap(upcall_queue_gauges_, UpcallQueueGauge_MAX + 1);
+  InitializeMap(storage_event_types_, StorageEventType_MAX + 1);
+  InitializeMap(traffic_counters_, TrafficCounter_MAX + 1);
 }
 
+const int Statistics::kMaxReportedValue = 0x7fffffff;
+
 void Statistics::GetNonZeroStatistics(
     vector<pair<string, int> >* performance_counters) {
+  vector<pair<string, int64> > snapshot;
+  GetNonZeroStatisticsSnapshot(&snapshot);
+  for (size_t i = 0; i < snapshot.size(); ++i) {
+    int value = (snapshot[i].second > kMaxReportedValue) ?
+        kMaxReportedValue : static_cast<int>(snapshot[i].second);
+    performance_counters->push_back(make_pair(snapshot[i].first, value));
+  }
+}
+
+void Statistics::GetNonZeroStatisticsSnapshot(
+    vector<pair<string, int64> >* performance_counters) {
   // Add the non-zero values from the different maps to performance_counters.
   FillWithNonZeroStatistics(
       sent_message_types_, SentMessageType_MAX + 1, SentMessageType_names,
@@ -98,23 +163,52 @@ void Statistics::GetNonZeroStatistics(
   FillWithNonZeroStatistics(
       client_error_types_, ClientErrorType_MAX + 1, ClientErrorType_names,
       "ClientErrorType.", performance_counters);
+  FillWithNonZeroStatistics(
+      timer_event_types_, TimerEventType_MAX + 1, TimerEventType_names,
+      "TimerEventType.", performance_counters);
+  FillWithNonZeroStatistics(
+      upcall_event_types_, UpcallEventType_MAX + 1, UpcallEventType_names,
+      "UpcallEventType.", performance_counters);
+  FillWithNonZeroStatistics(
+      upcall_queue_gauges_, UpcallQueueGauge_MAX + 1, UpcallQueueGauge_names,
+      "UpcallQueueGauge.", performance_counters);
+  FillWithNonZeroStatistics(
+      storage_event_types_, StorageEventType_MAX + 1, StorageEventType_names,
+      "StorageEventType.", performance_counters);
+  FillWithNonZeroStatistics(
+      traffic_counters_, TrafficCounter_MAX + 1, TrafficCounter_names,
+      "TrafficCounter.", performance_counters);
+}
+
+void Statistics::GetLatencyStatistics(
+    vector<pair<string, int> >* latency_statistics) {
+  for (int i = 0; i <= LatencyStage_MAX; ++i) {
+    const LatencyHistogram& histogram = latency_histograms_[i];
+    if (histogram.count() == 0) {
+      continue;
+    }
+    histogram.GetSummary(
+        StringPrintf("LatencyStage.%s.", LatencyStage_names[i]),
+        latency_statistics);
+  }
 }
 
 /* Modifies result to contain those statistics from map whose value is > 0. */
 void Statistics::FillWithNonZeroStatistics(
-    int map[], int size, const char* names[], const char* prefix,
-    vector<pair<string, int> >* destination) {
+    const AtomicInt64 map[], int size, const char* names[], const char* prefix,
+    vector<pair<string, int64> >* destination) {
   for (int i = 0; i < size; ++i) {
-    if (map[i] > 0) {
+    int64 value = map[i].Load();
+    if (value > 0) {
       destination->push_back(
-          make_pair(StringPrintf("%s%s", prefix, names[i]), map[i]));
+          make_pair(StringPrintf("%s%s", prefix, names[i]), value));
     }
   }
 }
 
-void Statistics::InitializeMap(int map[], int size) {
+void Statistics::InitializeMap(AtomicInt64 map[], int size) {
   for (int i = 0; i < size; ++i) {
-    map[i] = 0;
+    map[i].Store(0);
   }
 }
 
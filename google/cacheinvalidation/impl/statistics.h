@@ -24,6 +24,10 @@
 
 #include "google/cacheinvalidation/deps/stl-namespace.h"
 #include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/atomic-int64.h"
+#include "google/cacheinvalidation/impl/latency-histogram.h"
+#include "google/cacheinvalidation/impl/task-statistics.h"
 
 namespace invalidation {
 
@@ -31,6 +35,10 @@ using INVALIDATION_STL_NAMESPACE::pair;
 using INVALIDATION_STL_NAMESPACE::string;
 using INVALIDATION_STL_NAMESPACE::vector;
 
+// The counters and gauges are relaxed 64-bit atomic integers, even on 32-bit
+// platforms: they may be recorded and read from any thread. The latency
+// histograms must be recorded and read on a single thread (the internal
+// scheduler thread in the Ticl). The task statistics are thread-safe.
 class Statistics {
  public:
   // Implementation: To classify the statistics a bit better, we have a few
@@ -146,87 +154,328 @@ class Statistics {
 
     /* Received a message with a token (transient) failure. */
     ClientErrorType_TOKEN_TRANSIENT_FAILURE,
+
+    /* The estimated memory used by the client exceeded its soft cap. */
+    ClientErrorType_MEMORY_SOFT_CAP_EXCEEDED,
   };
   static const ClientErrorType ClientErrorType_MIN =
       ClientErrorType_ACKNOWLEDGE_HANDLE_FAILURE;
   static const ClientErrorType ClientErrorType_MAX =
-      ClientErrorType_TOKEN_TRANSIENT_FAILURE;
+      ClientErrorType_MEMORY_SOFT_CAP_EXCEEDED;
   static const char* ClientErrorType_names[];
 
+  /* Wakeups of the timers that run the Ticl's recurring tasks. */
+  enum TimerEventType {
+    /* A scheduler wakeup was scheduled for one or more tasks. */
+    TimerEventType_WAKEUP_SCHEDULED,
+
+    /* A task joined an already-scheduled wakeup instead of scheduling its
+     * own.
+     */
+    TimerEventType_WAKEUP_SAVED,
+  };
+  static const TimerEventType TimerEventType_MIN =
+      TimerEventType_WAKEUP_SCHEDULED;
+  static const TimerEventType TimerEventType_MAX = TimerEventType_WAKEUP_SAVED;
+  static const char* TimerEventType_names[];
+
+  /* Invalidation upcalls held back, because the listener queue was full or
+   * for debouncing, or skipped as duplicates.
+   */
+  enum UpcallEventType {
+    /* An invalidation upcall was held instead of being queued. */
+    UpcallEventType_OVERFLOWED,
+
+    /* A held invalidation was merged with an earlier one for the same object
+     * into an invalidateUnknownVersion upcall.
+     */
+    UpcallEventType_COLLAPSED_TO_UNKNOWN_VERSION,
+
+    /* The held invalidations were collapsed into an invalidateAll upcall. */
+    UpcallEventType_COLLAPSED_TO_INVALIDATE_ALL,
+
+    /* A debounced invalidation was superseded by another one for the same
+     * object (of a higher version) and will not cause its own upcall.
+     */
+    UpcallEventType_DEBOUNCED,
+
+    /* A redelivered invalidation whose version the application had already
+     * acknowledged was acknowledged again without an upcall.
+     */
+    UpcallEventType_ALREADY_ACKNOWLEDGED,
+  };
+  static const UpcallEventType UpcallEventType_MIN =
+      UpcallEventType_OVERFLOWED;
+  static const UpcallEventType UpcallEventType_MAX =
+      UpcallEventType_ALREADY_ACKNOWLEDGED;
+  static const char* UpcallEventType_names[];
+
+  /* Writes to persistent storage. */
+  enum StorageEventType {
+    /* A write was issued to the storage. */
+    StorageEventType_PHYSICAL_WRITE,
+
+    /* A write was coalesced into a later one to the same key. */
+    StorageEventType_COALESCED_WRITE,
+  };
+  static const StorageEventType StorageEventType_MIN =
+      StorageEventType_PHYSICAL_WRITE;
+  static const StorageEventType StorageEventType_MAX =
+      StorageEventType_COALESCED_WRITE;
+  static const char* StorageEventType_names[];
+
+  /* Depth of the listener upcall queue, when it is bounded. */
+  enum UpcallQueueGauge {
+    /* Number of upcalls queued or running when last observed. */
+    UpcallQueueGauge_DEPTH,
+
+    /* Largest number of upcalls queued or running so far. */
+    UpcallQueueGauge_MAX_DEPTH,
+  };
+  static const UpcallQueueGauge UpcallQueueGauge_MIN = UpcallQueueGauge_DEPTH;
+  static const UpcallQueueGauge UpcallQueueGauge_MAX =
+      UpcallQueueGauge_MAX_DEPTH;
+  static const char* UpcallQueueGauge_names[];
+
+  /* Amounts of traffic exchanged with the server. */
+  enum TrafficCounter {
+    /* Bytes of the messages sent to the server. */
+    TrafficCounter_SENT_BYTES,
+
+    /* Bytes of the messages received from the server. */
+    TrafficCounter_RECEIVED_BYTES,
+
+    /* Registrations and unregistrations sent. */
+    TrafficCounter_SENT_REGISTRATIONS,
+
+    /* Invalidation acks sent. */
+    TrafficCounter_SENT_INVALIDATION_ACKS,
+
+    /* Registration subtrees sent for registration sync. */
+    TrafficCounter_SENT_REGISTRATION_SUBTREES,
+
+    /* Objects in the registration subtrees sent. */
+    TrafficCounter_SENT_SUBTREE_OBJECTS,
+
+    /* Invalidations received. */
+    TrafficCounter_RECEIVED_INVALIDATIONS,
+
+    /* Bytes of the payloads of the invalidations received. */
+    TrafficCounter_RECEIVED_PAYLOAD_BYTES,
+
+    /* Registration statuses received. */
+    TrafficCounter_RECEIVED_REGISTRATION_STATUSES,
+  };
+  static const TrafficCounter TrafficCounter_MIN = TrafficCounter_SENT_BYTES;
+  static const TrafficCounter TrafficCounter_MAX =
+      TrafficCounter_RECEIVED_REGISTRATION_STATUSES;
+  static const char* TrafficCounter_names[];
+
+  /* Stages of the client whose latencies are recorded. */
+  enum LatencyStage {
+    /* Parsing of a message from the server. */
+    LatencyStage_MESSAGE_PARSE,
+
+    /* Validation of a message from the server. */
+    LatencyStage_MESSAGE_VALIDATION,
+
+    /* Token checks and token changes for a message from the server. */
+    LatencyStage_TOKEN_CHECK,
+
+    /* Handling of the contents of a message from the server, including
+     * scheduling the listener upcalls.
+     */
+    LatencyStage_LISTENER_DISPATCH,
+
+    /* Building, validating and sending a message to the server. */
+    LatencyStage_MESSAGE_SEND,
+
+    /* Delay of a message send by the rate limits. */
+    LatencyStage_THROTTLE_DELAY,
+
+    /* Round trip of a write to persistent storage. */
+    LatencyStage_STORAGE_WRITE,
+
+    /* Round trip of a read from persistent storage. */
+    LatencyStage_STORAGE_READ,
+  };
+  static const LatencyStage LatencyStage_MIN = LatencyStage_MESSAGE_PARSE;
+  static const LatencyStage LatencyStage_MAX = LatencyStage_STORAGE_READ;
+  static const char* LatencyStage_names[];
+
   // Arrays for each type of Statistic to keep track of how many times each
   // event has occurred.
 
   Statistics();
 
   /* Returns the counter value for client_error_type. */
-  int GetClientErrorCounterForTest(ClientErrorType client_error_type) {
-    return client_error_types_[client_error_type];
+  int64 GetClientErrorCounterForTest(ClientErrorType client_error_type) {
+    return client_error_types_[client_error_type].Load();
+  }
+
+  /* Returns the counter value for timer_event_type. */
+  int64 GetTimerEventCounterForTest(TimerEventType timer_event_type) {
+    return timer_event_types_[timer_event_type].Load();
+  }
+
+  /* Returns the counter value for upcall_event_type. */
+  int64 GetUpcallEventCounterForTest(UpcallEventType upcall_event_type) {
+    return upcall_event_types_[upcall_event_type].Load();
+  }
+
+  /* Returns the value of upcall_queue_gauge. */
+  int64 GetUpcallQueueGaugeForTest(UpcallQueueGauge upcall_queue_gauge) {
+    return upcall_queue_gauges_[upcall_queue_gauge].Load();
+  }
+
+  /* Returns the counter value for storage_event_type. */
+  int64 GetStorageEventCounterForTest(StorageEventType storage_event_type) {
+    return storage_event_types_[storage_event_type].Load();
+  }
+
+  /* Returns the value of traffic_counter. */
+  int64 GetTrafficCounterForTest(TrafficCounter traffic_counter) {
+    return traffic_counters_[traffic_counter].Load();
+  }
+
+  /* Returns the statistics of the scheduled tasks. */
+  TaskStatistics* task_statistics() {
+    return &task_statistics_;
+  }
+
+  /* Returns the latency histogram of latency_stage. */
+  const LatencyHistogram& GetLatencyHistogram(LatencyStage latency_stage) {
+    return latency_histograms_[latency_stage];
   }
 
   /* Returns the counter value for sent_message_type. */
-  int GetSentMessageCounterForTest(SentMessageType sent_message_type) {
-    return sent_message_types_[sent_message_type];
+  int64 GetSentMessageCounterForTest(SentMessageType sent_message_type) {
+    return sent_message_types_[sent_message_type].Load();
   }
 
   /* Returns the counter value for received_message_type. */
-  int GetReceivedMessageCounterForTest(
+  int64 GetReceivedMessageCounterForTest(
       ReceivedMessageType received_message_type) {
-    return received_message_types_[received_message_type];
+    return received_message_types_[received_message_type].Load();
   }
 
   /* Records the fact that a message of type sent_message_type has been sent. */
   void RecordSentMessage(SentMessageType sent_message_type) {
-    ++sent_message_types_[sent_message_type];
+    sent_message_types_[sent_message_type].Increment(1);
   }
 
   /* Records the fact that a message of type received_message_type has been
    * received.
    */
   void RecordReceivedMessage(ReceivedMessageType received_message_type) {
-    ++received_message_types_[received_message_type];
+    received_message_types_[received_message_type].Increment(1);
   }
 
   /* Records the fact that the application has made a call of type
    * incoming_operation_type.
    */
   void RecordIncomingOperation(IncomingOperationType incoming_operation_type) {
-    ++incoming_operation_types_[incoming_operation_type];
+    incoming_operation_types_[incoming_operation_type].Increment(1);
   }
 
   /* Records the fact that the listener has issued an event of type
    * listener_event_type.
    */
   void RecordListenerEvent(ListenerEventType listener_event_type) {
-    ++listener_event_types_[listener_event_type];
+    listener_event_types_[listener_event_type].Increment(1);
   }
 
   /* Records the fact that the client has observed an error of type
    * client_error_type.
    */
   void RecordError(ClientErrorType client_error_type) {
-    ++client_error_types_[client_error_type];
+    client_error_types_[client_error_type].Increment(1);
+  }
+
+  /* Records the fact that a timer event of type timer_event_type has occurred.
+   */
+  void RecordTimerEvent(TimerEventType timer_event_type) {
+    timer_event_types_[timer_event_type].Increment(1);
+  }
+
+  /* Records the fact that an upcall event of type upcall_event_type has
+   * occurred.
+   */
+  void RecordUpcallEvent(UpcallEventType upcall_event_type) {
+    upcall_event_types_[upcall_event_type].Increment(1);
+  }
+
+  /* Records the fact that a storage event of type storage_event_type has
+   * occurred.
+   */
+  void RecordStorageEvent(StorageEventType storage_event_type) {
+    storage_event_types_[storage_event_type].Increment(1);
+  }
+
+  /* Records that traffic_counter increased by |amount|. */
+  void RecordTraffic(TrafficCounter traffic_counter, int64 amount) {
+    traffic_counters_[traffic_counter].Increment(amount);
+  }
+
+  /* Records that |depth| upcalls are queued or running. */
+  void RecordUpcallQueueDepth(int depth) {
+    upcall_queue_gauges_[UpcallQueueGauge_DEPTH].Store(depth);
+    upcall_queue_gauges_[UpcallQueueGauge_MAX_DEPTH].StoreMax(depth);
+  }
+
+  /* Records that latency_stage took |latency|. */
+  void RecordLatency(LatencyStage latency_stage, TimeDelta latency) {
+    latency_histograms_[latency_stage].Record(latency);
   }
 
   /* Modifies performance_counters to contain all the statistics that are
    * non-zero. Each pair has the name of the statistic event and the number of
-   * times that event has occurred since the client started.
+   * times that event has occurred since the client started, capped at
+   * kMaxReportedValue.
    */
   void GetNonZeroStatistics(vector<pair<string, int> >* performance_counters);
 
+  /* Like GetNonZeroStatistics, but with the uncapped values. May be called
+   * from any thread: each value is read atomically, but the values are not
+   * read at a single instant, so related counters may be off by the events
+   * recorded while reading them.
+   */
+  void GetNonZeroStatisticsSnapshot(
+      vector<pair<string, int64> >* performance_counters);
+
+  /* Modifies latency_statistics to contain a summary of the latencies of each
+   * stage with recorded latencies: their number, their mean, 50th and 99th
+   * percentiles and maximum, in microseconds. Each pair has the name of the
+   * statistic, e.g., "LatencyStage.STORAGE_WRITE.p99_us", and its value.
+   */
+  void GetLatencyStatistics(vector<pair<string, int> >* latency_statistics);
+
   /* Modifies result to contain those statistics from map whose value is > 0. */
   static void FillWithNonZeroStatistics(
-      int map[], int size, const char* names[], const char* prefix,
-      vector<pair<string, int> >* destination);
+      const AtomicInt64 map[], int size, const char* names[],
+      const char* prefix, vector<pair<string, int64> >* destination);
 
   /* Initialzes all values for keys in map to be 0. */
-  static void InitializeMap(int map[], int size);
+  static void InitializeMap(AtomicInt64 map[], int size);
+
+  /* Largest value reported by GetNonZeroStatistics, which the info message
+   * sent to the server can carry.
+   */
+  static const int kMaxReportedValue;
 
  private:
-  int sent_message_types_[SentMessageType_MAX + 1];
-  int received_message_types_[ReceivedMessageType_MAX + 1];
-  int incoming_operation_types_[IncomingOperationType_MAX + 1];
-  int listener_event_types_[ListenerEventType_MAX + 1];
-  int client_error_types_[ClientErrorType_MAX + 1];
+  AtomicInt64 sent_message_types_[SentMessageType_MAX + 1];
+  AtomicInt64 received_message_types_[ReceivedMessageType_MAX + 1];
+  AtomicInt64 incoming_operation_types_[IncomingOperationType_MAX + 1];
+  AtomicInt64 listener_event_types_[ListenerEventType_MAX + 1];
+  AtomicInt64 client_error_types_[ClientErrorType_MAX + 1];
+  AtomicInt64 timer_event_types_[TimerEventType_MAX + 1];
+  AtomicInt64 upcall_event_types_[UpcallEventType_MAX + 1];
+  AtomicInt64 upcall_queue_gauges_[UpcallQueueGauge_MAX + 1];
+  AtomicInt64 storage_event_types_[StorageEventType_MAX + 1];
+  AtomicInt64 traffic_counters_[TrafficCounter_MAX + 1];
+  LatencyHistogram latency_histograms_[LatencyStage_MAX + 1];
+  TaskStatistics task_statistics_;
 };
 
 }  // namespace invalidation
@@ -0,0 +1,79 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the Statistics class.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+
+namespace invalidation {
+
+/* Returns the value of the statistic |name| in |statistics|, or -1. */
+template<typename T>
+static int64 FindStatistic(const vector<pair<string, T> >& statistics,
+                           const string& name) {
+  for (size_t i = 0; i < statistics.size(); ++i) {
+    if (statistics[i].first == name) {
+      return statistics[i].second;
+    }
+  }
+  return -1;
+}
+
+/* Tests that the snapshot holds exactly the non-zero counters and gauges. */
+TEST(StatisticsTest, SnapshotHasNonZeroCounters) {
+  Statistics statistics;
+  statistics.RecordSentMessage(Statistics::SentMessageType_INITIALIZE);
+  statistics.RecordSentMessage(Statistics::SentMessageType_INITIALIZE);
+  statistics.RecordTraffic(Statistics::TrafficCounter_SENT_BYTES, 100);
+  statistics.RecordUpcallQueueDepth(5);
+  statistics.RecordUpcallQueueDepth(2);
+
+  vector<pair<string, int64> > snapshot;
+  statistics.GetNonZeroStatisticsSnapshot(&snapshot);
+  EXPECT_EQ(4, static_cast<int>(snapshot.size()));
+  EXPECT_EQ(2, FindStatistic(snapshot, "SentMessageType.INITIALIZE"));
+  EXPECT_EQ(100, FindStatistic(snapshot, "TrafficCounter.SENT_BYTES"));
+  EXPECT_EQ(2, FindStatistic(snapshot, "UpcallQueueGauge.DEPTH"));
+  EXPECT_EQ(5, FindStatistic(snapshot, "UpcallQueueGauge.MAX_DEPTH"));
+  EXPECT_EQ(-1, FindStatistic(snapshot, "SentMessageType.INFO"));
+}
+
+/* Tests that GetNonZeroStatistics caps the values that do not fit in an int,
+ * while the snapshot reports them in full.
+ */
+TEST(StatisticsTest, CapsReportedValues) {
+  Statistics statistics;
+  int64 large_value = static_cast<int64>(Statistics::kMaxReportedValue) + 10;
+  statistics.RecordTraffic(Statistics::TrafficCounter_RECEIVED_BYTES,
+                           large_value);
+  statistics.RecordTraffic(Statistics::TrafficCounter_SENT_BYTES, 7);
+
+  vector<pair<string, int64> > snapshot;
+  statistics.GetNonZeroStatisticsSnapshot(&snapshot);
+  EXPECT_EQ(large_value,
+            FindStatistic(snapshot, "TrafficCounter.RECEIVED_BYTES"));
+
+  vector<pair<string, int> > reported;
+  statistics.GetNonZeroStatistics(&reported);
+  EXPECT_EQ(Statistics::kMaxReportedValue,
+            FindStatistic(reported, "TrafficCounter.RECEIVED_BYTES"));
+  EXPECT_EQ(7, FindStatistic(reported, "TrafficCounter.SENT_BYTES"));
+}
+
+}  // namespace invalidation
@@ -0,0 +1,119 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Default implementations of the batch operations of the Storage interface in
+// terms of its single-key operations.
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+
+namespace invalidation {
+
+// Collects the results of the WriteKey calls of a batch and runs the batch's
+// callback after the last one, with the first failure if any.
+class BatchWriteState {
+ public:
+  BatchWriteState(int num_writes, WriteKeyCallback* done)
+      : num_remaining_(num_writes), status_(Status::SUCCESS, ""),
+        done_(done) {}
+
+  /* Records the status of one write, deleting this object after the last. */
+  void WriteCallback(Status status) {
+    bool finished;
+    {
+      MutexLock m(&lock_);
+      if (status_.IsSuccess() && !status.IsSuccess()) {
+        status_ = status;
+      }
+      finished = (--num_remaining_ == 0);
+    }
+    if (finished) {
+      done_->Run(status_);
+      delete done_;
+      delete this;
+    }
+  }
+
+ private:
+  Mutex lock_;
+  int num_remaining_;
+  Status status_;
+  WriteKeyCallback* done_;
+};
+
+// Collects the results of the ReadKey calls of a batch and runs the batch's
+// callback after the last one.
+class BatchReadState {
+ public:
+  BatchReadState(int num_reads, ReadKeysCallback* done)
+      : num_remaining_(num_reads),
+        results_(num_reads,
+                 StatusStringPair(Status(Status::SUCCESS, ""), "")),
+        done_(done) {}
+
+  /* Records the result of the read at |index|, deleting this object after the
+   * last.
+   */
+  void ReadCallback(int index, StatusStringPair result) {
+    bool finished;
+    {
+      MutexLock m(&lock_);
+      results_[index] = result;
+      finished = (--num_remaining_ == 0);
+    }
+    if (finished) {
+      done_->Run(results_);
+      delete done_;
+      delete this;
+    }
+  }
+
+ private:
+  Mutex lock_;
+  int num_remaining_;
+  vector<StatusStringPair> results_;
+  ReadKeysCallback* done_;
+};
+
+void Storage::WriteKeys(const vector<pair<string, string> >& key_values,
+                        WriteKeyCallback* done) {
+  if (key_values.empty()) {
+    done->Run(Status(Status::SUCCESS, ""));
+    delete done;
+    return;
+  }
+  BatchWriteState* state = new BatchWriteState(key_values.size(), done);
+  for (size_t i = 0; i < key_values.size(); ++i) {
+    WriteKey(key_values[i].first, key_values[i].second,
+             NewPermanentCallback(state, &BatchWriteState::WriteCallback));
+  }
+}
+
+void Storage::ReadKeys(const vector<string>& keys, ReadKeysCallback* done) {
+  if (keys.empty()) {
+    done->Run(vector<StatusStringPair>());
+    delete done;
+    return;
+  }
+  BatchReadState* state = new BatchReadState(keys.size(), done);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ReadKey(keys[i],
+            NewPermanentCallback(state, &BatchReadState::ReadCallback,
+                                 static_cast<int>(i)));
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,175 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the default batch operations of the Storage interface.
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::set;
+
+// A storage keeping its values in memory that implements only the single-key
+// operations, so that the batch operations are the default ones. Writes to
+// the keys in |failing_keys| fail.
+class SingleKeyStorage : public Storage {
+ public:
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done) {
+    ++num_writes;
+    if (failing_keys.find(key) != failing_keys.end()) {
+      done->Run(Status(Status::TRANSIENT_FAILURE, "Cannot write " + key));
+    } else {
+      values[key] = value;
+      done->Run(Status(Status::SUCCESS, ""));
+    }
+    delete done;
+  }
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done) {
+    map<string, string>::iterator iter = values.find(key);
+    if (iter == values.end()) {
+      done->Run(StatusStringPair(
+          Status(Status::PERMANENT_FAILURE, "Key not found"), ""));
+    } else {
+      done->Run(StatusStringPair(Status(Status::SUCCESS, ""), iter->second));
+    }
+    delete done;
+  }
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done) {
+    values.erase(key);
+    done->Run(true);
+    delete done;
+  }
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    map<string, string>::iterator iter;
+    for (iter = values.begin(); iter != values.end(); ++iter) {
+      key_callback->Run(
+          StatusStringPair(Status(Status::SUCCESS, ""), iter->first));
+    }
+    key_callback->Run(StatusStringPair(Status(Status::SUCCESS, ""), ""));
+  }
+
+  virtual void SetSystemResources(SystemResources* resources) {
+    // Nothing to do.
+  }
+
+  map<string, string> values;
+  set<string> failing_keys;
+  int num_writes;
+};
+
+class StorageBatchAdapterTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    storage.num_writes = 0;
+  }
+
+  void RecordWrite(Status status) {
+    write_statuses.push_back(status);
+  }
+
+  void RecordReads(vector<StatusStringPair> results) {
+    read_results = results;
+  }
+
+  SingleKeyStorage storage;
+  vector<Status> write_statuses;
+  vector<StatusStringPair> read_results;
+};
+
+/* Tests that WriteKeys writes every pair and reports success once. */
+TEST_F(StorageBatchAdapterTest, WritesAllPairs) {
+  vector<pair<string, string> > key_values;
+  key_values.push_back(make_pair("a", "1"));
+  key_values.push_back(make_pair("b", "2"));
+  storage.WriteKeys(key_values, NewPermanentCallback(
+      this, &StorageBatchAdapterTest::RecordWrite));
+
+  ASSERT_EQ(1, static_cast<int>(write_statuses.size()));
+  EXPECT_TRUE(write_statuses[0].IsSuccess());
+  EXPECT_EQ(2, storage.num_writes);
+  EXPECT_EQ("1", storage.values["a"]);
+  EXPECT_EQ("2", storage.values["b"]);
+}
+
+/* Tests that a failed write fails the batch without undoing the other
+ * writes, which the Storage contract allows.
+ */
+TEST_F(StorageBatchAdapterTest, ReportsFailure) {
+  storage.failing_keys.insert("b");
+  vector<pair<string, string> > key_values;
+  key_values.push_back(make_pair("a", "1"));
+  key_values.push_back(make_pair("b", "2"));
+  key_values.push_back(make_pair("c", "3"));
+  storage.WriteKeys(key_values, NewPermanentCallback(
+      this, &StorageBatchAdapterTest::RecordWrite));
+
+  ASSERT_EQ(1, static_cast<int>(write_statuses.size()));
+  EXPECT_TRUE(write_statuses[0].IsTransientFailure());
+  EXPECT_EQ(3, storage.num_writes);
+  EXPECT_EQ("1", storage.values["a"]);
+  EXPECT_EQ("3", storage.values["c"]);
+}
+
+/* Tests that ReadKeys returns one result per key, in order, including the
+ * failures.
+ */
+TEST_F(StorageBatchAdapterTest, ReadsInOrder) {
+  storage.values["a"] = "1";
+  storage.values["c"] = "3";
+  vector<string> keys;
+  keys.push_back("c");
+  keys.push_back("b");
+  keys.push_back("a");
+  storage.ReadKeys(keys, NewPermanentCallback(
+      this, &StorageBatchAdapterTest::RecordReads));
+
+  ASSERT_EQ(3, static_cast<int>(read_results.size()));
+  EXPECT_TRUE(read_results[0].first.IsSuccess());
+  EXPECT_EQ("3", read_results[0].second);
+  EXPECT_FALSE(read_results[1].first.IsSuccess());
+  EXPECT_TRUE(read_results[2].first.IsSuccess());
+  EXPECT_EQ("1", read_results[2].second);
+}
+
+/* Tests that empty batches complete at once. */
+TEST_F(StorageBatchAdapterTest, EmptyBatches) {
+  storage.WriteKeys(vector<pair<string, string> >(), NewPermanentCallback(
+      this, &StorageBatchAdapterTest::RecordWrite));
+  read_results.push_back(StatusStringPair(Status(Status::SUCCESS, ""), ""));
+  storage.ReadKeys(vector<string>(), NewPermanentCallback(
+      this, &StorageBatchAdapterTest::RecordReads));
+
+  ASSERT_EQ(1, static_cast<int>(write_statuses.size()));
+  EXPECT_TRUE(write_statuses[0].IsSuccess());
+  EXPECT_EQ(0, storage.num_writes);
+  EXPECT_TRUE(read_results.empty());
+}
+
+}  // namespace invalidation
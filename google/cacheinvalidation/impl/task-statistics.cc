@@ -0,0 +1,148 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Statistics on the tasks scheduled by the Ticl: how late they run, how long
+// they run and how many are waiting to run, per task name.
+
+#include "google/cacheinvalidation/impl/task-statistics.h"
+
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+// Runs a task, recording its statistics, and owns it until then.
+class TaskStatistics::WrappedTask : public Closure {
+ public:
+  /* Constructs a closure running |task|, intended to run at |fire_time|, and
+   * recording its statistics in |stats|. Takes ownership of |task|.
+   */
+  WrappedTask(TaskStats* stats, Time fire_time, Closure* task)
+      : stats_(stats), fire_time_(fire_time), task_(task), has_run_(false) {
+    stats_->AddRef();
+  }
+
+  virtual ~WrappedTask() {
+    if (!has_run_) {
+      // The scheduler dropped the task: it is no longer queued.
+      NoBarrier_AtomicIncrement(&stats_->queue_depth, -1);
+    }
+    delete task_;
+    stats_->Release();
+  }
+
+  virtual bool IsRepeatable() const {
+    return task_->IsRepeatable();
+  }
+
+  virtual void Run() {
+    CHECK(!has_run_) << "Wrapped task run twice";
+    has_run_ = true;
+    Time start_time = stats_->scheduler->GetCurrentTime();
+    NoBarrier_AtomicIncrement(&stats_->queue_depth, -1);
+    stats_->lateness.Record(start_time - fire_time_);
+    task_->Run();
+    stats_->run_time.Record(stats_->scheduler->GetCurrentTime() - start_time);
+  }
+
+ private:
+  /* Statistics of the tasks with the name of this one, referenced. */
+  TaskStats* stats_;
+
+  /* Time at which the task was intended to run. */
+  Time fire_time_;
+
+  /* The task to run. */
+  Closure* task_;
+
+  /* Whether the task has run. */
+  bool has_run_;
+
+  DISALLOW_COPY_AND_ASSIGN(WrappedTask);
+};
+
+void TaskStatistics::TaskStats::IncrementQueueDepth() {
+  AtomicWord depth = NoBarrier_AtomicIncrement(&queue_depth, 1);
+  AtomicWord old_max_depth = NoBarrier_Load(&max_queue_depth);
+  while (depth > old_max_depth) {
+    AtomicWord previous =
+        NoBarrier_CompareAndSwap(&max_queue_depth, old_max_depth, depth);
+    if (previous == old_max_depth) {
+      break;
+    }
+    old_max_depth = previous;
+  }
+}
+
+TaskStatistics::~TaskStatistics() {
+  map<string, TaskStats*>::iterator iter;
+  for (iter = task_stats_.begin(); iter != task_stats_.end(); ++iter) {
+    iter->second->Release();
+  }
+}
+
+Closure* TaskStatistics::Wrap(const string& name, Scheduler* scheduler,
+                              TimeDelta delay, Closure* task) {
+  Time fire_time = scheduler->GetCurrentTime() + delay;
+  TaskStats* stats;
+  {
+    MutexLock m(&lock_);
+    TaskStats*& entry = task_stats_[name];
+    if (entry == NULL) {
+      entry = new TaskStats();
+      entry->scheduler = scheduler;
+    }
+    stats = entry;
+  }
+  stats->IncrementQueueDepth();
+  return new WrappedTask(stats, fire_time, task);
+}
+
+void TaskStatistics::GetStatistics(vector<pair<string, int> >* statistics) {
+  MutexLock m(&lock_);
+  map<string, TaskStats*>::iterator iter;
+  for (iter = task_stats_.begin(); iter != task_stats_.end(); ++iter) {
+    string prefix = StringPrintf("Task.%s.", iter->first.c_str());
+    const TaskStats& stats = *iter->second;
+    statistics->push_back(make_pair(prefix + "QUEUE_DEPTH",
+        static_cast<int>(NoBarrier_Load(&stats.queue_depth))));
+    statistics->push_back(make_pair(prefix + "MAX_QUEUE_DEPTH",
+        static_cast<int>(NoBarrier_Load(&stats.max_queue_depth))));
+    LatencyHistogram lateness;
+    stats.lateness.GetSnapshot(&lateness);
+    if (lateness.count() > 0) {
+      LatencyHistogram run_time;
+      stats.run_time.GetSnapshot(&run_time);
+      lateness.GetSummary(prefix + "LATENESS.", statistics);
+      run_time.GetSummary(prefix + "RUN_TIME.", statistics);
+    }
+  }
+}
+
+bool TaskStatistics::GetTaskStatisticsForTest(const string& name,
+    LatencyHistogram* lateness, LatencyHistogram* run_time, int* queue_depth) {
+  MutexLock m(&lock_);
+  map<string, TaskStats*>::iterator iter = task_stats_.find(name);
+  if (iter == task_stats_.end()) {
+    return false;
+  }
+  iter->second->lateness.GetSnapshot(lateness);
+  iter->second->run_time.GetSnapshot(run_time);
+  *queue_depth = static_cast<int>(NoBarrier_Load(&iter->second->queue_depth));
+  return true;
+}
+
+}  // namespace invalidation
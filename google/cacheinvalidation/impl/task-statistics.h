@@ -0,0 +1,139 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Statistics on the tasks scheduled by the Ticl: how late they run, how long
+// they run and how many are waiting to run, per task name.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_TASK_STATISTICS_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_TASK_STATISTICS_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/deps/atomicops.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/mutex.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/latency-histogram.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// Tasks are instrumented by wrapping them with Wrap() before they are handed
+// to a scheduler. The times are read from the clock of a scheduler, which need
+// not be the one running the task (the schedulers of a client share a clock),
+// and which must be the same for all the tasks with a given name. This class
+// is thread-safe: tasks may be wrapped and run on any thread. Running a task
+// records its statistics with relaxed atomics; only wrapping one takes a
+// lock, to look its name up.
+class TaskStatistics {
+ public:
+  TaskStatistics() {}
+
+  ~TaskStatistics();
+
+  /* Returns a closure that runs |task| (and then deletes it) after recording,
+   * under |name|, how late it runs relative to |delay| from now and how long
+   * it runs, as measured by the clock of |scheduler|. The task counts as
+   * queued until it runs.
+   *
+   * Space for |scheduler| is owned by the caller. Ownership of |task| passes
+   * to the returned closure, which must be run at most once. Deleting the
+   * closure without running it, as a scheduler may do on shutdown, deletes
+   * |task| and stops counting it as queued.
+   */
+  Closure* Wrap(const string& name, Scheduler* scheduler, TimeDelta delay,
+                Closure* task);
+
+  /* Appends, for each task name, the number of queued tasks, the largest
+   * such number and summaries of the lateness and run times of the tasks,
+   * e.g., "Task.Batching.LATENESS.p99_us" and "Task.Batching.MAX_QUEUE_DEPTH".
+   */
+  void GetStatistics(vector<pair<string, int> >* statistics);
+
+  /* Stores the lateness and run time histograms and the queue depth of the
+   * tasks named |name| in the given arguments. Returns false if no task with
+   * that name was wrapped.
+   */
+  bool GetTaskStatisticsForTest(const string& name, LatencyHistogram* lateness,
+                                LatencyHistogram* run_time, int* queue_depth);
+
+ private:
+  /* The statistics of the tasks with a given name. Referenced by this object
+   * and by each wrapped task, since a scheduler may delete its tasks after
+   * this object is gone.
+   */
+  struct TaskStats {
+    /* Creates statistics referenced by their creator. */
+    TaskStats()
+        : scheduler(NULL), queue_depth(0), max_queue_depth(0), num_refs(1) {}
+
+    void AddRef() {
+      NoBarrier_AtomicIncrement(&num_refs, 1);
+    }
+
+    /* Drops a reference, deleting the statistics when none is left. */
+    void Release() {
+      if (Barrier_AtomicIncrement(&num_refs, -1) == 0) {
+        delete this;
+      }
+    }
+
+    /* Records that a task was wrapped. */
+    void IncrementQueueDepth();
+
+    /* Scheduler whose clock times the tasks. */
+    Scheduler* scheduler;
+
+    /* How late the tasks ran. */
+    AtomicLatencyHistogram lateness;
+
+    /* How long the tasks ran. */
+    AtomicLatencyHistogram run_time;
+
+    /* Number of tasks wrapped but neither run nor deleted yet. */
+    AtomicWord queue_depth;
+
+    /* Largest value of |queue_depth|. */
+    AtomicWord max_queue_depth;
+
+    /* Number of references to the statistics. */
+    AtomicWord num_refs;
+  };
+
+  /* The closure returned by Wrap(). */
+  class WrappedTask;
+
+  /* Lock protecting |task_stats_|. */
+  Mutex lock_;
+
+  /* Statistics of the tasks by name, each holding a reference. Entries are
+   * never removed.
+   */
+  map<string, TaskStats*> task_stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskStatistics);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_TASK_STATISTICS_H_
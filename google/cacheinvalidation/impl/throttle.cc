@@ -20,6 +20,7 @@
 
 #include "google/cacheinvalidation/include/system-resources.h"
 #include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/impl/statistics.h"
 
 namespace invalidation {
 
@@ -29,7 +30,7 @@ Throttle::Throttle(
     const RepeatedPtrField<RateLimitP>& rate_limits, Scheduler* scheduler,
     Closure* listener)
     : rate_limits_(rate_limits), scheduler_(scheduler), listener_(listener),
-      timer_scheduled_(false) {
+      timer_scheduled_(false), statistics_(NULL), fire_deferred_(false) {
 
   // Find the largest 'count' in all of the rate limits, as this is the size of
   // the buffer of recent messages we need to retain.
@@ -90,6 +91,10 @@ void Throttle::Fire() {
         // Set the flag to indicate we have a deferred task scheduled.  No need
         // to continue checking other rate limits now.
         timer_scheduled_ = true;
+        if (!fire_deferred_) {
+          fire_deferred_ = true;
+          first_deferred_fire_time_ = now;
+        }
         scheduler_->Schedule(
             window_end_from_now,
             NewPermanentCallback(this, &Throttle::RetryFire));
@@ -99,6 +104,12 @@ void Throttle::Fire() {
   }
   // We checked all the rate limits, and none would have been violated, so it's
   // safe to call the listener.
+  if (statistics_ != NULL) {
+    statistics_->RecordLatency(Statistics::LatencyStage_THROTTLE_DELAY,
+        fire_deferred_ ? now - first_deferred_fire_time_ :
+                         TimeDelta::FromMicroseconds(0));
+  }
+  fire_deferred_ = false;
   listener_->Run();
 
   // Record the fact that we're triggering an event now.
@@ -31,6 +31,7 @@
 namespace invalidation {
 
 class Scheduler;
+class Statistics;
 
 using INVALIDATION_STL_NAMESPACE::deque;
 using INVALIDATION_STL_NAMESPACE::vector;
@@ -55,6 +56,14 @@ class Throttle {
   // queued.
   void Fire();
 
+  // Sets the statistics in which the delay of each call to the listener is
+  // recorded, from the first call to Fire() that was deferred to the call to
+  // the listener. Ownership of statistics is retained by the caller. May be
+  // NULL.
+  void SetStatistics(Statistics* statistics) {
+    statistics_ = statistics;
+  }
+
  private:
   // Retries a call to Fire() after some delay.
   void RetryFire() {
@@ -75,6 +84,14 @@ class Throttle {
   // Whether we've already scheduled a deferred call.
   bool timer_scheduled_;
 
+  // Statistics for the delay of the calls to the listener (may be NULL).
+  Statistics* statistics_;
+
+  // Whether a call to Fire() has been deferred since the listener was last
+  // called, and the time of the first such call.
+  bool fire_deferred_;
+  Time first_deferred_fire_time_;
+
   // A buffer of recent events, so we can determine the length of the interval
   // in which we made the most recent K events.
   deque<Time> recent_event_times_;
@@ -262,6 +262,12 @@ DEFINE_VALIDATOR(RateLimitP) {
   REQUIRE(count);
 }
 
+DEFINE_VALIDATOR(DebounceConfigP) {
+  REQUIRE(source);
+  REQUIRE(window_ms);
+  NON_NEGATIVE(window_ms);
+}
+
 DEFINE_VALIDATOR(ProtocolHandlerConfigP) {
   ALLOW(batching_delay_ms);
   ZERO_OR_MORE(rate_limit);
@@ -281,6 +287,20 @@ DEFINE_VALIDATOR(ClientConfigP) {
   REQUIRE(protocol_handler_config);
   ALLOW(offline_heartbeat_threshold_ms);
   ALLOW(allow_suppression);
+  ALLOW(timer_slack_percent);
+  NON_NEGATIVE(timer_slack_percent);
+  ALLOW(max_pending_upcalls);
+  NON_NEGATIVE(max_pending_upcalls);
+  ALLOW(max_held_invalidation_objects);
+  GREATER_OR_EQUAL(max_held_invalidation_objects, 1);
+  ZERO_OR_MORE(debounce_config);
+  ALLOW(write_coalescing_window_ms);
+  NON_NEGATIVE(write_coalescing_window_ms);
+  ALLOW(ack_journal_size);
+  NON_NEGATIVE(ack_journal_size);
+  ALLOW(buffer_registrations_before_ready);
+  ALLOW(memory_soft_cap_bytes);
+  NON_NEGATIVE(memory_soft_cap_bytes);
 }
 
 DEFINE_VALIDATOR(InfoMessage) {
@@ -0,0 +1,97 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Coalesces timers whose deadlines fall within each other's slack so that
+// they are run from a single scheduler wakeup.
+
+#include "google/cacheinvalidation/impl/timer-coalescer.h"
+
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/impl/log-macro.h"
+
+namespace invalidation {
+
+TimerCoalescer::TimerCoalescer(Scheduler* scheduler, Statistics* statistics,
+    Logger* logger) : scheduler_(scheduler), statistics_(statistics),
+    logger_(logger) {
+}
+
+TimerCoalescer::~TimerCoalescer() {
+  map<Time, vector<Closure*> >::iterator iter;
+  for (iter = pending_wakeups_.begin(); iter != pending_wakeups_.end();
+       ++iter) {
+    for (size_t i = 0; i < iter->second.size(); ++i) {
+      delete iter->second[i];
+    }
+  }
+}
+
+void TimerCoalescer::Schedule(TimeDelta delay, TimeDelta slack,
+    Closure* task) {
+  CHECK(scheduler_->IsRunningOnThread()) << "Not on scheduler thread";
+  Time now = scheduler_->GetCurrentTime();
+  Time deadline = now + delay;
+  Time wakeup_time = GetWakeupTime(deadline, deadline + slack);
+  map<Time, vector<Closure*> >::iterator iter =
+      pending_wakeups_.find(wakeup_time);
+  if (iter != pending_wakeups_.end()) {
+    iter->second.push_back(task);
+    statistics_->RecordTimerEvent(Statistics::TimerEventType_WAKEUP_SAVED);
+    TLOG(logger_, FINE, "Coalesced task with deadline %d into wakeup at %d",
+         deadline.ToInternalValue(), wakeup_time.ToInternalValue());
+    return;
+  }
+
+  // No suitable wakeup: schedule one as late as the slack permits.
+  pending_wakeups_[wakeup_time].push_back(task);
+  statistics_->RecordTimerEvent(Statistics::TimerEventType_WAKEUP_SCHEDULED);
+  scheduler_->Schedule(wakeup_time - now,
+      NewPermanentCallback(this, &TimerCoalescer::RunWakeup, wakeup_time));
+}
+
+TimeDelta TimerCoalescer::GetWakeupDelay(TimeDelta delay, TimeDelta slack) {
+  CHECK(scheduler_->IsRunningOnThread()) << "Not on scheduler thread";
+  Time now = scheduler_->GetCurrentTime();
+  return GetWakeupTime(now + delay, now + delay + slack) - now;
+}
+
+Time TimerCoalescer::GetWakeupTime(Time deadline, Time latest) {
+  // Join the earliest pending wakeup that is no sooner than the deadline, as
+  // long as it is within the slack.
+  map<Time, vector<Closure*> >::iterator iter =
+      pending_wakeups_.lower_bound(deadline);
+  if ((iter != pending_wakeups_.end()) && (iter->first <= latest)) {
+    return iter->first;
+  }
+  return latest;
+}
+
+void TimerCoalescer::RunWakeup(Time wakeup_time) {
+  CHECK(scheduler_->IsRunningOnThread()) << "Not on scheduler thread";
+  map<Time, vector<Closure*> >::iterator iter =
+      pending_wakeups_.find(wakeup_time);
+  CHECK(iter != pending_wakeups_.end()) << "No tasks for wakeup";
+
+  // Remove the wakeup before running its tasks, since they may schedule new
+  // tasks (e.g., recurring tasks rescheduling themselves).
+  vector<Closure*> tasks;
+  tasks.swap(iter->second);
+  pending_wakeups_.erase(iter);
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    tasks[i]->Run();
+    delete tasks[i];
+  }
+}
+
+}  // namespace invalidation
@@ -0,0 +1,102 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Coalesces timers whose deadlines fall within each other's slack so that
+// they are run from a single scheduler wakeup.
+
+#ifndef GOOGLE_CACHEINVALIDATION_IMPL_TIMER_COALESCER_H_
+#define GOOGLE_CACHEINVALIDATION_IMPL_TIMER_COALESCER_H_
+
+#include <map>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// Each task is scheduled with a deadline (now + delay) and a slack, meaning
+// that it may run at any time in [deadline, deadline + slack]. If a wakeup is
+// already pending within that window, the task simply joins it; otherwise a
+// new wakeup is scheduled at the latest allowed time, which maximizes the
+// chance that tasks scheduled later can join it. With a zero slack, only tasks
+// with identical deadlines share a wakeup.
+//
+// A single instance may be shared by several clients as long as all of them
+// run on the thread of the coalescer's scheduler.
+class TimerCoalescer {
+ public:
+  /* Creates a coalescer that schedules its wakeups on |scheduler| and records
+   * them in |statistics|.
+   *
+   * Space for |scheduler|, |statistics| and |logger| is owned by the caller.
+   */
+  TimerCoalescer(Scheduler* scheduler, Statistics* statistics, Logger* logger);
+
+  /* Deletes the tasks that have not run yet. */
+  ~TimerCoalescer();
+
+  /* Schedules |task| to run no sooner than |delay| and no later than
+   * |delay| + |slack| from now. Space for |task| is owned by the callee.
+   *
+   * REQUIRES: Must be called from the scheduler thread.
+   */
+  void Schedule(TimeDelta delay, TimeDelta slack, Closure* task);
+
+  /* Returns the delay from now after which a task scheduled now with |delay|
+   * and |slack| would run: that of the wakeup it would join or get.
+   *
+   * REQUIRES: Must be called from the scheduler thread.
+   */
+  TimeDelta GetWakeupDelay(TimeDelta delay, TimeDelta slack);
+
+  /* Returns the number of wakeups that are currently scheduled. */
+  int GetPendingWakeupCountForTest() {
+    return pending_wakeups_.size();
+  }
+
+ private:
+  /* Returns the time of the wakeup of a task that may run at any time in
+   * [|deadline|, |latest|]: the earliest pending wakeup in that window, or
+   * |latest| if there is none.
+   */
+  Time GetWakeupTime(Time deadline, Time latest);
+
+  /* Runs all the tasks that were attached to the wakeup at |wakeup_time|. */
+  void RunWakeup(Time wakeup_time);
+
+  /* Scheduler on which the wakeups are scheduled. */
+  Scheduler* scheduler_;
+
+  /* Statistics recording the wakeups scheduled and saved. */
+  Statistics* statistics_;
+
+  /* A logger. */
+  Logger* logger_;
+
+  /* Tasks to be run for each pending wakeup, keyed by the wakeup time. */
+  map<Time, vector<Closure*> > pending_wakeups_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimerCoalescer);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_IMPL_TIMER_COALESCER_H_
@@ -0,0 +1,111 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the TimerCoalescer class.
+
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/impl/statistics.h"
+#include "google/cacheinvalidation/impl/timer-coalescer.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+
+namespace invalidation {
+
+class TimerCoalescerTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    logger.reset(new TestLogger());
+    scheduler.reset(new SimpleDeterministicScheduler(logger.get()));
+    statistics.reset(new Statistics());
+    coalescer.reset(
+        new TimerCoalescer(scheduler.get(), statistics.get(), logger.get()));
+    scheduler->StartScheduler();
+    run_times.clear();
+  }
+
+  /* Records the time at which a task ran. */
+  void RecordRun() {
+    run_times.push_back(scheduler->GetCurrentTime());
+  }
+
+  /* Schedules a task recording its run time with the given delay and slack. */
+  void ScheduleTask(int delay_ms, int slack_ms) {
+    coalescer->Schedule(TimeDelta::FromMilliseconds(delay_ms),
+        TimeDelta::FromMilliseconds(slack_ms),
+        NewPermanentCallback(this, &TimerCoalescerTest::RecordRun));
+  }
+
+  scoped_ptr<Logger> logger;
+  scoped_ptr<DeterministicScheduler> scheduler;
+  scoped_ptr<Statistics> statistics;
+  scoped_ptr<TimerCoalescer> coalescer;
+  vector<Time> run_times;
+};
+
+/* Tests that tasks whose deadlines fall within each other's slack are run from
+ * a single wakeup, within their allowed windows.
+ */
+TEST_F(TimerCoalescerTest, OverlappingWindowsShareWakeup) {
+  Time start = scheduler->GetCurrentTime();
+  ScheduleTask(1000, 200);  // Window [1000, 1200].
+  ScheduleTask(1100, 300);  // Window [1100, 1400].
+  ScheduleTask(1150, 0);    // Window [1150, 1150]: needs its own wakeup.
+  EXPECT_EQ(2, coalescer->GetPendingWakeupCountForTest());
+
+  scheduler->PassTime(TimeDelta::FromMilliseconds(2000));
+  ASSERT_EQ(3, static_cast<int>(run_times.size()));
+  EXPECT_EQ(start + TimeDelta::FromMilliseconds(1150), run_times[0]);
+  EXPECT_EQ(start + TimeDelta::FromMilliseconds(1200), run_times[1]);
+  EXPECT_EQ(start + TimeDelta::FromMilliseconds(1200), run_times[2]);
+  EXPECT_EQ(0, coalescer->GetPendingWakeupCountForTest());
+  EXPECT_EQ(2, statistics->GetTimerEventCounterForTest(
+      Statistics::TimerEventType_WAKEUP_SCHEDULED));
+  EXPECT_EQ(1, statistics->GetTimerEventCounterForTest(
+      Statistics::TimerEventType_WAKEUP_SAVED));
+}
+
+/* Tests that a task never joins a wakeup that would run it too early. */
+TEST_F(TimerCoalescerTest, NoEarlyRuns) {
+  Time start = scheduler->GetCurrentTime();
+  ScheduleTask(100, 0);
+  ScheduleTask(500, 1000);
+  EXPECT_EQ(2, coalescer->GetPendingWakeupCountForTest());
+
+  scheduler->PassTime(TimeDelta::FromMilliseconds(2000));
+  ASSERT_EQ(2, static_cast<int>(run_times.size()));
+  EXPECT_EQ(start + TimeDelta::FromMilliseconds(100), run_times[0]);
+  EXPECT_EQ(start + TimeDelta::FromMilliseconds(1500), run_times[1]);
+  EXPECT_EQ(0, statistics->GetTimerEventCounterForTest(
+      Statistics::TimerEventType_WAKEUP_SAVED));
+}
+
+/* Tests that the reported wakeup delay is that of the wakeup a task would
+ * join or get.
+ */
+TEST_F(TimerCoalescerTest, GetWakeupDelay) {
+  TimeDelta delay = TimeDelta::FromMilliseconds(1000);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1200),
+            coalescer->GetWakeupDelay(delay, TimeDelta::FromMilliseconds(200)));
+
+  ScheduleTask(1100, 0);
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1100),
+            coalescer->GetWakeupDelay(delay, TimeDelta::FromMilliseconds(200)));
+  EXPECT_EQ(TimeDelta::FromMilliseconds(1050),
+            coalescer->GetWakeupDelay(delay, TimeDelta::FromMilliseconds(50)));
+  EXPECT_EQ(1, coalescer->GetPendingWakeupCountForTest());
+}
+
+}  // namespace invalidation
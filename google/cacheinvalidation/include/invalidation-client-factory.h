@@ -113,6 +113,26 @@ class ClientFactory {
       SystemResources* resources,
       const InvalidationClientConfig& config,
       InvalidationListener* listener);
+
+  /* Constructs an invalidation client library instance with a default
+   * configuration that, when started, resumes from a snapshot of another
+   * client instead of its persistent state: it neither acquires a token nor
+   * sends its registrations again. Returns NULL if the snapshot cannot be
+   * used. Caller owns returned space.
+   *
+   * Arguments:
+   *   resources SystemResources to use for logging, scheduling, persistence,
+   *       and network connectivity
+   *   config configuration provided by the application
+   *   snapshot snapshot exported by the client being taken over (see
+   *       InvalidationClientCore::ExportSnapshot)
+   *   listener callback object for invalidation events
+   */
+  static InvalidationClient* CreateFromSnapshot(
+      SystemResources* resources,
+      const InvalidationClientConfig& config,
+      const string& snapshot,
+      InvalidationListener* listener);
 };
 
 /* Constructs an invalidation client library instance with a default
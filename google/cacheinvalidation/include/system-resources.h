@@ -25,6 +25,7 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "google/cacheinvalidation/deps/callback.h"
 #include "google/cacheinvalidation/deps/stl-namespace.h"
@@ -34,6 +35,7 @@ namespace invalidation {
 
 using INVALIDATION_STL_NAMESPACE::pair;
 using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
 
 class Status;
 class SystemResources;  // Declared below.
@@ -45,6 +47,7 @@ typedef INVALIDATION_CALLBACK1_TYPE(StatusStringPair) ReadKeyCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(Status) WriteKeyCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(bool) DeleteKeyCallback;
 typedef INVALIDATION_CALLBACK1_TYPE(StatusStringPair) ReadAllKeysCallback;
+typedef INVALIDATION_CALLBACK1_TYPE(vector<StatusStringPair>) ReadKeysCallback;
 
 /* Interface for a component of a SystemResources implementation constructed by
  * calls to set* methods of SystemResourcesBuilder.
@@ -207,11 +210,39 @@ class Storage : public ResourceComponent {
 
   /* Reads all the keys from the underlying store and then calls key_callback
    * with each key that was written earlier and not deleted. When all the keys
-   * are done, calls key_callback with null. With each key, the code can
-   * indicate a failed status, in which case the iteration stops.
+   * are done, calls key_callback with null, i.e., with a success status and
+   * an empty key. With each key, the code can indicate a failed status, in
+   * which case the iteration stops.
    * Caller continues to own |key_callback|.
    */
   virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) = 0;
+
+  /* Attempts to persist all the given key, value pairs. Invokes done when
+   * finished, passing a success status only if all of them were persisted.
+   * On failure, some of the pairs may have been persisted: a backend may
+   * write the batch atomically (all or none), but callers may only rely on
+   * that if the backend documents it. The same ordering requirement as for
+   * WriteKey applies to each key.
+   *
+   * The default implementation issues one WriteKey per pair and reports the
+   * first failure. Backends that can write several keys atomically should
+   * override it.
+   *
+   * Callee owns |done| after this call. After it calls |done->Run()|, it must
+   * delete |done|.
+   */
+  virtual void WriteKeys(const vector<pair<string, string> >& key_values,
+                         WriteKeyCallback* done);
+
+  /* Reads the values corresponding to keys and calls done with one result per
+   * key, in the same order, each as ReadKey would pass it.
+   *
+   * The default implementation issues one ReadKey per key.
+   *
+   * Callee owns |done| after this call. After it calls |done->Run()|, it must
+   * delete |done|.
+   */
+  virtual void ReadKeys(const vector<string>& keys, ReadKeysCallback* done);
 };
 
 class SystemResources {
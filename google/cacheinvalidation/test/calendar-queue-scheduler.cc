@@ -0,0 +1,156 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A deterministic scheduler for long simulations, backed by a calendar queue
+// and jumping straight to the next due task.
+
+#include "google/cacheinvalidation/test/calendar-queue-scheduler.h"
+
+#include <algorithm>
+
+namespace invalidation {
+
+CalendarQueueScheduler::CalendarQueueScheduler(
+    Logger* logger, TimeDelta bucket_width, int num_buckets)
+    : bucket_width_us_(bucket_width.InMicroseconds()),
+      buckets_(num_buckets),
+      first_bucket_number_(0),
+      num_calendar_tasks_(0),
+      current_id_(0),
+      running_internal_(false),
+      logger_(logger) {
+  CHECK(bucket_width_us_ > 0) << "bucket width must be positive";
+  CHECK(num_buckets > 0) << "calendar must have buckets";
+}
+
+CalendarQueueScheduler::CalendarQueueScheduler(Logger* logger)
+    : bucket_width_us_(TimeDelta::FromMilliseconds(1).InMicroseconds()),
+      buckets_(4096),
+      first_bucket_number_(0),
+      num_calendar_tasks_(0),
+      current_id_(0),
+      running_internal_(false),
+      logger_(logger) {
+}
+
+void CalendarQueueScheduler::StopScheduler() {
+  run_state_.Stop();
+  // Delete any tasks that haven't been run.
+  for (size_t i = 0; i < buckets_.size(); ++i) {
+    for (size_t j = 0; j < buckets_[i].size(); ++j) {
+      delete buckets_[i][j].task;
+    }
+    buckets_[i].clear();
+  }
+  num_calendar_tasks_ = 0;
+  while (!overflow_.empty()) {
+    delete overflow_.top().task;
+    overflow_.pop();
+  }
+}
+
+void CalendarQueueScheduler::SetInitialTime(Time new_time) {
+  CHECK(GetNumPendingTasks() == 0) << "cannot set the time of pending tasks";
+  current_time_ = new_time;
+  first_bucket_number_ = GetBucketNumber(new_time);
+}
+
+void CalendarQueueScheduler::Schedule(TimeDelta delay, Closure* task) {
+  CHECK(IsCallbackRepeatable(task));
+  CHECK(run_state_.IsStarted());
+  TLOG(logger_, FINE, "(Now: %d) Enqueuing %p with delay %d",
+       current_time_.ToInternalValue(), task, delay.InMilliseconds());
+  Enqueue(TaskEntry(current_time_ + delay, current_id_++, task));
+}
+
+void CalendarQueueScheduler::Enqueue(const TaskEntry& entry) {
+  // Tasks scheduled in the past go into the first bucket, where the heap
+  // order still puts them ahead of the others.
+  int64 bucket_number =
+      std::max(GetBucketNumber(entry.time), first_bucket_number_);
+  if (bucket_number >= first_bucket_number_ +
+      static_cast<int64>(buckets_.size())) {
+    overflow_.push(entry);
+    return;
+  }
+  vector<TaskEntry>* bucket = &buckets_[bucket_number % buckets_.size()];
+  bucket->push_back(entry);
+  std::push_heap(bucket->begin(), bucket->end());
+  ++num_calendar_tasks_;
+}
+
+void CalendarQueueScheduler::AdvanceCalendar(int64 bucket_number) {
+  if (bucket_number <= first_bucket_number_) {
+    return;
+  }
+  first_bucket_number_ = bucket_number;
+  int64 end_bucket_number =
+      first_bucket_number_ + static_cast<int64>(buckets_.size());
+  while (!overflow_.empty() &&
+         (GetBucketNumber(overflow_.top().time) < end_bucket_number)) {
+    TaskEntry entry = overflow_.top();
+    overflow_.pop();
+    Enqueue(entry);
+  }
+}
+
+bool CalendarQueueScheduler::FindNextTask(vector<TaskEntry>** bucket) {
+  if (num_calendar_tasks_ == 0) {
+    if (overflow_.empty()) {
+      return false;
+    }
+    // Jump the calendar to the first overflow task.
+    AdvanceCalendar(GetBucketNumber(overflow_.top().time));
+  }
+  // Every task in a bucket is due before any task of a later bucket, so the
+  // first non-empty bucket holds the next task, at the top of its heap.
+  for (int64 bucket_number = first_bucket_number_; ; ++bucket_number) {
+    vector<TaskEntry>* candidate = &buckets_[bucket_number % buckets_.size()];
+    if (!candidate->empty()) {
+      *bucket = candidate;
+      return true;
+    }
+  }
+}
+
+void CalendarQueueScheduler::PassTime(TimeDelta delta_time) {
+  CHECK(delta_time >= TimeDelta()) << "cannot pass a negative amount of time";
+  Time end_time = current_time_ + delta_time;
+  running_internal_ = true;
+  vector<TaskEntry>* bucket;
+  while (FindNextTask(&bucket) && (bucket->front().time <= end_time)) {
+    std::pop_heap(bucket->begin(), bucket->end());
+    TaskEntry entry = bucket->back();
+    bucket->pop_back();
+    --num_calendar_tasks_;
+
+    // The earlier buckets are empty: move the calendar up to this task.
+    AdvanceCalendar(GetBucketNumber(entry.time));
+    if (entry.time > current_time_) {
+      current_time_ = entry.time;
+    }
+    TLOG(logger_, FINE, "(Now: %d) Running task %p",
+         current_time_.ToInternalValue(), entry.task);
+    entry.task->Run();
+    delete entry.task;
+  }
+  running_internal_ = false;
+
+  // No task is left before the end of the interval, so the calendar can start
+  // there.
+  current_time_ = end_time;
+  AdvanceCalendar(GetBucketNumber(end_time));
+}
+
+}  // namespace invalidation
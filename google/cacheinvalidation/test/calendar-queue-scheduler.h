@@ -0,0 +1,162 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A deterministic scheduler for long simulations, backed by a calendar queue
+// and jumping straight to the next due task.
+
+#ifndef GOOGLE_CACHEINVALIDATION_TEST_CALENDAR_QUEUE_SCHEDULER_H_
+#define GOOGLE_CACHEINVALIDATION_TEST_CALENDAR_QUEUE_SCHEDULER_H_
+
+#include <queue>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/logging.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/log-macro.h"
+#include "google/cacheinvalidation/impl/run-state.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::priority_queue;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+// A single-threaded scheduler with the same contract as the
+// DeterministicScheduler: tasks run in the order of their scheduled times, and
+// tasks scheduled for the same time run in the order in which they were
+// enqueued. Two differences make it suited to simulations of many clients
+// over hours of virtual time:
+//
+// - PassTime jumps from one due task to the next instead of stepping through
+//   every 10ms, and the current time seen by a task is exactly its scheduled
+//   time.
+// - Tasks due within the next |num_buckets| * |bucket_width| are kept in a
+//   calendar of buckets indexed by time, each a small heap, so that scheduling
+//   and running a task costs about O(1) however many are pending. Later tasks
+//   wait in an overflow heap and move to the calendar as time reaches them.
+//
+// This class is not thread-safe.
+class CalendarQueueScheduler : public Scheduler {
+ public:
+  /* Creates a scheduler whose calendar has |num_buckets| buckets of
+   * |bucket_width| each. Caller retains ownership of |logger|.
+   */
+  CalendarQueueScheduler(Logger* logger, TimeDelta bucket_width,
+                         int num_buckets);
+
+  /* Creates a scheduler with a calendar of 4096 buckets of 1ms each. */
+  explicit CalendarQueueScheduler(Logger* logger);
+
+  virtual ~CalendarQueueScheduler() {
+    StopScheduler();
+  }
+
+  virtual void SetSystemResources(SystemResources* resources) {
+    // Nothing to do.
+  }
+
+  virtual Time GetCurrentTime() const {
+    return current_time_;
+  }
+
+  void StartScheduler() {
+    run_state_.Start();
+  }
+
+  void StopScheduler();
+
+  virtual void Schedule(TimeDelta delay, Closure* task);
+
+  virtual bool IsRunningOnThread() const {
+    return running_internal_;
+  }
+
+  /* Sets the current time. Must be called before any task is scheduled. */
+  void SetInitialTime(Time new_time);
+
+  /* Passes |delta_time|, running every task scheduled up to the end of the
+   * interval, including those enqueued by the tasks themselves.
+   */
+  void PassTime(TimeDelta delta_time);
+
+  /* Returns the number of tasks waiting to run. */
+  int GetNumPendingTasks() const {
+    return num_calendar_tasks_ + static_cast<int>(overflow_.size());
+  }
+
+ private:
+  /* Returns the absolute number of the bucket of |time|. */
+  int64 GetBucketNumber(Time time) const {
+    return time.ToInternalValue() / bucket_width_us_;
+  }
+
+  /* Adds |entry| to its bucket of the calendar, or to the overflow heap if it
+   * is beyond the calendar.
+   */
+  void Enqueue(const TaskEntry& entry);
+
+  /* Moves the calendar forward to |bucket_number|, whose earlier buckets must
+   * be empty, and moves the overflow tasks it now covers into it.
+   */
+  void AdvanceCalendar(int64 bucket_number);
+
+  /* Stores in |bucket| the calendar bucket holding the next task to run and
+   * returns true, or returns false if there are no pending tasks.
+   */
+  bool FindNextTask(vector<TaskEntry>** bucket);
+
+  /* Width of a bucket, in microseconds. */
+  int64 bucket_width_us_;
+
+  /* The buckets of the calendar, as heaps ordered by TaskEntry. Bucket number
+   * n is at index n % buckets_.size().
+   */
+  vector<vector<TaskEntry> > buckets_;
+
+  /* Absolute number of the first bucket of the calendar. No pending task is
+   * in an earlier bucket, except for tasks scheduled in the past, which are
+   * kept in this one.
+   */
+  int64 first_bucket_number_;
+
+  /* Number of tasks in the calendar. */
+  int num_calendar_tasks_;
+
+  /* Tasks beyond the calendar. */
+  priority_queue<TaskEntry> overflow_;
+
+  /* The current time. */
+  Time current_time_;
+
+  /* The id number of the next task. */
+  int64 current_id_;
+
+  /* Whether or not the scheduler has been started/stopped. */
+  RunState run_state_;
+
+  /* Whether tasks are being run by PassTime. */
+  bool running_internal_;
+
+  /* A logger. */
+  Logger* logger_;
+
+  DISALLOW_COPY_AND_ASSIGN(CalendarQueueScheduler);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_TEST_CALENDAR_QUEUE_SCHEDULER_H_
@@ -0,0 +1,153 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Unit tests for the CalendarQueueScheduler class.
+
+#include <vector>
+
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/random.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/test/calendar-queue-scheduler.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+
+namespace invalidation {
+
+class CalendarQueueSchedulerTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    logger.reset(new TestLogger());
+    start_time = Time() + TimeDelta::FromDays(1);
+
+    // A small calendar of 4 x 1ms buckets, so that most tasks overflow.
+    scheduler.reset(new CalendarQueueScheduler(logger.get(),
+        TimeDelta::FromMilliseconds(1), 4));
+    scheduler->SetInitialTime(start_time);
+    scheduler->StartScheduler();
+    task_ids.clear();
+    run_times.clear();
+  }
+
+  /* Records that task |id| ran, and when. */
+  void RecordRun(int id) {
+    task_ids.push_back(id);
+    run_times.push_back(scheduler->GetCurrentTime());
+  }
+
+  /* Records that task |id| ran on the reference scheduler. */
+  void RecordReferenceRun(int id) {
+    reference_task_ids.push_back(id);
+  }
+
+  /* Records that task |id| ran, then schedules task |id| + 1 after
+   * |delay_ms|.
+   */
+  void RecordRunAndReschedule(int id, int delay_ms) {
+    RecordRun(id);
+    ScheduleTask(delay_ms, id + 1);
+  }
+
+  /* Schedules task |id| to run after |delay_ms|. */
+  void ScheduleTask(int delay_ms, int id) {
+    scheduler->Schedule(TimeDelta::FromMilliseconds(delay_ms),
+        NewPermanentCallback(this, &CalendarQueueSchedulerTest::RecordRun,
+                             id));
+  }
+
+  scoped_ptr<Logger> logger;
+  scoped_ptr<CalendarQueueScheduler> scheduler;
+  Time start_time;
+  vector<int> task_ids;
+  vector<Time> run_times;
+  vector<int> reference_task_ids;
+};
+
+/* Tests that tasks run at exactly their scheduled times, in time order, and
+ * in enqueue order for equal times, whether in the calendar or beyond it.
+ */
+TEST_F(CalendarQueueSchedulerTest, RunsTasksInOrderAtScheduledTimes) {
+  ScheduleTask(3600000, 0);
+  ScheduleTask(2, 1);
+  ScheduleTask(3600000, 2);
+  ScheduleTask(2, 3);
+  ScheduleTask(0, 4);
+  ScheduleTask(7, 5);
+  EXPECT_EQ(6, scheduler->GetNumPendingTasks());
+
+  scheduler->PassTime(TimeDelta::FromHours(1));
+  ASSERT_EQ(6, static_cast<int>(task_ids.size()));
+  int expected_ids[] = {4, 1, 3, 5, 0, 2};
+  int expected_delays_ms[] = {0, 2, 2, 7, 3600000, 3600000};
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(expected_ids[i], task_ids[i]);
+    EXPECT_EQ(start_time + TimeDelta::FromMilliseconds(expected_delays_ms[i]),
+              run_times[i]);
+  }
+  EXPECT_EQ(0, scheduler->GetNumPendingTasks());
+  EXPECT_EQ(start_time + TimeDelta::FromHours(1),
+            scheduler->GetCurrentTime());
+}
+
+/* Tests that tasks scheduled by running tasks run within the same PassTime
+ * when they are due, and not before.
+ */
+TEST_F(CalendarQueueSchedulerTest, RunsTasksScheduledByTasks) {
+  scheduler->Schedule(TimeDelta::FromMilliseconds(1), NewPermanentCallback(
+      this, &CalendarQueueSchedulerTest::RecordRunAndReschedule, 0, 0));
+  scheduler->Schedule(TimeDelta::FromMilliseconds(1), NewPermanentCallback(
+      this, &CalendarQueueSchedulerTest::RecordRunAndReschedule, 10, 5000));
+  scheduler->PassTime(TimeDelta::FromSeconds(1));
+
+  // Task 1 is enqueued at the same time as task 10 but after it.
+  ASSERT_EQ(3, static_cast<int>(task_ids.size()));
+  EXPECT_EQ(0, task_ids[0]);
+  EXPECT_EQ(10, task_ids[1]);
+  EXPECT_EQ(1, task_ids[2]);
+  EXPECT_EQ(start_time + TimeDelta::FromMilliseconds(1), run_times[2]);
+  EXPECT_EQ(1, scheduler->GetNumPendingTasks());
+
+  scheduler->PassTime(TimeDelta::FromSeconds(5));
+  ASSERT_EQ(4, static_cast<int>(task_ids.size()));
+  EXPECT_EQ(11, task_ids[3]);
+  EXPECT_EQ(start_time + TimeDelta::FromMilliseconds(5001), run_times[3]);
+}
+
+/* Tests that tasks scheduled up front run in the same order as with the
+ * DeterministicScheduler.
+ */
+TEST_F(CalendarQueueSchedulerTest, MatchesDeterministicScheduler) {
+  DeterministicScheduler reference(logger.get());
+  reference.SetInitialTime(start_time);
+  reference.StartScheduler();
+  reference_task_ids.clear();
+
+  // Delays in whole steps of the reference, with many ties.
+  Random random(0);
+  static const int kNumTasks = 1000;
+  for (int i = 0; i < kNumTasks; ++i) {
+    int delay_ms = 10 * static_cast<int>(random.RandUint64() % 100);
+    ScheduleTask(delay_ms, i);
+    reference.Schedule(TimeDelta::FromMilliseconds(delay_ms),
+        NewPermanentCallback(this,
+            &CalendarQueueSchedulerTest::RecordReferenceRun, i));
+  }
+  scheduler->PassTime(TimeDelta::FromSeconds(10));
+  reference.PassTime(TimeDelta::FromSeconds(10));
+  ASSERT_EQ(kNumTasks, static_cast<int>(task_ids.size()));
+  EXPECT_TRUE(task_ids == reference_task_ids);
+}
+
+}  // namespace invalidation
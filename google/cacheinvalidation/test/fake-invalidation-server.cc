@@ -0,0 +1,526 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An in-process stand-in for the invalidation server, reached by clients over
+// loopback network channels, for end-to-end and load tests.
+
+#include "google/cacheinvalidation/test/fake-invalidation-server.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "google/cacheinvalidation/types.pb.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+#include "google/cacheinvalidation/impl/invalidation-client-util.h"
+#include "google/cacheinvalidation/impl/log-macro.h"
+#include "google/cacheinvalidation/impl/proto-helpers.h"
+
+namespace invalidation {
+
+using ::ipc::invalidation::ObjectSource_Type_TEST;
+using INVALIDATION_STL_NAMESPACE::lower_bound;
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+LoopbackChannel::LoopbackChannel(FakeInvalidationServer* server,
+                                 int channel_id)
+    : server_(server), channel_id_(channel_id), is_online_(true),
+      is_partitioned_(false) {
+}
+
+LoopbackChannel::~LoopbackChannel() {
+  if (server_ != NULL) {
+    server_->RemoveChannel(channel_id_);
+  }
+  for (size_t i = 0; i < network_status_receivers_.size(); ++i) {
+    delete network_status_receivers_[i];
+  }
+}
+
+void LoopbackChannel::SendMessage(const string& outgoing_message) {
+  if (IsConnected() && (server_ != NULL)) {
+    server_->ScheduleClientMessage(channel_id_, outgoing_message);
+  }
+}
+
+void LoopbackChannel::SetMessageReceiver(MessageCallback* incoming_receiver) {
+  message_receiver_.reset(incoming_receiver);
+}
+
+void LoopbackChannel::AddNetworkStatusReceiver(
+    NetworkStatusCallback* network_status_receiver) {
+  network_status_receivers_.push_back(network_status_receiver);
+}
+
+void LoopbackChannel::SetOnline(bool is_online) {
+  if (is_online_ == is_online) {
+    return;
+  }
+  is_online_ = is_online;
+  for (size_t i = 0; i < network_status_receivers_.size(); ++i) {
+    network_status_receivers_[i]->Run(is_online);
+  }
+}
+
+void LoopbackChannel::DeliverMessage(const string& message) {
+  if (IsConnected() && (message_receiver_.get() != NULL)) {
+    message_receiver_->Run(message);
+  }
+}
+
+FakeInvalidationServer::FakeInvalidationServer(
+    const FakeInvalidationServerConfig& config, Scheduler* scheduler,
+    Logger* logger)
+    : config_(config),
+      scheduler_(scheduler),
+      logger_(logger),
+      random_(config.random_seed),
+      loss_random_(config.random_seed + 1),
+      next_channel_id_(0),
+      next_token_number_(0),
+      next_message_id_(0),
+      is_generating_(false),
+      stream_id_(0),
+      invalidation_credit_(0),
+      messages_received_(0),
+      messages_sent_(0),
+      invalidations_generated_(0),
+      invalidations_sent_(0),
+      acks_received_(0),
+      heartbeats_received_(0),
+      registration_syncs_requested_(0),
+      registration_syncs_received_(0),
+      registration_sync_objects_received_(0),
+      messages_lost_(0) {
+  CHECK_GT(config_.num_objects, 0);
+  CHECK_GT(config_.invalidation_interval.InMicroseconds(), 0);
+
+  // Build the cumulative distribution of the choice of the objects, where the
+  // weight of object n is 1 / (n + 1)^object_skew.
+  double total_weight = 0;
+  for (int i = 0; i < config_.num_objects; ++i) {
+    ObjectIdP object_id;
+    object_id.set_source(ObjectSource_Type_TEST);
+    object_id.set_name(StringPrintf("oid%d", i));
+    object_ids_.push_back(object_id);
+    total_weight += pow(i + 1.0, -config_.object_skew);
+    object_cdf_.push_back(total_weight);
+  }
+  for (size_t i = 0; i < object_cdf_.size(); ++i) {
+    object_cdf_[i] /= total_weight;
+  }
+}
+
+FakeInvalidationServer::~FakeInvalidationServer() {
+  map<int, LoopbackChannel*>::iterator iter;
+  for (iter = channels_.begin(); iter != channels_.end(); ++iter) {
+    iter->second->server_ = NULL;
+  }
+  ForgetClients();
+}
+
+LoopbackChannel* FakeInvalidationServer::NewChannel() {
+  int channel_id = next_channel_id_++;
+  LoopbackChannel* channel = new LoopbackChannel(this, channel_id);
+  channels_[channel_id] = channel;
+  return channel;
+}
+
+void FakeInvalidationServer::RemoveChannel(int channel_id) {
+  channels_.erase(channel_id);
+  channel_tokens_.erase(channel_id);
+}
+
+bool FakeInvalidationServer::IsMessageLost() {
+  if ((config_.message_loss_probability <= 0) ||
+      (loss_random_.RandDouble() >= config_.message_loss_probability)) {
+    return false;
+  }
+  ++messages_lost_;
+  return true;
+}
+
+void FakeInvalidationServer::ScheduleClientMessage(int channel_id,
+                                                   const string& message) {
+  if (IsMessageLost()) {
+    return;
+  }
+  scheduler_->Schedule(config_.network_latency, NewPermanentCallback(
+      this, &FakeInvalidationServer::HandleClientMessage, channel_id,
+      message));
+}
+
+void FakeInvalidationServer::HandleClientMessage(int channel_id,
+                                                 string message) {
+  ClientToServerMessage client_message;
+  if (!client_message.ParseFromString(message)) {
+    TLOG(logger_, WARNING, "Dropping unparseable message on channel %d",
+         channel_id);
+    return;
+  }
+  ++messages_received_;
+  ServerToClientMessage response;
+
+  if (client_message.has_initialize_message()) {
+    // Issue a new token, forgetting the one previously used on the channel.
+    map<int, string>::iterator token_iter = channel_tokens_.find(channel_id);
+    if (token_iter != channel_tokens_.end()) {
+      map<string, ClientState*>::iterator iter =
+          clients_.find(token_iter->second);
+      if (iter != clients_.end()) {
+        ForgetClient(iter);
+      }
+    }
+    string token = StringPrintf("token-%d", next_token_number_++);
+    ClientState* client = new ClientState(channel_id, &digest_function_);
+    clients_[token] = client;
+    channel_tokens_[channel_id] = token;
+    response.mutable_token_control_message()->set_new_token(token);
+    TLOG(logger_, FINE, "Issuing token %s on channel %d", token.c_str(),
+         channel_id);
+    SendServerMessage(channel_id, client_message.initialize_message().nonce(),
+                      client, &response);
+    return;
+  }
+
+  const string& token = client_message.header().client_token();
+  if (token.empty()) {
+    TLOG(logger_, WARNING, "Dropping message without token on channel %d",
+         channel_id);
+    return;
+  }
+  map<string, ClientState*>::iterator iter = clients_.find(token);
+  if (iter == clients_.end()) {
+    // Destroy the unknown token, so that the client gets a new one.
+    response.mutable_token_control_message();
+    SendServerMessage(channel_id, token, NULL, &response);
+    return;
+  }
+  // Route later messages to the channel the client last used.
+  ClientState* client = iter->second;
+  client->channel_id = channel_id;
+  channel_tokens_[channel_id] = token;
+  HandleTokenMessage(channel_id, client_message, token, client, &response);
+  SendServerMessage(channel_id, token, client, &response);
+}
+
+void FakeInvalidationServer::HandleTokenMessage(
+    int channel_id, const ClientToServerMessage& message, const string& token,
+    ClientState* client, ServerToClientMessage* response) {
+  if (message.has_registration_message()) {
+    const RegistrationMessage& registration_message =
+        message.registration_message();
+    for (int i = 0; i < registration_message.registration_size(); ++i) {
+      const RegistrationP& registration =
+          registration_message.registration(i);
+      if (registration.op_type() == RegistrationP_OpType_REGISTER) {
+        AddRegistration(token, client, registration.object_id());
+      } else {
+        RemoveRegistration(token, client, registration.object_id());
+      }
+      RegistrationStatus* status = response->
+          mutable_registration_status_message()->add_registration_status();
+      status->mutable_registration()->CopyFrom(registration);
+      status->mutable_status()->set_code(StatusP_Code_SUCCESS);
+    }
+  }
+  if (message.has_registration_sync_message()) {
+    ++registration_syncs_received_;
+    const RegistrationSyncMessage& sync_message =
+        message.registration_sync_message();
+    set<string> synced_objects;
+    for (int i = 0; i < sync_message.subtree_size(); ++i) {
+      const RegistrationSubtree& subtree = sync_message.subtree(i);
+      for (int j = 0; j < subtree.registered_object_size(); ++j) {
+        AddRegistration(token, client, subtree.registered_object(j));
+        synced_objects.insert(
+            subtree.registered_object(j).SerializeAsString());
+      }
+      registration_sync_objects_received_ += subtree.registered_object_size();
+    }
+    // The subtrees cover all the registrations of the client (the empty
+    // digest prefix): drop those it no longer has, e.g., after a lost
+    // unregistration, so that the summaries match again.
+    vector<ObjectIdP> registered_objects;
+    client->registrations.GetElements("", 0, &registered_objects);
+    for (size_t i = 0; i < registered_objects.size(); ++i) {
+      if (synced_objects.count(registered_objects[i].SerializeAsString()) ==
+          0) {
+        RemoveRegistration(token, client, registered_objects[i]);
+      }
+    }
+  }
+  if (message.has_invalidation_ack_message()) {
+    Time now = scheduler_->GetCurrentTime();
+    const InvalidationMessage& ack_message = message.invalidation_ack_message();
+    for (int i = 0; i < ack_message.invalidation_size(); ++i) {
+      const InvalidationP& invalidation = ack_message.invalidation(i);
+      ++acks_received_;
+      map<SentInvalidation, Time>::iterator iter =
+          client->unacked_invalidations.find(make_pair(
+              invalidation.object_id().SerializeAsString(),
+              invalidation.version()));
+      if (iter != client->unacked_invalidations.end()) {
+        ack_latency_.Record(now - iter->second);
+        client->unacked_invalidations.erase(iter);
+      }
+    }
+  }
+
+  if (!message.has_registration_message() &&
+      !message.has_registration_sync_message() &&
+      !message.has_invalidation_ack_message()) {
+    // A heartbeat: measure the interval since the previous one.
+    Time now = scheduler_->GetCurrentTime();
+    ++heartbeats_received_;
+    if (client->has_sent_heartbeat) {
+      heartbeat_interval_.Record(now - client->last_heartbeat_time);
+    }
+    client->has_sent_heartbeat = true;
+    client->last_heartbeat_time = now;
+  }
+
+  // Ask the client for its registrations if its summary does not match ours,
+  // e.g., after it restarted with registrations made under another token.
+  const RegistrationSummary& summary =
+      message.header().registration_summary();
+  if ((summary.num_registrations() != client->registrations.size()) ||
+      (summary.registration_digest() != client->registrations.GetDigest())) {
+    TLOG(logger_, FINE, "Requesting registration sync on channel %d: %d "
+         "client registrations, %d server registrations", channel_id,
+         summary.num_registrations(), client->registrations.size());
+    response->mutable_registration_sync_request_message();
+    ++registration_syncs_requested_;
+  }
+}
+
+void FakeInvalidationServer::SendServerMessage(
+    int channel_id, const string& token, ClientState* client,
+    ServerToClientMessage* message) {
+  ServerHeader* header = message->mutable_header();
+  ProtoHelpers::InitProtocolVersion(header->mutable_protocol_version());
+  header->set_client_token(token);
+  if (client != NULL) {
+    RegistrationSummary* summary = header->mutable_registration_summary();
+    summary->set_num_registrations(client->registrations.size());
+    summary->set_registration_digest(client->registrations.GetDigest());
+  }
+  header->set_server_time_ms(
+      InvalidationClientUtil::GetCurrentTimeMs(scheduler_));
+  header->set_message_id(StringPrintf("%d", next_message_id_++));
+  ++messages_sent_;
+  if (message->has_invalidation_message()) {
+    invalidations_sent_ += message->invalidation_message().invalidation_size();
+  }
+  if (IsMessageLost()) {
+    return;
+  }
+  string serialized;
+  message->SerializeToString(&serialized);
+  scheduler_->Schedule(config_.network_latency, NewPermanentCallback(
+      this, &FakeInvalidationServer::DeliverServerMessage, channel_id,
+      serialized));
+}
+
+void FakeInvalidationServer::DeliverServerMessage(int channel_id,
+                                                  string message) {
+  map<int, LoopbackChannel*>::iterator iter = channels_.find(channel_id);
+  if (iter != channels_.end()) {
+    iter->second->DeliverMessage(message);
+  }
+}
+
+void FakeInvalidationServer::StartInvalidations() {
+  if (is_generating_) {
+    return;
+  }
+  is_generating_ = true;
+  ++stream_id_;
+  invalidation_credit_ = 0;
+  scheduler_->Schedule(config_.invalidation_interval, NewPermanentCallback(
+      this, &FakeInvalidationServer::GenerateInvalidations, stream_id_));
+}
+
+void FakeInvalidationServer::StopInvalidations() {
+  is_generating_ = false;
+}
+
+void FakeInvalidationServer::GenerateInvalidations(int stream_id) {
+  if (!is_generating_ || (stream_id != stream_id_)) {
+    return;
+  }
+  invalidation_credit_ += config_.invalidations_per_second *
+      config_.invalidation_interval.InMicroseconds() /
+      static_cast<double>(Time::kMicrosecondsPerSecond);
+  int count = static_cast<int>(invalidation_credit_);
+  invalidation_credit_ -= count;
+  map<string, ServerToClientMessage> messages;
+  for (int i = 0; i < count; ++i) {
+    AddInvalidation(object_ids_[ChooseObject()], &messages);
+  }
+  invalidations_generated_ += count;
+  SendInvalidationMessages(&messages);
+  scheduler_->Schedule(config_.invalidation_interval, NewPermanentCallback(
+      this, &FakeInvalidationServer::GenerateInvalidations, stream_id));
+}
+
+int FakeInvalidationServer::Invalidate(const ObjectIdP& object_id) {
+  map<string, ServerToClientMessage> messages;
+  int num_clients = AddInvalidation(object_id, &messages);
+  ++invalidations_generated_;
+  SendInvalidationMessages(&messages);
+  return num_clients;
+}
+
+int FakeInvalidationServer::ChooseObject() {
+  vector<double>::iterator iter =
+      lower_bound(object_cdf_.begin(), object_cdf_.end(), random_.RandDouble());
+  if (iter == object_cdf_.end()) {
+    // Rounding may leave the last value slightly under one.
+    return object_cdf_.size() - 1;
+  }
+  return iter - object_cdf_.begin();
+}
+
+int FakeInvalidationServer::AddInvalidation(
+    const ObjectIdP& object_id, map<string, ServerToClientMessage>* messages) {
+  string serialized_object_id = object_id.SerializeAsString();
+  int64 version = ++versions_[serialized_object_id];
+  InvalidationP invalidation;
+  invalidation.mutable_object_id()->CopyFrom(object_id);
+  invalidation.set_is_known_version(true);
+  invalidation.set_version(version);
+  if (config_.payload_size > 0) {
+    invalidation.set_payload(string(config_.payload_size, 'p'));
+  }
+
+  Time now = scheduler_->GetCurrentTime();
+  int num_clients = 0;
+  map<string, set<string> >::iterator registered =
+      registered_tokens_.find(serialized_object_id);
+  if (registered == registered_tokens_.end()) {
+    return 0;
+  }
+  set<string>::iterator iter;
+  for (iter = registered->second.begin(); iter != registered->second.end();
+       ++iter) {
+    ClientState* client = clients_[*iter];
+    (*messages)[*iter].mutable_invalidation_message()->
+        add_invalidation()->CopyFrom(invalidation);
+    client->unacked_invalidations[
+        make_pair(serialized_object_id, version)] = now;
+    ++num_clients;
+  }
+  return num_clients;
+}
+
+void FakeInvalidationServer::AddRegistration(
+    const string& token, ClientState* client, const ObjectIdP& object_id) {
+  if (client->registrations.Add(object_id)) {
+    registered_tokens_[object_id.SerializeAsString()].insert(token);
+  }
+}
+
+void FakeInvalidationServer::RemoveRegistration(
+    const string& token, ClientState* client, const ObjectIdP& object_id) {
+  if (!client->registrations.Remove(object_id)) {
+    return;
+  }
+  string serialized_object_id = object_id.SerializeAsString();
+  set<string>* tokens = &registered_tokens_[serialized_object_id];
+  tokens->erase(token);
+  if (tokens->empty()) {
+    registered_tokens_.erase(serialized_object_id);
+  }
+}
+
+void FakeInvalidationServer::ForgetClient(
+    map<string, ClientState*>::iterator iter) {
+  vector<ObjectIdP> object_ids;
+  iter->second->registrations.RemoveAll(&object_ids);
+  for (size_t i = 0; i < object_ids.size(); ++i) {
+    string serialized_object_id = object_ids[i].SerializeAsString();
+    set<string>* tokens = &registered_tokens_[serialized_object_id];
+    tokens->erase(iter->first);
+    if (tokens->empty()) {
+      registered_tokens_.erase(serialized_object_id);
+    }
+  }
+  delete iter->second;
+  clients_.erase(iter);
+}
+
+void FakeInvalidationServer::SendInvalidationMessages(
+    map<string, ServerToClientMessage>* messages) {
+  map<string, ServerToClientMessage>::iterator iter;
+  for (iter = messages->begin(); iter != messages->end(); ++iter) {
+    ClientState* client = clients_[iter->first];
+    SendServerMessage(client->channel_id, iter->first, client, &iter->second);
+  }
+}
+
+void FakeInvalidationServer::ForgetClients() {
+  map<string, ClientState*>::iterator iter;
+  for (iter = clients_.begin(); iter != clients_.end(); ++iter) {
+    delete iter->second;
+  }
+  clients_.clear();
+  channel_tokens_.clear();
+  registered_tokens_.clear();
+}
+
+int FakeInvalidationServer::GetNumClients() {
+  return clients_.size();
+}
+
+int FakeInvalidationServer::GetNumRegistrations() {
+  int num_registrations = 0;
+  map<string, ClientState*>::iterator iter;
+  for (iter = clients_.begin(); iter != clients_.end(); ++iter) {
+    num_registrations += iter->second->registrations.size();
+  }
+  return num_registrations;
+}
+
+void FakeInvalidationServer::GetStatistics(
+    vector<pair<string, int> >* statistics) {
+  statistics->push_back(make_pair("Server.CLIENTS", GetNumClients()));
+  statistics->push_back(make_pair("Server.REGISTRATIONS",
+                                  GetNumRegistrations()));
+  statistics->push_back(make_pair("Server.MESSAGES_RECEIVED",
+                                  messages_received_));
+  statistics->push_back(make_pair("Server.MESSAGES_SENT", messages_sent_));
+  statistics->push_back(make_pair("Server.INVALIDATIONS_GENERATED",
+                                  invalidations_generated_));
+  statistics->push_back(make_pair("Server.INVALIDATIONS_SENT",
+                                  invalidations_sent_));
+  statistics->push_back(make_pair("Server.ACKS_RECEIVED", acks_received_));
+  statistics->push_back(make_pair("Server.HEARTBEATS_RECEIVED",
+                                  heartbeats_received_));
+  statistics->push_back(make_pair("Server.REGISTRATION_SYNCS_REQUESTED",
+                                  registration_syncs_requested_));
+  statistics->push_back(make_pair("Server.REGISTRATION_SYNCS_RECEIVED",
+                                  registration_syncs_received_));
+  statistics->push_back(make_pair("Server.REGISTRATION_SYNC_OBJECTS_RECEIVED",
+                                  registration_sync_objects_received_));
+  statistics->push_back(make_pair("Server.MESSAGES_LOST", messages_lost_));
+  if (ack_latency_.count() > 0) {
+    ack_latency_.GetSummary("Server.ACK_LATENCY.", statistics);
+  }
+  if (heartbeat_interval_.count() > 0) {
+    heartbeat_interval_.GetSummary("Server.HEARTBEAT_INTERVAL.", statistics);
+  }
+}
+
+}  // namespace invalidation
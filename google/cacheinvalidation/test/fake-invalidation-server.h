@@ -0,0 +1,452 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// An in-process stand-in for the invalidation server, reached by clients over
+// loopback network channels, for end-to-end and load tests.
+
+#ifndef GOOGLE_CACHEINVALIDATION_TEST_FAKE_INVALIDATION_SERVER_H_
+#define GOOGLE_CACHEINVALIDATION_TEST_FAKE_INVALIDATION_SERVER_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/include/system-resources.h"
+#include "google/cacheinvalidation/deps/callback.h"
+#include "google/cacheinvalidation/deps/random.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/sha1-digest-function.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/client-protocol-namespace-fix.h"
+#include "google/cacheinvalidation/impl/latency-histogram.h"
+#include "google/cacheinvalidation/impl/simple-registration-store.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::set;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class FakeInvalidationServer;
+
+// A network channel connecting a client to a FakeInvalidationServer. Messages
+// are delivered in both directions after the latency of the server, as tasks
+// on the scheduler of the server. While the channel is offline or partitioned,
+// messages sent in either direction are dropped; only going offline is
+// reported to the client.
+class LoopbackChannel : public NetworkChannel {
+ public:
+  virtual ~LoopbackChannel();
+
+  virtual void SendMessage(const string& outgoing_message);
+
+  virtual void SetMessageReceiver(MessageCallback* incoming_receiver);
+
+  virtual void AddNetworkStatusReceiver(
+      NetworkStatusCallback* network_status_receiver);
+
+  virtual void SetSystemResources(SystemResources* resources) {
+    // Nothing to do.
+  }
+
+  /* Changes whether the channel is online, informing the network status
+   * receivers if it changes.
+   */
+  void SetOnline(bool is_online);
+
+  bool is_online() const {
+    return is_online_;
+  }
+
+  /* Changes whether the channel is cut from the server, without informing the
+   * client.
+   */
+  void SetPartitioned(bool is_partitioned) {
+    is_partitioned_ = is_partitioned;
+  }
+
+  bool is_partitioned() const {
+    return is_partitioned_;
+  }
+
+  /* Returns the id of the channel at the server. */
+  int channel_id() const {
+    return channel_id_;
+  }
+
+ private:
+  friend class FakeInvalidationServer;
+
+  LoopbackChannel(FakeInvalidationServer* server, int channel_id);
+
+  /* Returns whether messages go through the channel. */
+  bool IsConnected() const {
+    return is_online_ && !is_partitioned_;
+  }
+
+  /* Hands |message| to the message receiver, if any. */
+  void DeliverMessage(const string& message);
+
+  /* The server, or NULL if it was destroyed first. */
+  FakeInvalidationServer* server_;
+
+  /* The id of the channel at the server. */
+  int channel_id_;
+
+  /* Whether the channel is online, as known to the client. */
+  bool is_online_;
+
+  /* Whether the channel is cut from the server. */
+  bool is_partitioned_;
+
+  /* Receiver of the messages from the server. */
+  scoped_ptr<MessageCallback> message_receiver_;
+
+  /* Receivers of the changes of the network status. */
+  vector<NetworkStatusCallback*> network_status_receivers_;
+
+  DISALLOW_COPY_AND_ASSIGN(LoopbackChannel);
+};
+
+// Configuration of a FakeInvalidationServer.
+struct FakeInvalidationServerConfig {
+  FakeInvalidationServerConfig()
+      : network_latency(TimeDelta::FromMilliseconds(10)),
+        invalidations_per_second(0),
+        invalidation_interval(TimeDelta::FromMilliseconds(100)),
+        payload_size(0),
+        num_objects(100),
+        object_skew(0),
+        message_loss_probability(0),
+        random_seed(0) {}
+
+  /* Delay of the messages in each direction. */
+  TimeDelta network_latency;
+
+  /* Number of invalidations generated per second. Each is sent to the clients
+   * registered for its object, if any.
+   */
+  int invalidations_per_second;
+
+  /* Interval between the batches of generated invalidations. The
+   * invalidations generated in an interval are sent in one message per client.
+   */
+  TimeDelta invalidation_interval;
+
+  /* Size of the payload of the generated invalidations, in bytes. No payload
+   * is set if zero.
+   */
+  int payload_size;
+
+  /* Number of objects invalidated, in the TEST source and named oid<n> as
+   * with UnitTestBase::InitTestObjectIds.
+   */
+  int num_objects;
+
+  /* Skew of the invalidated objects: object oid<n> is invalidated with a
+   * probability proportional to 1 / (n + 1)^object_skew, e.g., uniformly if
+   * zero and following Zipf's law if one.
+   */
+  double object_skew;
+
+  /* Probability that a message is lost, in each direction. */
+  double message_loss_probability;
+
+  /* Seed of the choice of the invalidated objects and of the lost messages.
+   */
+  int64 random_seed;
+};
+
+// A fake of the server side of the protocol. It issues tokens to clients that
+// send an initialize message, keeps the registrations of each client and
+// includes their summary in every message, requests a registration sync when
+// the summary of a client does not match, and answers registrations with
+// successful statuses. Clients are known by their token rather than by their
+// channel, so that a client restarting with a persisted token on a new channel
+// keeps its registrations. The server also generates a stream of
+// invalidations of a set of objects and records how long clients take to
+// acknowledge them.
+//
+// The server and its channels run on |scheduler| and are not thread-safe:
+// with a DeterministicScheduler, tests control the interleaving completely.
+// The server must outlive the tasks it schedules.
+class FakeInvalidationServer {
+ public:
+  /* Creates a server running on |scheduler|, with the given configuration.
+   *
+   * Space for |scheduler| and |logger| is owned by the caller.
+   */
+  FakeInvalidationServer(const FakeInvalidationServerConfig& config,
+                         Scheduler* scheduler, Logger* logger);
+
+  ~FakeInvalidationServer();
+
+  /* Returns a new channel for a client of this server. Ownership passes to
+   * the caller, e.g., to the BasicSystemResources of the client.
+   */
+  LoopbackChannel* NewChannel();
+
+  /* Starts generating invalidations as configured. */
+  void StartInvalidations();
+
+  /* Stops generating invalidations. */
+  void StopInvalidations();
+
+  /* Sends an invalidation of |object_id| at the next version, with a payload
+   * as configured, to the clients registered for it. Returns the number of
+   * clients it was sent to.
+   */
+  int Invalidate(const ObjectIdP& object_id);
+
+  /* Forgets the tokens and registrations of all the clients, as on a restart
+   * of the server.
+   */
+  void ForgetClients();
+
+  /* Returns the number of clients holding a token. */
+  int GetNumClients();
+
+  /* Returns the number of registrations over all clients. */
+  int GetNumRegistrations();
+
+  /* Returns how long the acknowledged invalidations took to be acknowledged,
+   * from when the server sent them.
+   */
+  const LatencyHistogram& ack_latency() const {
+    return ack_latency_;
+  }
+
+  /* Returns the intervals between the heartbeats of each client: messages
+   * holding at most an info message.
+   */
+  const LatencyHistogram& heartbeat_interval() const {
+    return heartbeat_interval_;
+  }
+
+  int messages_received() const {
+    return messages_received_;
+  }
+
+  int messages_sent() const {
+    return messages_sent_;
+  }
+
+  int invalidations_sent() const {
+    return invalidations_sent_;
+  }
+
+  int acks_received() const {
+    return acks_received_;
+  }
+
+  int heartbeats_received() const {
+    return heartbeats_received_;
+  }
+
+  int registration_syncs_received() const {
+    return registration_syncs_received_;
+  }
+
+  int registration_sync_objects_received() const {
+    return registration_sync_objects_received_;
+  }
+
+  /* Appends the counters of the server and summaries of the ack latencies
+   * and heartbeat intervals, e.g., "Server.INVALIDATIONS_SENT" and
+   * "Server.ACK_LATENCY.p99_us".
+   */
+  void GetStatistics(vector<pair<string, int> >* statistics);
+
+ private:
+  friend class LoopbackChannel;
+
+  /* An invalidation sent to a client: the serialized object id and the
+   * version.
+   */
+  typedef pair<string, int64> SentInvalidation;
+
+  /* The state of a client holding a token. */
+  struct ClientState {
+    ClientState(int channel_id, DigestFunction* digest_function)
+        : channel_id(channel_id), registrations(digest_function),
+          has_sent_heartbeat(false) {}
+
+    /* The channel on which the client last sent a message. */
+    int channel_id;
+
+    /* The objects the client is registered for. */
+    SimpleRegistrationStore registrations;
+
+    /* When the invalidations not acknowledged yet were sent. */
+    map<SentInvalidation, Time> unacked_invalidations;
+
+    /* Whether the client sent a heartbeat, last at |last_heartbeat_time|. */
+    bool has_sent_heartbeat;
+    Time last_heartbeat_time;
+  };
+
+  /* Returns whether a message is lost, as configured. */
+  bool IsMessageLost();
+
+  /* Schedules the delivery of |message| from the client on |channel_id|. */
+  void ScheduleClientMessage(int channel_id, const string& message);
+
+  /* Forgets the channel |channel_id|. The tokens used on it remain valid. */
+  void RemoveChannel(int channel_id);
+
+  /* Handles |message| from the client on |channel_id|. */
+  void HandleClientMessage(int channel_id, string message);
+
+  /* Handles |message| from the client on |channel_id| with the state
+   * |client|, storing the parts of the response in |response|.
+   */
+  void HandleTokenMessage(int channel_id, const ClientToServerMessage& message,
+                          const string& token, ClientState* client,
+                          ServerToClientMessage* response);
+
+  /* Registers the client with |token| and the state |client| for
+   * |object_id|.
+   */
+  void AddRegistration(const string& token, ClientState* client,
+                       const ObjectIdP& object_id);
+
+  /* Unregisters the client with |token| and the state |client| from
+   * |object_id|.
+   */
+  void RemoveRegistration(const string& token, ClientState* client,
+                          const ObjectIdP& object_id);
+
+  /* Forgets the client at |iter| and its registrations. */
+  void ForgetClient(map<string, ClientState*>::iterator iter);
+
+  /* Fills the header of |message| for a client with |token| and, if not
+   * NULL, the state |client|, and sends it on |channel_id|.
+   */
+  void SendServerMessage(int channel_id, const string& token,
+                         ClientState* client, ServerToClientMessage* message);
+
+  /* Hands |message| to the channel |channel_id|, if it still exists. */
+  void DeliverServerMessage(int channel_id, string message);
+
+  /* Sends the messages holding invalidations in |messages|, by token. */
+  void SendInvalidationMessages(map<string, ServerToClientMessage>* messages);
+
+  /* Generates the invalidations of an interval and schedules the next
+   * interval, unless the stream started as |stream_id| was stopped.
+   */
+  void GenerateInvalidations(int stream_id);
+
+  /* Returns the index of an object chosen following the configured skew. */
+  int ChooseObject();
+
+  /* Adds an invalidation of |object_id| at the next version to the message
+   * of each client registered for it in |messages|. Returns the number of
+   * clients.
+   */
+  int AddInvalidation(const ObjectIdP& object_id,
+                      map<string, ServerToClientMessage>* messages);
+
+  FakeInvalidationServerConfig config_;
+
+  /* Scheduler running the server and delivering the messages. */
+  Scheduler* scheduler_;
+
+  /* A logger. */
+  Logger* logger_;
+
+  /* Digest function of the registration summaries, as used by clients. */
+  Sha1DigestFunction digest_function_;
+
+  /* Generator of the choices of invalidated objects. */
+  Random random_;
+
+  /* Generator of the lost messages, separate from |random_| so that losses
+   * do not change the invalidated objects.
+   */
+  Random loss_random_;
+
+  /* The channels by id. */
+  map<int, LoopbackChannel*> channels_;
+
+  /* The clients holding a token, by token. */
+  map<string, ClientState*> clients_;
+
+  /* The token last issued or used on each channel. */
+  map<int, string> channel_tokens_;
+
+  /* The tokens of the clients registered for each object, by serialized
+   * object id, so that an invalidation does not visit every client.
+   */
+  map<string, set<string> > registered_tokens_;
+
+  /* Id of the next channel. */
+  int next_channel_id_;
+
+  /* Number used to make the next token. */
+  int next_token_number_;
+
+  /* Id of the next message sent. */
+  int next_message_id_;
+
+  /* The objects invalidated by the stream. */
+  vector<ObjectIdP> object_ids_;
+
+  /* The cumulative distribution of the choice of the invalidated objects. */
+  vector<double> object_cdf_;
+
+  /* The last version of each invalidated object, by serialized object id. */
+  map<string, int64> versions_;
+
+  /* Whether invalidations are being generated. */
+  bool is_generating_;
+
+  /* Id of the current stream of invalidations, incremented when one starts
+   * so that the pending task of a stopped stream does nothing.
+   */
+  int stream_id_;
+
+  /* Number of invalidations due but not generated in the previous intervals,
+   * carried over so that fractional rates are honored.
+   */
+  double invalidation_credit_;
+
+  /* Latencies between sending invalidations and receiving their acks. */
+  LatencyHistogram ack_latency_;
+
+  /* Intervals between the heartbeats of each client. */
+  LatencyHistogram heartbeat_interval_;
+
+  /* Counters. */
+  int messages_received_;
+  int messages_sent_;
+  int invalidations_generated_;
+  int invalidations_sent_;
+  int acks_received_;
+  int heartbeats_received_;
+  int registration_syncs_requested_;
+  int registration_syncs_received_;
+  int registration_sync_objects_received_;
+  int messages_lost_;
+
+  DISALLOW_COPY_AND_ASSIGN(FakeInvalidationServer);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_TEST_FAKE_INVALIDATION_SERVER_H_
@@ -0,0 +1,268 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end tests of the Ticl against the FakeInvalidationServer.
+
+#include <vector>
+
+#include "google/cacheinvalidation/include/invalidation-listener.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/deps/gmock.h"
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/deps/random.h"
+#include "google/cacheinvalidation/impl/basic-system-resources.h"
+#include "google/cacheinvalidation/impl/invalidation-client-impl.h"
+#include "google/cacheinvalidation/test/deterministic-scheduler.h"
+#include "google/cacheinvalidation/test/fake-invalidation-server.h"
+#include "google/cacheinvalidation/test/test-logger.h"
+#include "google/cacheinvalidation/test/test-utils.h"
+
+namespace invalidation {
+
+using ::ipc::invalidation::ClientType_Type_TEST;
+using ::testing::NiceMock;
+
+// Given the ReadCallback of Storage::ReadKey as argument 1, invokes it with a
+// permanent failure status code, as for a fresh client.
+ACTION(InvokeReadCallbackFailure) {
+  arg1->Run(pair<Status, string>(Status(Status::PERMANENT_FAILURE, ""), ""));
+  delete arg1;
+}
+
+// Given the WriteCallback of Storage::WriteKey as argument 2, invokes it with
+// a success status code.
+ACTION(InvokeWriteCallbackSuccess) {
+  arg2->Run(Status(Status::SUCCESS, ""));
+  delete arg2;
+}
+
+// A listener that acknowledges every invalidation as soon as it gets it.
+class AckingListener : public InvalidationListener {
+ public:
+  AckingListener() : is_ready_(false), num_invalidations_(0) {}
+
+  virtual void Ready(InvalidationClient* client) {
+    is_ready_ = true;
+  }
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix, int prefix_length) {}
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+
+  bool is_ready() const {
+    return is_ready_;
+  }
+
+  int num_invalidations() const {
+    return num_invalidations_;
+  }
+
+ private:
+  bool is_ready_;
+  int num_invalidations_;
+};
+
+/* Number of objects the client registers for. */
+static const int kNumObjects = 10;
+
+class FakeInvalidationServerTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    Logger* logger = new TestLogger();
+    internal_scheduler = new DeterministicScheduler(logger);
+    internal_scheduler->SetInitialTime(Time() + TimeDelta::FromDays(9));
+
+    // Invalidate the registered objects 100 times per second, following
+    // Zipf's law.
+    FakeInvalidationServerConfig server_config;
+    server_config.invalidations_per_second = 100;
+    server_config.payload_size = 10;
+    server_config.num_objects = kNumObjects;
+    server_config.object_skew = 1;
+    server.reset(new FakeInvalidationServer(server_config, internal_scheduler,
+                                            logger));
+    channel = server->NewChannel();
+
+    // Run the listener upcalls inline and give the client empty storage.
+    NiceMock<MockScheduler>* listener_scheduler =
+        new NiceMock<MockScheduler>();
+    ON_CALL(*listener_scheduler, Schedule(_, _))
+        .WillByDefault(InvokeAndDeleteClosure<1>());
+    NiceMock<MockStorage>* storage = new NiceMock<MockStorage>();
+    ON_CALL(*storage, ReadKey(_, _))
+        .WillByDefault(InvokeReadCallbackFailure());
+    ON_CALL(*storage, WriteKey(_, _, _))
+        .WillByDefault(InvokeWriteCallbackSuccess());
+
+    resources.reset(new BasicSystemResources(logger, internal_scheduler,
+        listener_scheduler, channel, storage, "fake-server-test"));
+    internal_scheduler->StartScheduler();
+    resources->Start();
+
+    InvalidationClientImpl::InitConfig(&config);
+    config.set_smear_percent(0);
+    client.reset(new InvalidationClientImpl(resources.get(), new Random(0),
+        ClientType_Type_TEST, "clientName", config, "FakeServerTest",
+        &listener));
+  }
+
+  /* Registers the client for all the objects of the server. */
+  void RegisterAllObjects() {
+    vector<ObjectIdP> object_id_protos;
+    vector<ObjectId> object_ids;
+    UnitTestBase::InitTestObjectIds(kNumObjects, &object_id_protos);
+    UnitTestBase::ConvertFromObjectIdProtos(object_id_protos, &object_ids);
+    client->Register(object_ids);
+  }
+
+  ClientConfigP config;
+
+  /* Owned by |resources|. */
+  DeterministicScheduler* internal_scheduler;
+  LoopbackChannel* channel;
+
+  /* The server outlives the resources of the client. */
+  scoped_ptr<FakeInvalidationServer> server;
+  scoped_ptr<BasicSystemResources> resources;
+  AckingListener listener;
+  scoped_ptr<InvalidationClientImpl> client;
+};
+
+/* Tests that a client gets a token and registers through the server, and
+ * that it receives and acknowledges the stream of invalidations.
+ */
+TEST_F(FakeInvalidationServerTest, DeliversInvalidationStream) {
+  client->Start();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  ASSERT_TRUE(listener.is_ready());
+  ASSERT_EQ(1, server->GetNumClients());
+
+  RegisterAllObjects();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  ASSERT_EQ(kNumObjects, server->GetNumRegistrations());
+
+  // Generate ten seconds of invalidations, then let the acks drain.
+  server->StartInvalidations();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(10));
+  server->StopInvalidations();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(10));
+
+  EXPECT_EQ(1000, server->invalidations_sent());
+  EXPECT_EQ(server->invalidations_sent(), listener.num_invalidations());
+  EXPECT_EQ(server->invalidations_sent(), server->acks_received());
+  EXPECT_EQ(server->acks_received(), server->ack_latency().count());
+
+  vector<pair<string, int> > statistics;
+  server->GetStatistics(&statistics);
+  bool found = false;
+  for (size_t i = 0; i < statistics.size(); ++i) {
+    if (statistics[i].first == "Server.ACK_LATENCY.count") {
+      EXPECT_EQ(1000, statistics[i].second);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+}
+
+/* Tests that the server requests a registration sync from a client that
+ * restarts with a new token and gets its registrations back.
+ */
+TEST_F(FakeInvalidationServerTest, RequestsRegistrationSync) {
+  client->Start();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  RegisterAllObjects();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  ASSERT_EQ(kNumObjects, server->GetNumRegistrations());
+
+  // Make the server forget the client, as on a server restart: the client
+  // sees its token destroyed, gets a new one and syncs its registrations.
+  ObjectIdP object_id;
+  object_id.set_source(ObjectSource_Type_TEST);
+  object_id.set_name("oid0");
+  ASSERT_EQ(1, server->Invalidate(object_id));
+  server->ForgetClients();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  internal_scheduler->PassTime(
+      TimeDelta::FromMilliseconds(config.heartbeat_interval_ms()));
+  EXPECT_EQ(1, server->GetNumClients());
+  EXPECT_EQ(kNumObjects, server->GetNumRegistrations());
+  EXPECT_EQ(1, server->Invalidate(object_id));
+}
+
+/* Tests that a registration sync drops the registrations the client no
+ * longer has, so that a lost unregistration does not cause a sync on every
+ * later message.
+ */
+TEST_F(FakeInvalidationServerTest, SyncDropsStaleRegistrations) {
+  client->Start();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  RegisterAllObjects();
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  ASSERT_EQ(kNumObjects, server->GetNumRegistrations());
+
+  // Lose the unregistration of one object.
+  vector<ObjectIdP> object_id_protos;
+  vector<ObjectId> object_ids;
+  UnitTestBase::InitTestObjectIds(1, &object_id_protos);
+  UnitTestBase::ConvertFromObjectIdProtos(object_id_protos, &object_ids);
+  channel->SetPartitioned(true);
+  client->Unregister(object_ids);
+  internal_scheduler->PassTime(TimeDelta::FromSeconds(5));
+  channel->SetPartitioned(false);
+  ASSERT_EQ(kNumObjects, server->GetNumRegistrations());
+
+  // The next heartbeat reveals the mismatch, which one sync repairs.
+  internal_scheduler->PassTime(
+      TimeDelta::FromMilliseconds(2 * config.heartbeat_interval_ms()));
+  EXPECT_EQ(kNumObjects - 1, server->GetNumRegistrations());
+  int registration_syncs = server->registration_syncs_received();
+  EXPECT_GT(registration_syncs, 0);
+  internal_scheduler->PassTime(
+      TimeDelta::FromMilliseconds(3 * config.heartbeat_interval_ms()));
+  EXPECT_EQ(registration_syncs, server->registration_syncs_received());
+  EXPECT_EQ(0, server->Invalidate(object_id_protos[0]));
+}
+
+}  // namespace invalidation
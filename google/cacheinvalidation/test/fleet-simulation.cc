@@ -0,0 +1,397 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A deterministic simulation of a fleet of clients talking to a
+// FakeInvalidationServer on virtual time, to measure the load seen by the
+// server under scenarios such as a mass restart or a network flap.
+
+#include "google/cacheinvalidation/test/fleet-simulation.h"
+
+#include "google/cacheinvalidation/include/invalidation-listener.h"
+#include "google/cacheinvalidation/include/types.h"
+#include "google/cacheinvalidation/types.pb.h"
+#include "google/cacheinvalidation/deps/string_util.h"
+
+namespace invalidation {
+
+using ::ipc::invalidation::ClientType_Type_TEST;
+using ::ipc::invalidation::ObjectSource_Type_TEST;
+using INVALIDATION_STL_NAMESPACE::make_pair;
+
+// A logger that drops all messages: thousands of clients would otherwise
+// spend most of the simulation formatting them.
+class SimulationLogger : public Logger {
+ public:
+  virtual void Log(LogLevel level, const char* file, int line,
+                   const char* format, ...) {}
+
+  virtual void SetSystemResources(SystemResources* resources) {}
+};
+
+// A task of a client that runs only if the client was not destroyed since it
+// was scheduled. Deletes the inner task when it is itself deleted.
+class SimulatedClientTask : public Closure {
+ public:
+  /* Creates a task running |task| unless |*current_generation| is no longer
+   * |generation|. Takes ownership of |task|.
+   */
+  SimulatedClientTask(const int* current_generation, int generation,
+                      Closure* task)
+      : current_generation_(current_generation), generation_(generation),
+        task_(task) {}
+
+  virtual ~SimulatedClientTask() {
+    delete task_;
+  }
+
+  virtual bool IsRepeatable() const {
+    return task_->IsRepeatable();
+  }
+
+  virtual void Run() {
+    if (*current_generation_ == generation_) {
+      task_->Run();
+    }
+  }
+
+ private:
+  const int* current_generation_;
+  int generation_;
+  Closure* task_;
+};
+
+// A scheduler of a client that forwards its tasks to the scheduler shared by
+// the fleet.
+class SimulatedScheduler : public Scheduler {
+ public:
+  /* Creates a scheduler for the generation |generation| of a client, whose
+   * current generation is |*current_generation|.
+   *
+   * Space for |scheduler| and |current_generation| is owned by the caller.
+   */
+  SimulatedScheduler(CalendarQueueScheduler* scheduler,
+                     const int* current_generation, int generation)
+      : scheduler_(scheduler), current_generation_(current_generation),
+        generation_(generation) {}
+
+  virtual void Schedule(TimeDelta delay, Closure* task) {
+    scheduler_->Schedule(delay,
+        new SimulatedClientTask(current_generation_, generation_, task));
+  }
+
+  virtual bool IsRunningOnThread() const {
+    return scheduler_->IsRunningOnThread();
+  }
+
+  virtual Time GetCurrentTime() const {
+    return scheduler_->GetCurrentTime();
+  }
+
+  virtual void SetSystemResources(SystemResources* resources) {
+    // Nothing to do.
+  }
+
+ private:
+  CalendarQueueScheduler* scheduler_;
+  const int* current_generation_;
+  int generation_;
+};
+
+// Storage of a client kept by the simulation, so that it survives restarts of
+// the client. Operations complete immediately and always succeed.
+class SimulatedStorage : public Storage {
+ public:
+  /* Space for |values| is owned by the caller. */
+  explicit SimulatedStorage(map<string, string>* values) : values_(values) {}
+
+  virtual void WriteKey(const string& key, const string& value,
+                        WriteKeyCallback* done) {
+    (*values_)[key] = value;
+    done->Run(Status(Status::SUCCESS, ""));
+    delete done;
+  }
+
+  virtual void ReadKey(const string& key, ReadKeyCallback* done) {
+    map<string, string>::iterator iter = values_->find(key);
+    if (iter == values_->end()) {
+      done->Run(StatusStringPair(Status(Status::PERMANENT_FAILURE, ""), ""));
+    } else {
+      done->Run(StatusStringPair(Status(Status::SUCCESS, ""), iter->second));
+    }
+    delete done;
+  }
+
+  virtual void DeleteKey(const string& key, DeleteKeyCallback* done) {
+    values_->erase(key);
+    done->Run(true);
+    delete done;
+  }
+
+  virtual void ReadAllKeys(ReadAllKeysCallback* key_callback) {
+    map<string, string>::iterator iter;
+    for (iter = values_->begin(); iter != values_->end(); ++iter) {
+      key_callback->Run(
+          StatusStringPair(Status(Status::SUCCESS, ""), iter->first));
+    }
+    key_callback->Run(StatusStringPair(Status(Status::SUCCESS, ""), ""));
+  }
+
+  virtual void SetSystemResources(SystemResources* resources) {
+    // Nothing to do.
+  }
+
+ private:
+  map<string, string>* values_;
+};
+
+// The application of a client: registers for its objects when the client is
+// ready, unless told not to, and acknowledges every invalidation at once.
+class SimulatedListener : public InvalidationListener {
+ public:
+  SimulatedListener(const vector<ObjectId>& object_ids,
+                    bool register_on_ready)
+      : object_ids_(object_ids), register_on_ready_(register_on_ready),
+        is_ready_(false), num_invalidations_(0) {}
+
+  virtual void Ready(InvalidationClient* client) {
+    is_ready_ = true;
+    if (register_on_ready_) {
+      client->Register(object_ids_);
+    }
+  }
+
+  virtual void Invalidate(InvalidationClient* client,
+                          const Invalidation& invalidation,
+                          const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateUnknownVersion(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        const AckHandle& ack_handle) {
+    ++num_invalidations_;
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InvalidateAll(InvalidationClient* client,
+                             const AckHandle& ack_handle) {
+    client->Acknowledge(ack_handle);
+  }
+
+  virtual void InformRegistrationStatus(InvalidationClient* client,
+                                        const ObjectId& object_id,
+                                        RegistrationState reg_state) {}
+
+  virtual void InformRegistrationFailure(InvalidationClient* client,
+                                         const ObjectId& object_id,
+                                         bool is_transient,
+                                         const string& error_message) {}
+
+  virtual void ReissueRegistrations(InvalidationClient* client,
+                                    const string& prefix, int prefix_length) {
+    client->Register(object_ids_);
+  }
+
+  virtual void InformError(InvalidationClient* client,
+                           const ErrorInfo& error_info) {}
+
+  bool is_ready() const {
+    return is_ready_;
+  }
+
+  int num_invalidations() const {
+    return num_invalidations_;
+  }
+
+ private:
+  /* The objects to register for. */
+  vector<ObjectId> object_ids_;
+
+  /* Whether to register for |object_ids_| on Ready. */
+  bool register_on_ready_;
+
+  /* Whether Ready was called. */
+  bool is_ready_;
+
+  /* Number of invalidations of known and unknown versions received. */
+  int num_invalidations_;
+};
+
+FleetSimulation::FleetSimulation(const FleetSimulationConfig& config)
+    : config_(config),
+      logger_(new SimulationLogger()),
+      scheduler_(logger_.get()),
+      seed_random_(config.random_seed),
+      sampled_messages_received_(0),
+      total_messages_per_second_(0),
+      num_load_samples_(0),
+      peak_messages_per_second_(0) {
+  scheduler_.SetInitialTime(Time() + TimeDelta::FromDays(1));
+  scheduler_.StartScheduler();
+  server_.reset(new FakeInvalidationServer(config_.server_config, &scheduler_,
+                                           logger_.get()));
+  for (int i = 0; i < config_.num_clients; ++i) {
+    clients_.push_back(new SimulatedClient());
+  }
+}
+
+FleetSimulation::~FleetSimulation() {
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    DestroyClient(i);
+    delete clients_[i];
+  }
+}
+
+void FleetSimulation::StartClients() {
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    CreateClient(i);
+  }
+}
+
+void FleetSimulation::RestartClients(int first_client, int num_clients) {
+  for (int i = first_client; i < first_client + num_clients; ++i) {
+    DestroyClient(i);
+    CreateClient(i);
+  }
+}
+
+void FleetSimulation::SetPartitioned(int first_client, int num_clients,
+                                     bool is_partitioned) {
+  for (int i = first_client; i < first_client + num_clients; ++i) {
+    if (clients_[i]->channel != NULL) {
+      clients_[i]->channel->SetPartitioned(is_partitioned);
+    }
+  }
+}
+
+void FleetSimulation::SetOnline(int first_client, int num_clients,
+                                bool is_online) {
+  for (int i = first_client; i < first_client + num_clients; ++i) {
+    if (clients_[i]->channel != NULL) {
+      clients_[i]->channel->SetOnline(is_online);
+    }
+  }
+}
+
+void FleetSimulation::CreateClient(int index) {
+  SimulatedClient* simulated = clients_[index];
+  CHECK(simulated->client.get() == NULL) << "Client already exists: " << index;
+
+  vector<ObjectId> object_ids;
+  int num_objects = config_.server_config.num_objects;
+  for (int i = 0; i < config_.registrations_per_client; ++i) {
+    object_ids.push_back(ObjectId(ObjectSource_Type_TEST,
+        StringPrintf("oid%d", (index + i) % num_objects)));
+  }
+  simulated->listener.reset(new SimulatedListener(
+      object_ids, !config_.register_before_start));
+  simulated->channel = server_->NewChannel();
+  simulated->resources.reset(new BasicSystemResources(
+      new SimulationLogger(),
+      new SimulatedScheduler(&scheduler_, &simulated->generation,
+                             simulated->generation),
+      new SimulatedScheduler(&scheduler_, &simulated->generation,
+                             simulated->generation),
+      simulated->channel, new SimulatedStorage(&simulated->storage),
+      "fleet-simulation"));
+  simulated->resources->Start();
+  simulated->client.reset(new InvalidationClientImpl(
+      simulated->resources.get(), new Random(seed_random_.RandUint64()),
+      ClientType_Type_TEST, StringPrintf("client%d", index),
+      config_.client_config, "FleetSimulation", simulated->listener.get()));
+  if (config_.register_before_start) {
+    simulated->client->Register(object_ids);
+  }
+  simulated->client->Start();
+}
+
+void FleetSimulation::DestroyClient(int index) {
+  SimulatedClient* simulated = clients_[index];
+  if (simulated->client.get() == NULL) {
+    return;
+  }
+  // Disown the pending tasks of the instance before destroying it.
+  ++simulated->generation;
+  simulated->client.reset();
+  simulated->resources.reset();
+  simulated->listener.reset();
+  simulated->channel = NULL;
+}
+
+void FleetSimulation::RunFor(TimeDelta duration) {
+  while (duration > TimeDelta()) {
+    TimeDelta step = config_.load_sample_interval - time_since_sample_;
+    if (step > duration) {
+      step = duration;
+    }
+    scheduler_.PassTime(step);
+    duration -= step;
+    time_since_sample_ += step;
+    if (time_since_sample_ >= config_.load_sample_interval) {
+      SampleLoad();
+    }
+  }
+}
+
+void FleetSimulation::SampleLoad() {
+  int messages_received = server_->messages_received();
+  int messages_per_second = static_cast<int>(
+      (messages_received - sampled_messages_received_) *
+      static_cast<int64>(Time::kMicrosecondsPerSecond) /
+      time_since_sample_.InMicroseconds());
+  total_messages_per_second_ += messages_per_second;
+  ++num_load_samples_;
+  if (messages_per_second > peak_messages_per_second_) {
+    peak_messages_per_second_ = messages_per_second;
+  }
+  sampled_messages_received_ = messages_received;
+  time_since_sample_ = TimeDelta();
+}
+
+int FleetSimulation::GetNumReadyClients() {
+  int num_ready = 0;
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    if ((clients_[i]->listener.get() != NULL) &&
+        clients_[i]->listener->is_ready()) {
+      ++num_ready;
+    }
+  }
+  return num_ready;
+}
+
+int FleetSimulation::GetNumInvalidatedClients() {
+  int num_invalidated = 0;
+  for (size_t i = 0; i < clients_.size(); ++i) {
+    if ((clients_[i]->listener.get() != NULL) &&
+        (clients_[i]->listener->num_invalidations() > 0)) {
+      ++num_invalidated;
+    }
+  }
+  return num_invalidated;
+}
+
+void FleetSimulation::GetStatistics(vector<pair<string, int> >* statistics) {
+  server_->GetStatistics(statistics);
+  statistics->push_back(make_pair("Fleet.CLIENTS", config_.num_clients));
+  statistics->push_back(make_pair("Fleet.READY_CLIENTS",
+                                  GetNumReadyClients()));
+  statistics->push_back(make_pair("Fleet.PEAK_MESSAGES_PER_SECOND",
+                                  peak_messages_per_second_));
+  statistics->push_back(make_pair("Fleet.MEAN_MESSAGES_PER_SECOND",
+      static_cast<int>(num_load_samples_ == 0 ? 0 :
+                       total_messages_per_second_ / num_load_samples_)));
+}
+
+}  // namespace invalidation
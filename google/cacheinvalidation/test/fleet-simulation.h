@@ -0,0 +1,220 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A deterministic simulation of a fleet of clients talking to a
+// FakeInvalidationServer on virtual time, to measure the load seen by the
+// server under scenarios such as a mass restart or a network flap.
+
+#ifndef GOOGLE_CACHEINVALIDATION_TEST_FLEET_SIMULATION_H_
+#define GOOGLE_CACHEINVALIDATION_TEST_FLEET_SIMULATION_H_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/cacheinvalidation/client_protocol.pb.h"
+#include "google/cacheinvalidation/deps/random.h"
+#include "google/cacheinvalidation/deps/scoped_ptr.h"
+#include "google/cacheinvalidation/deps/stl-namespace.h"
+#include "google/cacheinvalidation/deps/time.h"
+#include "google/cacheinvalidation/impl/basic-system-resources.h"
+#include "google/cacheinvalidation/impl/invalidation-client-impl.h"
+#include "google/cacheinvalidation/test/calendar-queue-scheduler.h"
+#include "google/cacheinvalidation/test/fake-invalidation-server.h"
+
+namespace invalidation {
+
+using INVALIDATION_STL_NAMESPACE::map;
+using INVALIDATION_STL_NAMESPACE::pair;
+using INVALIDATION_STL_NAMESPACE::string;
+using INVALIDATION_STL_NAMESPACE::vector;
+
+class SimulatedListener;
+
+// Configuration of a FleetSimulation.
+struct FleetSimulationConfig {
+  FleetSimulationConfig()
+      : num_clients(1000),
+        registrations_per_client(10),
+        register_before_start(false),
+        load_sample_interval(TimeDelta::FromSeconds(1)),
+        random_seed(0) {
+    InvalidationClientImpl::InitConfig(&client_config);
+  }
+
+  /* Number of clients. */
+  int num_clients;
+
+  /* Number of objects each client registers for when it is ready: client n
+   * registers for the objects of the server following oid<n>, wrapping
+   * around.
+   */
+  int registrations_per_client;
+
+  /* Whether clients register for their objects right after being created,
+   * before they are started, rather than when they are ready. Requires
+   * buffer_registrations_before_ready in |client_config|.
+   */
+  bool register_before_start;
+
+  /* Configuration of the clients. */
+  ClientConfigP client_config;
+
+  /* Configuration of the server and of the network. */
+  FakeInvalidationServerConfig server_config;
+
+  /* Interval over which the rate of the messages received by the server is
+   * measured.
+   */
+  TimeDelta load_sample_interval;
+
+  /* Seed of the random generators of the clients. */
+  int64 random_seed;
+};
+
+// Runs many InvalidationClientImpl instances against one server, all on one
+// CalendarQueueScheduler, so that a run is reproducible and hours of virtual
+// time take seconds. Each client has its own system resources, whose
+// schedulers forward to the shared one and whose storage survives restarts of
+// the client. Scenarios are driven by the caller between calls to RunFor,
+// e.g., RestartClients for a mass restart or SetPartitioned for a network
+// partition.
+//
+// This class is not thread-safe.
+class FleetSimulation {
+ public:
+  explicit FleetSimulation(const FleetSimulationConfig& config);
+
+  ~FleetSimulation();
+
+  /* Creates and starts the clients. */
+  void StartClients();
+
+  /* Replaces clients [first_client, first_client + num_clients) with new
+   * instances that start from the state persisted by the old ones, as when
+   * processes restart.
+   */
+  void RestartClients(int first_client, int num_clients);
+
+  /* Cuts clients [first_client, first_client + num_clients) from the server
+   * or reconnects them, without telling them.
+   */
+  void SetPartitioned(int first_client, int num_clients, bool is_partitioned);
+
+  /* Takes the network of clients [first_client, first_client + num_clients)
+   * offline or back online, telling them.
+   */
+  void SetOnline(int first_client, int num_clients, bool is_online);
+
+  /* Passes |duration| of virtual time, running all the tasks due. */
+  void RunFor(TimeDelta duration);
+
+  /* Returns the number of clients whose current instance is ready. */
+  int GetNumReadyClients();
+
+  /* Returns the number of clients whose current instance has received an
+   * invalidation.
+   */
+  int GetNumInvalidatedClients();
+
+  /* Returns the largest number of messages received by the server per second
+   * over a sampling interval.
+   */
+  int GetPeakMessagesPerSecond() const {
+    return peak_messages_per_second_;
+  }
+
+  /* Appends the statistics of the server and of the fleet, e.g.,
+   * "Server.HEARTBEAT_INTERVAL.p50_us" and "Fleet.PEAK_MESSAGES_PER_SECOND".
+   */
+  void GetStatistics(vector<pair<string, int> >* statistics);
+
+  FakeInvalidationServer* server() {
+    return server_.get();
+  }
+
+  CalendarQueueScheduler* scheduler() {
+    return &scheduler_;
+  }
+
+ private:
+  /* A client of the fleet, across restarts. */
+  struct SimulatedClient {
+    SimulatedClient() : generation(0), channel(NULL) {}
+
+    /* Incremented when the client is destroyed, so that its pending tasks do
+     * not run.
+     */
+    int generation;
+
+    /* What the client persisted. */
+    map<string, string> storage;
+
+    /* The current instance and its resources. The channel is owned by the
+     * resources.
+     */
+    LoopbackChannel* channel;
+    scoped_ptr<SimulatedListener> listener;
+    scoped_ptr<BasicSystemResources> resources;
+    scoped_ptr<InvalidationClientImpl> client;
+  };
+
+  /* Creates and starts a new instance of client |index|. */
+  void CreateClient(int index);
+
+  /* Destroys the current instance of client |index|. */
+  void DestroyClient(int index);
+
+  /* Records the rate of messages received by the server since the last
+   * sample.
+   */
+  void SampleLoad();
+
+  FleetSimulationConfig config_;
+
+  /* Logger for the server and the scheduler. */
+  scoped_ptr<Logger> logger_;
+
+  /* Scheduler running all the clients, the server and the network. */
+  CalendarQueueScheduler scheduler_;
+
+  /* The server. It outlives the clients and their channels. */
+  scoped_ptr<FakeInvalidationServer> server_;
+
+  /* Generator of the seeds of the clients. */
+  Random seed_random_;
+
+  /* The clients, by index. */
+  vector<SimulatedClient*> clients_;
+
+  /* Number of messages received by the server at the last sample. */
+  int sampled_messages_received_;
+
+  /* Virtual time since the last sample. */
+  TimeDelta time_since_sample_;
+
+  /* Sum and number of the samples of the messages received per second. */
+  int64 total_messages_per_second_;
+  int num_load_samples_;
+
+  /* Largest sample of the messages received per second. */
+  int peak_messages_per_second_;
+
+  DISALLOW_COPY_AND_ASSIGN(FleetSimulation);
+};
+
+}  // namespace invalidation
+
+#endif  // GOOGLE_CACHEINVALIDATION_TEST_FLEET_SIMULATION_H_
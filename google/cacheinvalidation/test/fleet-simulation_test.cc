@@ -0,0 +1,134 @@
+// Copyright 2012 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Scenario tests of fleets of clients run by the FleetSimulation class.
+
+#include "google/cacheinvalidation/deps/googletest.h"
+#include "google/cacheinvalidation/test/fleet-simulation.h"
+
+namespace invalidation {
+
+/* Number of clients of the simulated fleets. */
+static const int kNumClients = 100;
+
+/* Number of registrations of each client. */
+static const int kRegistrationsPerClient = 10;
+
+/* Number of clients of the large-fleet scenario. */
+static const int kNumClientsLargeFleet = 10000;
+
+class FleetSimulationTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    config.num_clients = kNumClients;
+    config.registrations_per_client = kRegistrationsPerClient;
+    config.server_config.num_objects = 1000;
+    config.server_config.invalidations_per_second = 10;
+  }
+
+  /* Creates the simulation, starts the clients and checks that they all
+   * register within five minutes, which leaves time for the retries of lost
+   * messages.
+   */
+  void StartFleet() {
+    simulation.reset(new FleetSimulation(config));
+    simulation->StartClients();
+    simulation->RunFor(TimeDelta::FromMinutes(5));
+    ASSERT_EQ(config.num_clients, simulation->GetNumReadyClients());
+    ASSERT_EQ(config.num_clients * kRegistrationsPerClient,
+              simulation->server()->GetNumRegistrations());
+  }
+
+  FleetSimulationConfig config;
+  scoped_ptr<FleetSimulation> simulation;
+};
+
+/* Tests that restarted clients keep their tokens and registrations, so that
+ * the server sees no new clients and no burst of messages.
+ */
+TEST_F(FleetSimulationTest, MassRestart) {
+  StartFleet();
+  int messages_before_restart = simulation->server()->messages_received();
+
+  simulation->RestartClients(0, kNumClients);
+  simulation->RunFor(TimeDelta::FromMinutes(1));
+  EXPECT_EQ(kNumClients, simulation->GetNumReadyClients());
+  EXPECT_EQ(kNumClients, simulation->server()->GetNumClients());
+  EXPECT_EQ(kNumClients * kRegistrationsPerClient,
+            simulation->server()->GetNumRegistrations());
+  EXPECT_EQ(messages_before_restart,
+            simulation->server()->messages_received());
+  EXPECT_GT(simulation->GetPeakMessagesPerSecond(), 0);
+}
+
+/* Tests that the fleet delivers invalidations and heartbeats through network
+ * flaps, partitions and message loss.
+ */
+TEST_F(FleetSimulationTest, NetworkFlapAndPartition) {
+  config.server_config.message_loss_probability = 0.05;
+  StartFleet();
+  simulation->server()->StartInvalidations();
+
+  // Flap the network of the whole fleet, then cut half of it for a while.
+  for (int i = 0; i < 5; ++i) {
+    simulation->SetOnline(0, kNumClients, false);
+    simulation->RunFor(TimeDelta::FromSeconds(10));
+    simulation->SetOnline(0, kNumClients, true);
+    simulation->RunFor(TimeDelta::FromSeconds(10));
+  }
+  simulation->SetPartitioned(0, kNumClients / 2, true);
+  simulation->RunFor(TimeDelta::FromMinutes(5));
+  simulation->SetPartitioned(0, kNumClients / 2, false);
+  simulation->RunFor(TimeDelta::FromMinutes(60));
+
+  EXPECT_EQ(kNumClients * kRegistrationsPerClient,
+            simulation->server()->GetNumRegistrations());
+  EXPECT_GT(simulation->server()->acks_received(), 0);
+  EXPECT_GT(simulation->server()->heartbeat_interval().count(), 0);
+
+  vector<pair<string, int> > statistics;
+  simulation->GetStatistics(&statistics);
+  bool found = false;
+  for (size_t i = 0; i < statistics.size(); ++i) {
+    if (statistics[i].first == "Fleet.PEAK_MESSAGES_PER_SECOND") {
+      EXPECT_EQ(simulation->GetPeakMessagesPerSecond(), statistics[i].second);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+}
+
+/* Tests that a fleet of kNumClientsLargeFleet clients starts, receives
+ * invalidations and survives a mass restart. Disabled because it takes
+ * minutes; run it with --gtest_also_run_disabled_tests.
+ */
+TEST_F(FleetSimulationTest, DISABLED_LargeFleet) {
+  config.num_clients = kNumClientsLargeFleet;
+  config.server_config.num_objects = 100000;
+  config.server_config.invalidations_per_second = 100;
+  StartFleet();
+  simulation->server()->StartInvalidations();
+  simulation->RunFor(TimeDelta::FromMinutes(10));
+  EXPECT_GT(simulation->server()->acks_received(), 0);
+
+  int messages_before_restart = simulation->server()->messages_received();
+  simulation->RestartClients(0, kNumClientsLargeFleet);
+  simulation->RunFor(TimeDelta::FromMinutes(1));
+  EXPECT_EQ(kNumClientsLargeFleet, simulation->GetNumReadyClients());
+  EXPECT_EQ(kNumClientsLargeFleet, simulation->server()->GetNumClients());
+  EXPECT_GE(simulation->server()->messages_received(),
+            messages_before_restart);
+}
+
+}  // namespace invalidation
@@ -102,6 +102,7 @@ class MockStorage : public Storage {
   MOCK_METHOD2(ReadKey, void(const string&, ReadKeyCallback*));  // NOLINT
   MOCK_METHOD2(DeleteKey, void(const string&, DeleteKeyCallback*));  // NOLINT
   MOCK_METHOD1(ReadAllKeys, void(ReadAllKeysCallback*));  // NOLINT
+  MOCK_METHOD2(WriteKeys, void(const vector<pair<string, string> >&, WriteKeyCallback*));  // NOLINT
   MOCK_METHOD1(SetSystemResources, void(SystemResources*));  // NOLINT
 };
 